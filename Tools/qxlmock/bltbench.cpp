@@ -0,0 +1,195 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlbltbench: the frame buffer updates of the VGA present path of
+ * qxldod, VgaDevice::ExecutePresentDisplayOnly, for a present trace.
+ * Every present is applied to two frame buffers in system memory with
+ * the blit functions of the driver: once with the moves copied from the
+ * source image by BltBits, as the driver used to, once with the moves
+ * done within the frame buffer by MoveBits. The dirty rects come from
+ * the source both times. Both frame buffers must end up equal to the
+ * source.
+ *
+ * The frame buffer of the device is mapped write-combined, which user
+ * space cannot get here. --uncached flushes both frame buffers from the
+ * cache before every present instead, so what the moves read back comes
+ * from memory rather than from the cache.
+ *
+ *   qxlbltbench [--loops N] [--uncached] TRACE
+ */
+
+#include "trace.h"
+#include "driver.h"
+#include "QxlDod.h"
+
+#include <getopt.h>
+#include <immintrin.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static double Seconds(Clock::time_point Begin)
+{
+    return std::chrono::duration<double>(Clock::now() - Begin).count();
+}
+
+static BLT_INFO BltInfo(std::vector<UCHAR> &Bits, UINT Width, UINT Height)
+{
+    BLT_INFO Info = {};
+
+    Info.pBits = Bits.data();
+    Info.Pitch = Width * 4;
+    Info.BitsPerPel = 32;
+    Info.Rotation = D3DKMDT_VPPR_IDENTITY;
+    Info.Width = Width;
+    Info.Height = Height;
+    return Info;
+}
+
+static void Flush(std::vector<UCHAR> &Bits)
+{
+    for (size_t i = 0; i < Bits.size(); i += 64) {
+        _mm_clflush(&Bits[i]);
+    }
+    _mm_mfence();
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option LongOptions[] = {
+        { "loops", required_argument, NULL, 'l' },
+        { "uncached", no_argument, NULL, 'u' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    ULONG Loops = 1;
+    bool Uncached = false;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "l:uh", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 'l': Loops = strtoul(optarg, NULL, 0); break;
+        case 'u': Uncached = true; break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 || !Loops) {
+        fprintf(stderr, "usage: %s [--loops N] [--uncached] TRACE\n", argv[0]);
+        return 2;
+    }
+
+    TraceReader Reader;
+    if (!Reader.Open(argv[optind])) {
+        return 2;
+    }
+
+    TraceFrame Frame;
+    std::vector<UCHAR> Source, Blit, Move;
+    std::vector<D3DKMT_MOVE_RECT> Moves;
+    std::vector<RECT> Dirty;
+    UINT Width = 0, Height = 0;
+    ULONG Frames = 0, Skipped = 0;
+    ULONGLONG MovedBytes = 0;
+    double BlitSec = 0, MoveSec = 0;
+
+    for (ULONG Loop = 0; Loop < Loops; Loop++) {
+        Reader.Rewind();
+        while (Reader.Next(Frame)) {
+            const QXLPresentTraceFrame &h = Frame.Header;
+
+            // the VGA path only moves within the frame buffer unrotated
+            if (h.source_id != 0 || h.bytes_per_pixel != 4 || !h.width || !h.height ||
+                h.rotation != D3DKMDT_VPPR_IDENTITY) {
+                Skipped++;
+                continue;
+            }
+            if (h.width != Width || h.height != Height) {
+                Width = h.width;
+                Height = h.height;
+                Source.assign((size_t)Width * Height * 4, 0);
+                Blit = Source;
+                Move = Source;
+            }
+            BLT_INFO SrcInfo = BltInfo(Source, Width, Height);
+            BLT_INFO BlitInfo = BltInfo(Blit, Width, Height);
+            BLT_INFO MoveInfo = BltInfo(Move, Width, Height);
+
+            // the new source: the moves applied in order, the dirty pixels on top
+            Moves.clear();
+            for (const QXLPresentTraceMove &m : Frame.Moves) {
+                D3DKMT_MOVE_RECT Rect;
+                Rect.SourcePoint.x = m.src_x;
+                Rect.SourcePoint.y = m.src_y;
+                Rect.DestRect = { m.dest.left, m.dest.top, m.dest.right, m.dest.bottom };
+                if (Rect.DestRect.left < 0 || Rect.DestRect.top < 0 || m.src_x < 0 || m.src_y < 0 ||
+                    Rect.DestRect.right <= Rect.DestRect.left || Rect.DestRect.bottom <= Rect.DestRect.top ||
+                    (UINT)Rect.DestRect.right > Width || (UINT)Rect.DestRect.bottom > Height ||
+                    (UINT)(m.src_x + Rect.DestRect.right - Rect.DestRect.left) > Width ||
+                    (UINT)(m.src_y + Rect.DestRect.bottom - Rect.DestRect.top) > Height) {
+                    continue;
+                }
+                MoveBits(&SrcInfo, &Rect);
+                Moves.push_back(Rect);
+                MovedBytes += (ULONGLONG)(Rect.DestRect.right - Rect.DestRect.left) *
+                              (Rect.DestRect.bottom - Rect.DestRect.top) * 4;
+            }
+            Dirty.clear();
+            const UCHAR *pPixels = Frame.Pixels.data();
+            const UCHAR *pEnd = pPixels + Frame.Pixels.size();
+            for (const QXLPresentTraceRect &r : Frame.Rects) {
+                size_t Bytes = (r.right - r.left) * 4;
+                for (LONG y = r.top; y < r.bottom && pPixels + Bytes <= pEnd; y++) {
+                    memcpy(&Source[((size_t)y * Width + r.left) * 4], pPixels, Bytes);
+                    pPixels += Bytes;
+                }
+                Dirty.push_back({ r.left, r.top, r.right, r.bottom });
+            }
+
+            if (Uncached) {
+                Flush(Blit);
+                Flush(Move);
+            }
+            Clock::time_point Begin = Clock::now();
+            for (const D3DKMT_MOVE_RECT &m : Moves) {
+                BltBits(&BlitInfo, &SrcInfo, 1, &m.DestRect);
+            }
+            BltBits(&BlitInfo, &SrcInfo, (UINT)Dirty.size(), Dirty.data());
+            BlitSec += Seconds(Begin);
+
+            Begin = Clock::now();
+            for (const D3DKMT_MOVE_RECT &m : Moves) {
+                MoveBits(&MoveInfo, &m);
+            }
+            BltBits(&MoveInfo, &SrcInfo, (UINT)Dirty.size(), Dirty.data());
+            MoveSec += Seconds(Begin);
+            Frames++;
+        }
+    }
+    if (!Frames) {
+        fprintf(stderr, "qxlbltbench: %s: no unrotated 32bpp presents of source 0\n", argv[optind]);
+        return 1;
+    }
+    if (Blit != Source || Move != Source) {
+        fprintf(stderr, "qxlbltbench: %s: frame buffer differs from the source\n", argv[optind]);
+        return 1;
+    }
+    printf("%-24s %-8s %6u presents %6u skipped  moves %8.1f KB/present  blit %8.1f us  move %8.1f us  %+.0f%%\n",
+           argv[optind], Uncached ? "uncached" : "cached", Frames, Skipped, MovedBytes / 1024.0 / Frames, BlitSec * 1e6 / Frames,
+           MoveSec * 1e6 / Frames, BlitSec > 0 ? (MoveSec / BlitSec - 1) * 100 : 0.0);
+    return 0;
+}
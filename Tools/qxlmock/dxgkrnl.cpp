@@ -0,0 +1,613 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "dxgkrnl.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+static KMDDOD_INITIALIZATION_DATA g_Ddi;
+static bool g_bDdiValid;
+
+NTSTATUS DxgkInitializeDisplayOnlyDriver(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath,
+                                         KMDDOD_INITIALIZATION_DATA *KmdDodInitializationData)
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(RegistryPath);
+
+    if (!KmdDodInitializationData->DxgkDdiAddDevice ||
+        !KmdDodInitializationData->DxgkDdiStartDevice ||
+        !KmdDodInitializationData->DxgkDdiPresentDisplayOnly) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    g_Ddi = *KmdDodInitializationData;
+    g_bDdiValid = true;
+    return STATUS_SUCCESS;
+}
+
+VOID DxgkUnInitialize(PVOID MiniportDeviceContext)
+{
+    UNREFERENCED_PARAMETER(MiniportDeviceContext);
+    g_bDdiValid = false;
+}
+
+/* a functional VidPn with one path and one pinned source mode */
+
+struct MockVidPn
+{
+    D3DKMDT_VIDPN_PRESENT_PATH Path;
+    D3DKMDT_VIDPN_SOURCE_MODE SourceMode;
+};
+
+static NTSTATUS VidPnGetNumPaths(D3DKMDT_HVIDPNTOPOLOGY hTopology, SIZE_T *pNumPaths)
+{
+    UNREFERENCED_PARAMETER(hTopology);
+    *pNumPaths = 1;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnGetNumPathsFromSource(D3DKMDT_HVIDPNTOPOLOGY hTopology,
+                                           D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, SIZE_T *pNumPaths)
+{
+    MockVidPn *pVidPn = (MockVidPn *)hTopology;
+    *pNumPaths = (SourceId == pVidPn->Path.VidPnSourceId) ? 1 : 0;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnEnumPathTargetsFromSource(D3DKMDT_HVIDPNTOPOLOGY hTopology,
+                                               D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, SIZE_T Index,
+                                               D3DDDI_VIDEO_PRESENT_TARGET_ID *pTargetId)
+{
+    MockVidPn *pVidPn = (MockVidPn *)hTopology;
+    if (SourceId != pVidPn->Path.VidPnSourceId || Index != 0) {
+        return STATUS_GRAPHICS_SOURCE_NOT_IN_TOPOLOGY;
+    }
+    *pTargetId = pVidPn->Path.VidPnTargetId;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnGetPathSourceFromTarget(D3DKMDT_HVIDPNTOPOLOGY hTopology,
+                                             D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId,
+                                             D3DDDI_VIDEO_PRESENT_SOURCE_ID *pSourceId)
+{
+    MockVidPn *pVidPn = (MockVidPn *)hTopology;
+    if (TargetId != pVidPn->Path.VidPnTargetId) {
+        return STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_TARGET;
+    }
+    *pSourceId = pVidPn->Path.VidPnSourceId;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnAcquirePathInfo(D3DKMDT_HVIDPNTOPOLOGY hTopology, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId,
+                                     D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId,
+                                     const D3DKMDT_VIDPN_PRESENT_PATH **ppPath)
+{
+    MockVidPn *pVidPn = (MockVidPn *)hTopology;
+    if (SourceId != pVidPn->Path.VidPnSourceId || TargetId != pVidPn->Path.VidPnTargetId) {
+        return STATUS_GRAPHICS_SOURCE_NOT_IN_TOPOLOGY;
+    }
+    *ppPath = &pVidPn->Path;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnAcquireFirstPathInfo(D3DKMDT_HVIDPNTOPOLOGY hTopology,
+                                          const D3DKMDT_VIDPN_PRESENT_PATH **ppPath)
+{
+    *ppPath = &((MockVidPn *)hTopology)->Path;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnAcquireNextPathInfo(D3DKMDT_HVIDPNTOPOLOGY hTopology, const D3DKMDT_VIDPN_PRESENT_PATH *pPath,
+                                         const D3DKMDT_VIDPN_PRESENT_PATH **ppNext)
+{
+    UNREFERENCED_PARAMETER(hTopology);
+    UNREFERENCED_PARAMETER(pPath);
+    *ppNext = NULL;
+    return STATUS_GRAPHICS_NO_MORE_ELEMENTS_IN_DATASET;
+}
+
+static NTSTATUS VidPnUpdatePathSupportInfo(D3DKMDT_HVIDPNTOPOLOGY hTopology,
+                                           const D3DKMDT_VIDPN_PRESENT_PATH *pPath)
+{
+    UNREFERENCED_PARAMETER(hTopology);
+    UNREFERENCED_PARAMETER(pPath);
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnReleasePathInfo(D3DKMDT_HVIDPNTOPOLOGY hTopology, const D3DKMDT_VIDPN_PRESENT_PATH *pPath)
+{
+    return (pPath == &((MockVidPn *)hTopology)->Path) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+static const DXGK_VIDPNTOPOLOGY_INTERFACE s_TopologyInterface = {
+    VidPnGetNumPaths,
+    VidPnGetNumPathsFromSource,
+    VidPnEnumPathTargetsFromSource,
+    VidPnGetPathSourceFromTarget,
+    VidPnAcquirePathInfo,
+    VidPnAcquireFirstPathInfo,
+    VidPnAcquireNextPathInfo,
+    VidPnUpdatePathSupportInfo,
+    VidPnReleasePathInfo,
+};
+
+static NTSTATUS SourceModeGetNumModes(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, SIZE_T *pNumModes)
+{
+    UNREFERENCED_PARAMETER(hModeSet);
+    *pNumModes = 1;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS SourceModeAcquireMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet,
+                                      const D3DKMDT_VIDPN_SOURCE_MODE **ppMode)
+{
+    *ppMode = &((MockVidPn *)hModeSet)->SourceMode;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS SourceModeAcquireNextMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, const D3DKMDT_VIDPN_SOURCE_MODE *pMode,
+                                          const D3DKMDT_VIDPN_SOURCE_MODE **ppNext)
+{
+    UNREFERENCED_PARAMETER(hModeSet);
+    UNREFERENCED_PARAMETER(pMode);
+    *ppNext = NULL;
+    return STATUS_GRAPHICS_NO_MORE_ELEMENTS_IN_DATASET;
+}
+
+static NTSTATUS SourceModeReleaseMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, const D3DKMDT_VIDPN_SOURCE_MODE *pMode)
+{
+    return (pMode == &((MockVidPn *)hModeSet)->SourceMode) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+static NTSTATUS SourceModeCreateNewMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, D3DKMDT_VIDPN_SOURCE_MODE **ppMode)
+{
+    UNREFERENCED_PARAMETER(hModeSet);
+    UNREFERENCED_PARAMETER(ppMode);
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS SourceModeAddMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, const D3DKMDT_VIDPN_SOURCE_MODE *pMode)
+{
+    UNREFERENCED_PARAMETER(hModeSet);
+    UNREFERENCED_PARAMETER(pMode);
+    return STATUS_NOT_SUPPORTED;
+}
+
+static NTSTATUS SourceModePinMode(D3DKMDT_HVIDPNSOURCEMODESET hModeSet, D3DKMDT_VIDEO_PRESENT_SOURCE_MODE_ID Id)
+{
+    UNREFERENCED_PARAMETER(hModeSet);
+    UNREFERENCED_PARAMETER(Id);
+    return STATUS_SUCCESS;
+}
+
+static const DXGK_VIDPNSOURCEMODESET_INTERFACE s_SourceModeSetInterface = {
+    SourceModeGetNumModes,
+    SourceModeAcquireMode,
+    SourceModeAcquireNextMode,
+    SourceModeAcquireMode,
+    SourceModeReleaseMode,
+    SourceModeCreateNewMode,
+    SourceModeAddMode,
+    SourceModePinMode,
+};
+
+static NTSTATUS VidPnGetTopology(D3DKMDT_HVIDPN hVidPn, D3DKMDT_HVIDPNTOPOLOGY *phTopology,
+                                 const DXGK_VIDPNTOPOLOGY_INTERFACE **ppInterface)
+{
+    *phTopology = hVidPn;
+    *ppInterface = &s_TopologyInterface;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnAcquireSourceModeSet(D3DKMDT_HVIDPN hVidPn, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId,
+                                          D3DKMDT_HVIDPNSOURCEMODESET *phModeSet,
+                                          const DXGK_VIDPNSOURCEMODESET_INTERFACE **ppInterface)
+{
+    if (SourceId != ((MockVidPn *)hVidPn)->Path.VidPnSourceId) {
+        return STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_SOURCE;
+    }
+    *phModeSet = hVidPn;
+    *ppInterface = &s_SourceModeSetInterface;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS VidPnReleaseSourceModeSet(D3DKMDT_HVIDPN hVidPn, D3DKMDT_HVIDPNSOURCEMODESET hModeSet)
+{
+    return (hModeSet == hVidPn) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+static const DXGK_VIDPN_INTERFACE s_VidPnInterface = {
+    DXGK_VIDPN_INTERFACE_VERSION_V1,
+    VidPnGetTopology,
+    VidPnAcquireSourceModeSet,
+    VidPnReleaseSourceModeSet,
+};
+
+static NTSTATUS QueryVidPnInterface(D3DKMDT_HVIDPN hVidPn, DXGK_VIDPN_INTERFACE_VERSION Version,
+                                    const DXGK_VIDPN_INTERFACE **ppVidPnInterface)
+{
+    if (!hVidPn || Version != DXGK_VIDPN_INTERFACE_VERSION_V1) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    *ppVidPnInterface = &s_VidPnInterface;
+    return STATUS_SUCCESS;
+}
+
+/* adapter */
+
+MockDxgk::MockDxgk(MockQxl &Device) :
+    m_Device(Device),
+    m_Context(NULL),
+    m_bStarted(false),
+    m_bRunning(true),
+    m_IrqGeneration(0),
+    m_bDpcQueued(false),
+    m_Interrupts(0),
+    m_Dpcs(0),
+    m_VSyncs(0),
+    m_ChildStatus(0),
+    m_ConnectedChildren(1)
+{
+    memset(&m_DriverObject, 0, sizeof(m_DriverObject));
+    memset(&m_Pdo, 0, sizeof(m_Pdo));
+    memset(&m_Interface, 0, sizeof(m_Interface));
+    memset(&m_Resources, 0, sizeof(m_Resources));
+
+    m_Interface.Size = sizeof(m_Interface);
+    m_Interface.Version = DXGKDDI_INTERFACE_VERSION;
+    m_Interface.DeviceHandle = this;
+    m_Interface.DxgkCbGetDeviceInformation = GetDeviceInformation;
+    m_Interface.DxgkCbIndicateChildStatus = IndicateChildStatus;
+    m_Interface.DxgkCbMapMemory = MapMemory;
+    m_Interface.DxgkCbQueueDpc = QueueDpc;
+    m_Interface.DxgkCbReadDeviceSpace = ReadDeviceSpace;
+    m_Interface.DxgkCbSynchronizeExecution = SynchronizeExecution;
+    m_Interface.DxgkCbUnmapMemory = UnmapMemory;
+    m_Interface.DxgkCbNotifyInterrupt = NotifyInterrupt;
+    m_Interface.DxgkCbNotifyDpc = NotifyDpc;
+    m_Interface.DxgkCbQueryVidPnInterface = QueryVidPnInterface;
+    m_Interface.DxgkCbAcquirePostDisplayOwnership = AcquirePostDisplayOwnership;
+
+    // HWInit expects the BARs in PCI order: RAM, VRAM, ROM, then the ports
+    CM_PARTIAL_RESOURCE_DESCRIPTOR *prd = m_Resources.List.List[0].PartialResourceList.PartialDescriptors;
+    m_Resources.List.Count = 1;
+    m_Resources.List.List[0].PartialResourceList.Count = 4;
+    prd[0].Type = CmResourceTypeMemory;
+    prd[0].u.Memory.Start.QuadPart = m_Device.RamPA();
+    prd[0].u.Memory.Length = m_Device.RamSize();
+    prd[1].Type = CmResourceTypeMemory;
+    prd[1].u.Memory.Start.QuadPart = m_Device.VRamPA();
+    prd[1].u.Memory.Length = m_Device.VRamSize();
+    prd[2].Type = CmResourceTypeMemory;
+    prd[2].u.Memory.Start.QuadPart = m_Device.RomPA();
+    prd[2].u.Memory.Length = m_Device.RomSize();
+    prd[3].Type = CmResourceTypePort;
+    prd[3].Flags = CM_RESOURCE_PORT_IO;
+    prd[3].u.Port.Start.QuadPart = MockQxl::IO_BASE;
+    prd[3].u.Port.Length = QXL_IO_RANGE_SIZE;
+
+    m_Device.SetInterruptHandler([this]() { RaiseIrq(); });
+    m_IrqThread = std::thread(&MockDxgk::IrqThread, this);
+    m_DpcThread = std::thread(&MockDxgk::DpcThread, this);
+}
+
+MockDxgk::~MockDxgk()
+{
+    Stop();
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        m_bRunning = false;
+        m_IrqWake.notify_all();
+        m_DpcWake.notify_all();
+    }
+    m_IrqThread.join();
+    m_DpcThread.join();
+    m_Device.SetInterruptHandler(nullptr);
+}
+
+NTSTATUS MockDxgk::Start()
+{
+    static WCHAR Path[] = L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\qxldod";
+    UNICODE_STRING RegistryPath;
+    DXGK_START_INFO StartInfo;
+    ULONG NumberOfViews = 0;
+    ULONG NumberOfChildren = 0;
+    NTSTATUS Status;
+
+    RtlInitUnicodeString(&RegistryPath, Path);
+    Status = DriverEntry(&m_DriverObject, &RegistryPath);
+    if (!NT_SUCCESS(Status) || !g_bDdiValid) {
+        fprintf(stderr, "qxlmock: DriverEntry failed with 0x%X\n", Status);
+        return NT_SUCCESS(Status) ? STATUS_UNSUCCESSFUL : Status;
+    }
+    Status = g_Ddi.DxgkDdiAddDevice(&m_Pdo, &m_Context);
+    if (!NT_SUCCESS(Status)) {
+        fprintf(stderr, "qxlmock: DxgkDdiAddDevice failed with 0x%X\n", Status);
+        return Status;
+    }
+    memset(&StartInfo, 0, sizeof(StartInfo));
+    Status = g_Ddi.DxgkDdiStartDevice(m_Context, &StartInfo, &m_Interface, &NumberOfViews, &NumberOfChildren);
+    if (!NT_SUCCESS(Status)) {
+        fprintf(stderr, "qxlmock: DxgkDdiStartDevice failed with 0x%X\n", Status);
+        return Status;
+    }
+    m_bStarted = true;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MockDxgk::SetMode(UINT Width, UINT Height, D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation)
+{
+    MockVidPn VidPn;
+    DXGKARG_COMMITVIDPN Commit;
+
+    memset(&VidPn, 0, sizeof(VidPn));
+    VidPn.Path.VidPnSourceId = 0;
+    VidPn.Path.VidPnTargetId = 0;
+    VidPn.Path.ContentTransformation.Scaling = D3DKMDT_VPPS_IDENTITY;
+    VidPn.Path.ContentTransformation.Rotation = Rotation;
+    VidPn.Path.GammaRamp.Type = D3DDDI_GAMMARAMP_DEFAULT;
+    VidPn.SourceMode.Id = 0;
+    VidPn.SourceMode.Type = D3DKMDT_RMT_GRAPHICS;
+    VidPn.SourceMode.Format.Graphics.PrimSurfSize.cx = Width;
+    VidPn.SourceMode.Format.Graphics.PrimSurfSize.cy = Height;
+    VidPn.SourceMode.Format.Graphics.VisibleRegionSize = VidPn.SourceMode.Format.Graphics.PrimSurfSize;
+    VidPn.SourceMode.Format.Graphics.Stride = Width * 4;
+    VidPn.SourceMode.Format.Graphics.PixelFormat = D3DDDIFMT_A8R8G8B8;
+    VidPn.SourceMode.Format.Graphics.ColorBasis = D3DKMDT_CB_SCRGB;
+    VidPn.SourceMode.Format.Graphics.PixelValueAccessMode = D3DKMDT_PVAM_DIRECT;
+
+    memset(&Commit, 0, sizeof(Commit));
+    Commit.hFunctionalVidPn = (D3DKMDT_HVIDPN)&VidPn;
+    Commit.AffectedVidPnSourceId = 0;
+    Commit.MonitorConnectivityChecks = D3DKMDT_MCC_ENFORCE;
+    return g_Ddi.DxgkDdiCommitVidPn(m_Context, &Commit);
+}
+
+NTSTATUS MockDxgk::Present(const DXGKARG_PRESENT_DISPLAYONLY *pPresent)
+{
+    return g_Ddi.DxgkDdiPresentDisplayOnly(m_Context, pPresent);
+}
+
+void MockDxgk::Drain()
+{
+    ULONGLONG Last = ~0ULL;
+
+    for (int i = 0; i < 100; i++) {
+        m_Device.WaitIdle(1000);
+        MockQxlStats s = m_Device.Stats();
+        ULONGLONG Now = s.Commands[QXL_CMD_DRAW] + s.Commands[QXL_CMD_SURFACE] + s.Commands[QXL_CMD_CURSOR];
+        if (Now == Last) {
+            return;
+        }
+        Last = Now;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+NTSTATUS MockDxgk::SetPointerShape(const DXGKARG_SETPOINTERSHAPE *pShape)
+{
+    return g_Ddi.DxgkDdiSetPointerShape(m_Context, pShape);
+}
+
+NTSTATUS MockDxgk::SetPointerPosition(const DXGKARG_SETPOINTERPOSITION *pPosition)
+{
+    return g_Ddi.DxgkDdiSetPointerPosition(m_Context, pPosition);
+}
+
+NTSTATUS MockDxgk::Escape(void *pData, UINT Size)
+{
+    DXGKARG_ESCAPE Escape = {};
+
+    Escape.pPrivateDriverData = pData;
+    Escape.PrivateDriverDataSize = Size;
+    return g_Ddi.DxgkDdiEscape(m_Context, &Escape);
+}
+
+void MockDxgk::Stop()
+{
+    if (!m_Context) {
+        return;
+    }
+    if (m_bStarted) {
+        g_Ddi.DxgkDdiStopDevice(m_Context);
+        m_bStarted = false;
+    }
+    g_Ddi.DxgkDdiRemoveDevice(m_Context);
+    m_Context = NULL;
+    if (g_Ddi.DxgkDdiUnload) {
+        g_Ddi.DxgkDdiUnload();
+    }
+}
+
+/* interrupt delivery: the line is level triggered, the ISR runs until
+   int_pending & int_mask drops and queues the DPC */
+
+void MockDxgk::RaiseIrq()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_IrqGeneration++;
+    m_IrqWake.notify_all();
+}
+
+void MockDxgk::IrqThread()
+{
+    ULONG Seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_Lock);
+            m_IrqWake.wait(lock, [&]() { return !m_bRunning || m_IrqGeneration != Seen; });
+            if (!m_bRunning) {
+                break;
+            }
+            Seen = m_IrqGeneration;
+        }
+        // the ISR writes QXL_IO_UPDATE_IRQ, a level still up re-raises
+        // and bumps the generation, so a single call per wakeup is enough
+        if (!m_bStarted || !m_Device.InterruptLevel()) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(m_IntLock);
+        ShimRunAtDispatch([this]() {
+            if (g_Ddi.DxgkDdiInterruptRoutine(m_Context, 0)) {
+                m_Interrupts++;
+            }
+        });
+    }
+}
+
+void MockDxgk::DpcThread()
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_Lock);
+            m_DpcWake.wait(lock, [&]() { return !m_bRunning || m_bDpcQueued; });
+            if (!m_bRunning) {
+                break;
+            }
+            // dequeued before it runs, the ISR may queue it again
+            m_bDpcQueued = false;
+        }
+        ShimRunAtDispatch([this]() {
+            g_Ddi.DxgkDdiDpcRoutine(m_Context);
+        });
+        m_Dpcs++;
+    }
+}
+
+/* dxgkrnl callbacks */
+
+NTSTATUS MockDxgk::GetDeviceInformation(HANDLE DeviceHandle, PDXGK_DEVICE_INFO DeviceInfo)
+{
+    MockDxgk *pThis = (MockDxgk *)DeviceHandle;
+
+    memset(DeviceInfo, 0, sizeof(*DeviceInfo));
+    DeviceInfo->MiniportDeviceContext = pThis->m_Context;
+    DeviceInfo->PhysicalDeviceObject = &pThis->m_Pdo;
+    DeviceInfo->TranslatedResourceList = &pThis->m_Resources.List;
+    DeviceInfo->SystemMemorySize.QuadPart = 4ULL << 30;
+    DeviceInfo->HighestPhysicalAddress.QuadPart = ~0ULL >> 12;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MockDxgk::IndicateChildStatus(HANDLE DeviceHandle, PDXGK_CHILD_STATUS ChildStatus)
+{
+    MockDxgk *pThis = (MockDxgk *)DeviceHandle;
+
+    if (ChildStatus->Type != StatusConnection || ChildStatus->ChildUid >= 32) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (ChildStatus->HotPlug.Connected) {
+        pThis->m_ConnectedChildren |= 1u << ChildStatus->ChildUid;
+    } else {
+        pThis->m_ConnectedChildren &= ~(1u << ChildStatus->ChildUid);
+    }
+    pThis->m_ChildStatus++;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MockDxgk::MapMemory(HANDLE DeviceHandle, PHYSICAL_ADDRESS TranslatedAddress, ULONG Length,
+                             BOOLEAN InIoSpace, BOOLEAN MapToUserMode, MEMORY_CACHING_TYPE CacheType,
+                             PVOID *VirtualAddress)
+{
+    UNREFERENCED_PARAMETER(DeviceHandle);
+    UNREFERENCED_PARAMETER(InIoSpace);
+    UNREFERENCED_PARAMETER(MapToUserMode);
+    UNREFERENCED_PARAMETER(CacheType);
+
+    *VirtualAddress = ShimPhysicalToHost(TranslatedAddress.QuadPart, Length);
+    return *VirtualAddress ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+BOOLEAN MockDxgk::QueueDpc(HANDLE DeviceHandle)
+{
+    MockDxgk *pThis = (MockDxgk *)DeviceHandle;
+    std::lock_guard<std::mutex> lock(pThis->m_Lock);
+
+    if (pThis->m_bDpcQueued) {
+        return FALSE;
+    }
+    pThis->m_bDpcQueued = true;
+    pThis->m_DpcWake.notify_all();
+    return TRUE;
+}
+
+NTSTATUS MockDxgk::ReadDeviceSpace(HANDLE DeviceHandle, ULONG DataType, PVOID Buffer, ULONG Offset,
+                                   ULONG Length, PULONG BytesRead)
+{
+    MockDxgk *pThis = (MockDxgk *)DeviceHandle;
+    PCI_COMMON_HEADER Header;
+
+    if (DataType != DXGK_WHICHSPACE_CONFIG || Offset >= sizeof(Header)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    memset(&Header, 0, sizeof(Header));
+    Header.VendorID = 0x1b36;
+    Header.DeviceID = 0x0100;
+    Header.RevisionID = pThis->m_Device.Revision();
+    Header.BaseClass = 0x03;
+    Header.u.type0.BaseAddresses[0] = (ULONG)pThis->m_Device.RamPA();
+    Header.u.type0.BaseAddresses[1] = (ULONG)pThis->m_Device.VRamPA();
+    Header.u.type0.BaseAddresses[2] = (ULONG)pThis->m_Device.RomPA();
+    Header.u.type0.BaseAddresses[3] = MockQxl::IO_BASE | 1;
+
+    if (Length > sizeof(Header) - Offset) {
+        Length = sizeof(Header) - Offset;
+    }
+    memcpy(Buffer, (UCHAR *)&Header + Offset, Length);
+    *BytesRead = Length;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MockDxgk::SynchronizeExecution(HANDLE DeviceHandle, PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+                                        PVOID Context, ULONG MessageNumber, PBOOLEAN ReturnValue)
+{
+    MockDxgk *pThis = (MockDxgk *)DeviceHandle;
+    BOOLEAN Result = FALSE;
+
+    UNREFERENCED_PARAMETER(MessageNumber);
+    std::lock_guard<std::mutex> lock(pThis->m_IntLock);
+    ShimRunAtDispatch([&]() { Result = SynchronizeRoutine(Context); });
+    if (ReturnValue) {
+        *ReturnValue = Result;
+    }
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MockDxgk::UnmapMemory(HANDLE DeviceHandle, PVOID VirtualAddress)
+{
+    // the BARs stay mapped for the life of the mock device
+    UNREFERENCED_PARAMETER(DeviceHandle);
+    UNREFERENCED_PARAMETER(VirtualAddress);
+    return STATUS_SUCCESS;
+}
+
+VOID MockDxgk::NotifyInterrupt(HANDLE hAdapter, const DXGKARGCB_NOTIFY_INTERRUPT_DATA *pData)
+{
+    MockDxgk *pThis = (MockDxgk *)hAdapter;
+
+    if (pData->InterruptType == DXGK_INTERRUPT_DISPLAYONLY_VSYNC) {
+        pThis->m_VSyncs++;
+    }
+}
+
+VOID MockDxgk::NotifyDpc(HANDLE hAdapter)
+{
+    UNREFERENCED_PARAMETER(hAdapter);
+}
+
+NTSTATUS MockDxgk::AcquirePostDisplayOwnership(HANDLE DeviceHandle, PDXGK_DISPLAY_INFORMATION DisplayInfo)
+{
+    // no firmware framebuffer, the driver falls back to its default mode
+    UNREFERENCED_PARAMETER(DeviceHandle);
+    memset(DisplayInfo, 0, sizeof(*DisplayInfo));
+    return STATUS_SUCCESS;
+}
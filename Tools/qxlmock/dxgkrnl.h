@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * The part of dxgkrnl a display only driver talks to: it loads qxldod,
+ * owns the adapter callbacks, delivers the device interrupt through the
+ * driver ISR and DPC and drives the DDIs the way the OS would.
+ */
+
+#pragma once
+
+#include "mockdev.h"
+
+#include <atomic>
+
+extern "C" NTSTATUS DriverEntry(PDRIVER_OBJECT pDriverObject, PUNICODE_STRING pRegistryPath);
+
+class MockDxgk
+{
+public:
+    MockDxgk(MockQxl &Device);
+    ~MockDxgk();
+
+    // DriverEntry, AddDevice and StartDevice
+    NTSTATUS Start();
+    // CommitVidPn of one path on source 0 with an A8R8G8B8 mode
+    NTSTATUS SetMode(UINT Width, UINT Height,
+                     D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation = D3DKMDT_VPPR_IDENTITY);
+    NTSTATUS Present(const DXGKARG_PRESENT_DISPLAYONLY *pPresent);
+    // waits until the present workers and the device both went quiet
+    void Drain();
+    NTSTATUS SetPointerShape(const DXGKARG_SETPOINTERSHAPE *pShape);
+    NTSTATUS SetPointerPosition(const DXGKARG_SETPOINTERPOSITION *pPosition);
+    NTSTATUS Escape(void *pData, UINT Size);
+    // StopDevice, RemoveDevice and Unload
+    void Stop();
+
+    ULONGLONG Interrupts() const { return m_Interrupts; }
+    ULONGLONG Dpcs() const { return m_Dpcs; }
+    ULONGLONG VSyncs() const { return m_VSyncs; }
+    // DxgkCbIndicateChildStatus calls and the children last reported
+    // connected, one bit each
+    ULONGLONG ChildStatus() const { return m_ChildStatus; }
+    ULONG ConnectedChildren() const { return m_ConnectedChildren; }
+
+private:
+    static NTSTATUS GetDeviceInformation(HANDLE DeviceHandle, PDXGK_DEVICE_INFO DeviceInfo);
+    static NTSTATUS IndicateChildStatus(HANDLE DeviceHandle, PDXGK_CHILD_STATUS ChildStatus);
+    static NTSTATUS MapMemory(HANDLE DeviceHandle, PHYSICAL_ADDRESS TranslatedAddress, ULONG Length,
+                              BOOLEAN InIoSpace, BOOLEAN MapToUserMode, MEMORY_CACHING_TYPE CacheType,
+                              PVOID *VirtualAddress);
+    static BOOLEAN QueueDpc(HANDLE DeviceHandle);
+    static NTSTATUS ReadDeviceSpace(HANDLE DeviceHandle, ULONG DataType, PVOID Buffer, ULONG Offset,
+                                    ULONG Length, PULONG BytesRead);
+    static NTSTATUS SynchronizeExecution(HANDLE DeviceHandle, PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+                                         PVOID Context, ULONG MessageNumber, PBOOLEAN ReturnValue);
+    static NTSTATUS UnmapMemory(HANDLE DeviceHandle, PVOID VirtualAddress);
+    static VOID NotifyInterrupt(HANDLE hAdapter, const DXGKARGCB_NOTIFY_INTERRUPT_DATA *pData);
+    static VOID NotifyDpc(HANDLE hAdapter);
+    static NTSTATUS AcquirePostDisplayOwnership(HANDLE DeviceHandle, PDXGK_DISPLAY_INFORMATION DisplayInfo);
+
+    void RaiseIrq();
+    void IrqThread();
+    void DpcThread();
+
+    MockQxl &m_Device;
+    DRIVER_OBJECT m_DriverObject;
+    DEVICE_OBJECT m_Pdo;
+    DXGKRNL_INTERFACE m_Interface;
+    PVOID m_Context;
+    bool m_bStarted;
+
+    // resource list with the port and the three BARs
+    struct {
+        CM_RESOURCE_LIST List;
+        CM_PARTIAL_RESOURCE_DESCRIPTOR More[3];
+    } m_Resources;
+
+    // the ISR runs under m_IntLock, like DxgkCbSynchronizeExecution
+    std::mutex m_IntLock;
+    std::mutex m_Lock;
+    std::condition_variable m_IrqWake;
+    std::condition_variable m_DpcWake;
+    std::thread m_IrqThread;
+    std::thread m_DpcThread;
+    bool m_bRunning;
+    ULONG m_IrqGeneration;
+    bool m_bDpcQueued;
+    std::atomic<ULONGLONG> m_Interrupts;
+    std::atomic<ULONGLONG> m_Dpcs;
+    std::atomic<ULONGLONG> m_VSyncs;
+    std::atomic<ULONGLONG> m_ChildStatus;
+    std::atomic<ULONG> m_ConnectedChildren;
+};
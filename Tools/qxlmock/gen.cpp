@@ -0,0 +1,490 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxltracegen: writes synthetic desktop workloads as present traces, so
+ * qxlreplay can measure the present path against known patterns of
+ * dirty rectangles, moves and pixel content at any resolution.
+ *
+ * A scenario paints a 32bpp desktop (wallpaper, one window with text)
+ * and presents what changed the way DWM would: moves for scrolled or
+ * dragged content, dirty rectangles for everything newly painted. The
+ * pixels come from the same desktop, so the trace is self consistent.
+ */
+
+#include "trace.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+
+typedef std::vector<QXLPresentTraceMove> MoveList;
+typedef std::vector<QXLPresentTraceRect> RectList;
+
+// 100ns units
+#define FRAME_TIME      166667ULL   // 60 Hz
+#define MS_TIME         10000ULL
+
+#define GLYPH_WIDTH     8
+#define GLYPH_HEIGHT    16
+#define GLYPH_COUNT     96
+#define TITLE_HEIGHT    24
+
+#define COLOR_WINDOW    0xffffffff
+#define COLOR_TEXT      0xff202020
+#define COLOR_TITLE     0xff2b579a
+#define COLOR_CARET     0xff000000
+
+static QXLPresentTraceRect MakeRect(int32_t Left, int32_t Top, int32_t Right, int32_t Bottom)
+{
+    QXLPresentTraceRect r = { Left, Top, Right, Bottom };
+    return r;
+}
+
+static bool IsEmpty(const QXLPresentTraceRect &r)
+{
+    return r.right <= r.left || r.bottom <= r.top;
+}
+
+class Desktop
+{
+public:
+    Desktop(UINT Width, UINT Height, ULONG Seed, TraceWriter &Writer);
+
+    UINT Width() const { return m_Width; }
+    UINT Height() const { return m_Height; }
+    std::mt19937 &Rng() { return m_Rng; }
+    // the client area of the window
+    const QXLPresentTraceRect &Client() const { return m_Client; }
+    const QXLPresentTraceRect &Window() const { return m_Window; }
+
+    UINT32 *Pixel(int32_t x, int32_t y) { return &m_Fb[(size_t)y * m_Width + x]; }
+    void Fill(const QXLPresentTraceRect &r, UINT32 Color);
+    // wallpaper, the picture of a slide when Variant is not 0
+    void Wallpaper(const QXLPresentTraceRect &r, ULONG Variant);
+    void Glyph(int32_t x, int32_t y, ULONG Index, UINT32 Fg, UINT32 Bg);
+    // one line of words starting at x, y up to Right
+    void TextLine(int32_t x, int32_t y, int32_t Right);
+    void Text(const QXLPresentTraceRect &r);
+    void PaintWindow(const QXLPresentTraceRect &Window);
+    void Move(const QXLPresentTraceMove &m);
+    ULONG RandomChar();
+
+    // a present Delay after the previous one
+    bool Present(ULONGLONG Delay, const MoveList &Moves, const RectList &Rects);
+    // the first present after the mode set covers the whole screen
+    bool PresentAll();
+
+private:
+    UINT m_Width;
+    UINT m_Height;
+    std::vector<UINT32> m_Fb;
+    UCHAR m_Glyphs[GLYPH_COUNT][GLYPH_HEIGHT];
+    std::mt19937 m_Rng;
+    QXLPresentTraceRect m_Window;
+    QXLPresentTraceRect m_Client;
+    TraceWriter &m_Writer;
+    ULONGLONG m_Time;
+};
+
+Desktop::Desktop(UINT Width, UINT Height, ULONG Seed, TraceWriter &Writer) :
+    m_Width(Width),
+    m_Height(Height),
+    m_Fb((size_t)Width * Height),
+    m_Rng(Seed),
+    m_Writer(Writer),
+    m_Time(0)
+{
+    // glyphs are noise in the x-height band, index 0 is the space
+    for (ULONG i = 0; i < GLYPH_COUNT; i++) {
+        for (ULONG y = 0; y < GLYPH_HEIGHT; y++) {
+            UCHAR Bits = 0;
+            if (i && y >= 3 && y < 13) {
+                Bits = (UCHAR)(m_Rng() & m_Rng() & 0x7e);
+            }
+            m_Glyphs[i][y] = Bits;
+        }
+    }
+    m_Window = MakeRect(Width / 10, Height / 10, Width - Width / 10, Height - Height / 10);
+    Wallpaper(MakeRect(0, 0, Width, Height), 0);
+    PaintWindow(m_Window);
+}
+
+void Desktop::Fill(const QXLPresentTraceRect &r, UINT32 Color)
+{
+    for (int32_t y = r.top; y < r.bottom; y++) {
+        std::fill(&m_Fb[(size_t)y * m_Width + r.left], &m_Fb[(size_t)y * m_Width + r.right], Color);
+    }
+}
+
+void Desktop::Wallpaper(const QXLPresentTraceRect &r, ULONG Variant)
+{
+    double Phase = Variant * 0.7;
+
+    for (int32_t y = r.top; y < r.bottom; y++) {
+        UINT32 *pRow = &m_Fb[(size_t)y * m_Width];
+        for (int32_t x = r.left; x < r.right; x++) {
+            double u = (double)x / m_Width;
+            double v = (double)y / m_Height;
+            UINT32 R = (UINT32)(40 + 60 * u + 40 * sin(Phase + 6 * v));
+            UINT32 G = (UINT32)(60 + 80 * v + 30 * sin(Phase * 2 + 4 * u));
+            UINT32 B = (UINT32)(120 + 90 * (1 - u) * v);
+            pRow[x] = 0xff000000 | (R << 16) | (G << 8) | B;
+        }
+    }
+    if (!Variant) {
+        return;
+    }
+    // a slide: some shapes on top of the gradient
+    for (int i = 0; i < 24; i++) {
+        int32_t w = 16 + m_Rng() % (m_Width / 4);
+        int32_t h = 16 + m_Rng() % (m_Height / 4);
+        int32_t x = r.left + m_Rng() % std::max(1, r.right - r.left - w);
+        int32_t y = r.top + m_Rng() % std::max(1, r.bottom - r.top - h);
+        Fill(MakeRect(x, y, std::min(x + w, r.right), std::min(y + h, r.bottom)), 0xff000000 | (m_Rng() & 0xffffff));
+    }
+}
+
+void Desktop::Glyph(int32_t x, int32_t y, ULONG Index, UINT32 Fg, UINT32 Bg)
+{
+    for (int32_t gy = 0; gy < GLYPH_HEIGHT && y + gy < (int32_t)m_Height; gy++) {
+        UCHAR Bits = m_Glyphs[Index % GLYPH_COUNT][gy];
+        UINT32 *pRow = &m_Fb[(size_t)(y + gy) * m_Width];
+        for (int32_t gx = 0; gx < GLYPH_WIDTH && x + gx < (int32_t)m_Width; gx++) {
+            pRow[x + gx] = (Bits & (0x80 >> gx)) ? Fg : Bg;
+        }
+    }
+}
+
+ULONG Desktop::RandomChar()
+{
+    // roughly one space in six characters
+    return (m_Rng() % 6) ? 1 + m_Rng() % (GLYPH_COUNT - 1) : 0;
+}
+
+void Desktop::TextLine(int32_t x, int32_t y, int32_t Right)
+{
+    // ragged right margin like prose
+    int32_t End = Right - (int32_t)(m_Rng() % 12) * GLYPH_WIDTH;
+    Fill(MakeRect(x, y, Right, y + GLYPH_HEIGHT), COLOR_WINDOW);
+    for (; x + GLYPH_WIDTH <= End; x += GLYPH_WIDTH) {
+        Glyph(x, y, RandomChar(), COLOR_TEXT, COLOR_WINDOW);
+    }
+}
+
+void Desktop::Text(const QXLPresentTraceRect &r)
+{
+    for (int32_t y = r.top; y + GLYPH_HEIGHT <= r.bottom; y += GLYPH_HEIGHT) {
+        TextLine(r.left, y, r.right);
+    }
+}
+
+void Desktop::PaintWindow(const QXLPresentTraceRect &Window)
+{
+    m_Window = Window;
+    Fill(MakeRect(Window.left, Window.top, Window.right, Window.top + TITLE_HEIGHT), COLOR_TITLE);
+    Fill(MakeRect(Window.left, Window.top + TITLE_HEIGHT, Window.right, Window.bottom), COLOR_WINDOW);
+    m_Client = MakeRect(Window.left + GLYPH_WIDTH, Window.top + TITLE_HEIGHT + 4,
+                        Window.right - GLYPH_WIDTH, Window.bottom - 4);
+    // whole lines only
+    m_Client.bottom = m_Client.top + (m_Client.bottom - m_Client.top) / GLYPH_HEIGHT * GLYPH_HEIGHT;
+    Text(m_Client);
+}
+
+void Desktop::Move(const QXLPresentTraceMove &m)
+{
+    int32_t w = m.dest.right - m.dest.left;
+    int32_t h = m.dest.bottom - m.dest.top;
+    bool Up = m.dest.top > m.src_y;
+    std::vector<UINT32> Row(w);
+
+    for (int32_t i = 0; i < h; i++) {
+        int32_t y = Up ? h - 1 - i : i;
+        memcpy(Row.data(), &m_Fb[(size_t)(m.src_y + y) * m_Width + m.src_x], w * 4);
+        memcpy(&m_Fb[(size_t)(m.dest.top + y) * m_Width + m.dest.left], Row.data(), w * 4);
+    }
+}
+
+bool Desktop::Present(ULONGLONG Delay, const MoveList &Moves, const RectList &Rects)
+{
+    m_Time += Delay;
+    return m_Writer.Write(m_Time, m_Width, m_Height, m_Fb.data(), Moves, Rects);
+}
+
+bool Desktop::PresentAll()
+{
+    return Present(0, MoveList(), RectList(1, MakeRect(0, 0, m_Width, m_Height)));
+}
+
+/* scenarios, each one presents Frames times after the first full screen */
+
+// one character every 80 to 200 ms with the caret following, the text
+// scrolls up one line at the bottom of the window
+static bool Typing(Desktop &d, ULONG Frames)
+{
+    QXLPresentTraceRect c = d.Client();
+    int32_t x = c.left, y = c.top;
+
+    d.Fill(c, COLOR_WINDOW);
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        MoveList Moves;
+        RectList Rects;
+
+        d.Glyph(x, y, d.RandomChar(), COLOR_TEXT, COLOR_WINDOW);
+        Rects.push_back(MakeRect(x, y, x + GLYPH_WIDTH, y + GLYPH_HEIGHT));
+        x += GLYPH_WIDTH;
+        if (x + GLYPH_WIDTH > c.right) {
+            x = c.left;
+            y += GLYPH_HEIGHT;
+        }
+        if (y + GLYPH_HEIGHT > c.bottom) {
+            QXLPresentTraceMove m;
+            y -= GLYPH_HEIGHT;
+            m.src_x = c.left;
+            m.src_y = c.top + GLYPH_HEIGHT;
+            m.dest = MakeRect(c.left, c.top, c.right, c.bottom - GLYPH_HEIGHT);
+            d.Move(m);
+            Moves.push_back(m);
+            QXLPresentTraceRect Last = MakeRect(c.left, y, c.right, y + GLYPH_HEIGHT);
+            d.Fill(Last, COLOR_WINDOW);
+            Rects.assign(1, Last);
+        }
+        d.Fill(MakeRect(x, y, x + 2, y + GLYPH_HEIGHT), COLOR_CARET);
+        Rects.push_back(MakeRect(x, y, x + 2, y + GLYPH_HEIGHT));
+        Ok = d.Present((80 + d.Rng()() % 120) * MS_TIME, Moves, Rects);
+    }
+    return Ok;
+}
+
+// the document in the window scrolls by three lines every frame
+static bool Scroll(Desktop &d, ULONG Frames)
+{
+    QXLPresentTraceRect c = d.Client();
+    const int32_t Step = 3 * GLYPH_HEIGHT;
+
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        QXLPresentTraceMove m;
+        m.src_x = c.left;
+        m.src_y = c.top + Step;
+        m.dest = MakeRect(c.left, c.top, c.right, c.bottom - Step);
+        d.Move(m);
+        QXLPresentTraceRect New = MakeRect(c.left, c.bottom - Step, c.right, c.bottom);
+        d.Text(New);
+        Ok = d.Present(FRAME_TIME, MoveList(1, m), RectList(1, New));
+    }
+    return Ok;
+}
+
+// the window bounces around the screen, its content is moved and the
+// uncovered wallpaper repainted
+static bool Drag(Desktop &d, ULONG Frames)
+{
+    QXLPresentTraceRect w = d.Window();
+    int32_t Width = (w.right - w.left) * 3 / 4, Height = (w.bottom - w.top) * 3 / 4;
+    int32_t dx = 7, dy = 5;
+
+    d.Wallpaper(MakeRect(0, 0, d.Width(), d.Height()), 0);
+    d.PaintWindow(MakeRect(w.left, w.top, w.left + Width, w.top + Height));
+    w = d.Window();
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        if (w.left + dx < 0 || w.right + dx > (int32_t)d.Width()) {
+            dx = -dx;
+        }
+        if (w.top + dy < 0 || w.bottom + dy > (int32_t)d.Height()) {
+            dy = -dy;
+        }
+        QXLPresentTraceRect n = MakeRect(w.left + dx, w.top + dy, w.right + dx, w.bottom + dy);
+        QXLPresentTraceMove m;
+        m.src_x = w.left;
+        m.src_y = w.top;
+        m.dest = n;
+        d.Move(m);
+
+        // the old position minus the new one
+        RectList Exposed;
+        if (n.left >= w.right || n.right <= w.left || n.top >= w.bottom || n.bottom <= w.top) {
+            Exposed.push_back(w);
+        } else {
+            int32_t Top = std::max(w.top, n.top), Bottom = std::min(w.bottom, n.bottom);
+            Exposed.push_back(MakeRect(w.left, w.top, w.right, n.top));
+            Exposed.push_back(MakeRect(w.left, n.bottom, w.right, w.bottom));
+            Exposed.push_back(MakeRect(w.left, Top, n.left, Bottom));
+            Exposed.push_back(MakeRect(n.right, Top, w.right, Bottom));
+        }
+        RectList Rects;
+        for (const QXLPresentTraceRect &r : Exposed) {
+            if (!IsEmpty(r)) {
+                d.Wallpaper(r, 0);
+                Rects.push_back(r);
+            }
+        }
+        w = n;
+        Ok = d.Present(FRAME_TIME, MoveList(1, m), Rects);
+    }
+    return Ok;
+}
+
+// a 640x360 player at 30 frames/s with a progress bar under it
+static bool Video(Desktop &d, ULONG Frames)
+{
+    int32_t Width = std::min(640, (int32_t)d.Width()), Height = std::min(360, (int32_t)d.Height() - 8);
+    int32_t x0 = (d.Width() - Width) / 2, y0 = (d.Height() - Height - 8) / 2;
+    QXLPresentTraceRect Player = MakeRect(x0, y0, x0 + Width, y0 + Height);
+
+    d.Fill(MakeRect(x0, y0 + Height, x0 + Width, y0 + Height + 8), 0xff404040);
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        RectList Rects(1, Player);
+        // smooth moving gradients with 8x8 blocks of noise, close to what
+        // a decoded frame looks like to a compressor
+        for (int32_t y = 0; y < Height; y++) {
+            UINT32 *pRow = d.Pixel(x0, y0 + y);
+            for (int32_t x = 0; x < Width; x++) {
+                UINT32 Noise = ((x >> 3) * 7919 + (y >> 3) * 104729 + f * 31) % 24;
+                UINT32 R = (UINT32)(128 + 100 * sin(0.02 * x + 0.1 * f)) + Noise;
+                UINT32 G = (UINT32)(128 + 100 * sin(0.03 * y - 0.07 * f));
+                UINT32 B = (UINT32)(128 + 100 * sin(0.01 * (x + y) + 0.05 * f)) + Noise;
+                pRow[x] = 0xff000000 | (std::min(R, 255u) << 16) | (std::min(G, 255u) << 8) | std::min(B, 255u);
+            }
+        }
+        int32_t Progress = x0 + (int32_t)((ULONGLONG)Width * (f + 1) / Frames);
+        if (f % 30 == 0 || f + 1 == Frames) {
+            QXLPresentTraceRect Bar = MakeRect(x0, y0 + Height + 2, Progress, y0 + Height + 6);
+            d.Fill(Bar, 0xffe04040);
+            Rects.push_back(Bar);
+        }
+        Ok = d.Present(2 * FRAME_TIME, MoveList(), Rects);
+    }
+    return Ok;
+}
+
+// a new full screen picture every five seconds
+static bool Slideshow(Desktop &d, ULONG Frames)
+{
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        d.Wallpaper(MakeRect(0, 0, d.Width(), d.Height()), f + 1);
+        Ok = d.Present(5000 * MS_TIME, MoveList(), RectList(1, MakeRect(0, 0, d.Width(), d.Height())));
+    }
+    return Ok;
+}
+
+// nothing but the caret blinking every 530 ms and the clock changing
+// once a minute
+static bool Idle(Desktop &d, ULONG Frames)
+{
+    QXLPresentTraceRect c = d.Client();
+    QXLPresentTraceRect Caret = MakeRect(c.left + 4 * GLYPH_WIDTH, c.top, c.left + 4 * GLYPH_WIDTH + 2,
+                                         c.top + GLYPH_HEIGHT);
+    int32_t Right = d.Width() - GLYPH_WIDTH, Bottom = d.Height() - 4;
+    QXLPresentTraceRect Clock = MakeRect(Right - 5 * GLYPH_WIDTH, Bottom - GLYPH_HEIGHT, Right, Bottom);
+
+    bool Ok = d.PresentAll();
+    for (ULONG f = 0; Ok && f < Frames; f++) {
+        RectList Rects;
+        d.Fill(Caret, (f & 1) ? COLOR_WINDOW : COLOR_CARET);
+        Rects.push_back(Caret);
+        // 113 blinks are a minute
+        if (f % 113 == 112) {
+            for (int32_t x = Clock.left; x < Clock.right; x += GLYPH_WIDTH) {
+                d.Glyph(x, Clock.top, d.RandomChar(), COLOR_WINDOW, COLOR_TITLE);
+            }
+            Rects.push_back(Clock);
+        }
+        Ok = d.Present(530 * MS_TIME, MoveList(), Rects);
+    }
+    return Ok;
+}
+
+static const struct {
+    const char *Name;
+    bool (*Run)(Desktop &d, ULONG Frames);
+    ULONG Frames;
+    const char *Help;
+} s_Scenarios[] = {
+    { "typing", Typing, 300, "a character at a time with the caret, scrolls at the bottom" },
+    { "scroll", Scroll, 120, "a text window scrolled three lines per frame at 60 Hz" },
+    { "drag", Drag, 120, "a window dragged around the screen at 60 Hz" },
+    { "video", Video, 60, "a 640x360 video at 30 frames/s with a progress bar" },
+    { "slideshow", Slideshow, 10, "a full screen picture every five seconds" },
+    { "idle", Idle, 120, "a blinking caret and a clock" },
+};
+
+static void Usage(const char *Name)
+{
+    fprintf(stderr,
+        "usage: %s [options] SCENARIO FILE\n"
+        "  -W, --width N          mode width (1024)\n"
+        "  -H, --height N         mode height (768)\n"
+        "  -f, --frames N         presents after the first full screen one (per scenario)\n"
+        "      --seed N           seed of the content generator (1)\n"
+        "scenarios:\n",
+        Name);
+    for (const auto &s : s_Scenarios) {
+        fprintf(stderr, "  %-10s %4u  %s\n", s.Name, s.Frames, s.Help);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option LongOptions[] = {
+        { "width", required_argument, NULL, 'W' },
+        { "height", required_argument, NULL, 'H' },
+        { "frames", required_argument, NULL, 'f' },
+        { "seed", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    UINT Width = 1024, Height = 768;
+    ULONG Frames = 0, Seed = 1;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "W:H:f:h", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 'W': Width = strtoul(optarg, NULL, 0); break;
+        case 'H': Height = strtoul(optarg, NULL, 0); break;
+        case 'f': Frames = strtoul(optarg, NULL, 0); break;
+        case 's': Seed = strtoul(optarg, NULL, 0); break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    // the window needs room for a title and a few lines of text
+    if (optind != argc - 2 || Width < 320 || Height < 240) {
+        Usage(argv[0]);
+        return 2;
+    }
+    for (const auto &s : s_Scenarios) {
+        if (strcmp(s.Name, argv[optind])) {
+            continue;
+        }
+        TraceWriter Writer;
+        if (!Writer.Open(argv[optind + 1])) {
+            return 1;
+        }
+        Desktop d(Width, Height, Seed, Writer);
+        if (!s.Run(d, Frames ? Frames : s.Frames) || !Writer.Close()) {
+            fprintf(stderr, "%s: write failed\n", argv[optind + 1]);
+            return 1;
+        }
+        return 0;
+    }
+    fprintf(stderr, "unknown scenario '%s'\n", argv[optind]);
+    Usage(argv[0]);
+    return 2;
+}
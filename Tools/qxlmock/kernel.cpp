@@ -0,0 +1,1166 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Kernel routines qxldod calls, implemented on top of pthreads.
+ *
+ * Every dispatcher object (event, mutex, thread, timer) is guarded by one
+ * global lock and one condition variable, waiters re-check their object
+ * on each broadcast. That is slow but simple and the driver only waits
+ * on a handful of objects.
+ */
+
+#include "qxlmock.h"
+
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static std::mutex g_ObjLock;
+static std::condition_variable g_ObjCond;
+
+static thread_local KIRQL t_Irql = PASSIVE_LEVEL;
+static thread_local PVOID t_Thread;
+
+static ULONG g_Asserts;
+static bool g_AssertFatal = true;
+static bool g_DebugOutput = true;
+
+/* time */
+
+ULONGLONG ShimNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 10000000ULL + ts.tv_nsec / 100;
+}
+
+void KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    // 100ns intervals since 1601
+    CurrentTime->QuadPart = ((LONGLONG)ts.tv_sec + 11644473600LL) * 10000000LL + ts.tv_nsec / 100;
+}
+
+ULONGLONG KeQueryInterruptTime(void)
+{
+    return ShimNow();
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+    LARGE_INTEGER Counter;
+    if (PerformanceFrequency) {
+        PerformanceFrequency->QuadPart = 10000000;
+    }
+    Counter.QuadPart = (LONGLONG)ShimNow();
+    return Counter;
+}
+
+ULONG ExSetTimerResolution(ULONG DesiredTime, BOOLEAN SetResolution)
+{
+    UNREFERENCED_PARAMETER(SetResolution);
+    return DesiredTime ? DesiredTime : 156250;
+}
+
+// deadline in ShimNow() units for a kernel timeout, 0 for an infinite one
+static ULONGLONG Deadline(PLARGE_INTEGER Timeout)
+{
+    if (Timeout == NULL) {
+        return 0;
+    }
+    if (Timeout->QuadPart <= 0) {
+        return ShimNow() + (ULONGLONG)(-Timeout->QuadPart);
+    }
+    LARGE_INTEGER Now;
+    KeQuerySystemTime(&Now);
+    LONGLONG Rel = Timeout->QuadPart - Now.QuadPart;
+    return ShimNow() + (Rel > 0 ? Rel : 0);
+}
+
+static bool WaitUntil(std::unique_lock<std::mutex> &Lock, ULONGLONG Due)
+{
+    if (!Due) {
+        g_ObjCond.wait(Lock);
+        return true;
+    }
+    ULONGLONG Now = ShimNow();
+    if (Now >= Due) {
+        return false;
+    }
+    g_ObjCond.wait_for(Lock, std::chrono::nanoseconds((Due - Now) * 100));
+    return true;
+}
+
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval)
+{
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    ULONGLONG Due = Deadline(Interval);
+    for (ULONGLONG Now = ShimNow(); Now < Due; Now = ShimNow()) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds((Due - Now) * 100));
+    }
+    return STATUS_SUCCESS;
+}
+
+/* diagnostics */
+
+void ShimAssert(const char *expr, const char *file, int line)
+{
+    __sync_add_and_fetch(&g_Asserts, 1);
+    fprintf(stderr, "qxlmock: assertion \"%s\" failed at %s:%d\n", expr, file, line);
+    if (g_AssertFatal) {
+        abort();
+    }
+}
+
+ULONG ShimAssertCount(void)
+{
+    return g_Asserts;
+}
+
+void ShimSetAssertFatal(bool bFatal)
+{
+    g_AssertFatal = bFatal;
+}
+
+void ShimSetDebugOutput(bool bEnable)
+{
+    g_DebugOutput = bEnable;
+}
+
+// Windows format strings to glibc: %I64x is %llx, %S and %ws are wide
+// strings and %lx is 32 bits wide on Windows
+static std::string TranslateFormat(const char *Format)
+{
+    std::string Out;
+    for (const char *p = Format; *p; ++p) {
+        Out += *p;
+        if (*p != '%') {
+            continue;
+        }
+        if (p[1] == '%') {
+            Out += *++p;
+            continue;
+        }
+        while (p[1] && strchr("-+ #0123456789.*", p[1])) {
+            Out += *++p;
+        }
+        if (p[1] == 'I' && p[2] == '6' && p[3] == '4') {
+            Out += "ll";
+            p += 3;
+        } else if (p[1] == 'I' && p[2] == '3' && p[3] == '2') {
+            p += 3;
+        } else if (p[1] == 'I') {
+            Out += 'z';
+            p += 1;
+        } else if (p[1] == 'S' || (p[1] == 'w' && p[2] == 's')) {
+            Out += "ls";
+            p += (p[1] == 'S') ? 1 : 2;
+        } else if (p[1] == 'l' && p[2] && strchr("duxXi", p[2])) {
+            p += 1;
+        }
+    }
+    return Out;
+}
+
+NTSTATUS RtlStringCbVPrintfA(char *Dest, size_t cbDest, const char *Format, va_list argList)
+{
+    if (!cbDest) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    int Len = vsnprintf(Dest, cbDest, TranslateFormat(Format).c_str(), argList);
+    if (Len < 0) {
+        Dest[0] = 0;
+        return STATUS_INVALID_PARAMETER;
+    }
+    return (size_t)Len >= cbDest ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+NTSTATUS RtlStringCbPrintfA(char *Dest, size_t cbDest, const char *Format, ...)
+{
+    va_list List;
+    va_start(List, Format);
+    NTSTATUS Status = RtlStringCbVPrintfA(Dest, cbDest, Format, List);
+    va_end(List);
+    return Status;
+}
+
+// the driver prints everything to the serial port as well, the kernel
+// debugger copy is dropped
+ULONG vDbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, va_list arglist)
+{
+    UNREFERENCED_PARAMETER(ComponentId);
+    UNREFERENCED_PARAMETER(Level);
+    UNREFERENCED_PARAMETER(Format);
+    UNREFERENCED_PARAMETER(arglist);
+    return STATUS_SUCCESS;
+}
+
+ULONG DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...)
+{
+    va_list List;
+    va_start(List, Format);
+    ULONG Status = vDbgPrintEx(ComponentId, Level, Format, List);
+    va_end(List);
+    return Status;
+}
+
+/* strings and memory */
+
+SIZE_T ShimCompareMemory(const void *a, const void *b, SIZE_T len)
+{
+    const UCHAR *pa = (const UCHAR *)a;
+    const UCHAR *pb = (const UCHAR *)b;
+    SIZE_T i = 0;
+    while (i < len && pa[i] == pb[i]) {
+        ++i;
+    }
+    return i;
+}
+
+void RtlInitUnicodeString(PUNICODE_STRING Dest, PCWSTR Source)
+{
+    Dest->Buffer = (PWSTR)Source;
+    Dest->Length = Source ? (USHORT)(wcslen(Source) * sizeof(WCHAR)) : 0;
+    Dest->MaximumLength = Source ? Dest->Length + sizeof(WCHAR) : 0;
+}
+
+void RtlInitAnsiString(PANSI_STRING Dest, PCSZ Source)
+{
+    Dest->Buffer = (PCHAR)Source;
+    Dest->Length = Source ? (USHORT)strlen(Source) : 0;
+    Dest->MaximumLength = Source ? Dest->Length + 1 : 0;
+}
+
+NTSTATUS RtlAnsiStringToUnicodeString(PUNICODE_STRING Dest, PANSI_STRING Source, BOOLEAN Allocate)
+{
+    USHORT Chars = Source->Length;
+    if (Allocate) {
+        Dest->Buffer = (PWSTR)malloc((Chars + 1) * sizeof(WCHAR));
+        if (!Dest->Buffer) {
+            return STATUS_NO_MEMORY;
+        }
+        Dest->MaximumLength = (USHORT)((Chars + 1) * sizeof(WCHAR));
+    } else if (Dest->MaximumLength < (Chars + 1) * sizeof(WCHAR)) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+    for (USHORT i = 0; i < Chars; ++i) {
+        Dest->Buffer[i] = (UCHAR)Source->Buffer[i];
+    }
+    Dest->Buffer[Chars] = 0;
+    Dest->Length = (USHORT)(Chars * sizeof(WCHAR));
+    return STATUS_SUCCESS;
+}
+
+void RtlFreeUnicodeString(PUNICODE_STRING String)
+{
+    free(String->Buffer);
+    String->Buffer = NULL;
+    String->Length = String->MaximumLength = 0;
+}
+
+NTSTATUS RtlGetVersion(PRTL_OSVERSIONINFOW lpVersionInformation)
+{
+    // Windows 10 1607, the first build the driver enables VSync settings on
+    lpVersionInformation->dwMajorVersion = 10;
+    lpVersionInformation->dwMinorVersion = 0;
+    lpVersionInformation->dwBuildNumber = 14393;
+    lpVersionInformation->dwPlatformId = 2;
+    lpVersionInformation->szCSDVersion[0] = 0;
+    return STATUS_SUCCESS;
+}
+
+/* pool, plain malloc so the driver's operator delete and the C++ runtime
+   can free each other's blocks */
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+    return malloc(NumberOfBytes ? NumberOfBytes : 1);
+}
+
+void ExFreePool(PVOID P)
+{
+    free(P);
+}
+
+void ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+/* dispatcher objects */
+
+void KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+    Event->Header.Type = ShimEventObject;
+    Event->Header.AutoReset = (Type == SynchronizationEvent);
+    Event->Header.SignalState = State ? 1 : 0;
+}
+
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait)
+{
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    LONG Prev = Event->Header.SignalState;
+    Event->Header.SignalState = 1;
+    g_ObjCond.notify_all();
+    return Prev;
+}
+
+void KeClearEvent(PRKEVENT Event)
+{
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    Event->Header.SignalState = 0;
+}
+
+LONG KeResetEvent(PRKEVENT Event)
+{
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    LONG Prev = Event->Header.SignalState;
+    Event->Header.SignalState = 0;
+    return Prev;
+}
+
+void KeInitializeMutex(PRKMUTEX Mutex, ULONG Level)
+{
+    UNREFERENCED_PARAMETER(Level);
+    Mutex->Header.Type = ShimMutexObject;
+    Mutex->Header.SignalState = 1;
+    Mutex->Owner = NULL;
+    Mutex->Recursion = 0;
+}
+
+PVOID KeGetCurrentThread(void)
+{
+    // threads the driver did not create get a per thread cookie
+    static thread_local char Cookie;
+    return t_Thread ? t_Thread : &Cookie;
+}
+
+LONG KeReleaseMutex(PRKMUTEX Mutex, BOOLEAN Wait)
+{
+    UNREFERENCED_PARAMETER(Wait);
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    if (Mutex->Owner != KeGetCurrentThread() || Mutex->Recursion <= 0) {
+        fprintf(stderr, "qxlmock: mutex %p released by a thread that does not own it\n", (void *)Mutex);
+        ShimAssert("Mutex->Owner == KeGetCurrentThread()", __FILE__, __LINE__);
+        return 0;
+    }
+    if (--Mutex->Recursion == 0) {
+        Mutex->Owner = NULL;
+        Mutex->Header.SignalState = 1;
+        g_ObjCond.notify_all();
+    }
+    return 0;
+}
+
+struct ShimThread
+{
+    DISPATCHER_HEADER Header;
+    LONG Refs;
+    PKSTART_ROUTINE Routine;
+    PVOID Context;
+};
+
+// checks and consumes the signal of an object, called under g_ObjLock
+static bool TryAcquire(DISPATCHER_HEADER *Header)
+{
+    switch (Header->Type) {
+    case ShimMutexObject: {
+        PKMUTEX Mutex = CONTAINING_RECORD(Header, KMUTEX, Header);
+        if (Mutex->Owner && Mutex->Owner != KeGetCurrentThread()) {
+            return false;
+        }
+        Mutex->Owner = KeGetCurrentThread();
+        Mutex->Recursion++;
+        Header->SignalState = 0;
+        return true;
+    }
+    case ShimEventObject:
+    case ShimThreadObject:
+    case ShimTimerObject:
+        if (!Header->SignalState) {
+            return false;
+        }
+        if (Header->AutoReset) {
+            Header->SignalState = 0;
+        }
+        return true;
+    default:
+        ShimAssert("known dispatcher object", __FILE__, __LINE__);
+        return true;
+    }
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    DISPATCHER_HEADER *Header = (DISPATCHER_HEADER *)Object;
+    ULONGLONG Due = Deadline(Timeout);
+    if (Timeout && Timeout->QuadPart == 0) {
+        Due = ShimNow();
+    }
+
+    std::unique_lock<std::mutex> Lock(g_ObjLock);
+    while (!TryAcquire(Header)) {
+        if (!WaitUntil(Lock, Due)) {
+            return STATUS_TIMEOUT;
+        }
+    }
+    return STATUS_SUCCESS;
+}
+
+/* processors */
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+    return std::max(1U, std::thread::hardware_concurrency());
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+    int Cpu = sched_getcpu();
+    ULONG Number = Cpu < 0 ? 0 : (ULONG)Cpu;
+    if (ProcNumber) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)Number;
+        ProcNumber->Reserved = 0;
+    }
+    return Number;
+}
+
+/* threads */
+
+HANDLE PsGetCurrentThreadId(void)
+{
+    return (HANDLE)(ULONG_PTR)gettid();
+}
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                              HANDLE ProcessHandle, PCLIENT_ID ClientId, PKSTART_ROUTINE StartRoutine,
+                              PVOID StartContext)
+{
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(ProcessHandle);
+    UNREFERENCED_PARAMETER(ClientId);
+
+    ShimThread *pThread = new ShimThread;
+    pThread->Header.Type = ShimThreadObject;
+    pThread->Header.SignalState = 0;
+    pThread->Header.AutoReset = FALSE;
+    // one reference for the handle, one for the running thread
+    pThread->Refs = 2;
+    pThread->Routine = StartRoutine;
+    pThread->Context = StartContext;
+
+    std::thread([pThread]() {
+        t_Thread = pThread;
+        pThread->Routine(pThread->Context);
+        // returning from the start routine is PsTerminateSystemThread
+        {
+            std::lock_guard<std::mutex> Lock(g_ObjLock);
+            pThread->Header.SignalState = 1;
+            g_ObjCond.notify_all();
+        }
+        ShimDereferenceObject(pThread);
+    }).detach();
+
+    *ThreadHandle = pThread;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus)
+{
+    // every driver thread calls this last thing in its routine, the
+    // wrapper above finishes the job once the routine returns
+    UNREFERENCED_PARAMETER(ExitStatus);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType,
+                                   KPROCESSOR_MODE AccessMode, PVOID *Object, PVOID HandleInformation)
+{
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectType);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+    ShimThread *pThread = (ShimThread *)Handle;
+    if (!pThread || pThread->Header.Type != ShimThreadObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    __sync_add_and_fetch(&pThread->Refs, 1);
+    *Object = pThread;
+    return STATUS_SUCCESS;
+}
+
+void ShimDereferenceObject(PVOID Object)
+{
+    ShimThread *pThread = (ShimThread *)Object;
+    if (__sync_sub_and_fetch(&pThread->Refs, 1) == 0) {
+        delete pThread;
+    }
+}
+
+struct ShimFile
+{
+    DISPATCHER_HEADER Header;
+    FILE *Stream;
+};
+
+NTSTATUS ZwClose(HANDLE Handle)
+{
+    DISPATCHER_HEADER *Header = (DISPATCHER_HEADER *)Handle;
+    if (Header && Header->Type == ShimThreadObject) {
+        ShimDereferenceObject(Handle);
+    } else if (Header && Header->Type == ShimFileObject) {
+        ShimFile *pFile = (ShimFile *)Handle;
+        fclose(pFile->Stream);
+        delete pFile;
+    }
+    // registry handles are static
+    return STATUS_SUCCESS;
+}
+
+KPRIORITY KeSetPriorityThread(PVOID Thread, KPRIORITY Priority)
+{
+    UNREFERENCED_PARAMETER(Thread);
+    UNREFERENCED_PARAMETER(Priority);
+    return 8;
+}
+
+/* timers, one thread runs all of them and their DPCs */
+
+struct ShimTimer
+{
+    PKTIMER Timer;
+    PKDPC Dpc;
+    ULONGLONG Due;
+    LONG Period;
+    bool Armed;
+};
+
+static std::map<PKTIMER, ShimTimer> g_Timers;
+// never destroyed: the timer thread is still waiting on it at exit, and
+// glibc blocks destroying a condition variable that has waiters
+static std::condition_variable &g_TimerCond = *new std::condition_variable;
+static bool g_TimerThreadStarted;
+static bool g_TimerDpcRunning;
+
+static void TimerThread()
+{
+    t_Irql = DISPATCH_LEVEL;
+    std::unique_lock<std::mutex> Lock(g_ObjLock);
+    for (;;) {
+        ShimTimer *pNext = NULL;
+        for (auto &it : g_Timers) {
+            if (it.second.Armed && (!pNext || it.second.Due < pNext->Due)) {
+                pNext = &it.second;
+            }
+        }
+        ULONGLONG Now = ShimNow();
+        if (!pNext) {
+            g_TimerCond.wait(Lock);
+            continue;
+        }
+        if (pNext->Due > Now) {
+            g_TimerCond.wait_for(Lock, std::chrono::nanoseconds((pNext->Due - Now) * 100));
+            continue;
+        }
+        PKTIMER Timer = pNext->Timer;
+        PKDPC Dpc = pNext->Dpc;
+        if (pNext->Period) {
+            pNext->Due += (ULONGLONG)pNext->Period * 10000;
+        } else {
+            pNext->Armed = false;
+        }
+        Timer->Header.SignalState = 1;
+        g_ObjCond.notify_all();
+        if (Dpc) {
+            g_TimerDpcRunning = true;
+            Lock.unlock();
+            Dpc->DeferredRoutine(Dpc, Dpc->DeferredContext, NULL, NULL);
+            Lock.lock();
+            g_TimerDpcRunning = false;
+            g_TimerCond.notify_all();
+        }
+    }
+}
+
+void KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext)
+{
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+}
+
+void KeInitializeTimer(PKTIMER Timer)
+{
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    Timer->Header.Type = ShimTimerObject;
+    Timer->Header.SignalState = 0;
+    Timer->Header.AutoReset = FALSE;
+    Timer->Shim = NULL;
+    g_Timers.erase(Timer);
+}
+
+BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dpc)
+{
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    if (!g_TimerThreadStarted) {
+        g_TimerThreadStarted = true;
+        std::thread(TimerThread).detach();
+    }
+    ShimTimer &t = g_Timers[Timer];
+    BOOLEAN WasArmed = t.Armed;
+    t.Timer = Timer;
+    t.Dpc = Dpc;
+    t.Due = Deadline(&DueTime);
+    t.Period = Period;
+    t.Armed = true;
+    Timer->Shim = &t;
+    Timer->Header.SignalState = 0;
+    g_TimerCond.notify_all();
+    return WasArmed;
+}
+
+BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc)
+{
+    return KeSetTimerEx(Timer, DueTime, 0, Dpc);
+}
+
+BOOLEAN KeCancelTimer(PKTIMER Timer)
+{
+    std::lock_guard<std::mutex> Lock(g_ObjLock);
+    auto it = g_Timers.find(Timer);
+    if (it == g_Timers.end()) {
+        return FALSE;
+    }
+    BOOLEAN WasArmed = it->second.Armed;
+    it->second.Armed = false;
+    g_TimerCond.notify_all();
+    return WasArmed;
+}
+
+// only timer DPCs are waited for, the interrupt DPC runs on the caller
+// of MockDxgk and is done by the time it returns
+void KeFlushQueuedDpcs(void)
+{
+    std::unique_lock<std::mutex> Lock(g_ObjLock);
+    g_TimerCond.wait(Lock, [] { return !g_TimerDpcRunning; });
+}
+
+/* spin locks and irql */
+
+void KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock)
+{
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+void KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+    *OldIrql = t_Irql;
+    t_Irql = DISPATCH_LEVEL;
+    KeAcquireSpinLockAtDpcLevel(SpinLock);
+}
+
+void KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+    KeReleaseSpinLockFromDpcLevel(SpinLock);
+    t_Irql = NewIrql;
+}
+
+KIRQL KeGetCurrentIrql(void)
+{
+    return t_Irql;
+}
+
+void ShimRunAtDispatch(const std::function<void()> &Routine)
+{
+    KIRQL Old = t_Irql;
+    t_Irql = DISPATCH_LEVEL;
+    Routine();
+    t_Irql = Old;
+}
+
+/* registry, a flat map per key */
+
+struct ShimValue
+{
+    ULONG Type;
+    std::string Data;
+};
+
+typedef std::map<std::wstring, ShimValue> ShimKey;
+static std::map<std::wstring, ShimKey> g_Registry;
+static std::mutex g_RegLock;
+
+static const wchar_t DEVICE_KEY[] = L"Device";
+
+static std::wstring ValueName(PUNICODE_STRING Name)
+{
+    return std::wstring(Name->Buffer, Name->Length / sizeof(WCHAR));
+}
+
+void ShimSetRegistryDword(const wchar_t *Key, const wchar_t *Name, ULONG Value)
+{
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    ShimValue &v = g_Registry[Key][Name];
+    v.Type = REG_DWORD;
+    v.Data.assign((const char *)&Value, sizeof(Value));
+}
+
+bool ShimGetRegistryValue(const wchar_t *Key, const wchar_t *Name, ULONG *pType, std::string *pData)
+{
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    auto k = g_Registry.find(Key);
+    if (k == g_Registry.end()) {
+        return false;
+    }
+    auto v = k->second.find(Name);
+    if (v == k->second.end()) {
+        return false;
+    }
+    *pType = v->second.Type;
+    *pData = v->second.Data;
+    return true;
+}
+
+NTSTATUS IoOpenDeviceRegistryKey(PDEVICE_OBJECT DeviceObject, ULONG DevInstKeyType,
+                                 ACCESS_MASK DesiredAccess, PHANDLE DevInstRegKey)
+{
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(DevInstKeyType);
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    *DevInstRegKey = &g_Registry[DEVICE_KEY];
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwSetValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName_, ULONG TitleIndex, ULONG Type,
+                       PVOID Data, ULONG DataSize)
+{
+    UNREFERENCED_PARAMETER(TitleIndex);
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    ShimValue &v = (*(ShimKey *)KeyHandle)[ValueName(ValueName_)];
+    v.Type = Type;
+    v.Data.assign((const char *)Data, DataSize);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwQueryValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName_,
+                         KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+                         PVOID KeyValueInformation, ULONG Length, PULONG ResultLength)
+{
+    if (KeyValueInformationClass != KeyValuePartialInformation) {
+        return STATUS_NOT_IMPLEMENTED;
+    }
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    ShimKey *pKey = (ShimKey *)KeyHandle;
+    auto v = pKey->find(ValueName(ValueName_));
+    if (v == pKey->end()) {
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+    ULONG Needed = (ULONG)(FIELD_OFFSET(KEY_VALUE_PARTIAL_INFORMATION, Data) + v->second.Data.size());
+    *ResultLength = Needed;
+    if (Length < Needed) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    PKEY_VALUE_PARTIAL_INFORMATION pInfo = (PKEY_VALUE_PARTIAL_INFORMATION)KeyValueInformation;
+    pInfo->TitleIndex = 0;
+    pInfo->Type = v->second.Type;
+    pInfo->DataLength = (ULONG)v->second.Data.size();
+    memcpy(pInfo->Data, v->second.Data.data(), v->second.Data.size());
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwDeleteValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName_)
+{
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    return ((ShimKey *)KeyHandle)->erase(ValueName(ValueName_)) ? STATUS_SUCCESS : STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+// only the direct DWORD queries DriverEntry makes, relative to a subkey
+// of the service key
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                PVOID Context, PVOID Environment)
+{
+    UNREFERENCED_PARAMETER(RelativeTo);
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Environment);
+    std::lock_guard<std::mutex> Lock(g_RegLock);
+    std::wstring Key = L"Parameters";
+
+    for (PRTL_QUERY_REGISTRY_TABLE q = QueryTable; q->QueryRoutine || q->Name; ++q) {
+        if (q->Flags & RTL_QUERY_REGISTRY_SUBKEY) {
+            Key = q->Name;
+            continue;
+        }
+        if (!(q->Flags & RTL_QUERY_REGISTRY_DIRECT)) {
+            return STATUS_NOT_IMPLEMENTED;
+        }
+        auto k = g_Registry.find(Key);
+        auto v = (k != g_Registry.end()) ? k->second.find(q->Name) : ShimKey::iterator();
+        if (k == g_Registry.end() || v == k->second.end()) {
+            if (q->Flags & RTL_QUERY_REGISTRY_REQUIRED) {
+                return STATUS_OBJECT_NAME_NOT_FOUND;
+            }
+            continue;
+        }
+        if ((q->Flags & RTL_QUERY_REGISTRY_TYPECHECK) && (q->DefaultType >> 24) != v->second.Type) {
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+        if (v->second.Type != REG_DWORD) {
+            return STATUS_NOT_IMPLEMENTED;
+        }
+        memcpy(q->EntryContext, v->second.Data.data(), sizeof(ULONG));
+    }
+    return STATUS_SUCCESS;
+}
+
+/* files */
+
+static std::map<std::wstring, std::string> g_Files;
+static std::mutex g_FileLock;
+
+void ShimMapFile(const wchar_t *NtPath, const char *HostPath)
+{
+    std::lock_guard<std::mutex> Lock(g_FileLock);
+    g_Files[NtPath] = HostPath;
+}
+
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                      PIO_STATUS_BLOCK IoStatusBlock, PLARGE_INTEGER AllocationSize, ULONG FileAttributes,
+                      ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer,
+                      ULONG EaLength)
+{
+    UNREFERENCED_PARAMETER(AllocationSize);
+    UNREFERENCED_PARAMETER(FileAttributes);
+    UNREFERENCED_PARAMETER(ShareAccess);
+    UNREFERENCED_PARAMETER(CreateOptions);
+    UNREFERENCED_PARAMETER(EaBuffer);
+    UNREFERENCED_PARAMETER(EaLength);
+    std::string Host;
+    const char *Mode;
+
+    {
+        std::lock_guard<std::mutex> Lock(g_FileLock);
+        auto f = g_Files.find(ValueName(ObjectAttributes->ObjectName));
+        if (f == g_Files.end()) {
+            IoStatusBlock->Status = STATUS_OBJECT_PATH_NOT_FOUND;
+            return STATUS_OBJECT_PATH_NOT_FOUND;
+        }
+        Host = f->second;
+    }
+    switch (CreateDisposition) {
+    case FILE_SUPERSEDE:
+    case FILE_OVERWRITE:
+    case FILE_OVERWRITE_IF:
+        Mode = "wb";
+        break;
+    case FILE_OPEN_IF:
+        Mode = (DesiredAccess & (GENERIC_WRITE | FILE_APPEND_DATA)) ? "ab" : "rb";
+        break;
+    default:
+        Mode = (DesiredAccess & GENERIC_WRITE) ? "r+b" : "rb";
+        break;
+    }
+    FILE *Stream = fopen(Host.c_str(), Mode);
+    if (!Stream) {
+        IoStatusBlock->Status = STATUS_ACCESS_DENIED;
+        return STATUS_ACCESS_DENIED;
+    }
+    ShimFile *pFile = new ShimFile;
+    pFile->Header.Type = ShimFileObject;
+    pFile->Stream = Stream;
+    *FileHandle = pFile;
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = 0;
+    return STATUS_SUCCESS;
+}
+
+// synchronous only, the Event, APC and Key arguments are ignored
+NTSTATUS ZwWriteFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext,
+                     PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset,
+                     PULONG Key)
+{
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(ApcRoutine);
+    UNREFERENCED_PARAMETER(ApcContext);
+    UNREFERENCED_PARAMETER(Key);
+    ShimFile *pFile = (ShimFile *)FileHandle;
+    if (!pFile || pFile->Header.Type != ShimFileObject) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (ByteOffset && fseeko(pFile->Stream, ByteOffset->QuadPart, SEEK_SET)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    size_t Written = fwrite(Buffer, 1, Length, pFile->Stream);
+    IoStatusBlock->Information = Written;
+    IoStatusBlock->Status = (Written == Length) ? STATUS_SUCCESS : STATUS_DISK_FULL;
+    return IoStatusBlock->Status;
+}
+
+/* physical memory, the mock device registers its BARs */
+
+struct ShimRange
+{
+    UINT64 Start;
+    SIZE_T Length;
+    UCHAR *Host;
+};
+
+static std::vector<ShimRange> g_Physical;
+
+void ShimRegisterPhysical(UINT64 Start, SIZE_T Length, void *pHost)
+{
+    g_Physical.push_back({Start, Length, (UCHAR *)pHost});
+}
+
+void *ShimPhysicalToHost(UINT64 Start, SIZE_T Length)
+{
+    for (const ShimRange &r : g_Physical) {
+        if (Start >= r.Start && Start - r.Start <= r.Length && Length <= r.Length - (Start - r.Start)) {
+            return r.Host + (Start - r.Start);
+        }
+    }
+    return NULL;
+}
+
+PVOID MmMapIoSpace(PHYSICAL_ADDRESS PhysicalAddress, SIZE_T NumberOfBytes, MEMORY_CACHING_TYPE CacheType)
+{
+    UNREFERENCED_PARAMETER(CacheType);
+    return ShimPhysicalToHost((UINT64)PhysicalAddress.QuadPart, NumberOfBytes);
+}
+
+void MmUnmapIoSpace(PVOID BaseAddress, SIZE_T NumberOfBytes)
+{
+    UNREFERENCED_PARAMETER(BaseAddress);
+    UNREFERENCED_PARAMETER(NumberOfBytes);
+}
+
+// no MmMapIoSpaceEx, compat.cpp falls back to MmMapIoSpace
+PVOID MmGetSystemRoutineAddress(PUNICODE_STRING SystemRoutineName)
+{
+    UNREFERENCED_PARAMETER(SystemRoutineName);
+    return NULL;
+}
+
+/* MDLs describe user buffers that are already mapped */
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PVOID Irp)
+{
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+    UNREFERENCED_PARAMETER(Irp);
+    PMDL Mdl = (PMDL)calloc(1, sizeof(MDL));
+    if (Mdl) {
+        Mdl->StartVa = VirtualAddress;
+        Mdl->ByteCount = Length;
+    }
+    return Mdl;
+}
+
+void IoFreeMdl(PMDL Mdl)
+{
+    free(Mdl);
+}
+
+void MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation)
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(Operation);
+    Mdl->MdlFlags |= 1;
+}
+
+void MmUnlockPages(PMDL Mdl)
+{
+    Mdl->MdlFlags &= ~1;
+}
+
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority)
+{
+    UNREFERENCED_PARAMETER(Priority);
+    return Mdl->StartVa;
+}
+
+/* port i/o */
+
+struct ShimPorts
+{
+    ULONG Base;
+    ULONG Length;
+    ShimPortHandler *Handler;
+};
+
+static std::vector<ShimPorts> g_Ports;
+static std::string g_SerialLine;
+static std::mutex g_SerialLock;
+
+#define SERIAL_PORT 0x3F8
+
+void ShimRegisterPorts(ULONG Base, ULONG Length, ShimPortHandler *pHandler)
+{
+    g_Ports.push_back({Base, Length, pHandler});
+}
+
+void ShimUnregisterPorts(ShimPortHandler *pHandler)
+{
+    for (auto it = g_Ports.begin(); it != g_Ports.end(); ) {
+        it = (it->Handler == pHandler) ? g_Ports.erase(it) : it + 1;
+    }
+}
+
+static void SerialWrite(UCHAR Value)
+{
+    std::lock_guard<std::mutex> Lock(g_SerialLock);
+    if (Value == '\r' || Value == '\n') {
+        if (!g_SerialLine.empty() && g_DebugOutput) {
+            fprintf(stderr, "qxldod: %s\n", g_SerialLine.c_str());
+        }
+        g_SerialLine.clear();
+    } else {
+        g_SerialLine += (char)Value;
+    }
+}
+
+void WRITE_PORT_UCHAR(PUCHAR Port, UCHAR Value)
+{
+    ULONG Addr = (ULONG)(ULONG_PTR)Port;
+    if (Addr == SERIAL_PORT) {
+        SerialWrite(Value);
+        return;
+    }
+    for (const ShimPorts &p : g_Ports) {
+        if (Addr >= p.Base && Addr < p.Base + p.Length) {
+            p.Handler->PortWrite(Addr - p.Base, Value);
+            return;
+        }
+    }
+    fprintf(stderr, "qxlmock: write to unknown port 0x%x\n", Addr);
+}
+
+UCHAR READ_PORT_UCHAR(PUCHAR Port)
+{
+    ULONG Addr = (ULONG)(ULONG_PTR)Port;
+    for (const ShimPorts &p : g_Ports) {
+        if (Addr >= p.Base && Addr < p.Base + p.Length) {
+            return p.Handler->PortRead(Addr - p.Base);
+        }
+    }
+    return 0xff;
+}
+
+void WRITE_PORT_BUFFER_UCHAR(PUCHAR Port, PUCHAR Buffer, ULONG Count)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        WRITE_PORT_UCHAR(Port, Buffer[i]);
+    }
+}
+
+// the VGA device is the only user of the wide ports, the mock has no VGA
+USHORT READ_PORT_USHORT(PUSHORT Port)
+{
+    UNREFERENCED_PARAMETER(Port);
+    return 0xffff;
+}
+
+void WRITE_PORT_USHORT(PUSHORT Port, USHORT Value)
+{
+    UNREFERENCED_PARAMETER(Port);
+    UNREFERENCED_PARAMETER(Value);
+}
+
+ULONG READ_PORT_ULONG(PULONG Port)
+{
+    UNREFERENCED_PARAMETER(Port);
+    return 0xffffffff;
+}
+
+void WRITE_PORT_ULONG(PULONG Port, ULONG Value)
+{
+    UNREFERENCED_PARAMETER(Port);
+    UNREFERENCED_PARAMETER(Value);
+}
+
+/* no real mode BIOS, the VGA fallback fails to start */
+
+extern "C" {
+
+BOOLEAN x86BiosCall(ULONG Vector, PVOID Regs)
+{
+    UNREFERENCED_PARAMETER(Vector);
+    UNREFERENCED_PARAMETER(Regs);
+    return FALSE;
+}
+
+NTSTATUS x86BiosAllocateBuffer(ULONG *Size, USHORT *Segment, USHORT *Offset)
+{
+    UNREFERENCED_PARAMETER(Size);
+    UNREFERENCED_PARAMETER(Segment);
+    UNREFERENCED_PARAMETER(Offset);
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS x86BiosFreeBuffer(USHORT Segment, USHORT Offset)
+{
+    UNREFERENCED_PARAMETER(Segment);
+    UNREFERENCED_PARAMETER(Offset);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS x86BiosReadMemory(USHORT Segment, USHORT Offset, PVOID Buffer, ULONG Size)
+{
+    UNREFERENCED_PARAMETER(Segment);
+    UNREFERENCED_PARAMETER(Offset);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Size);
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS x86BiosWriteMemory(USHORT Segment, USHORT Offset, PVOID Buffer, ULONG Size)
+{
+    UNREFERENCED_PARAMETER(Segment);
+    UNREFERENCED_PARAMETER(Offset);
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Size);
+    return STATUS_NOT_SUPPORTED;
+}
+
+}
@@ -0,0 +1,423 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlmock: loads qxldod against the mock QXL device, sets a mode and
+ * presents synthetic frames, then prints what the driver and the device
+ * did. The exit code is non zero on device errors or failed assertions.
+ */
+
+#include "dxgkrnl.h"
+#include "../qxlstats/qxlstats.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+extern int nDebugLevel;
+
+// QXLEscape of the driver with the stats member
+#include "start-packed.h"
+struct SPICE_ATTR_PACKED QXLStatsEscape {
+    uint32_t ioctl;
+    QXLEscapeStats stats;
+};
+#include "end-packed.h"
+
+// PRESENT_TRACE_FILE of the driver
+static const wchar_t TRACE_FILE[] = L"\\SystemRoot\\Temp\\qxldod.trace";
+// TRACE_RING_FILE of the driver
+static const wchar_t TRACE_RING_FILE[] = L"\\SystemRoot\\Temp\\qxldod.ring";
+
+struct Options
+{
+    UINT Width = 1024;
+    UINT Height = 768;
+    ULONG Frames = 1000;
+    ULONG Rects = 4;
+    ULONG RectSize = 128;
+    ULONG Moves = 0;
+    bool Cursor = false;
+    ULONG Seed = 1;
+    // layout the client asks for halfway through, heads side by side
+    std::vector<QXLURect> ClientMonitors;
+    // a headless run gets its client halfway through
+    bool ClientConnect = false;
+    MockQxlConfig Device;
+};
+
+static void Usage(const char *Name)
+{
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -W, --width N          mode width (1024)\n"
+        "  -H, --height N         mode height (768)\n"
+        "  -f, --frames N         presents to issue (1000)\n"
+        "  -r, --rects N          dirty rectangles per present (4)\n"
+        "  -s, --rect-size N      edge of a dirty rectangle in pixels (128)\n"
+        "  -m, --moves N          move rectangles per present (0)\n"
+        "  -c, --cursor           move the pointer on every present\n"
+        "      --seed N           seed of the rectangle generator (1)\n"
+        "      --delay US         device cost of one command in microseconds (0)\n"
+        "      --release-bunch N  releases the device collects before pushing (32)\n"
+        "      --no-render        do not read bitmap data on the device side\n"
+        "      --ram MB           size of the RAM bar (64)\n"
+        "      --vram MB          size of the VRAM bar (64)\n"
+        "      --guest-debug N    ROM log_level, driver messages up to it go to QXL_IO_LOG (0)\n"
+        "      --headless         no SPICE client connected (ROM client_present 0)\n"
+        "      --client-connect   with --headless, connect the client halfway through the frames\n"
+        "      --compression-level N  ROM compression_level (9)\n"
+        "      --client-monitors WxH[,WxH...]\n"
+        "                         client monitor layout sent halfway through the frames\n"
+        "      --set NAME=VALUE   DWORD driver parameter, e.g. --set SurfaceBpp=16\n"
+        "      --record FILE      record the presents for qxlreplay (PresentTrace=1024)\n"
+        "      --trace-ring FILE  dump the trace ring when the device stops (TraceRing=5)\n"
+        "  -d, --debug LEVEL      driver trace level, 0 to 5 (2)\n",
+        Name);
+}
+
+static bool SetParameter(const char *Arg)
+{
+    const char *eq = strchr(Arg, '=');
+    if (!eq || eq == Arg) {
+        return false;
+    }
+    std::wstring Name(Arg, eq);
+    ShimSetRegistryDword(L"Parameters", Name.c_str(), strtoul(eq + 1, NULL, 0));
+    return true;
+}
+
+static bool ParseClientMonitors(const char *Arg, std::vector<QXLURect> &Heads)
+{
+    uint32_t x = 0;
+
+    Heads.clear();
+    while (*Arg) {
+        char *end;
+        QXLURect r;
+        unsigned long w = strtoul(Arg, &end, 10);
+        if (end == Arg || *end != 'x') {
+            return false;
+        }
+        Arg = end + 1;
+        unsigned long h = strtoul(Arg, &end, 10);
+        if (end == Arg || (*end && *end != ',')) {
+            return false;
+        }
+        Arg = *end ? end + 1 : end;
+        r.left = x;
+        r.top = 0;
+        r.right = x + w;
+        r.bottom = h;
+        Heads.push_back(r);
+        x += w;
+    }
+    return !Heads.empty();
+}
+
+static bool ParseOptions(int argc, char **argv, Options &Opt)
+{
+    enum { OPT_SEED = 256, OPT_DELAY, OPT_BUNCH, OPT_NORENDER, OPT_RAM, OPT_VRAM, OPT_SET, OPT_RECORD, OPT_RING, OPT_GUESTDEBUG,
+           OPT_CLIENTMONITORS, OPT_HEADLESS, OPT_CLIENTCONNECT, OPT_COMPRESSION };
+    static const struct option LongOptions[] = {
+        { "width", required_argument, NULL, 'W' },
+        { "height", required_argument, NULL, 'H' },
+        { "frames", required_argument, NULL, 'f' },
+        { "rects", required_argument, NULL, 'r' },
+        { "rect-size", required_argument, NULL, 's' },
+        { "moves", required_argument, NULL, 'm' },
+        { "cursor", no_argument, NULL, 'c' },
+        { "seed", required_argument, NULL, OPT_SEED },
+        { "delay", required_argument, NULL, OPT_DELAY },
+        { "release-bunch", required_argument, NULL, OPT_BUNCH },
+        { "no-render", no_argument, NULL, OPT_NORENDER },
+        { "ram", required_argument, NULL, OPT_RAM },
+        { "vram", required_argument, NULL, OPT_VRAM },
+        { "guest-debug", required_argument, NULL, OPT_GUESTDEBUG },
+        { "client-monitors", required_argument, NULL, OPT_CLIENTMONITORS },
+        { "headless", no_argument, NULL, OPT_HEADLESS },
+        { "client-connect", no_argument, NULL, OPT_CLIENTCONNECT },
+        { "compression-level", required_argument, NULL, OPT_COMPRESSION },
+        { "set", required_argument, NULL, OPT_SET },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "trace-ring", required_argument, NULL, OPT_RING },
+        { "debug", required_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool bRecord = false;
+    bool bRing = false;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "W:H:f:r:s:m:cd:h", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 'W': Opt.Width = strtoul(optarg, NULL, 0); break;
+        case 'H': Opt.Height = strtoul(optarg, NULL, 0); break;
+        case 'f': Opt.Frames = strtoul(optarg, NULL, 0); break;
+        case 'r': Opt.Rects = strtoul(optarg, NULL, 0); break;
+        case 's': Opt.RectSize = strtoul(optarg, NULL, 0); break;
+        case 'm': Opt.Moves = strtoul(optarg, NULL, 0); break;
+        case 'c': Opt.Cursor = true; break;
+        case 'd': nDebugLevel = atoi(optarg); break;
+        case OPT_SEED: Opt.Seed = strtoul(optarg, NULL, 0); break;
+        case OPT_DELAY: Opt.Device.ConsumerDelay = strtoul(optarg, NULL, 0); break;
+        case OPT_BUNCH: Opt.Device.ReleaseBunch = std::max(1UL, strtoul(optarg, NULL, 0)); break;
+        case OPT_NORENDER: Opt.Device.Render = false; break;
+        case OPT_RAM: Opt.Device.RamSize = strtoul(optarg, NULL, 0) << 20; break;
+        case OPT_VRAM: Opt.Device.VRamSize = strtoul(optarg, NULL, 0) << 20; break;
+        case OPT_GUESTDEBUG: Opt.Device.LogLevel = strtoul(optarg, NULL, 0); break;
+        case OPT_HEADLESS: Opt.Device.ClientPresent = false; break;
+        case OPT_CLIENTCONNECT: Opt.ClientConnect = true; break;
+        case OPT_COMPRESSION: Opt.Device.CompressionLevel = strtoul(optarg, NULL, 0); break;
+        case OPT_CLIENTMONITORS:
+            if (!ParseClientMonitors(optarg, Opt.ClientMonitors)) {
+                fprintf(stderr, "bad monitor layout '%s', expected WxH[,WxH...]\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_SET:
+            if (!SetParameter(optarg)) {
+                fprintf(stderr, "bad parameter '%s', expected NAME=VALUE\n", optarg);
+                return false;
+            }
+            break;
+        case OPT_RECORD:
+            ShimMapFile(TRACE_FILE, optarg);
+            bRecord = true;
+            break;
+        case OPT_RING:
+            ShimMapFile(TRACE_RING_FILE, optarg);
+            bRing = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    ULONG Type;
+    std::string Data;
+    if (bRecord && !ShimGetRegistryValue(L"Parameters", L"PresentTrace", &Type, &Data)) {
+        ShimSetRegistryDword(L"Parameters", L"PresentTrace", 1024);
+    }
+    if (bRing && !ShimGetRegistryValue(L"Parameters", L"TraceRing", &Type, &Data)) {
+        ShimSetRegistryDword(L"Parameters", L"TraceRing", 5);
+    }
+    if (optind != argc || !Opt.Width || !Opt.Height || !Opt.RectSize ||
+        Opt.Device.RamSize <= Opt.Device.Surface0Size + (1 << 20) || !Opt.Device.VRamSize) {
+        return false;
+    }
+    return true;
+}
+
+static RECT RandomRect(std::mt19937 &Rng, const Options &Opt)
+{
+    UINT w = std::min(Opt.RectSize, (ULONG)Opt.Width);
+    UINT h = std::min(Opt.RectSize, (ULONG)Opt.Height);
+    RECT r;
+
+    r.left = Rng() % (Opt.Width - w + 1);
+    r.top = Rng() % (Opt.Height - h + 1);
+    r.right = r.left + w;
+    r.bottom = r.top + h;
+    return r;
+}
+
+// the pixel loop a real desktop would have run before the present
+static void Paint(std::vector<UINT32> &Frame, const Options &Opt, const RECT &r, UINT32 Color)
+{
+    for (LONG y = r.top; y < r.bottom; y++) {
+        std::fill(&Frame[y * Opt.Width + r.left], &Frame[y * Opt.Width + r.right], Color);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Options Opt;
+    NTSTATUS Status;
+
+    if (!ParseOptions(argc, argv, Opt)) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    MockQxl Device(Opt.Device);
+    Device.Start();
+    int rc = 0;
+    {
+        MockDxgk Kernel(Device);
+
+        Status = Kernel.Start();
+        if (!NT_SUCCESS(Status)) {
+            return 1;
+        }
+        Status = Kernel.SetMode(Opt.Width, Opt.Height);
+        if (!NT_SUCCESS(Status)) {
+            fprintf(stderr, "qxlmock: CommitVidPn %ux%u failed with 0x%X\n", Opt.Width, Opt.Height, Status);
+            Kernel.Stop();
+            return 1;
+        }
+
+        std::vector<UINT32> Frame((size_t)Opt.Width * Opt.Height, 0);
+        std::vector<RECT> Dirty(Opt.Rects);
+        std::vector<D3DKMT_MOVE_RECT> Moves(Opt.Moves);
+        std::vector<UINT32> Shape(32 * 32, 0xff808080);
+        std::mt19937 Rng(Opt.Seed);
+        double MaxMs = 0;
+        NTSTATUS LastError = STATUS_SUCCESS;
+        ULONG Failed = 0;
+
+        if (Opt.Cursor) {
+            DXGKARG_SETPOINTERSHAPE PointerShape;
+            memset(&PointerShape, 0, sizeof(PointerShape));
+            PointerShape.Flags.Color = 1;
+            PointerShape.Width = 32;
+            PointerShape.Height = 32;
+            PointerShape.Pitch = 32 * 4;
+            PointerShape.pPixels = Shape.data();
+            Status = Kernel.SetPointerShape(&PointerShape);
+            if (!NT_SUCCESS(Status)) {
+                fprintf(stderr, "qxlmock: SetPointerShape failed with 0x%X\n", Status);
+            }
+        }
+
+        auto Begin = std::chrono::steady_clock::now();
+        for (ULONG f = 0; f < Opt.Frames; f++) {
+            DXGKARG_PRESENT_DISPLAYONLY Present;
+
+            if (f == Opt.Frames / 2 && !Opt.ClientMonitors.empty()) {
+                Device.SetClientMonitorsConfig(Opt.ClientMonitors);
+            }
+            if (f == Opt.Frames / 2 && Opt.ClientConnect && !Opt.Device.ClientPresent) {
+                Device.SetClientPresent(true);
+            }
+
+            for (ULONG i = 0; i < Opt.Moves; i++) {
+                RECT d = RandomRect(Rng, Opt);
+                RECT s = RandomRect(Rng, Opt);
+                Moves[i].SourcePoint.x = s.left;
+                Moves[i].SourcePoint.y = s.top;
+                Moves[i].DestRect = d;
+            }
+            for (ULONG i = 0; i < Opt.Rects; i++) {
+                Dirty[i] = RandomRect(Rng, Opt);
+                Paint(Frame, Opt, Dirty[i], 0xff000000 | (Rng() & 0xffffff));
+            }
+
+            memset(&Present, 0, sizeof(Present));
+            Present.VidPnSourceId = 0;
+            Present.pSource = Frame.data();
+            Present.BytesPerPixel = 4;
+            Present.Pitch = Opt.Width * 4;
+            Present.NumMoves = Opt.Moves;
+            Present.pMoves = Moves.data();
+            Present.NumDirtyRects = Opt.Rects;
+            Present.pDirtyRect = Dirty.data();
+
+            auto t0 = std::chrono::steady_clock::now();
+            Status = Kernel.Present(&Present);
+            double Ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            MaxMs = std::max(MaxMs, Ms);
+            if (!NT_SUCCESS(Status)) {
+                Failed++;
+                LastError = Status;
+            }
+
+            if (Opt.Cursor) {
+                DXGKARG_SETPOINTERPOSITION Position;
+                memset(&Position, 0, sizeof(Position));
+                Position.X = Rng() % Opt.Width;
+                Position.Y = Rng() % Opt.Height;
+                Position.Flags.Visible = 1;
+                Kernel.SetPointerPosition(&Position);
+            }
+        }
+        double PresentSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+        Kernel.Drain();
+        double TotalSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+
+        // the worker of head 0 applies the layout between presents, give
+        // it a moment when the frames ran out first; the driver has 4 heads
+        ULONG ExpectedChildren = Opt.ClientMonitors.empty() ? 1 : (1u << std::min<size_t>(Opt.ClientMonitors.size(), 4)) - 1;
+        for (int i = 0; i < 1000 && Kernel.ConnectedChildren() != ExpectedChildren; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        MockQxlStats s = Device.Stats();
+        printf("mode            %ux%u\n", Opt.Width, Opt.Height);
+        printf("presents        %u in %.3f s, %.1f/s, worst call %.3f ms, %u failed",
+               Opt.Frames, PresentSec, PresentSec > 0 ? Opt.Frames / PresentSec : 0.0, MaxMs, Failed);
+        if (Failed) {
+            printf(" (last 0x%X)", LastError);
+        }
+        printf("\n");
+        printf("drained         %.3f s, %.1f frames/s end to end\n",
+               TotalSec, TotalSec > 0 ? Opt.Frames / TotalSec : 0.0);
+        printf("commands        draw %llu, surface %llu, cursor %llu, max ring fill %u\n",
+               s.Commands[QXL_CMD_DRAW], s.Commands[QXL_CMD_SURFACE], s.Commands[QXL_CMD_CURSOR],
+               s.MaxCmdRingFill);
+        printf("draws           copy %llu, fill %llu, opaque %llu, other %llu\n",
+               s.Draws[QXL_DRAW_COPY], s.Draws[QXL_DRAW_FILL], s.Draws[QXL_DRAW_OPAQUE],
+               s.Commands[QXL_CMD_DRAW] - s.Draws[QXL_DRAW_COPY] - s.Draws[QXL_DRAW_FILL] -
+               s.Draws[QXL_DRAW_OPAQUE]);
+        printf("bitmap bytes    %llu (%.1f MB/s), %llu bitmaps at 16bpp\n", s.BitmapBytes,
+               TotalSec > 0 ? s.BitmapBytes / TotalSec / (1 << 20) : 0.0, s.Bitmaps16);
+        printf("releases        %llu in %llu pushes\n", s.Releases, s.ReleasePushes);
+        printf("notifies        cmd %llu, cursor %llu, oom %llu\n", s.NotifyCmd, s.NotifyCursor,
+               s.NotifyOom);
+        printf("interrupts      raised %llu, isr %llu, dpc %llu, vsync %llu\n", s.Interrupts,
+               Kernel.Interrupts(), Kernel.Dpcs(), Kernel.VSyncs());
+        printf("async io        %llu, primary creates %llu, monitors configs %llu\n", s.AsyncIo,
+               s.PrimaryCreates, s.MonitorsConfigs);
+        printf("host log        %llu lines in %llu QXL_IO_LOG\n", s.LogLines, s.LogIo);
+        printf("child status    %llu indications, connected 0x%x\n", Kernel.ChildStatus(), Kernel.ConnectedChildren());
+        printf("device errors   %llu\n", s.Errors);
+        printf("assertions      %u\n", ShimAssertCount());
+
+        // the driver counters have to agree with what the device saw
+        bool bStatsOk = false;
+        QXLStatsEscape Escape = {};
+        Escape.ioctl = QXL_ESCAPE_GET_STATS;
+        Status = Kernel.Escape(&Escape, sizeof(Escape));
+        if (!NT_SUCCESS(Status)) {
+            fprintf(stderr, "qxlmock: QXL_ESCAPE_GET_STATS failed with 0x%X\n", Status);
+        } else if (Escape.stats.drawables != s.Commands[QXL_CMD_DRAW] ||
+                   Escape.stats.oom_notifies != s.NotifyOom) {
+            fprintf(stderr, "qxlmock: driver counted %llu draws and %llu oom notifies, device %llu and %llu\n",
+                    (unsigned long long)Escape.stats.drawables, (unsigned long long)Escape.stats.oom_notifies,
+                    s.Commands[QXL_CMD_DRAW], s.NotifyOom);
+        } else if (Opt.ClientConnect && Escape.stats.presents_headless > 1 && Escape.stats.headless_uploads < 2) {
+            // the first present is uploaded at once, the damage after it
+            // no later than the client connect
+            fprintf(stderr, "qxlmock: %llu headless uploads, the damage was not sent on client connect\n",
+                    (unsigned long long)Escape.stats.headless_uploads);
+        } else {
+            bStatsOk = true;
+        }
+        printf("\ndriver counters\n");
+        PrintQxlStats(stdout, &Escape.stats);
+
+        Kernel.Stop();
+        if (Kernel.ConnectedChildren() != ExpectedChildren) {
+            fprintf(stderr, "qxlmock: children connected 0x%x, expected 0x%x\n", Kernel.ConnectedChildren(),
+                    ExpectedChildren);
+            rc = 1;
+        }
+        if (s.Errors || ShimAssertCount() || Failed || !bStatsOk) {
+            rc = 1;
+        }
+    }
+    Device.Stop();
+    return rc;
+}
@@ -0,0 +1,723 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "mockdev.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+static const struct { ULONG x, y; } s_Modes[] = {
+    { 640, 480 }, { 800, 600 }, { 1024, 768 }, { 1280, 720 }, { 1280, 800 },
+    { 1280, 1024 }, { 1440, 900 }, { 1600, 900 }, { 1680, 1050 },
+    { 1920, 1080 }, { 1920, 1200 }, { 2560, 1440 },
+};
+
+MockQxl::MockQxl(const MockQxlConfig &Config) :
+    m_Config(Config),
+    m_bRunning(false),
+    m_bBusy(false),
+    m_bFlush(false),
+    m_bKick(false),
+    m_LastRelease(NULL),
+    m_PendingReleases(0)
+{
+    m_Ram = (UCHAR *)aligned_alloc(4096, m_Config.RamSize);
+    m_VRam = (UCHAR *)aligned_alloc(4096, m_Config.VRamSize);
+    m_Rom = (UCHAR *)aligned_alloc(4096, ROM_SIZE);
+    if (!m_Ram || !m_VRam || !m_Rom) {
+        fprintf(stderr, "qxlmock: out of memory for the device BARs\n");
+        abort();
+    }
+    memset(m_Ram, 0, m_Config.RamSize);
+    memset(m_VRam, 0, m_Config.VRamSize);
+    memset(m_Rom, 0, ROM_SIZE);
+    memset(m_Slots, 0, sizeof(m_Slots));
+    memset(&m_Primary, 0, sizeof(m_Primary));
+    memset(&m_Stats, 0, sizeof(m_Stats));
+
+    InitRom();
+    m_RamHdr = (QXLRam *)(m_Ram + m_RomHdr->ram_header_offset);
+    m_RamHdr->magic = QXL_RAM_MAGIC;
+    m_Surfaces.assign(m_Config.NumSurfaces, false);
+
+    ShimRegisterPhysical(RamPA(), m_Config.RamSize, m_Ram);
+    ShimRegisterPhysical(VRamPA(), m_Config.VRamSize, m_VRam);
+    ShimRegisterPhysical(RomPA(), ROM_SIZE, m_Rom);
+    ShimRegisterPorts(IO_BASE, QXL_IO_RANGE_SIZE, this);
+}
+
+MockQxl::~MockQxl()
+{
+    Stop();
+    ShimUnregisterPorts(this);
+    free(m_Ram);
+    free(m_VRam);
+    free(m_Rom);
+}
+
+void MockQxl::InitRom()
+{
+    ULONG n_modes = 2 * (sizeof(s_Modes) / sizeof(s_Modes[0]));
+
+    m_RomHdr = (QXLRom *)m_Rom;
+    m_RomHdr->magic = QXL_ROM_MAGIC;
+    m_RomHdr->id = 0;
+    m_RomHdr->log_level = m_Config.LogLevel;
+    m_RomHdr->compression_level = m_Config.CompressionLevel;
+    SetClientFields(m_Config.ClientPresent);
+    m_RomHdr->modes_offset = ALIGN_UP((ULONG)sizeof(QXLRom), 16);
+    m_RomHdr->surface0_area_size = m_Config.Surface0Size;
+    m_RomHdr->ram_header_offset = m_Config.RamSize - ALIGN_UP((ULONG)sizeof(QXLRam), 4096);
+    m_RomHdr->num_pages = (m_RomHdr->ram_header_offset - m_Config.Surface0Size) / PAGE_SIZE;
+    m_RomHdr->n_surfaces = m_Config.NumSurfaces;
+    m_RomHdr->slots_start = 1;
+    m_RomHdr->slots_end = NUM_MEMSLOTS - 1;
+    m_RomHdr->slot_gen_bits = 8;
+    m_RomHdr->slot_id_bits = 8;
+    m_RomHdr->slot_generation = 0;
+
+    QXLModes *modes = (QXLModes *)(m_Rom + m_RomHdr->modes_offset);
+    if (m_RomHdr->modes_offset + sizeof(QXLModes) + n_modes * sizeof(QXLMode) > ROM_SIZE) {
+        fprintf(stderr, "qxlmock: mode list does not fit the ROM\n");
+        abort();
+    }
+    modes->n_modes = 0;
+    for (ULONG bits = 16; bits <= 32; bits += 16) {
+        for (ULONG i = 0; i < sizeof(s_Modes) / sizeof(s_Modes[0]); i++) {
+            ULONG stride = s_Modes[i].x * bits / 8;
+            if (stride * s_Modes[i].y > m_Config.Surface0Size) {
+                continue;
+            }
+            QXLMode *mode = &modes->modes[modes->n_modes];
+            mode->id = modes->n_modes++;
+            mode->x_res = s_Modes[i].x;
+            mode->y_res = s_Modes[i].y;
+            mode->bits = bits;
+            mode->stride = stride;
+            mode->x_mili = 0;
+            mode->y_mili = 0;
+            mode->orientation = 0;
+        }
+    }
+}
+
+void MockQxl::Start()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    if (m_bRunning) {
+        return;
+    }
+    m_bRunning = true;
+    m_bBusy = true;
+    m_Thread = std::thread(&MockQxl::Consumer, this);
+}
+
+void MockQxl::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Lock);
+        if (!m_bRunning) {
+            return;
+        }
+        m_bRunning = false;
+        m_Wake.notify_all();
+    }
+    m_Thread.join();
+}
+
+bool MockQxl::InterruptLevel() const
+{
+    return (m_RamHdr->int_pending & m_RamHdr->int_mask) != 0;
+}
+
+void MockQxl::RaiseInterrupt(UINT32 Bits)
+{
+    UINT32 old = __atomic_fetch_or(&m_RamHdr->int_pending, Bits, __ATOMIC_SEQ_CST);
+    // like qemu, no new edge when every bit was already pending
+    if ((old & Bits) == Bits) {
+        return;
+    }
+    __atomic_add_fetch(&m_Stats.Interrupts, 1, __ATOMIC_RELAXED);
+    if (InterruptLevel() && m_RaiseIrq) {
+        m_RaiseIrq();
+    }
+}
+
+// crc32 of qemu over the client monitors config, reflected, from 0 and
+// without the final xor
+static uint32_t ClientMonitorsCrc(const UCHAR *p, size_t len)
+{
+    uint32_t crc = 0;
+    while (len--) {
+        crc ^= *p++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CLIENT_MONITORS_CONFIG_CRC32_POLY : 0);
+        }
+    }
+    return crc;
+}
+
+void MockQxl::SetClientMonitorsConfig(const std::vector<QXLURect> &Heads)
+{
+    decltype(QXLRom::client_monitors_config) config;
+
+    memset(&config, 0, sizeof(config));
+    config.count = (uint16_t)std::min(Heads.size(), sizeof(config.heads) / sizeof(config.heads[0]));
+    std::copy(Heads.begin(), Heads.begin() + config.count, config.heads);
+    {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        memcpy(&m_RomHdr->client_monitors_config, &config, sizeof(config));
+        m_RomHdr->client_monitors_config_crc = ClientMonitorsCrc((const UCHAR *)&config, sizeof(config));
+    }
+    RaiseInterrupt(QXL_INTERRUPT_CLIENT_MONITORS_CONFIG);
+}
+
+void MockQxl::SetClientFields(bool bPresent)
+{
+    m_RomHdr->client_present = bPresent;
+    memset(m_RomHdr->client_capabilities, 0, sizeof(m_RomHdr->client_capabilities));
+    if (bPresent) {
+        // SPICE_DISPLAY_CAP_MONITORS_CONFIG, one of the few capabilities
+        // spice-server forwards to the ROM
+        m_RomHdr->client_capabilities[0] = 1 << 1;
+    }
+}
+
+void MockQxl::SetClientPresent(bool bPresent)
+{
+    {
+        std::lock_guard<std::mutex> Lock(m_Lock);
+        SetClientFields(bPresent);
+    }
+    RaiseInterrupt(QXL_INTERRUPT_CLIENT);
+}
+
+void MockQxl::Error(const char *Format, ...)
+{
+    va_list args;
+
+    __atomic_add_fetch(&m_Stats.Errors, 1, __ATOMIC_RELAXED);
+    va_start(args, Format);
+    fprintf(stderr, "qxlmock: device error: ");
+    vfprintf(stderr, Format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+void MockQxl::Reset()
+{
+    SPICE_RING_INIT(&m_RamHdr->cmd_ring);
+    SPICE_RING_INIT(&m_RamHdr->cursor_ring);
+    SPICE_RING_INIT(&m_RamHdr->release_ring);
+    *SPICE_RING_PROD_ITEM(&m_RamHdr->release_ring) = 0;
+    m_RamHdr->int_pending = 0;
+    m_RamHdr->int_mask = 0;
+    m_LastRelease = NULL;
+    m_PendingReleases = 0;
+    memset(m_Slots, 0, sizeof(m_Slots));
+    memset(&m_Primary, 0, sizeof(m_Primary));
+    m_Surfaces.assign(m_Config.NumSurfaces, false);
+}
+
+void MockQxl::PortWrite(ULONG Offset, UCHAR Value)
+{
+    std::unique_lock<std::mutex> lock(m_Lock);
+
+    switch (Offset) {
+    case QXL_IO_NOTIFY_CMD:
+        m_Stats.NotifyCmd++;
+        m_bKick = true;
+        m_Wake.notify_all();
+        break;
+    case QXL_IO_NOTIFY_CURSOR:
+        m_Stats.NotifyCursor++;
+        m_bKick = true;
+        m_Wake.notify_all();
+        break;
+    case QXL_IO_UPDATE_IRQ:
+        if (InterruptLevel() && m_RaiseIrq) {
+            m_RaiseIrq();
+        }
+        break;
+    case QXL_IO_NOTIFY_OOM:
+        // qemu lets the server drain its pipe and then pushes whatever
+        // was released, the consumer does the same on its next pass
+        m_Stats.NotifyOom++;
+        m_bFlush = true;
+        m_bKick = true;
+        m_Wake.notify_all();
+        break;
+    case QXL_IO_RESET:
+        Reset();
+        break;
+    case QXL_IO_MEMSLOT_ADD:
+    case QXL_IO_MEMSLOT_ADD_ASYNC:
+        if (Value < m_RomHdr->slots_start || Value > m_RomHdr->slots_end) {
+            Error("memslot %u out of range", Value);
+        } else if (m_RamHdr->mem_slot.mem_end <= m_RamHdr->mem_slot.mem_start ||
+                   !ShimPhysicalToHost(m_RamHdr->mem_slot.mem_start,
+                       (SIZE_T)(m_RamHdr->mem_slot.mem_end - m_RamHdr->mem_slot.mem_start))) {
+            Error("memslot %u covers unmapped range 0x%llx-0x%llx", Value,
+                  (unsigned long long)m_RamHdr->mem_slot.mem_start,
+                  (unsigned long long)m_RamHdr->mem_slot.mem_end);
+        } else {
+            m_Slots[Value].Active = true;
+            m_Slots[Value].Start = m_RamHdr->mem_slot.mem_start;
+            m_Slots[Value].End = m_RamHdr->mem_slot.mem_end;
+        }
+        break;
+    case QXL_IO_MEMSLOT_DEL:
+        if (Value < NUM_MEMSLOTS) {
+            m_Slots[Value].Active = false;
+        }
+        break;
+    case QXL_IO_CREATE_PRIMARY:
+    case QXL_IO_CREATE_PRIMARY_ASYNC: {
+        QXLSurfaceCreate *create = &m_RamHdr->create_surface;
+        SIZE_T size = (SIZE_T)(create->stride < 0 ? -create->stride : create->stride) * create->height;
+
+        if (m_Primary.width) {
+            Error("primary surface created twice");
+        }
+        if (create->type != QXL_SURF_TYPE_PRIMARY || !create->width || !create->height ||
+            (create->format != SPICE_SURFACE_FMT_32_xRGB && create->format != SPICE_SURFACE_FMT_16_555) ||
+            (ULONG)(create->stride < 0 ? -create->stride : create->stride) < create->width * (create->format / 8)) {
+            Error("bad primary %ux%u stride %d format %u", create->width, create->height,
+                  create->stride, create->format);
+        } else if (!Translate(create->mem, size)) {
+            Error("primary surface memory is not in a memslot");
+        } else {
+            m_Primary = *create;
+            m_Stats.PrimaryCreates++;
+        }
+        break;
+    }
+    case QXL_IO_DESTROY_PRIMARY:
+    case QXL_IO_DESTROY_PRIMARY_ASYNC:
+        memset(&m_Primary, 0, sizeof(m_Primary));
+        break;
+    case QXL_IO_DESTROY_ALL_SURFACES:
+    case QXL_IO_DESTROY_ALL_SURFACES_ASYNC:
+        memset(&m_Primary, 0, sizeof(m_Primary));
+        m_Surfaces.assign(m_Config.NumSurfaces, false);
+        break;
+    case QXL_IO_MONITORS_CONFIG_ASYNC: {
+        QXLMonitorsConfig *config = (QXLMonitorsConfig *)Translate(m_RamHdr->monitors_config,
+                                                                    sizeof(QXLMonitorsConfig));
+        if (!config || !Translate(m_RamHdr->monitors_config,
+                                  sizeof(QXLMonitorsConfig) + config->count * sizeof(QXLHead))) {
+            Error("monitors config at 0x%llx is not in a memslot",
+                  (unsigned long long)m_RamHdr->monitors_config);
+        } else {
+            m_Stats.MonitorsConfigs++;
+        }
+        break;
+    }
+    case QXL_IO_LOG: {
+        // qemu prints log_buf as one string
+        const char *Log = (const char *)m_RamHdr->log_buf;
+        if (!memchr(Log, 0, QXL_LOG_BUF_SIZE)) {
+            Error("log_buf not terminated");
+            m_RamHdr->log_buf[QXL_LOG_BUF_SIZE - 1] = 0;
+        }
+        m_Stats.LogIo++;
+        m_Stats.LogLines += std::count(Log, Log + strlen(Log), '\n');
+        fprintf(stderr, "qxlmock: guest log: %s", Log);
+        break;
+    }
+    case QXL_IO_UPDATE_AREA:
+    case QXL_IO_UPDATE_AREA_ASYNC:
+    case QXL_IO_DESTROY_SURFACE_WAIT:
+    case QXL_IO_DESTROY_SURFACE_ASYNC:
+    case QXL_IO_FLUSH_SURFACES_ASYNC:
+    case QXL_IO_FLUSH_RELEASE:
+        break;
+    default:
+        Error("write to unhandled port %u", Offset);
+        break;
+    }
+
+    switch (Offset) {
+    case QXL_IO_UPDATE_AREA_ASYNC:
+    case QXL_IO_MEMSLOT_ADD_ASYNC:
+    case QXL_IO_CREATE_PRIMARY_ASYNC:
+    case QXL_IO_DESTROY_PRIMARY_ASYNC:
+    case QXL_IO_DESTROY_SURFACE_ASYNC:
+    case QXL_IO_DESTROY_ALL_SURFACES_ASYNC:
+    case QXL_IO_FLUSH_SURFACES_ASYNC:
+    case QXL_IO_MONITORS_CONFIG_ASYNC:
+        // there is no server to wait for, the operation is done already
+        m_Stats.AsyncIo++;
+        lock.unlock();
+        RaiseInterrupt(QXL_INTERRUPT_IO_CMD);
+        break;
+    }
+}
+
+UCHAR MockQxl::PortRead(ULONG Offset)
+{
+    UNREFERENCED_PARAMETER(Offset);
+    return 0xff;
+}
+
+void *MockQxl::Translate(QXLPHYSICAL Addr, SIZE_T Size)
+{
+    UINT8 id_bits = m_RomHdr->slot_id_bits;
+    UINT8 gen_bits = m_RomHdr->slot_gen_bits;
+    UINT64 slot = Addr >> (64 - id_bits);
+    UINT64 gen = (Addr >> (64 - id_bits - gen_bits)) & ((1ULL << gen_bits) - 1);
+    UINT64 offset = Addr & (~0ULL >> (id_bits + gen_bits));
+
+    if (slot >= NUM_MEMSLOTS || !m_Slots[slot].Active) {
+        Error("address 0x%llx uses inactive slot %llu", (unsigned long long)Addr,
+              (unsigned long long)slot);
+        return NULL;
+    }
+    if (gen != m_RomHdr->slot_generation) {
+        Error("address 0x%llx has generation %llu, expected %u", (unsigned long long)Addr,
+              (unsigned long long)gen, m_RomHdr->slot_generation);
+        return NULL;
+    }
+    if (m_Slots[slot].Start + offset + Size > m_Slots[slot].End) {
+        Error("address 0x%llx size %zu runs past slot %llu", (unsigned long long)Addr,
+              (size_t)Size, (unsigned long long)slot);
+        return NULL;
+    }
+    return ShimPhysicalToHost(m_Slots[slot].Start + offset, Size);
+}
+
+ULONGLONG MockQxl::ReadChunks(QXLPHYSICAL Addr)
+{
+    ULONGLONG total = 0;
+    ULONG count = 0;
+
+    while (Addr) {
+        QXLDataChunk *chunk = (QXLDataChunk *)Translate(Addr, sizeof(QXLDataChunk));
+        if (!chunk) {
+            break;
+        }
+        UINT8 *data = (UINT8 *)Translate(Addr, sizeof(QXLDataChunk) + chunk->data_size);
+        if (!data) {
+            break;
+        }
+        if (m_Config.Render) {
+            // touch every byte like the server encoding the bitmap would
+            volatile UINT8 sum = 0;
+            for (ULONG i = 0; i < chunk->data_size; i++) {
+                sum += chunk->data[i];
+            }
+        }
+        total += chunk->data_size;
+        if (++count > 65536) {
+            Error("chunk chain at 0x%llx does not end", (unsigned long long)Addr);
+            break;
+        }
+        Addr = chunk->next_chunk;
+    }
+    return total;
+}
+
+void MockQxl::ReadImage(QXLPHYSICAL Addr)
+{
+    QXLImage *image = (QXLImage *)Translate(Addr, sizeof(QXLImage));
+
+    if (!image) {
+        return;
+    }
+    switch (image->descriptor.type) {
+    case SPICE_IMAGE_TYPE_BITMAP: {
+        ULONGLONG size = ReadChunks(image->bitmap.data);
+        if (size < (ULONGLONG)image->bitmap.stride * image->bitmap.y) {
+            Error("bitmap %ux%u stride %u carries only %llu bytes", image->bitmap.x,
+                  image->bitmap.y, image->bitmap.stride, size);
+        }
+        m_Stats.BitmapBytes += size;
+        if (image->bitmap.format == SPICE_BITMAP_FMT_16BIT) {
+            m_Stats.Bitmaps16++;
+        } else if (image->bitmap.format != SPICE_BITMAP_FMT_RGBA && image->bitmap.format != SPICE_BITMAP_FMT_32BIT) {
+            Error("bitmap format %u", image->bitmap.format);
+        }
+        break;
+    }
+    case SPICE_IMAGE_TYPE_SURFACE:
+        if (image->surface_image.surface_id == 0) {
+            if (!m_Primary.width) {
+                Error("image from the primary surface before it was created");
+            }
+        } else if (image->surface_image.surface_id >= m_Surfaces.size() ||
+                   !m_Surfaces[image->surface_image.surface_id]) {
+            Error("image from unknown surface %u", image->surface_image.surface_id);
+        }
+        break;
+    default:
+        Error("unexpected image type %u", image->descriptor.type);
+        break;
+    }
+}
+
+void MockQxl::ProcessDraw(QXLPHYSICAL Addr)
+{
+    QXLDrawable *drawable = (QXLDrawable *)Translate(Addr, sizeof(QXLDrawable));
+
+    if (!drawable) {
+        return;
+    }
+    if (drawable->type <= QXL_DRAW_COMPOSITE) {
+        m_Stats.Draws[drawable->type]++;
+    }
+    if (drawable->surface_id == 0) {
+        if (!m_Primary.width) {
+            Error("draw to the primary surface before it was created");
+        } else if (drawable->bbox.left < 0 || drawable->bbox.top < 0 ||
+                   drawable->bbox.right > (int32_t)m_Primary.width ||
+                   drawable->bbox.bottom > (int32_t)m_Primary.height ||
+                   drawable->bbox.left >= drawable->bbox.right ||
+                   drawable->bbox.top >= drawable->bbox.bottom) {
+            Error("bbox (%d,%d)-(%d,%d) outside of the %ux%u primary", drawable->bbox.left,
+                  drawable->bbox.top, drawable->bbox.right, drawable->bbox.bottom,
+                  m_Primary.width, m_Primary.height);
+        }
+    } else if (drawable->surface_id >= m_Surfaces.size() || !m_Surfaces[drawable->surface_id]) {
+        Error("draw to unknown surface %u", drawable->surface_id);
+    }
+
+    switch (drawable->type) {
+    case QXL_DRAW_COPY:
+    case QXL_DRAW_BLEND:
+        ReadImage(drawable->u.copy.src_bitmap);
+        break;
+    case QXL_DRAW_OPAQUE:
+        ReadImage(drawable->u.opaque.src_bitmap);
+        break;
+    default:
+        break;
+    }
+    Release(&drawable->release_info);
+}
+
+void MockQxl::ProcessSurface(QXLPHYSICAL Addr)
+{
+    QXLSurfaceCmd *cmd = (QXLSurfaceCmd *)Translate(Addr, sizeof(QXLSurfaceCmd));
+
+    if (!cmd) {
+        return;
+    }
+    if (cmd->surface_id == 0 || cmd->surface_id >= m_Surfaces.size()) {
+        Error("surface command for bad id %u", cmd->surface_id);
+    } else if (cmd->type == QXL_SURFACE_CMD_CREATE) {
+        QXLSurface *surface = &cmd->u.surface_create;
+        SIZE_T size = (SIZE_T)(surface->stride < 0 ? -surface->stride : surface->stride) *
+                      surface->height;
+        if (m_Surfaces[cmd->surface_id]) {
+            Error("surface %u created twice", cmd->surface_id);
+        }
+        if (!Translate(surface->data, size)) {
+            Error("surface %u memory is not in a memslot", cmd->surface_id);
+        }
+        m_Surfaces[cmd->surface_id] = true;
+    } else if (cmd->type == QXL_SURFACE_CMD_DESTROY) {
+        if (!m_Surfaces[cmd->surface_id]) {
+            Error("destroy of unknown surface %u", cmd->surface_id);
+        }
+        m_Surfaces[cmd->surface_id] = false;
+    }
+    Release(&cmd->release_info);
+}
+
+void MockQxl::ProcessCursor(QXLPHYSICAL Addr)
+{
+    QXLCursorCmd *cmd = (QXLCursorCmd *)Translate(Addr, sizeof(QXLCursorCmd));
+
+    if (!cmd) {
+        return;
+    }
+    if (cmd->type <= QXL_CURSOR_TRAIL) {
+        m_Stats.Cursors[cmd->type]++;
+    }
+    if (cmd->type == QXL_CURSOR_SET) {
+        QXLCursor *cursor = (QXLCursor *)Translate(cmd->u.set.shape, sizeof(QXLCursor));
+        if (cursor) {
+            ULONGLONG size = ReadChunks(cmd->u.set.shape + offsetof(QXLCursor, chunk));
+            if (size < cursor->data_size) {
+                Error("cursor shape carries %llu of %u bytes", size, cursor->data_size);
+            }
+        }
+    }
+    Release(&cmd->release_info);
+}
+
+void MockQxl::Release(QXLReleaseInfo *pInfo)
+{
+    QXLReleaseRing *ring = &m_RamHdr->release_ring;
+    uint64_t *item = SPICE_RING_PROD_ITEM(ring);
+    uint64_t id = pInfo->id;
+
+    // the same chaining qemu does: the first id of a bunch goes into
+    // the ring item, the others hang off the previous release info
+    pInfo->next = 0;
+    if (*item == 0) {
+        *item = id;
+    } else {
+        m_LastRelease->next = id;
+    }
+    m_LastRelease = pInfo;
+    m_PendingReleases++;
+    m_Stats.Releases++;
+    PushReleases(false);
+}
+
+void MockQxl::PushReleases(bool bFlush)
+{
+    QXLReleaseRing *ring = &m_RamHdr->release_ring;
+    int notify;
+
+    if (m_PendingReleases == 0) {
+        return;
+    }
+    // the producer item is the bunch being filled, never hand the last
+    // free slot to the driver
+    if (ring->prod - ring->cons + 1 == ring->num_items) {
+        return;
+    }
+    if (!bFlush && m_PendingReleases < m_Config.ReleaseBunch) {
+        return;
+    }
+    SPICE_RING_PUSH(ring, notify);
+    *SPICE_RING_PROD_ITEM(ring) = 0;
+    m_PendingReleases = 0;
+    m_LastRelease = NULL;
+    m_Stats.ReleasePushes++;
+    if (notify) {
+        RaiseInterrupt(QXL_INTERRUPT_DISPLAY);
+    }
+}
+
+void MockQxl::Consumer()
+{
+    QXLCommandRing *cmd_ring = &m_RamHdr->cmd_ring;
+    QXLCursorRing *cursor_ring = &m_RamHdr->cursor_ring;
+
+    for (;;) {
+        bool bWork = false;
+        int wait;
+        int notify;
+
+        {
+            std::unique_lock<std::mutex> lock(m_Lock);
+            if (!m_bRunning) {
+                break;
+            }
+            m_bKick = false;
+            if (m_bFlush) {
+                m_bFlush = false;
+                PushReleases(true);
+            }
+        }
+
+        SPICE_RING_CONS_WAIT(cursor_ring, wait);
+        if (!wait) {
+            QXLCommand cmd = *SPICE_RING_CONS_ITEM(cursor_ring);
+            SPICE_RING_POP(cursor_ring, notify);
+            if (notify) {
+                RaiseInterrupt(QXL_INTERRUPT_CURSOR);
+            }
+            std::lock_guard<std::mutex> lock(m_Lock);
+            if (cmd.type == QXL_CMD_CURSOR) {
+                m_Stats.Commands[QXL_CMD_CURSOR]++;
+                ProcessCursor(cmd.data);
+            } else {
+                Error("command type %u on the cursor ring", cmd.type);
+            }
+            bWork = true;
+        }
+
+        SPICE_RING_CONS_WAIT(cmd_ring, wait);
+        if (!wait) {
+            ULONG fill = cmd_ring->prod - cmd_ring->cons;
+            QXLCommand cmd = *SPICE_RING_CONS_ITEM(cmd_ring);
+            SPICE_RING_POP(cmd_ring, notify);
+            if (notify) {
+                RaiseInterrupt(QXL_INTERRUPT_DISPLAY);
+            }
+            std::lock_guard<std::mutex> lock(m_Lock);
+            if (fill > m_Stats.MaxCmdRingFill) {
+                m_Stats.MaxCmdRingFill = fill;
+            }
+            if (cmd.type <= QXL_CMD_SURFACE) {
+                m_Stats.Commands[cmd.type]++;
+            }
+            switch (cmd.type) {
+            case QXL_CMD_DRAW:
+                ProcessDraw(cmd.data);
+                break;
+            case QXL_CMD_SURFACE:
+                ProcessSurface(cmd.data);
+                break;
+            default:
+                Error("unexpected command type %u", cmd.type);
+                break;
+            }
+            bWork = true;
+        }
+
+        if (bWork) {
+            if (m_Config.ConsumerDelay) {
+                std::this_thread::sleep_for(std::chrono::microseconds(m_Config.ConsumerDelay));
+            }
+            continue;
+        }
+
+        // both rings are empty, hand back what was released and sleep
+        // until the driver notifies
+        std::unique_lock<std::mutex> lock(m_Lock);
+        PushReleases(true);
+        m_bBusy = false;
+        m_Idle.notify_all();
+        if (m_bRunning && !m_bKick) {
+            m_Wake.wait_for(lock, std::chrono::milliseconds(20));
+        }
+        m_bBusy = true;
+    }
+
+    std::lock_guard<std::mutex> lock(m_Lock);
+    m_bBusy = false;
+    m_Idle.notify_all();
+}
+
+bool MockQxl::WaitIdle(ULONG TimeoutMs)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(TimeoutMs);
+    std::unique_lock<std::mutex> lock(m_Lock);
+
+    for (;;) {
+        // releases held back for the next bunch stay pending, like on
+        // qemu they only go out with more work or an oom notify
+        if (SPICE_RING_IS_EMPTY(&m_RamHdr->cmd_ring) &&
+            SPICE_RING_IS_EMPTY(&m_RamHdr->cursor_ring) &&
+            !m_bBusy) {
+            return true;
+        }
+        if (m_Idle.wait_until(lock, deadline) == std::cv_status::timeout) {
+            return false;
+        }
+    }
+}
+
+MockQxlStats MockQxl::Stats()
+{
+    std::lock_guard<std::mutex> lock(m_Lock);
+    return m_Stats;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * A QXL PCI device without a SPICE server behind it: ROM with the mode
+ * list, RAM with the rings, VRAM for surfaces, the I/O ports and a host
+ * thread consuming the command and cursor rings at a configurable pace.
+ */
+
+#pragma once
+
+#include "qxlmock.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "qxl_dev.h"
+
+struct MockQxlConfig
+{
+    ULONG RamSize = 64 << 20;
+    ULONG VRamSize = 64 << 20;
+    ULONG Surface0Size = 16 << 20;
+    ULONG NumSurfaces = 1024;
+    UCHAR Revision = 5;
+    // host cost of one command in microseconds
+    ULONG ConsumerDelay = 0;
+    // releases collected before they are pushed to the release ring
+    ULONG ReleaseBunch = 32;
+    // walk and read every bitmap chunk like a SPICE server would
+    bool Render = true;
+    // ROM log_level, the guestdebug property of qemu
+    ULONG LogLevel = 0;
+    // ROM client fields: a client that decodes MJPEG streams is connected
+    bool ClientPresent = true;
+    // the default of qemu
+    ULONG CompressionLevel = 9;
+};
+
+struct MockQxlStats
+{
+    ULONGLONG Commands[QXL_CMD_SURFACE + 1];
+    ULONGLONG Draws[QXL_DRAW_COMPOSITE + 1];
+    ULONGLONG Cursors[QXL_CURSOR_TRAIL + 1];
+    ULONGLONG BitmapBytes;
+    ULONGLONG Bitmaps16;
+    ULONGLONG Releases;
+    ULONGLONG ReleasePushes;
+    ULONGLONG Interrupts;
+    ULONGLONG NotifyCmd;
+    ULONGLONG NotifyCursor;
+    ULONGLONG NotifyOom;
+    ULONGLONG AsyncIo;
+    ULONGLONG PrimaryCreates;
+    ULONGLONG MonitorsConfigs;
+    ULONGLONG LogIo;
+    ULONGLONG LogLines;
+    ULONGLONG Errors;
+    ULONG MaxCmdRingFill;
+};
+
+class MockQxl : public ShimPortHandler
+{
+public:
+    static const ULONG IO_BASE = 0xc000;
+    static const UINT64 RAM_PA = 0x80000000ULL;
+
+    MockQxl(const MockQxlConfig &Config);
+    ~MockQxl();
+
+    // raised when int_pending & int_mask turns non zero
+    void SetInterruptHandler(const std::function<void()> &Handler) { m_RaiseIrq = Handler; }
+    void Start();
+    void Stop();
+
+    UINT64 RamPA() const { return RAM_PA; }
+    UINT64 VRamPA() const { return RAM_PA + m_Config.RamSize; }
+    UINT64 RomPA() const { return VRamPA() + m_Config.VRamSize; }
+    ULONG RamSize() const { return m_Config.RamSize; }
+    ULONG VRamSize() const { return m_Config.VRamSize; }
+    ULONG RomSize() const { return ROM_SIZE; }
+    UCHAR Revision() const { return m_Config.Revision; }
+
+    // true while the interrupt line is up
+    bool InterruptLevel() const;
+    // writes a client monitor layout to the ROM, as qemu does when the
+    // client changes its monitors, and raises the interrupt
+    void SetClientMonitorsConfig(const std::vector<QXLURect> &Heads);
+    // connects or disconnects the SPICE client, qemu updates the ROM and
+    // raises QXL_INTERRUPT_CLIENT
+    void SetClientPresent(bool bPresent);
+    // waits until the device has consumed everything the driver queued
+    bool WaitIdle(ULONG TimeoutMs);
+    MockQxlStats Stats();
+    const QXLSurfaceCreate &Primary() const { return m_Primary; }
+
+    void PortWrite(ULONG Offset, UCHAR Value);
+    UCHAR PortRead(ULONG Offset);
+
+private:
+    static const ULONG ROM_SIZE = 8192;
+    static const ULONG NUM_MEMSLOTS = 8;
+
+    struct Slot
+    {
+        bool Active;
+        UINT64 Start;
+        UINT64 End;
+    };
+
+    void InitRom();
+    void SetClientFields(bool bPresent);
+    void Reset();
+    void Consumer();
+    void *Translate(QXLPHYSICAL Addr, SIZE_T Size);
+    void ProcessDraw(QXLPHYSICAL Addr);
+    void ProcessSurface(QXLPHYSICAL Addr);
+    void ProcessCursor(QXLPHYSICAL Addr);
+    ULONGLONG ReadChunks(QXLPHYSICAL Addr);
+    void ReadImage(QXLPHYSICAL Addr);
+    void Release(QXLReleaseInfo *pInfo);
+    void PushReleases(bool bFlush);
+    void RaiseInterrupt(UINT32 Bits);
+    void Error(const char *Format, ...);
+
+    MockQxlConfig m_Config;
+    std::function<void()> m_RaiseIrq;
+    UCHAR *m_Ram;
+    UCHAR *m_VRam;
+    UCHAR *m_Rom;
+    QXLRom *m_RomHdr;
+    QXLRam *m_RamHdr;
+    Slot m_Slots[NUM_MEMSLOTS];
+    QXLSurfaceCreate m_Primary;
+    std::vector<bool> m_Surfaces;
+
+    // m_Lock guards the device state against the port writes, the rings
+    // are lock free between the driver and the consumer
+    std::mutex m_Lock;
+    std::condition_variable m_Wake;
+    std::condition_variable m_Idle;
+    std::thread m_Thread;
+    bool m_bRunning;
+    bool m_bBusy;
+    bool m_bFlush;
+    bool m_bKick;
+    QXLReleaseInfo *m_LastRelease;
+    ULONG m_PendingReleases;
+    MockQxlStats m_Stats;
+};
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlpoolbench: memory bandwidth of the pool allocations of qxldod for
+ * bulk pixel buffers, the delayed chunks of AttachNewBitmap and
+ * PutBytesAlign among them. Each buffer is allocated with the operator
+ * new of the driver, BaseObject.cpp, filled the way the driver fills it
+ * and freed; once with the fill of the allocation and once with NoInit.
+ *
+ *   qxlpoolbench [--loops N]
+ */
+
+// the host side of the shims, then the allocation operators of the driver
+#include "qxlmock.h"
+#include "BaseObject.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// a bitmap line, a PutBytesAlign chunk (BITS_BUF_MAX), full screen
+// bitmaps at 1920x1080 and 2560x1440
+static const size_t Sizes[] = { 4 << 10, 64 << 10, 1920 * 1080 * 4, 2560 * 1440 * 4 };
+
+static double Run(const std::vector<UCHAR> &Source, size_t Size, ULONG Loops, bool bNoInit)
+{
+    auto Begin = std::chrono::steady_clock::now();
+    for (ULONG i = 0; i < Loops; i++) {
+        UCHAR *p = bNoInit ? new (PagedPool, NoInit) UCHAR[Size] : new (PagedPool) UCHAR[Size];
+        if (!p) {
+            fprintf(stderr, "qxlpoolbench: allocation of %zu bytes failed\n", Size);
+            exit(1);
+        }
+        memcpy(p, Source.data(), Size);
+        // keep the copy from being optimized away
+        __asm__ __volatile__("" : : "r"(p) : "memory");
+        delete[] p;
+    }
+    double Sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+    return Sec > 0 ? (double)Size * Loops / Sec / (1 << 20) : 0.0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option LongOptions[] = {
+        { "loops", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    // bytes moved per size, the loop count is scaled down for the large ones
+    ULONGLONG Bytes = 2ULL << 30;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "n:h", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 'n': Bytes = strtoull(optarg, NULL, 0) * Sizes[3]; break;
+        default:
+            fprintf(stderr, "usage: %s [--loops N]   N full 2560x1440 buffers per size (%llu)\n",
+                    argv[0], Bytes / Sizes[3]);
+            return 2;
+        }
+    }
+
+    std::vector<UCHAR> Source(Sizes[3]);
+    for (size_t i = 0; i < Source.size(); i++) {
+        Source[i] = (UCHAR)(i * 2654435761u >> 24);
+    }
+    printf("%-12s %12s %12s %8s\n", "buffer", "filled MB/s", "NoInit MB/s", "gain");
+    for (size_t Size : Sizes) {
+        ULONG Loops = (ULONG)std::max<ULONGLONG>(1, Bytes / Size);
+        // warm up the allocator and the source
+        Run(Source, Size, Loops / 10 + 1, false);
+        double Filled = Run(Source, Size, Loops, false);
+        double NoInitRate = Run(Source, Size, Loops, true);
+        printf("%-12zu %12.0f %12.0f %7.0f%%\n", Size, Filled, NoInitRate,
+               Filled > 0 ? (NoInitRate / Filled - 1) * 100 : 0.0);
+    }
+    return 0;
+}
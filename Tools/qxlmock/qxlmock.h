@@ -0,0 +1,60 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Host side of the kernel shims: what the mock device and the harness
+ * use to plug into the routines qxldod calls.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#define QXLMOCK_HOST
+#include "wdk.h"
+
+// port i/o, WRITE_PORT_* and READ_PORT_* in [base, base + length) land here
+class ShimPortHandler
+{
+public:
+    virtual ~ShimPortHandler() {}
+    virtual void PortWrite(ULONG Offset, UCHAR Value) = 0;
+    virtual UCHAR PortRead(ULONG Offset) = 0;
+};
+
+void ShimRegisterPorts(ULONG Base, ULONG Length, ShimPortHandler *pHandler);
+void ShimUnregisterPorts(ShimPortHandler *pHandler);
+
+// physical ranges MmMapIoSpace and the device translate
+void ShimRegisterPhysical(UINT64 Start, SIZE_T Length, void *pHost);
+void *ShimPhysicalToHost(UINT64 Start, SIZE_T Length);
+
+// registry, Key is L"Parameters" for the service key read in DriverEntry
+// and L"Device" for the key IoOpenDeviceRegistryKey opens
+void ShimSetRegistryDword(const wchar_t *Key, const wchar_t *Name, ULONG Value);
+bool ShimGetRegistryValue(const wchar_t *Key, const wchar_t *Name, ULONG *pType, std::string *pData);
+
+// files, ZwCreateFile of NtPath opens HostPath, other paths are not found
+void ShimMapFile(const wchar_t *NtPath, const char *HostPath);
+
+// driver debug output written to the serial port goes to stderr, the
+// driver filters it on nDebugLevel
+void ShimSetDebugOutput(bool bEnable);
+
+// monotonic time in 100ns units, the base of KeQueryInterruptTime
+ULONGLONG ShimNow(void);
+
+// number of failed assertions and whether they abort the run
+ULONG ShimAssertCount(void);
+void ShimSetAssertFatal(bool bFatal);
+
+// runs a routine at DISPATCH_LEVEL on the calling thread
+void ShimRunAtDispatch(const std::function<void()> &Routine);
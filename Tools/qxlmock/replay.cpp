@@ -0,0 +1,470 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlreplay: feeds a present trace recorded by the driver (PresentTrace
+ * parameter, or qxlmock --record) through qxldod and the mock device and
+ * reports the time of every present, the bytes the device had to read
+ * and what the driver did with its device memory allocator.
+ *
+ * The source surface is rebuilt frame by frame: the moves are applied
+ * to the previous frame and the recorded dirty pixels pasted on top, so
+ * the driver sees the same pSource the OS gave it.
+ */
+
+#include "dxgkrnl.h"
+#include "trace.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+extern int nDebugLevel;
+
+/* allocator accounting, the link wraps the mspace calls of the driver */
+
+typedef void *mspace;
+
+extern "C" {
+mspace __real_create_mspace_with_base(void *base, size_t capacity, int locked, void *user_data);
+void *__real_mspace_malloc(mspace msp, size_t bytes);
+void __real_mspace_free(mspace msp, void *mem);
+}
+
+// the driver creates the DEVRAM space first and the VRAM one second
+#define MAX_SPACES 2
+static const char *SpaceNames[MAX_SPACES] = { "devram", "vram" };
+
+struct SpaceStats
+{
+    mspace Space;
+    size_t Capacity;
+    ULONGLONG Allocs;
+    ULONGLONG Frees;
+    ULONGLONG Failed;
+    ULONGLONG Bytes;
+    size_t InUse;
+    size_t PeakInUse;
+};
+
+static std::mutex g_SpaceLock;
+static SpaceStats g_Spaces[MAX_SPACES];
+static std::unordered_map<void *, size_t> g_Blocks;
+
+static SpaceStats *FindSpace(mspace msp)
+{
+    for (SpaceStats &s : g_Spaces) {
+        if (s.Space == msp) {
+            return &s;
+        }
+    }
+    return NULL;
+}
+
+extern "C" mspace __wrap_create_mspace_with_base(void *base, size_t capacity, int locked, void *user_data)
+{
+    mspace msp = __real_create_mspace_with_base(base, capacity, locked, user_data);
+    std::lock_guard<std::mutex> Lock(g_SpaceLock);
+    for (SpaceStats &s : g_Spaces) {
+        if (!s.Space) {
+            s.Space = msp;
+            s.Capacity = capacity;
+            break;
+        }
+    }
+    return msp;
+}
+
+extern "C" void *__wrap_mspace_malloc(mspace msp, size_t bytes)
+{
+    void *mem = __real_mspace_malloc(msp, bytes);
+    std::lock_guard<std::mutex> Lock(g_SpaceLock);
+    SpaceStats *s = FindSpace(msp);
+    if (s) {
+        if (!mem) {
+            s->Failed++;
+            return mem;
+        }
+        s->Allocs++;
+        s->Bytes += bytes;
+        s->InUse += bytes;
+        s->PeakInUse = std::max(s->PeakInUse, s->InUse);
+        g_Blocks[mem] = bytes;
+    }
+    return mem;
+}
+
+extern "C" void __wrap_mspace_free(mspace msp, void *mem)
+{
+    {
+        std::lock_guard<std::mutex> Lock(g_SpaceLock);
+        SpaceStats *s = FindSpace(msp);
+        auto b = g_Blocks.find(mem);
+        if (s && b != g_Blocks.end()) {
+            s->Frees++;
+            s->InUse -= b->second;
+            g_Blocks.erase(b);
+        }
+    }
+    __real_mspace_free(msp, mem);
+}
+
+static void SpaceSnapshot(SpaceStats *pStats)
+{
+    std::lock_guard<std::mutex> Lock(g_SpaceLock);
+    memcpy(pStats, g_Spaces, sizeof(g_Spaces));
+}
+
+/* replay */
+
+struct Options
+{
+    const char *Trace = NULL;
+    const char *Csv = NULL;
+    ULONG Loops = 1;
+    bool Realtime = false;
+    bool Brief = false;
+    MockQxlConfig Device;
+};
+
+static void Usage(const char *Name)
+{
+    fprintf(stderr,
+        "usage: %s [options] TRACE\n"
+        "  -l, --loops N          replay the trace N times (1)\n"
+        "      --realtime         keep the recorded spacing of the presents\n"
+        "      --csv FILE         write one line per present to FILE\n"
+        "      --brief            print one summary line, for comparing traces\n"
+        "      --delay US         device cost of one command in microseconds (0)\n"
+        "      --release-bunch N  releases the device collects before pushing (32)\n"
+        "      --no-render        do not read bitmap data on the device side\n"
+        "      --ram MB           size of the RAM bar (64)\n"
+        "      --vram MB          size of the VRAM bar (64)\n"
+        "      --set NAME=VALUE   DWORD driver parameter, e.g. --set SurfaceBpp=16\n"
+        "  -d, --debug LEVEL      driver trace level, 0 to 5 (2)\n",
+        Name);
+}
+
+static bool ParseOptions(int argc, char **argv, Options &Opt)
+{
+    enum { OPT_REALTIME = 256, OPT_CSV, OPT_BRIEF, OPT_DELAY, OPT_BUNCH, OPT_NORENDER, OPT_RAM, OPT_VRAM, OPT_SET };
+    static const struct option LongOptions[] = {
+        { "loops", required_argument, NULL, 'l' },
+        { "realtime", no_argument, NULL, OPT_REALTIME },
+        { "csv", required_argument, NULL, OPT_CSV },
+        { "brief", no_argument, NULL, OPT_BRIEF },
+        { "delay", required_argument, NULL, OPT_DELAY },
+        { "release-bunch", required_argument, NULL, OPT_BUNCH },
+        { "no-render", no_argument, NULL, OPT_NORENDER },
+        { "ram", required_argument, NULL, OPT_RAM },
+        { "vram", required_argument, NULL, OPT_VRAM },
+        { "set", required_argument, NULL, OPT_SET },
+        { "debug", required_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+
+    while ((c = getopt_long(argc, argv, "l:d:h", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 'l': Opt.Loops = strtoul(optarg, NULL, 0); break;
+        case 'd': nDebugLevel = atoi(optarg); break;
+        case OPT_REALTIME: Opt.Realtime = true; break;
+        case OPT_CSV: Opt.Csv = optarg; break;
+        case OPT_BRIEF: Opt.Brief = true; break;
+        case OPT_DELAY: Opt.Device.ConsumerDelay = strtoul(optarg, NULL, 0); break;
+        case OPT_BUNCH: Opt.Device.ReleaseBunch = std::max(1UL, strtoul(optarg, NULL, 0)); break;
+        case OPT_NORENDER: Opt.Device.Render = false; break;
+        case OPT_RAM: Opt.Device.RamSize = strtoul(optarg, NULL, 0) << 20; break;
+        case OPT_VRAM: Opt.Device.VRamSize = strtoul(optarg, NULL, 0) << 20; break;
+        case OPT_SET: {
+            const char *eq = strchr(optarg, '=');
+            if (!eq || eq == optarg) {
+                fprintf(stderr, "bad parameter '%s', expected NAME=VALUE\n", optarg);
+                return false;
+            }
+            std::wstring Name((const char *)optarg, eq);
+            ShimSetRegistryDword(L"Parameters", Name.c_str(), strtoul(eq + 1, NULL, 0));
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    if (optind != argc - 1 || !Opt.Loops ||
+        Opt.Device.RamSize <= Opt.Device.Surface0Size + (1 << 20) || !Opt.Device.VRamSize) {
+        return false;
+    }
+    Opt.Trace = argv[optind];
+    return true;
+}
+
+// the pSource of the next present: the last one, moved, with the new pixels
+static void BuildSource(std::vector<UCHAR> &Source, const TraceFrame &Frame)
+{
+    const QXLPresentTraceFrame &h = Frame.Header;
+    ULONG Pitch = h.width * h.bytes_per_pixel;
+    std::vector<UCHAR> Row;
+
+    for (const QXLPresentTraceMove &m : Frame.Moves) {
+        LONG w = m.dest.right - m.dest.left;
+        LONG hgt = m.dest.bottom - m.dest.top;
+        if (w <= 0 || hgt <= 0 || m.dest.left < 0 || m.dest.top < 0 || m.src_x < 0 || m.src_y < 0 ||
+            (ULONG)(m.dest.left + w) > h.width || (ULONG)(m.dest.top + hgt) > h.height ||
+            (ULONG)(m.src_x + w) > h.width || (ULONG)(m.src_y + hgt) > h.height) {
+            continue;
+        }
+        // rows are copied in the order that keeps overlapping moves intact
+        bool Up = m.dest.top > m.src_y;
+        Row.resize(w * h.bytes_per_pixel);
+        for (LONG i = 0; i < hgt; i++) {
+            LONG y = Up ? hgt - 1 - i : i;
+            memcpy(Row.data(), &Source[(m.src_y + y) * Pitch + m.src_x * h.bytes_per_pixel], Row.size());
+            memcpy(&Source[(m.dest.top + y) * Pitch + m.dest.left * h.bytes_per_pixel], Row.data(), Row.size());
+        }
+    }
+
+    const UCHAR *pPixels = Frame.Pixels.data();
+    const UCHAR *pEnd = pPixels + Frame.Pixels.size();
+    for (const QXLPresentTraceRect &r : Frame.Rects) {
+        size_t Width = (r.right - r.left) * h.bytes_per_pixel;
+        for (LONG y = r.top; y < r.bottom && pPixels + Width <= pEnd; y++) {
+            memcpy(&Source[y * Pitch + r.left * h.bytes_per_pixel], pPixels, Width);
+            pPixels += Width;
+        }
+    }
+}
+
+static double Percentile(const std::vector<double> &Sorted, double p)
+{
+    if (Sorted.empty()) {
+        return 0;
+    }
+    return Sorted[std::min(Sorted.size() - 1, (size_t)(p * Sorted.size()))];
+}
+
+int main(int argc, char **argv)
+{
+    Options Opt;
+    TraceReader Reader;
+    NTSTATUS Status;
+
+    if (!ParseOptions(argc, argv, Opt)) {
+        Usage(argv[0]);
+        return 2;
+    }
+    if (!Reader.Open(Opt.Trace)) {
+        return 2;
+    }
+    FILE *Csv = NULL;
+    if (Opt.Csv) {
+        Csv = fopen(Opt.Csv, "w");
+        if (!Csv) {
+            perror(Opt.Csv);
+            return 2;
+        }
+        fprintf(Csv, "frame,time_us,moves,rects,source_bytes,call_us,bitmap_bytes,allocs,alloc_bytes,in_use,oom\n");
+    }
+
+    MockQxl Device(Opt.Device);
+    Device.Start();
+    int rc = 0;
+    {
+        MockDxgk Kernel(Device);
+
+        Status = Kernel.Start();
+        if (!NT_SUCCESS(Status)) {
+            return 1;
+        }
+
+        TraceFrame Frame;
+        std::vector<UCHAR> Source;
+        std::vector<RECT> Dirty;
+        std::vector<D3DKMT_MOVE_RECT> Moves;
+        std::vector<double> CallUs;
+        UINT Width = 0, Height = 0;
+        ULONG Rotation = D3DKMDT_VPPR_IDENTITY;
+        ULONG Frames = 0, Skipped = 0, ModeSets = 0, Failed = 0;
+        ULONGLONG SourceBytes = 0;
+        NTSTATUS LastError = STATUS_SUCCESS;
+
+        auto Begin = std::chrono::steady_clock::now();
+        for (ULONG Loop = 0; Loop < Opt.Loops; Loop++) {
+            auto LoopBegin = std::chrono::steady_clock::now();
+            Reader.Rewind();
+            while (Reader.Next(Frame)) {
+                const QXLPresentTraceFrame &h = Frame.Header;
+
+                // the mock has one path, the other sources are counted only
+                if (h.source_id != 0 || h.bytes_per_pixel != 4 || !h.width || !h.height) {
+                    Skipped++;
+                    continue;
+                }
+                if (h.width != Width || h.height != Height || h.rotation != Rotation) {
+                    Kernel.Drain();
+                    Status = Kernel.SetMode(h.width, h.height, (D3DKMDT_VIDPN_PRESENT_PATH_ROTATION)h.rotation);
+                    if (!NT_SUCCESS(Status)) {
+                        fprintf(stderr, "qxlreplay: CommitVidPn %ux%u failed with 0x%X\n", h.width, h.height, Status);
+                        rc = 1;
+                        break;
+                    }
+                    Width = h.width;
+                    Height = h.height;
+                    Rotation = h.rotation;
+                    Source.assign((size_t)Width * Height * 4, 0);
+                    ModeSets++;
+                }
+                BuildSource(Source, Frame);
+
+                Moves.resize(h.num_moves);
+                for (ULONG i = 0; i < h.num_moves; i++) {
+                    Moves[i].SourcePoint.x = Frame.Moves[i].src_x;
+                    Moves[i].SourcePoint.y = Frame.Moves[i].src_y;
+                    Moves[i].DestRect.left = Frame.Moves[i].dest.left;
+                    Moves[i].DestRect.top = Frame.Moves[i].dest.top;
+                    Moves[i].DestRect.right = Frame.Moves[i].dest.right;
+                    Moves[i].DestRect.bottom = Frame.Moves[i].dest.bottom;
+                }
+                Dirty.resize(h.num_rects);
+                for (ULONG i = 0; i < h.num_rects; i++) {
+                    Dirty[i].left = Frame.Rects[i].left;
+                    Dirty[i].top = Frame.Rects[i].top;
+                    Dirty[i].right = Frame.Rects[i].right;
+                    Dirty[i].bottom = Frame.Rects[i].bottom;
+                }
+
+                DXGKARG_PRESENT_DISPLAYONLY Present;
+                memset(&Present, 0, sizeof(Present));
+                Present.VidPnSourceId = 0;
+                Present.pSource = Source.data();
+                Present.BytesPerPixel = 4;
+                Present.Pitch = Width * 4;
+                Present.Flags.Rotate = Rotation != D3DKMDT_VPPR_IDENTITY;
+                Present.NumMoves = h.num_moves;
+                Present.pMoves = Moves.data();
+                Present.NumDirtyRects = h.num_rects;
+                Present.pDirtyRect = Dirty.data();
+
+                if (Opt.Realtime) {
+                    std::this_thread::sleep_until(LoopBegin + std::chrono::microseconds(h.time / 10));
+                }
+                auto t0 = std::chrono::steady_clock::now();
+                Status = Kernel.Present(&Present);
+                auto t1 = std::chrono::steady_clock::now();
+                double Us = std::chrono::duration<double, std::micro>(t1 - t0).count();
+                CallUs.push_back(Us);
+                if (!NT_SUCCESS(Status)) {
+                    Failed++;
+                    LastError = Status;
+                }
+                SourceBytes += Frame.Pixels.size();
+
+                // the device counters are sampled when the call returns,
+                // the present workers may still be building the frame
+                if (Csv) {
+                    MockQxlStats s = Device.Stats();
+                    SpaceStats Spaces[MAX_SPACES];
+                    SpaceSnapshot(Spaces);
+                    fprintf(Csv, "%u,%.1f,%u,%u,%zu,%.1f,%llu,%llu,%llu,%zu,%llu\n",
+                            Frames, std::chrono::duration<double, std::micro>(t0 - Begin).count(),
+                            h.num_moves, h.num_rects, Frame.Pixels.size(), Us, s.BitmapBytes,
+                            Spaces[0].Allocs + Spaces[1].Allocs, Spaces[0].Bytes + Spaces[1].Bytes,
+                            Spaces[0].InUse + Spaces[1].InUse, s.NotifyOom);
+                }
+                Frames++;
+            }
+            if (rc) {
+                break;
+            }
+        }
+        double PresentSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+        Kernel.Drain();
+        double TotalSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - Begin).count();
+
+        MockQxlStats s = Device.Stats();
+        SpaceStats Spaces[MAX_SPACES];
+        SpaceSnapshot(Spaces);
+        std::vector<double> Sorted(CallUs);
+        std::sort(Sorted.begin(), Sorted.end());
+        double SumUs = 0;
+        for (double Us : CallUs) {
+            SumUs += Us;
+        }
+
+        if (Opt.Brief) {
+            ULONGLONG Allocs = Spaces[0].Allocs + Spaces[1].Allocs;
+            const char *Name = strrchr(Opt.Trace, '/');
+            printf("%-24s %6u presents %8.1f/s  call p50 %7.1f p99 %8.1f max %8.1f us  %8.1f MB/s  "
+                   "%5.1f allocs/present  oom %llu  errors %llu\n",
+                   Name ? Name + 1 : Opt.Trace, Frames, TotalSec > 0 ? Frames / TotalSec : 0.0,
+                   Percentile(Sorted, 0.50), Percentile(Sorted, 0.99), Sorted.empty() ? 0.0 : Sorted.back(),
+                   TotalSec > 0 ? s.BitmapBytes / TotalSec / (1 << 20) : 0.0,
+                   Frames ? (double)Allocs / Frames : 0.0, s.NotifyOom, s.Errors + ShimAssertCount() + Failed);
+        } else {
+            printf("trace           %s, %u loops, %u mode sets\n", Opt.Trace, Opt.Loops, ModeSets);
+            printf("presents        %u in %.3f s, %.1f/s, %u skipped, %u failed", Frames, PresentSec,
+                   PresentSec > 0 ? Frames / PresentSec : 0.0, Skipped, Failed);
+            if (Failed) {
+                printf(" (last 0x%X)", LastError);
+            }
+            printf("\n");
+            printf("call us         mean %.1f, p50 %.1f, p95 %.1f, p99 %.1f, max %.1f\n",
+                   Frames ? SumUs / Frames : 0.0, Percentile(Sorted, 0.50), Percentile(Sorted, 0.95),
+                   Percentile(Sorted, 0.99), Sorted.empty() ? 0.0 : Sorted.back());
+            printf("drained         %.3f s, %.1f frames/s end to end\n",
+                   TotalSec, TotalSec > 0 ? Frames / TotalSec : 0.0);
+            printf("source bytes    %llu\n", SourceBytes);
+            printf("bitmap bytes    %llu (%.2f of the source, %.1f MB/s)\n", s.BitmapBytes,
+                   SourceBytes ? (double)s.BitmapBytes / SourceBytes : 0.0,
+                   TotalSec > 0 ? s.BitmapBytes / TotalSec / (1 << 20) : 0.0);
+            printf("commands        draw %llu, surface %llu, max ring fill %u\n",
+                   s.Commands[QXL_CMD_DRAW], s.Commands[QXL_CMD_SURFACE], s.MaxCmdRingFill);
+            printf("releases        %llu in %llu pushes, oom notifies %llu\n", s.Releases, s.ReleasePushes,
+                   s.NotifyOom);
+            for (int i = 0; i < MAX_SPACES; i++) {
+                const SpaceStats &a = Spaces[i];
+                if (!a.Space) {
+                    continue;
+                }
+                printf("%-6s mspace   %llu allocs (%.1f per present, %.0f bytes avg), %llu frees, %llu failed\n",
+                       SpaceNames[i], a.Allocs, Frames ? (double)a.Allocs / Frames : 0.0,
+                       a.Allocs ? (double)a.Bytes / a.Allocs : 0.0, a.Frees, a.Failed);
+                printf("                peak in use %zu KB of %zu KB, %zu KB in use after the drain\n",
+                       a.PeakInUse >> 10, a.Capacity >> 10, a.InUse >> 10);
+            }
+            printf("device errors   %llu\n", s.Errors);
+            printf("assertions      %u\n", ShimAssertCount());
+        }
+
+        // the driver drops presents to modes it does not offer, below
+        // 1024x768 for example
+        if (Frames && !s.Commands[QXL_CMD_DRAW]) {
+            fprintf(stderr, "qxlreplay: no draw reached the device, is %ux%u a mode of the driver?\n",
+                    Width, Height);
+            rc = 1;
+        }
+
+        Kernel.Stop();
+        if (s.Errors || ShimAssertCount() || Failed) {
+            rc = 1;
+        }
+    }
+    Device.Stop();
+    if (Csv) {
+        fclose(Csv);
+    }
+    return rc;
+}
@@ -0,0 +1,170 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlringdecode: prints a trace ring dump of qxldod, see
+ * qxl_trace_ring.h, as one timeline of all processors.
+ *
+ *   qxlringdecode [--summary] [--last N] FILE
+ */
+
+#include <cstdint>
+
+#include "qxl_trace_ring.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+struct EventInfo
+{
+    const char *Name;
+    const char *Format;
+};
+
+static const EventInfo Events[QXL_TRACE_NUM_EVENTS] = {
+    { "NONE", "" },
+#define QXL_TRACE_INFO(name, level, format) { #name, format },
+    QXL_TRACE_EVENTS(QXL_TRACE_INFO)
+#undef QXL_TRACE_INFO
+};
+
+static void Usage(const char *Name)
+{
+    fprintf(stderr,
+        "usage: %s [options] FILE\n"
+        "  -s, --summary          print the count of every event instead of the timeline\n"
+        "  -n, --last N           print only the last N events\n",
+        Name);
+}
+
+static bool ReadDump(const char *Path, QXLTraceRingHeader &Header, std::vector<QXLTraceRecord> &Records,
+                     uint64_t &Lost)
+{
+    FILE *f = fopen(Path, "rb");
+    if (!f) {
+        perror(Path);
+        return false;
+    }
+    bool bOk = false;
+    if (fread(&Header, sizeof(Header), 1, f) != 1 || Header.magic != QXL_TRACE_RING_MAGIC) {
+        fprintf(stderr, "%s: not a trace ring dump\n", Path);
+    } else if (Header.version != QXL_TRACE_RING_VERSION || Header.header_size != sizeof(Header) ||
+               Header.record_size != sizeof(QXLTraceRecord) || !Header.records_per_cpu) {
+        fprintf(stderr, "%s: unsupported version %u\n", Path, Header.version);
+    } else {
+        std::vector<QXLTraceRecord> Ring(Header.records_per_cpu);
+        bOk = true;
+        Lost = 0;
+        for (uint32_t cpu = 0; bOk && cpu < Header.num_cpus; cpu++) {
+            uint64_t Written;
+            if (fread(&Written, sizeof(Written), 1, f) != 1 ||
+                fread(Ring.data(), sizeof(QXLTraceRecord), Ring.size(), f) != Ring.size()) {
+                fprintf(stderr, "%s: truncated at processor %u\n", Path, cpu);
+                bOk = false;
+                break;
+            }
+            if (Written > Ring.size()) {
+                Lost += Written - Ring.size();
+            }
+            for (const QXLTraceRecord &r : Ring) {
+                if (r.event != QXL_TRACE_NONE) {
+                    Records.push_back(r);
+                }
+            }
+        }
+    }
+    fclose(f);
+    return bOk;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option LongOptions[] = {
+        { "summary", no_argument, NULL, 's' },
+        { "last", required_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    bool bSummary = false;
+    size_t Last = 0;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "sn:h", LongOptions, NULL)) != -1) {
+        switch (c) {
+        case 's': bSummary = true; break;
+        case 'n': Last = strtoul(optarg, NULL, 0); break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    QXLTraceRingHeader Header;
+    std::vector<QXLTraceRecord> Records;
+    uint64_t Lost;
+    if (!ReadDump(argv[optind], Header, Records, Lost)) {
+        return 1;
+    }
+    if (Records.empty()) {
+        fprintf(stderr, "%s: no events\n", argv[optind]);
+        return 1;
+    }
+    std::stable_sort(Records.begin(), Records.end(),
+                     [](const QXLTraceRecord &a, const QXLTraceRecord &b) { return a.time < b.time; });
+    if (Last && Last < Records.size()) {
+        Records.erase(Records.begin(), Records.end() - Last);
+    }
+
+    double Frequency = Header.frequency ? (double)Header.frequency : 1.0;
+    printf("%zu events on %u processors, %llu overwritten, %.3f ms up to the dump\n",
+           Records.size(), Header.num_cpus, (unsigned long long)Lost,
+           (int64_t)(Header.dump_time - Records.front().time) * 1000.0 / Frequency);
+
+    if (bSummary) {
+        std::vector<uint64_t> Counts(QXL_TRACE_NUM_EVENTS + 1);
+        for (const QXLTraceRecord &r : Records) {
+            Counts[std::min<uint32_t>(r.event, QXL_TRACE_NUM_EVENTS)]++;
+        }
+        for (uint32_t e = 1; e <= QXL_TRACE_NUM_EVENTS; e++) {
+            if (Counts[e]) {
+                printf("%-18s %llu\n", e < QXL_TRACE_NUM_EVENTS ? Events[e].Name : "unknown",
+                       (unsigned long long)Counts[e]);
+            }
+        }
+        return 0;
+    }
+
+    // milliseconds from the first event, the gap to the previous one
+    uint64_t Prev = Records.front().time;
+    for (const QXLTraceRecord &r : Records) {
+        const uint64_t *a = r.args;
+        printf("%12.3f %+9.3f  cpu %-3u %6u  ", (int64_t)(r.time - Records.front().time) * 1000.0 / Frequency,
+               (int64_t)(r.time - Prev) * 1000.0 / Frequency, r.cpu, r.thread);
+        if (r.event < QXL_TRACE_NUM_EVENTS) {
+            printf("%-18s ", Events[r.event].Name);
+            printf(Events[r.event].Format, a[0], a[1], a[2], a[3], a[4], a[5]);
+        } else {
+            printf("event %u %llx %llx %llx %llx %llx %llx", r.event, (unsigned long long)a[0],
+                   (unsigned long long)a[1], (unsigned long long)a[2], (unsigned long long)a[3],
+                   (unsigned long long)a[4], (unsigned long long)a[5]);
+        }
+        printf("\n");
+        Prev = r.time;
+    }
+    return 0;
+}
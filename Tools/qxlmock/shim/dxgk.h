@@ -0,0 +1,787 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Display miniport and DXGK declarations used by qxldod, see wdk.h.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* videoport */
+
+typedef struct _VIDEO_MODE {
+    ULONG RequestedMode;
+} VIDEO_MODE, *PVIDEO_MODE;
+
+typedef struct _VIDEO_MODE_INFORMATION {
+    ULONG Length;
+    ULONG ModeIndex;
+    ULONG VisScreenWidth;
+    ULONG VisScreenHeight;
+    ULONG ScreenStride;
+    ULONG NumberOfPlanes;
+    ULONG BitsPerPlane;
+    ULONG Frequency;
+    ULONG XMillimeter;
+    ULONG YMillimeter;
+    ULONG NumberRedBits;
+    ULONG NumberGreenBits;
+    ULONG NumberBlueBits;
+    ULONG RedMask;
+    ULONG GreenMask;
+    ULONG BlueMask;
+    ULONG AttributeFlags;
+    ULONG VideoMemoryBitmapWidth;
+    ULONG VideoMemoryBitmapHeight;
+    ULONG DriverSpecificAttributeFlags;
+} VIDEO_MODE_INFORMATION, *PVIDEO_MODE_INFORMATION;
+
+#define VIDEO_MODE_COLOR 0x0002
+#define VIDEO_MODE_GRAPHICS 0x0004
+#define VIDEO_MODE_NO_OFF_SCREEN 0x0020
+
+typedef struct _STATUS_BLOCK {
+    NTSTATUS Status;
+    ULONG_PTR Information;
+} STATUS_BLOCK, *PSTATUS_BLOCK;
+
+typedef struct _VIDEO_REQUEST_PACKET {
+    ULONG IoControlCode;
+    PSTATUS_BLOCK StatusBlock;
+    PVOID InputBuffer;
+    ULONG InputBufferLength;
+    PVOID OutputBuffer;
+    ULONG OutputBufferLength;
+} VIDEO_REQUEST_PACKET, *PVIDEO_REQUEST_PACKET;
+
+#define DISPLAY_ADAPTER_HW_ID 0xFFFFFFFF
+
+/* d3d ids and formats */
+
+typedef UINT D3DDDI_VIDEO_PRESENT_SOURCE_ID;
+typedef UINT D3DDDI_VIDEO_PRESENT_TARGET_ID;
+typedef UINT D3DKMT_HANDLE;
+#define D3DDDI_ID_UNINITIALIZED ((UINT)(~0))
+#define D3DDDI_ID_NOTAPPLICABLE ((UINT)(0))
+#define D3DDDI_ID_ALL ((UINT)(~0))
+
+typedef enum _D3DDDIFORMAT {
+    D3DDDIFMT_UNKNOWN = 0,
+    D3DDDIFMT_R8G8B8 = 20,
+    D3DDDIFMT_A8R8G8B8 = 21,
+    D3DDDIFMT_X8R8G8B8 = 22,
+    D3DDDIFMT_R5G6B5 = 23,
+    D3DDDIFMT_P8 = 41,
+} D3DDDIFORMAT;
+
+typedef struct _D3DKMT_MOVE_RECT {
+    POINT SourcePoint;
+    RECT DestRect;
+} D3DKMT_MOVE_RECT;
+
+typedef struct _D3DDDI_RATIONAL {
+    UINT Numerator;
+    UINT Denominator;
+} D3DDDI_RATIONAL;
+
+typedef enum _D3DDDI_VIDEO_SIGNAL_SCANLINE_ORDERING {
+    D3DDDI_VSSLO_UNINITIALIZED = 0,
+    D3DDDI_VSSLO_PROGRESSIVE = 1,
+} D3DDDI_VIDEO_SIGNAL_SCANLINE_ORDERING;
+
+typedef enum _D3DDDI_GAMMARAMP_TYPE {
+    D3DDDI_GAMMARAMP_UNINITIALIZED = 0,
+    D3DDDI_GAMMARAMP_DEFAULT = 1,
+} D3DDDI_GAMMARAMP_TYPE;
+
+#define D3DKMDT_FREQUENCY_NOTSPECIFIED 0
+#define D3DKMDT_DIMENSION_NOTSPECIFIED ((UINT)(~0))
+
+typedef ULONG_PTR D3DKMDT_HVIDPN;
+typedef ULONG_PTR D3DKMDT_HVIDPNTOPOLOGY;
+typedef ULONG_PTR D3DKMDT_HVIDPNSOURCEMODESET;
+typedef ULONG_PTR D3DKMDT_HVIDPNTARGETMODESET;
+typedef ULONG_PTR D3DKMDT_HMONITORSOURCEMODESET;
+typedef UINT D3DKMDT_VIDEO_PRESENT_SOURCE_MODE_ID;
+typedef UINT D3DKMDT_VIDEO_PRESENT_TARGET_MODE_ID;
+typedef UINT D3DKMDT_MONITOR_SOURCE_MODE_ID;
+
+typedef struct _D3DKMDT_2DREGION {
+    UINT cx;
+    UINT cy;
+} D3DKMDT_2DREGION;
+
+typedef enum _D3DKMDT_VIDPN_PRESENT_PATH_ROTATION {
+    D3DKMDT_VPPR_UNINITIALIZED = 0,
+    D3DKMDT_VPPR_IDENTITY = 1,
+    D3DKMDT_VPPR_ROTATE90 = 2,
+    D3DKMDT_VPPR_ROTATE180 = 3,
+    D3DKMDT_VPPR_ROTATE270 = 4,
+    D3DKMDT_VPPR_UNPINNED = 254,
+    D3DKMDT_VPPR_NOTSPECIFIED = 255
+} D3DKMDT_VIDPN_PRESENT_PATH_ROTATION;
+
+typedef enum _D3DKMDT_VIDPN_PRESENT_PATH_SCALING {
+    D3DKMDT_VPPS_UNINITIALIZED = 0,
+    D3DKMDT_VPPS_IDENTITY = 1,
+    D3DKMDT_VPPS_CENTERED = 2,
+    D3DKMDT_VPPS_STRETCHED = 3,
+    D3DKMDT_VPPS_UNPINNED = 254,
+    D3DKMDT_VPPS_NOTSPECIFIED = 255
+} D3DKMDT_VIDPN_PRESENT_PATH_SCALING;
+
+typedef struct _D3DKMDT_VIDPN_PRESENT_PATH_ROTATION_SUPPORT {
+    UINT Identity : 1;
+    UINT Rotate90 : 1;
+    UINT Rotate180 : 1;
+    UINT Rotate270 : 1;
+    UINT Offset0 : 1;
+} D3DKMDT_VIDPN_PRESENT_PATH_ROTATION_SUPPORT;
+
+typedef struct _D3DKMDT_VIDPN_PRESENT_PATH_SCALING_SUPPORT {
+    UINT Identity : 1;
+    UINT Centered : 1;
+    UINT Stretched : 1;
+    UINT AspectRatioCenteredMax : 1;
+    UINT Custom : 1;
+} D3DKMDT_VIDPN_PRESENT_PATH_SCALING_SUPPORT;
+
+typedef struct _D3DKMDT_VIDPN_PRESENT_PATH_TRANSFORMATION {
+    D3DKMDT_VIDPN_PRESENT_PATH_SCALING Scaling;
+    D3DKMDT_VIDPN_PRESENT_PATH_SCALING_SUPPORT ScalingSupport;
+    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation;
+    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION_SUPPORT RotationSupport;
+} D3DKMDT_VIDPN_PRESENT_PATH_TRANSFORMATION;
+
+typedef enum _D3DKMDT_COLOR_BASIS {
+    D3DKMDT_CB_UNINITIALIZED = 0,
+    D3DKMDT_CB_INTENSITY = 1,
+    D3DKMDT_CB_SRGB = 2,
+    D3DKMDT_CB_SCRGB = 3,
+} D3DKMDT_COLOR_BASIS;
+
+typedef struct _D3DKMDT_COLOR_COEFF_DYNAMIC_RANGES {
+    UINT FirstChannel;
+    UINT SecondChannel;
+    UINT ThirdChannel;
+    UINT FourthChannel;
+} D3DKMDT_COLOR_COEFF_DYNAMIC_RANGES;
+
+typedef struct _D3DKMDT_GAMMA_RAMP {
+    D3DDDI_GAMMARAMP_TYPE Type;
+    SIZE_T DataSize;
+    PVOID Data;
+} D3DKMDT_GAMMA_RAMP;
+
+typedef struct _D3DKMDT_VIDPN_PRESENT_PATH {
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID VidPnTargetId;
+    UINT ImportanceOrdinal;
+    D3DKMDT_VIDPN_PRESENT_PATH_TRANSFORMATION ContentTransformation;
+    POINT VisibleFromActiveTLOffset;
+    POINT VisibleFromActiveBROffset;
+    D3DKMDT_COLOR_BASIS VidPnTargetColorBasis;
+    D3DKMDT_COLOR_COEFF_DYNAMIC_RANGES VidPnTargetColorCoeffDynamicRanges;
+    UINT Content;
+    UINT CopyProtection;
+    D3DKMDT_GAMMA_RAMP GammaRamp;
+} D3DKMDT_VIDPN_PRESENT_PATH;
+
+typedef enum _D3DKMDT_VIDPN_SOURCE_MODE_TYPE {
+    D3DKMDT_RMT_UNINITIALIZED = 0,
+    D3DKMDT_RMT_GRAPHICS = 1,
+    D3DKMDT_RMT_TEXT = 2
+} D3DKMDT_VIDPN_SOURCE_MODE_TYPE;
+
+typedef enum _D3DKMDT_PIXEL_VALUE_ACCESS_MODE {
+    D3DKMDT_PVAM_UNINITIALIZED = 0,
+    D3DKMDT_PVAM_DIRECT = 1,
+    D3DKMDT_PVAM_PRESETPALETTE = 2,
+    D3DKMDT_PVAM_SETTABLEPALETTE = 3,
+} D3DKMDT_PIXEL_VALUE_ACCESS_MODE;
+
+typedef struct _D3DKMDT_GRAPHICS_RENDERING_FORMAT {
+    D3DKMDT_2DREGION PrimSurfSize;
+    D3DKMDT_2DREGION VisibleRegionSize;
+    SIZE_T Stride;
+    D3DDDIFORMAT PixelFormat;
+    D3DKMDT_COLOR_BASIS ColorBasis;
+    D3DKMDT_PIXEL_VALUE_ACCESS_MODE PixelValueAccessMode;
+} D3DKMDT_GRAPHICS_RENDERING_FORMAT;
+
+typedef struct _D3DKMDT_VIDPN_SOURCE_MODE {
+    D3DKMDT_VIDEO_PRESENT_SOURCE_MODE_ID Id;
+    D3DKMDT_VIDPN_SOURCE_MODE_TYPE Type;
+    union {
+        D3DKMDT_GRAPHICS_RENDERING_FORMAT Graphics;
+    } Format;
+} D3DKMDT_VIDPN_SOURCE_MODE;
+
+typedef enum _D3DKMDT_VIDEO_SIGNAL_STANDARD {
+    D3DKMDT_VSS_UNINITIALIZED = 0,
+    D3DKMDT_VSS_OTHER = 255
+} D3DKMDT_VIDEO_SIGNAL_STANDARD;
+
+typedef struct _D3DKMDT_VIDEO_SIGNAL_INFO {
+    D3DKMDT_VIDEO_SIGNAL_STANDARD VideoStandard;
+    D3DKMDT_2DREGION TotalSize;
+    D3DKMDT_2DREGION ActiveSize;
+    D3DDDI_RATIONAL VSyncFreq;
+    D3DDDI_RATIONAL HSyncFreq;
+    SIZE_T PixelRate;
+    union {
+        D3DDDI_VIDEO_SIGNAL_SCANLINE_ORDERING ScanLineOrdering;
+        UINT AdditionalSignalInfo;
+    };
+} D3DKMDT_VIDEO_SIGNAL_INFO;
+
+typedef enum _D3DKMDT_MODE_PREFERENCE {
+    D3DKMDT_MP_UNINITIALIZED = 0,
+    D3DKMDT_MP_PREFERRED = 1,
+    D3DKMDT_MP_NOTPREFERRED = 2,
+} D3DKMDT_MODE_PREFERENCE;
+
+typedef struct _D3DKMDT_VIDPN_TARGET_MODE {
+    D3DKMDT_VIDEO_PRESENT_TARGET_MODE_ID Id;
+    D3DKMDT_VIDEO_SIGNAL_INFO VideoSignalInfo;
+    D3DKMDT_MODE_PREFERENCE Preference;
+} D3DKMDT_VIDPN_TARGET_MODE;
+
+typedef enum _D3DKMDT_MONITOR_CAPABILITIES_ORIGIN {
+    D3DKMDT_MCO_UNINITIALIZED = 0,
+    D3DKMDT_MCO_DEFAULTMONITORPROFILE = 1,
+    D3DKMDT_MCO_MONITORDESCRIPTOR = 2,
+    D3DKMDT_MCO_MONITORDESCRIPTOR_REGISTRYOVERRIDE = 3,
+    D3DKMDT_MCO_SPECIFICCAP_REGISTRYOVERRIDE = 4,
+    D3DKMDT_MCO_DRIVER = 5,
+} D3DKMDT_MONITOR_CAPABILITIES_ORIGIN;
+
+typedef struct _D3DKMDT_MONITOR_SOURCE_MODE {
+    D3DKMDT_MONITOR_SOURCE_MODE_ID Id;
+    D3DKMDT_VIDEO_SIGNAL_INFO VideoSignalInfo;
+    D3DKMDT_COLOR_BASIS ColorBasis;
+    D3DKMDT_COLOR_COEFF_DYNAMIC_RANGES ColorCoeffDynamicRanges;
+    D3DKMDT_MONITOR_CAPABILITIES_ORIGIN Origin;
+    D3DKMDT_MODE_PREFERENCE Preference;
+} D3DKMDT_MONITOR_SOURCE_MODE;
+
+typedef enum _D3DKMDT_ENUMCOFUNCMODALITY_PIVOT_TYPE {
+    D3DKMDT_EPT_UNINITIALIZED = 0,
+    D3DKMDT_EPT_VIDPNSOURCE = 1,
+    D3DKMDT_EPT_VIDPNTARGET = 2,
+    D3DKMDT_EPT_SCALING = 3,
+    D3DKMDT_EPT_ROTATION = 4,
+    D3DKMDT_EPT_NOPIVOT = 5
+} D3DKMDT_ENUMCOFUNCMODALITY_PIVOT_TYPE;
+
+typedef enum _D3DKMDT_VIDEO_OUTPUT_TECHNOLOGY {
+    D3DKMDT_VOT_UNINITIALIZED = -2,
+    D3DKMDT_VOT_OTHER = -1,
+    D3DKMDT_VOT_HD15 = 0,
+} D3DKMDT_VIDEO_OUTPUT_TECHNOLOGY;
+
+typedef enum _D3DKMDT_MONITOR_ORIENTATION_AWARENESS {
+    D3DKMDT_MOA_UNINITIALIZED = 0,
+    D3DKMDT_MOA_NONE = 1,
+} D3DKMDT_MONITOR_ORIENTATION_AWARENESS;
+
+/* vidpn interfaces */
+
+typedef struct _DXGK_VIDPNTOPOLOGY_INTERFACE {
+    NTSTATUS (*pfnGetNumPaths)(D3DKMDT_HVIDPNTOPOLOGY, SIZE_T *);
+    NTSTATUS (*pfnGetNumPathsFromSource)(D3DKMDT_HVIDPNTOPOLOGY, D3DDDI_VIDEO_PRESENT_SOURCE_ID, SIZE_T *);
+    NTSTATUS (*pfnEnumPathTargetsFromSource)(D3DKMDT_HVIDPNTOPOLOGY, D3DDDI_VIDEO_PRESENT_SOURCE_ID, SIZE_T,
+                                             D3DDDI_VIDEO_PRESENT_TARGET_ID *);
+    NTSTATUS (*pfnGetPathSourceFromTarget)(D3DKMDT_HVIDPNTOPOLOGY, D3DDDI_VIDEO_PRESENT_TARGET_ID,
+                                           D3DDDI_VIDEO_PRESENT_SOURCE_ID *);
+    NTSTATUS (*pfnAcquirePathInfo)(D3DKMDT_HVIDPNTOPOLOGY, D3DDDI_VIDEO_PRESENT_SOURCE_ID,
+                                   D3DDDI_VIDEO_PRESENT_TARGET_ID, const D3DKMDT_VIDPN_PRESENT_PATH **);
+    NTSTATUS (*pfnAcquireFirstPathInfo)(D3DKMDT_HVIDPNTOPOLOGY, const D3DKMDT_VIDPN_PRESENT_PATH **);
+    NTSTATUS (*pfnAcquireNextPathInfo)(D3DKMDT_HVIDPNTOPOLOGY, const D3DKMDT_VIDPN_PRESENT_PATH *,
+                                       const D3DKMDT_VIDPN_PRESENT_PATH **);
+    NTSTATUS (*pfnUpdatePathSupportInfo)(D3DKMDT_HVIDPNTOPOLOGY, const D3DKMDT_VIDPN_PRESENT_PATH *);
+    NTSTATUS (*pfnReleasePathInfo)(D3DKMDT_HVIDPNTOPOLOGY, const D3DKMDT_VIDPN_PRESENT_PATH *);
+} DXGK_VIDPNTOPOLOGY_INTERFACE;
+
+typedef struct _DXGK_VIDPNSOURCEMODESET_INTERFACE {
+    NTSTATUS (*pfnGetNumModes)(D3DKMDT_HVIDPNSOURCEMODESET, SIZE_T *);
+    NTSTATUS (*pfnAcquireFirstModeInfo)(D3DKMDT_HVIDPNSOURCEMODESET, const D3DKMDT_VIDPN_SOURCE_MODE **);
+    NTSTATUS (*pfnAcquireNextModeInfo)(D3DKMDT_HVIDPNSOURCEMODESET, const D3DKMDT_VIDPN_SOURCE_MODE *,
+                                       const D3DKMDT_VIDPN_SOURCE_MODE **);
+    NTSTATUS (*pfnAcquirePinnedModeInfo)(D3DKMDT_HVIDPNSOURCEMODESET, const D3DKMDT_VIDPN_SOURCE_MODE **);
+    NTSTATUS (*pfnReleaseModeInfo)(D3DKMDT_HVIDPNSOURCEMODESET, const D3DKMDT_VIDPN_SOURCE_MODE *);
+    NTSTATUS (*pfnCreateNewModeInfo)(D3DKMDT_HVIDPNSOURCEMODESET, D3DKMDT_VIDPN_SOURCE_MODE **);
+    NTSTATUS (*pfnAddMode)(D3DKMDT_HVIDPNSOURCEMODESET, const D3DKMDT_VIDPN_SOURCE_MODE *);
+    NTSTATUS (*pfnPinMode)(D3DKMDT_HVIDPNSOURCEMODESET, D3DKMDT_VIDEO_PRESENT_SOURCE_MODE_ID);
+} DXGK_VIDPNSOURCEMODESET_INTERFACE;
+
+typedef struct _DXGK_VIDPNTARGETMODESET_INTERFACE {
+    NTSTATUS (*pfnGetNumModes)(D3DKMDT_HVIDPNTARGETMODESET, SIZE_T *);
+    NTSTATUS (*pfnAcquireFirstModeInfo)(D3DKMDT_HVIDPNTARGETMODESET, const D3DKMDT_VIDPN_TARGET_MODE **);
+    NTSTATUS (*pfnAcquireNextModeInfo)(D3DKMDT_HVIDPNTARGETMODESET, const D3DKMDT_VIDPN_TARGET_MODE *,
+                                       const D3DKMDT_VIDPN_TARGET_MODE **);
+    NTSTATUS (*pfnAcquirePinnedModeInfo)(D3DKMDT_HVIDPNTARGETMODESET, const D3DKMDT_VIDPN_TARGET_MODE **);
+    NTSTATUS (*pfnReleaseModeInfo)(D3DKMDT_HVIDPNTARGETMODESET, const D3DKMDT_VIDPN_TARGET_MODE *);
+    NTSTATUS (*pfnCreateNewModeInfo)(D3DKMDT_HVIDPNTARGETMODESET, D3DKMDT_VIDPN_TARGET_MODE **);
+    NTSTATUS (*pfnAddMode)(D3DKMDT_HVIDPNTARGETMODESET, const D3DKMDT_VIDPN_TARGET_MODE *);
+    NTSTATUS (*pfnPinMode)(D3DKMDT_HVIDPNTARGETMODESET, D3DKMDT_VIDEO_PRESENT_TARGET_MODE_ID);
+} DXGK_VIDPNTARGETMODESET_INTERFACE;
+
+typedef struct _DXGK_MONITORSOURCEMODESET_INTERFACE {
+    NTSTATUS (*pfnCreateNewModeInfo)(D3DKMDT_HMONITORSOURCEMODESET, D3DKMDT_MONITOR_SOURCE_MODE **);
+    NTSTATUS (*pfnAddMode)(D3DKMDT_HMONITORSOURCEMODESET, const D3DKMDT_MONITOR_SOURCE_MODE *);
+    NTSTATUS (*pfnReleaseModeInfo)(D3DKMDT_HMONITORSOURCEMODESET, const D3DKMDT_MONITOR_SOURCE_MODE *);
+} DXGK_MONITORSOURCEMODESET_INTERFACE;
+
+typedef struct _DXGK_VIDPN_INTERFACE {
+    ULONG Version;
+    NTSTATUS (*pfnGetTopology)(D3DKMDT_HVIDPN, D3DKMDT_HVIDPNTOPOLOGY *, const DXGK_VIDPNTOPOLOGY_INTERFACE **);
+    NTSTATUS (*pfnAcquireSourceModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_SOURCE_ID, D3DKMDT_HVIDPNSOURCEMODESET *,
+                                        const DXGK_VIDPNSOURCEMODESET_INTERFACE **);
+    NTSTATUS (*pfnReleaseSourceModeSet)(D3DKMDT_HVIDPN, D3DKMDT_HVIDPNSOURCEMODESET);
+    NTSTATUS (*pfnCreateNewSourceModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_SOURCE_ID, D3DKMDT_HVIDPNSOURCEMODESET *,
+                                          const DXGK_VIDPNSOURCEMODESET_INTERFACE **);
+    NTSTATUS (*pfnAssignSourceModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_SOURCE_ID, D3DKMDT_HVIDPNSOURCEMODESET);
+    NTSTATUS (*pfnAcquireTargetModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_TARGET_ID, D3DKMDT_HVIDPNTARGETMODESET *,
+                                        const DXGK_VIDPNTARGETMODESET_INTERFACE **);
+    NTSTATUS (*pfnReleaseTargetModeSet)(D3DKMDT_HVIDPN, D3DKMDT_HVIDPNTARGETMODESET);
+    NTSTATUS (*pfnCreateNewTargetModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_TARGET_ID, D3DKMDT_HVIDPNTARGETMODESET *,
+                                          const DXGK_VIDPNTARGETMODESET_INTERFACE **);
+    NTSTATUS (*pfnAssignTargetModeSet)(D3DKMDT_HVIDPN, D3DDDI_VIDEO_PRESENT_TARGET_ID, D3DKMDT_HVIDPNTARGETMODESET);
+} DXGK_VIDPN_INTERFACE;
+
+typedef enum _DXGK_VIDPN_INTERFACE_VERSION {
+    DXGK_VIDPN_INTERFACE_VERSION_UNINITIALIZED = 0,
+    DXGK_VIDPN_INTERFACE_VERSION_V1 = 1,
+} DXGK_VIDPN_INTERFACE_VERSION;
+
+/* dxgkrnl interface */
+
+typedef enum _DXGK_WHICHSPACE {
+    DXGK_WHICHSPACE_CONFIG = 0,
+} DXGK_WHICHSPACE;
+
+typedef enum _DXGK_INTERRUPT_TYPE {
+    DXGK_INTERRUPT_DMA_COMPLETED = 1,
+    DXGK_INTERRUPT_DISPLAYONLY_VSYNC = 9,
+} DXGK_INTERRUPT_TYPE;
+
+typedef struct _DXGKARGCB_NOTIFY_INTERRUPT_DATA {
+    DXGK_INTERRUPT_TYPE InterruptType;
+    union {
+        struct {
+            D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+        } DisplayOnlyVSync;
+    };
+} DXGKARGCB_NOTIFY_INTERRUPT_DATA;
+
+typedef enum _DXGK_CHILD_STATUS_TYPE {
+    StatusConnection = 1,
+    StatusRotation = 2,
+} DXGK_CHILD_STATUS_TYPE;
+
+typedef struct _DXGK_CHILD_STATUS {
+    DXGK_CHILD_STATUS_TYPE Type;
+    ULONG ChildUid;
+    union {
+        struct {
+            BOOLEAN Connected;
+        } HotPlug;
+        struct {
+            UCHAR Angle;
+        } Rotation;
+    };
+} DXGK_CHILD_STATUS, *PDXGK_CHILD_STATUS;
+
+typedef struct _DXGK_DEVICE_INFO {
+    PVOID MiniportDeviceContext;
+    PDEVICE_OBJECT PhysicalDeviceObject;
+    UNICODE_STRING DeviceRegistryPath;
+    PCM_RESOURCE_LIST TranslatedResourceList;
+    LARGE_INTEGER SystemMemorySize;
+    PHYSICAL_ADDRESS HighestPhysicalAddress;
+    PHYSICAL_ADDRESS AgpApertureBase;
+    SIZE_T AgpApertureSize;
+} DXGK_DEVICE_INFO, *PDXGK_DEVICE_INFO;
+
+typedef struct _DXGK_DISPLAY_INFORMATION {
+    UINT Width;
+    UINT Height;
+    UINT Pitch;
+    D3DDDIFORMAT ColorFormat;
+    PHYSICAL_ADDRESS PhysicAddress;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId;
+    UINT AcpiId;
+} DXGK_DISPLAY_INFORMATION, *PDXGK_DISPLAY_INFORMATION;
+
+typedef BOOLEAN KSYNCHRONIZE_ROUTINE(PVOID SynchronizeContext);
+typedef KSYNCHRONIZE_ROUTINE *PKSYNCHRONIZE_ROUTINE;
+
+typedef struct _DXGKRNL_INTERFACE {
+    ULONG Size;
+    ULONG Version;
+    HANDLE DeviceHandle;
+    NTSTATUS (*DxgkCbEvalAcpiMethod)(void);
+    NTSTATUS (*DxgkCbGetDeviceInformation)(HANDLE DeviceHandle, PDXGK_DEVICE_INFO DeviceInfo);
+    NTSTATUS (*DxgkCbIndicateChildStatus)(HANDLE DeviceHandle, PDXGK_CHILD_STATUS ChildStatus);
+    NTSTATUS (*DxgkCbMapMemory)(HANDLE DeviceHandle, PHYSICAL_ADDRESS TranslatedAddress, ULONG Length,
+                                BOOLEAN InIoSpace, BOOLEAN MapToUserMode, MEMORY_CACHING_TYPE CacheType,
+                                PVOID *VirtualAddress);
+    BOOLEAN (*DxgkCbQueueDpc)(HANDLE DeviceHandle);
+    NTSTATUS (*DxgkCbQueryServices)(void);
+    NTSTATUS (*DxgkCbReadDeviceSpace)(HANDLE DeviceHandle, ULONG DataType, PVOID Buffer, ULONG Offset,
+                                      ULONG Length, PULONG BytesRead);
+    NTSTATUS (*DxgkCbSynchronizeExecution)(HANDLE DeviceHandle, PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+                                           PVOID Context, ULONG MessageNumber, PBOOLEAN ReturnValue);
+    NTSTATUS (*DxgkCbUnmapMemory)(HANDLE DeviceHandle, PVOID VirtualAddress);
+    NTSTATUS (*DxgkCbWriteDeviceSpace)(HANDLE DeviceHandle, ULONG DataType, PVOID Buffer, ULONG Offset,
+                                       ULONG Length, PULONG BytesWritten);
+    NTSTATUS (*DxgkCbIsDevicePresent)(void);
+    VOID (*DxgkCbNotifyInterrupt)(HANDLE hAdapter, const DXGKARGCB_NOTIFY_INTERRUPT_DATA *);
+    VOID (*DxgkCbNotifyDpc)(HANDLE hAdapter);
+    NTSTATUS (*DxgkCbQueryVidPnInterface)(D3DKMDT_HVIDPN hVidPn, DXGK_VIDPN_INTERFACE_VERSION Version,
+                                          const DXGK_VIDPN_INTERFACE **ppVidPnInterface);
+    NTSTATUS (*DxgkCbQueryMonitorInterface)(void);
+    NTSTATUS (*DxgkCbAcquirePostDisplayOwnership)(HANDLE DeviceHandle, PDXGK_DISPLAY_INFORMATION DisplayInfo);
+} DXGKRNL_INTERFACE, *PDXGKRNL_INTERFACE;
+
+typedef struct _DXGK_START_INFO {
+    ULONG RequiredDmaQueueEntry;
+    GUID AdapterGuid;
+} DXGK_START_INFO, *PDXGK_START_INFO;
+
+/* ddi arguments */
+
+typedef enum _DXGK_CHILD_DEVICE_TYPE {
+    TypeUninitialized,
+    TypeVideoOutput,
+    TypeOther
+} DXGK_CHILD_DEVICE_TYPE;
+
+typedef enum _DXGK_CHILD_DEVICE_HPD_AWARENESS {
+    HpdAwarenessUninitialized = 0,
+    HpdAwarenessAlwaysConnected = 1,
+    HpdAwarenessNone = 2,
+    HpdAwarenessPolled = 3,
+    HpdAwarenessInterruptible = 4
+} DXGK_CHILD_DEVICE_HPD_AWARENESS;
+
+typedef struct _DXGK_VIDEO_OUTPUT_CAPABILITIES {
+    D3DKMDT_VIDEO_OUTPUT_TECHNOLOGY InterfaceTechnology;
+    D3DKMDT_MONITOR_ORIENTATION_AWARENESS MonitorOrientationAwareness;
+    BOOLEAN SupportsSdtvModes;
+} DXGK_VIDEO_OUTPUT_CAPABILITIES;
+
+typedef struct _DXGK_CHILD_CAPABILITIES {
+    union {
+        DXGK_VIDEO_OUTPUT_CAPABILITIES VideoOutput;
+    } Type;
+    DXGK_CHILD_DEVICE_HPD_AWARENESS HpdAwareness;
+} DXGK_CHILD_CAPABILITIES;
+
+typedef struct _DXGK_CHILD_DESCRIPTOR {
+    DXGK_CHILD_DEVICE_TYPE ChildDeviceType;
+    DXGK_CHILD_CAPABILITIES ChildCapabilities;
+    ULONG AcpiUid;
+    ULONG ChildUid;
+} DXGK_CHILD_DESCRIPTOR, *PDXGK_CHILD_DESCRIPTOR;
+
+typedef struct _DXGK_DEVICE_DESCRIPTOR {
+    ULONG DescriptorOffset;
+    ULONG DescriptorLength;
+    PVOID DescriptorBuffer;
+} DXGK_DEVICE_DESCRIPTOR, *PDXGK_DEVICE_DESCRIPTOR;
+
+typedef enum _DXGK_QUERYADAPTERINFOTYPE {
+    DXGKQAITYPE_UMDRIVERPRIVATE = 0,
+    DXGKQAITYPE_DRIVERCAPS = 1,
+    DXGKQAITYPE_QUERYSEGMENT = 2,
+    DXGKQAITYPE_DISPLAY_DRIVERCAPS_EXTENSION = 19,
+} DXGK_QUERYADAPTERINFOTYPE;
+
+typedef struct _DXGKARG_QUERYADAPTERINFO {
+    DXGK_QUERYADAPTERINFOTYPE Type;
+    VOID *pInputData;
+    UINT InputDataSize;
+    VOID *pOutputData;
+    UINT OutputDataSize;
+} DXGKARG_QUERYADAPTERINFO;
+
+typedef enum _DXGK_WDDMVERSION {
+    DXGKDDI_WDDMv1 = 0x1000,
+    DXGKDDI_WDDMv1_2 = 0x1200,
+} DXGK_WDDMVERSION;
+
+typedef struct _DXGK_DRIVERCAPS {
+    PHYSICAL_ADDRESS HighestAcceptableAddress;
+    UINT MaxAllocationListSlotId;
+    SIZE_T ApertureSegmentCommitLimit;
+    UINT MaxPointerWidth;
+    UINT MaxPointerHeight;
+    struct {
+        UINT Monochrome : 1;
+        UINT Color : 1;
+        UINT MaskedColor : 1;
+    } PointerCaps;
+    struct {
+        UINT VSyncPowerSaveAware : 1;
+    } SchedulingCaps;
+    BOOLEAN SupportNonVGA;
+    DXGK_WDDMVERSION WDDMVersion;
+} DXGK_DRIVERCAPS;
+
+typedef struct _DXGK_SETPOINTERSHAPE_FLAGS {
+    union {
+        struct {
+            UINT Monochrome : 1;
+            UINT Color : 1;
+            UINT MaskedColor : 1;
+        };
+        UINT Value;
+    };
+} DXGK_SETPOINTERSHAPE_FLAGS;
+
+typedef struct _DXGKARG_SETPOINTERSHAPE {
+    DXGK_SETPOINTERSHAPE_FLAGS Flags;
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    UINT Width;
+    UINT Height;
+    UINT Pitch;
+    CONST VOID *pPixels;
+    UINT XHot;
+    UINT YHot;
+} DXGKARG_SETPOINTERSHAPE;
+
+typedef struct _DXGK_SETPOINTERPOSITION_FLAGS {
+    union {
+        struct {
+            UINT Visible : 1;
+            UINT Procedural : 1;
+        };
+        UINT Value;
+    };
+} DXGK_SETPOINTERPOSITION_FLAGS;
+
+typedef struct _DXGKARG_SETPOINTERPOSITION {
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    INT X;
+    INT Y;
+    DXGK_SETPOINTERPOSITION_FLAGS Flags;
+} DXGKARG_SETPOINTERPOSITION;
+
+typedef struct _DXGK_ESCAPEFLAGS {
+    union {
+        struct {
+            UINT HardwareAccess : 1;
+        };
+        UINT Value;
+    };
+} DXGK_ESCAPEFLAGS;
+
+typedef struct _DXGKARG_ESCAPE {
+    HANDLE hDevice;
+    DXGK_ESCAPEFLAGS Flags;
+    VOID *pPrivateDriverData;
+    UINT PrivateDriverDataSize;
+    HANDLE hContext;
+} DXGKARG_ESCAPE;
+
+typedef struct _DXGKARG_PRESENT_DISPLAYONLY_FLAGS {
+    union {
+        struct {
+            UINT Rotate : 1;
+        };
+        UINT Value;
+    };
+} DXGK_PRESENTDISPLAYONLYFLAGS;
+
+typedef struct _DXGKARG_PRESENT_DISPLAYONLY {
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    VOID *pSource;
+    ULONG BytesPerPixel;
+    LONG Pitch;
+    DXGK_PRESENTDISPLAYONLYFLAGS Flags;
+    ULONG NumMoves;
+    D3DKMT_MOVE_RECT *pMoves;
+    ULONG NumDirtyRects;
+    RECT *pDirtyRect;
+} DXGKARG_PRESENT_DISPLAYONLY;
+
+typedef struct _DXGKARG_ISSUPPORTEDVIDPN {
+    D3DKMDT_HVIDPN hDesiredVidPn;
+    BOOLEAN IsVidPnSupported;
+} DXGKARG_ISSUPPORTEDVIDPN;
+
+typedef struct _DXGKARG_RECOMMENDFUNCTIONALVIDPN {
+    UINT NumberOfVidPnTargets;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID *pVidPnTargetPrioritizationVector;
+    D3DKMDT_HVIDPN hRecommendedFunctionalVidPn;
+    UINT RequestReason;
+    VOID *pPrivateDriverData;
+    UINT PrivateDriverDataSize;
+} DXGKARG_RECOMMENDFUNCTIONALVIDPN;
+
+typedef struct _DXGKARG_RECOMMENDVIDPNTOPOLOGY {
+    D3DKMDT_HVIDPN hVidPn;
+    UINT VidPnSourceId;
+    SIZE_T NumberOfVidPnTargets;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID *pVidPnTargetPrioritizationVector;
+    UINT RequestReason;
+    VOID *pPrivateDriverData;
+    UINT PrivateDriverDataSize;
+} DXGKARG_RECOMMENDVIDPNTOPOLOGY;
+
+typedef struct _DXGKARG_RECOMMENDMONITORMODES {
+    D3DDDI_VIDEO_PRESENT_TARGET_ID VideoPresentTargetId;
+    D3DKMDT_HMONITORSOURCEMODESET hMonitorSourceModeSet;
+    const DXGK_MONITORSOURCEMODESET_INTERFACE *pMonitorSourceModeSetInterface;
+} DXGKARG_RECOMMENDMONITORMODES;
+
+typedef struct _D3DKMDT_ENUMCOFUNCMODALITY_PIVOT {
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID VidPnTargetId;
+} D3DKMDT_ENUMCOFUNCMODALITY_PIVOT;
+
+typedef struct _DXGKARG_ENUMVIDPNCOFUNCMODALITY {
+    D3DKMDT_HVIDPN hConstrainingVidPn;
+    D3DKMDT_ENUMCOFUNCMODALITY_PIVOT_TYPE EnumPivotType;
+    D3DKMDT_ENUMCOFUNCMODALITY_PIVOT EnumPivot;
+} DXGKARG_ENUMVIDPNCOFUNCMODALITY;
+
+typedef struct _DXGKARG_SETVIDPNSOURCEVISIBILITY {
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID VidPnSourceId;
+    BOOLEAN Visible;
+} DXGKARG_SETVIDPNSOURCEVISIBILITY;
+
+typedef enum _D3DKMDT_MONITOR_CONNECTIVITY_CHECKS {
+    D3DKMDT_MCC_UNINITIALIZED = 0,
+    D3DKMDT_MCC_IGNORE = 1,
+    D3DKMDT_MCC_ENFORCE = 2
+} D3DKMDT_MONITOR_CONNECTIVITY_CHECKS;
+
+typedef struct _DXGKARG_COMMITVIDPN_FLAGS {
+    UINT PathPowerTransition : 1;
+    UINT PathPoweredOff : 1;
+} DXGKARG_COMMITVIDPN_FLAGS;
+
+typedef struct _DXGKARG_COMMITVIDPN {
+    D3DKMDT_HVIDPN hFunctionalVidPn;
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID AffectedVidPnSourceId;
+    D3DKMDT_MONITOR_CONNECTIVITY_CHECKS MonitorConnectivityChecks;
+    HANDLE hPrimaryAllocation;
+    DXGKARG_COMMITVIDPN_FLAGS Flags;
+} DXGKARG_COMMITVIDPN;
+
+typedef struct _DXGKARG_UPDATEACTIVEVIDPNPRESENTPATH {
+    D3DKMDT_VIDPN_PRESENT_PATH VidPnPresentPathInfo;
+} DXGKARG_UPDATEACTIVEVIDPNPRESENTPATH;
+
+typedef struct _D3DKMDT_VIDPN_HW_CAPABILITY {
+    UINT DriverRotation : 1;
+    UINT DriverScaling : 1;
+    UINT DriverCloning : 1;
+    UINT DriverColorConvert : 1;
+    UINT DriverLinkedAdapaterOutput : 1;
+    UINT DriverRemoteDisplay : 1;
+    UINT Reserved : 26;
+} D3DKMDT_VIDPN_HW_CAPABILITY;
+
+typedef struct _DXGKARG_QUERYVIDPNHWCAPABILITY {
+    D3DKMDT_HVIDPN hFunctionalVidPn;
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId;
+    D3DDDI_VIDEO_PRESENT_TARGET_ID TargetId;
+    D3DKMDT_VIDPN_HW_CAPABILITY VidPnHWCaps;
+} DXGKARG_QUERYVIDPNHWCAPABILITY;
+
+typedef struct _DXGKARG_SYSTEM_DISPLAY_ENABLE_FLAGS {
+    union {
+        struct {
+            UINT Reset : 1;
+        };
+        UINT Value;
+    };
+} DXGKARG_SYSTEM_DISPLAY_ENABLE_FLAGS, *PDXGKARG_SYSTEM_DISPLAY_ENABLE_FLAGS;
+
+typedef struct _DXGKARG_GETSCANLINE {
+    D3DDDI_VIDEO_PRESENT_TARGET_ID VidPnTargetId;
+    BOOLEAN InVerticalBlank;
+    UINT ScanLine;
+} DXGKARG_GETSCANLINE, *PDXGKARG_GETSCANLINE;
+
+typedef struct _QUERY_INTERFACE {
+    const GUID *InterfaceType;
+    USHORT Size;
+    USHORT Version;
+    PVOID Interface;
+    PVOID InterfaceSpecificData;
+} QUERY_INTERFACE, *PQUERY_INTERFACE;
+
+#define IN_CONST_HANDLE const HANDLE
+#define IN_CONST_DXGK_INTERRUPT_TYPE const DXGK_INTERRUPT_TYPE
+#define IN_BOOLEAN BOOLEAN
+#define INOUT_PDXGKARG_GETSCANLINE DXGKARG_GETSCANLINE *
+
+/* driver registration, DxgkInitializeDisplayOnlyDriver keeps the table
+   so the mock kernel calls the driver the way dxgkrnl does */
+
+#define DXGKDDI_INTERFACE_VERSION 0x4002
+#define DXGKDDI_INTERFACE_VERSION_WIN8 0x300E
+
+typedef NTSTATUS DXGKDDI_ADD_DEVICE(PDEVICE_OBJECT PhysicalDeviceObject, PVOID *MiniportDeviceContext);
+
+typedef struct _KMDDOD_INITIALIZATION_DATA {
+    ULONG Version;
+    NTSTATUS (*DxgkDdiAddDevice)(PDEVICE_OBJECT, PVOID *);
+    NTSTATUS (*DxgkDdiStartDevice)(PVOID, DXGK_START_INFO *, DXGKRNL_INTERFACE *, ULONG *, ULONG *);
+    NTSTATUS (*DxgkDdiStopDevice)(PVOID);
+    NTSTATUS (*DxgkDdiRemoveDevice)(PVOID);
+    NTSTATUS (*DxgkDdiDispatchIoRequest)(PVOID, ULONG, VIDEO_REQUEST_PACKET *);
+    BOOLEAN (*DxgkDdiInterruptRoutine)(PVOID, ULONG);
+    VOID (*DxgkDdiDpcRoutine)(PVOID);
+    NTSTATUS (*DxgkDdiQueryChildRelations)(PVOID, DXGK_CHILD_DESCRIPTOR *, ULONG);
+    NTSTATUS (*DxgkDdiQueryChildStatus)(PVOID, DXGK_CHILD_STATUS *, BOOLEAN);
+    NTSTATUS (*DxgkDdiQueryDeviceDescriptor)(PVOID, ULONG, DXGK_DEVICE_DESCRIPTOR *);
+    NTSTATUS (*DxgkDdiSetPowerState)(PVOID, ULONG, DEVICE_POWER_STATE, POWER_ACTION);
+    VOID (*DxgkDdiResetDevice)(PVOID);
+    VOID (*DxgkDdiUnload)(VOID);
+    NTSTATUS (*DxgkDdiQueryInterface)(PVOID, QUERY_INTERFACE *);
+    NTSTATUS (*DxgkDdiQueryAdapterInfo)(const HANDLE, const DXGKARG_QUERYADAPTERINFO *);
+    NTSTATUS (*DxgkDdiSetPointerPosition)(const HANDLE, const DXGKARG_SETPOINTERPOSITION *);
+    NTSTATUS (*DxgkDdiSetPointerShape)(const HANDLE, const DXGKARG_SETPOINTERSHAPE *);
+    NTSTATUS (*DxgkDdiEscape)(const HANDLE, const DXGKARG_ESCAPE *);
+    NTSTATUS (*DxgkDdiIsSupportedVidPn)(const HANDLE, DXGKARG_ISSUPPORTEDVIDPN *);
+    NTSTATUS (*DxgkDdiRecommendFunctionalVidPn)(const HANDLE, const DXGKARG_RECOMMENDFUNCTIONALVIDPN *);
+    NTSTATUS (*DxgkDdiEnumVidPnCofuncModality)(const HANDLE, const DXGKARG_ENUMVIDPNCOFUNCMODALITY *);
+    NTSTATUS (*DxgkDdiSetVidPnSourceVisibility)(const HANDLE, const DXGKARG_SETVIDPNSOURCEVISIBILITY *);
+    NTSTATUS (*DxgkDdiCommitVidPn)(const HANDLE, const DXGKARG_COMMITVIDPN *);
+    NTSTATUS (*DxgkDdiUpdateActiveVidPnPresentPath)(const HANDLE, const DXGKARG_UPDATEACTIVEVIDPNPRESENTPATH *);
+    NTSTATUS (*DxgkDdiRecommendMonitorModes)(const HANDLE, const DXGKARG_RECOMMENDMONITORMODES *);
+    NTSTATUS (*DxgkDdiQueryVidPnHWCapability)(const HANDLE, DXGKARG_QUERYVIDPNHWCAPABILITY *);
+    NTSTATUS (*DxgkDdiPresentDisplayOnly)(const HANDLE, const DXGKARG_PRESENT_DISPLAYONLY *);
+    NTSTATUS (*DxgkDdiStopDeviceAndReleasePostDisplayOwnership)(PVOID, D3DDDI_VIDEO_PRESENT_TARGET_ID,
+                                                               DXGK_DISPLAY_INFORMATION *);
+    NTSTATUS (*DxgkDdiSystemDisplayEnable)(PVOID, D3DDDI_VIDEO_PRESENT_TARGET_ID,
+                                           PDXGKARG_SYSTEM_DISPLAY_ENABLE_FLAGS, UINT *, UINT *, D3DDDIFORMAT *);
+    VOID (*DxgkDdiSystemDisplayWrite)(PVOID, VOID *, UINT, UINT, UINT, UINT, UINT);
+    NTSTATUS (*DxgkDdiControlInterrupt)(const HANDLE, const DXGK_INTERRUPT_TYPE, BOOLEAN);
+    NTSTATUS (*DxgkDdiGetScanLine)(const HANDLE, DXGKARG_GETSCANLINE *);
+} KMDDOD_INITIALIZATION_DATA;
+
+NTSTATUS DxgkInitializeDisplayOnlyDriver(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath,
+                                         KMDDOD_INITIALIZATION_DATA *KmdDodInitializationData);
+VOID DxgkUnInitialize(PVOID MiniportDeviceContext);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,3 @@
+/* the driver sources include their headers with varying case */
+#pragma once
+#include "../../../qxldod/QxlDod.h"
@@ -0,0 +1,792 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Minimal user-space stand-in for the WDK headers the driver includes
+ * (ntddk.h, d3dkmddi.h, dispmprt.h, ...). Only the types, fields and
+ * routines qxldod uses are declared, the layouts are not binary
+ * compatible with Windows. Routines are implemented in kernel.cpp and
+ * dxgkrnl.cpp.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* compiler and annotation glue */
+
+#define __cdecl
+#define __stdcall
+#define APIENTRY
+#define NTAPI
+#define NTHALAPI
+#define NTSYSAPI
+#define NTKERNELAPI
+#define FORCEINLINE __inline__ __attribute__((always_inline))
+#define __forceinline inline __attribute__((always_inline))
+#define __declspec(x)
+#ifndef QXLMOCK_HOST
+#define __try if (1)
+#define __except(x) else
+#endif
+#define EXCEPTION_EXECUTE_HANDLER 1
+#define DECLSPEC_ALIGN(x) __attribute__((aligned(x)))
+#define C_ASSERT(e) static_assert(e, #e)
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define PAGED_CODE() do { } while (0)
+#define ASSERT(e) do { if (!(e)) ShimAssert(#e, __FILE__, __LINE__); } while (0)
+#define NT_ASSERT(e) ASSERT(e)
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((char *)(address) - offsetof(type, field)))
+#define MAX_PATH 260
+#define PAGE_SIZE 0x1000
+#define PAGE_SHIFT 12
+#define BYTE_OFFSET(Va) ((ULONG)((ULONG_PTR)(Va) & (PAGE_SIZE - 1)))
+#define ADDRESS_AND_SIZE_TO_SPAN_PAGES(Va, Size) \
+    ((ULONG)((BYTE_OFFSET(Va) + (SIZE_T)(Size) + (PAGE_SIZE - 1)) >> PAGE_SHIFT))
+#define MAXULONG 0xffffffffU
+#define MAXLONG 0x7fffffff
+#define MAXUSHORT 0xffff
+#define MM_USER_PROBE_ADDRESS ((ULONG_PTR)0x7fffffff0000ULL)
+#define GetExceptionCode() STATUS_ACCESS_VIOLATION
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#define LOWORD(l) ((WORD)(((ULONG_PTR)(l)) & 0xffff))
+#define HIWORD(l) ((WORD)((((ULONG_PTR)(l)) >> 16) & 0xffff))
+#ifndef QXLMOCK_HOST
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define IN
+#define OUT
+#define OPTIONAL
+#define CONST const
+#define VOID void
+#ifndef FALSE
+#define FALSE 0
+#endif
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_reads_(x)
+#define _In_reads_bytes_(x)
+#define _In_reads_opt_(x)
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(x)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(x)
+#define _Out_writes_bytes_(x)
+#define _Outptr_
+#define _Outptr_opt_
+#define _Outptr_result_bytebuffer_(x)
+#define _When_(a, b)
+#define _Success_(x)
+#define _Check_return_
+#define _Must_inspect_result_
+#define _Use_decl_annotations_
+#define _IRQL_requires_(x)
+#define _IRQL_requires_max_(x)
+#define _Function_class_(x)
+#define __drv_reportError(x)
+#ifndef QXLMOCK_HOST
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#endif
+
+/* basic types, Windows is LLP64 so ULONG stays 32 bits */
+
+typedef void *PVOID, *LPVOID, *HANDLE, **PHANDLE;
+typedef unsigned char UCHAR, *PUCHAR, BYTE, *PBYTE, BOOLEAN, *PBOOLEAN;
+typedef char CHAR, *PCHAR, *PSTR, *LPSTR;
+typedef const char *PCSTR, *LPCSTR, *PCSZ;
+typedef unsigned short USHORT, *PUSHORT, WORD;
+typedef short SHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG, DWORD, *PDWORD;
+typedef int INT, BOOL;
+typedef unsigned int UINT, *PUINT;
+typedef int8_t INT8;
+typedef uint8_t UINT8, *PUINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16, *PUINT16;
+typedef int32_t INT32, LONG32;
+typedef uint32_t UINT32, ULONG32, *PUINT32;
+typedef long long INT64, LONG64, LONGLONG;
+typedef unsigned long long UINT64, ULONG64, ULONGLONG, DWORD64, *PULONG64, *PULONGLONG;
+typedef intptr_t LONG_PTR, INT_PTR;
+typedef uintptr_t ULONG_PTR, UINT_PTR, *PULONG_PTR, KAFFINITY;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef wchar_t WCHAR, *PWCHAR, *PWSTR, *PWCH, *LPWSTR;
+typedef const wchar_t *PCWSTR, *LPCWSTR;
+typedef LONG NTSTATUS;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG ACCESS_MASK;
+typedef ULONG LOGICAL;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    } u;
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _POINT {
+    LONG x;
+    LONG y;
+} POINT, *PPOINT, POINTL;
+
+typedef struct _RECT {
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+} RECT, *PRECT, RECTL, *PRECTL;
+
+typedef struct _SIZE {
+    LONG cx;
+    LONG cy;
+} SIZE;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PCHAR Buffer;
+} ANSI_STRING, *PANSI_STRING;
+
+typedef struct _GUID {
+    ULONG Data1;
+    USHORT Data2;
+    USHORT Data3;
+    UCHAR Data4[8];
+} GUID;
+
+/* status codes */
+
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define STATUS_SUCCESS                      ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                      ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                      ((NTSTATUS)0x00000103L)
+#define STATUS_BUFFER_OVERFLOW              ((NTSTATUS)0x80000005L)
+#define STATUS_UNSUCCESSFUL                 ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED              ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER            ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_MEMORY                    ((NTSTATUS)0xC0000017L)
+#define STATUS_ACCESS_DENIED                ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL             ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND        ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_PATH_NOT_FOUND        ((NTSTATUS)0xC000003AL)
+#define STATUS_DISK_FULL                    ((NTSTATUS)0xC000007FL)
+#define STATUS_INSUFFICIENT_RESOURCES       ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED                ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_DEVICE_REQUEST       ((NTSTATUS)0xC0000010L)
+#define STATUS_NAME_TOO_LONG                ((NTSTATUS)0xC0000106L)
+#define STATUS_INVALID_BUFFER_SIZE          ((NTSTATUS)0xC0000206L)
+#define STATUS_INVALID_PARAMETER_1          ((NTSTATUS)0xC00000EFL)
+#define STATUS_INVALID_PARAMETER_2          ((NTSTATUS)0xC00000F0L)
+#define STATUS_INVALID_PARAMETER_3          ((NTSTATUS)0xC00000F1L)
+#define STATUS_INVALID_PARAMETER_4          ((NTSTATUS)0xC00000F2L)
+#define STATUS_ILLEGAL_INSTRUCTION          ((NTSTATUS)0xC000001DL)
+#define STATUS_DEVICE_NOT_READY             ((NTSTATUS)0xC00000A3L)
+#define STATUS_ACCESS_VIOLATION             ((NTSTATUS)0xC0000005L)
+#define STATUS_NOT_FOUND                    ((NTSTATUS)0xC0000225L)
+#define STATUS_REVISION_MISMATCH            ((NTSTATUS)0xC0000059L)
+#define STATUS_GRAPHICS_SOURCE_NOT_IN_TOPOLOGY              ((NTSTATUS)0xC01E0325L)
+#define STATUS_GRAPHICS_NO_RECOMMENDED_FUNCTIONAL_VIDPN     ((NTSTATUS)0xC01E0307L)
+#define STATUS_GRAPHICS_NO_MORE_ELEMENTS_IN_DATASET         ((NTSTATUS)0x001E034CL)
+#define STATUS_GRAPHICS_DRIVER_MISMATCH                     ((NTSTATUS)0xC01E0009L)
+#define STATUS_GRAPHICS_INVALID_VIDPN                       ((NTSTATUS)0xC01E0303L)
+#define STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_SOURCE        ((NTSTATUS)0xC01E0304L)
+#define STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_TARGET        ((NTSTATUS)0xC01E0305L)
+#define STATUS_GRAPHICS_VIDPN_MODALITY_NOT_SUPPORTED        ((NTSTATUS)0xC01E0306L)
+#define STATUS_GRAPHICS_MODE_NOT_PINNED                     ((NTSTATUS)0x001E0307L)
+#define STATUS_GRAPHICS_INVALID_VIDPN_TOPOLOGY              ((NTSTATUS)0xC01E0308L)
+#define STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_SOURCE_MODE   ((NTSTATUS)0xC01E0310L)
+#define STATUS_GRAPHICS_INVALID_VIDEO_PRESENT_TARGET_MODE   ((NTSTATUS)0xC01E0311L)
+#define STATUS_GRAPHICS_GAMMA_RAMP_NOT_SUPPORTED            ((NTSTATUS)0xC01E0329L)
+#define STATUS_GRAPHICS_PATH_ALREADY_IN_TOPOLOGY            ((NTSTATUS)0xC01E0313L)
+#define STATUS_GRAPHICS_SOURCE_ALREADY_IN_SET               ((NTSTATUS)0xC01E0315L)
+#define STATUS_GRAPHICS_NO_PREFERRED_MODE                   ((NTSTATUS)0x001E031EL)
+#define STATUS_GRAPHICS_MODE_ALREADY_IN_MODESET             ((NTSTATUS)0xC01E0314L)
+#define STATUS_GRAPHICS_INVALID_POINTER                     ((NTSTATUS)0xC01E0113L)
+#define STATUS_GRAPHICS_INVALID_DRIVER_MODEL                ((NTSTATUS)0xC01E0004L)
+#define STATUS_GRAPHICS_CHILD_DESCRIPTOR_NOT_SUPPORTED      ((NTSTATUS)0xC01E0584L)
+#define STATUS_MONITOR_NO_DESCRIPTOR                        ((NTSTATUS)0xC01D0001L)
+#define STATUS_MONITOR_NO_MORE_DESCRIPTOR_DATA              ((NTSTATUS)0xC01D0002L)
+
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_INVALID_PARAMETER 87L
+
+/* diagnostics */
+
+void ShimAssert(const char *expr, const char *file, int line);
+ULONG DbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, ...);
+ULONG vDbgPrintEx(ULONG ComponentId, ULONG Level, PCSTR Format, va_list arglist);
+#define DPFLTR_IHVVIDEO_ID 0
+#define DPFLTR_ERROR_LEVEL 0
+
+/* lists */
+
+FORCEINLINE void InitializeListHead(PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{
+    return (BOOLEAN)(ListHead->Flink == ListHead);
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = Entry->Flink;
+    PLIST_ENTRY Blink = Entry->Blink;
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return (BOOLEAN)(Flink == Blink);
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+FORCEINLINE PLIST_ENTRY RemoveTailList(PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Blink;
+    RemoveEntryList(Entry);
+    return Entry;
+}
+
+FORCEINLINE void InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Blink = ListHead->Blink;
+    Entry->Flink = ListHead;
+    Entry->Blink = Blink;
+    Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE void InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = ListHead->Flink;
+    Entry->Flink = Flink;
+    Entry->Blink = ListHead;
+    Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+/* memory and strings */
+
+#define RtlZeroMemory(d, l) memset((d), 0, (l))
+#define RtlFillMemory(d, l, f) memset((d), (f), (l))
+#define RtlCopyMemory(d, s, l) memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l) memmove((d), (s), (l))
+#define RtlEqualMemory(a, b, l) (!memcmp((a), (b), (l)))
+#define RtlCompareMemory(a, b, l) ShimCompareMemory((a), (b), (l))
+SIZE_T ShimCompareMemory(const void *a, const void *b, SIZE_T len);
+
+void RtlInitUnicodeString(PUNICODE_STRING Dest, PCWSTR Source);
+void RtlInitAnsiString(PANSI_STRING Dest, PCSZ Source);
+NTSTATUS RtlAnsiStringToUnicodeString(PUNICODE_STRING Dest, PANSI_STRING Source, BOOLEAN Allocate);
+void RtlFreeUnicodeString(PUNICODE_STRING String);
+NTSTATUS RtlStringCbVPrintfA(char *Dest, size_t cbDest, const char *Format, va_list argList);
+NTSTATUS RtlStringCbPrintfA(char *Dest, size_t cbDest, const char *Format, ...);
+
+typedef struct _RTL_OSVERSIONINFOW {
+    ULONG dwOSVersionInfoSize;
+    ULONG dwMajorVersion;
+    ULONG dwMinorVersion;
+    ULONG dwBuildNumber;
+    ULONG dwPlatformId;
+    WCHAR szCSDVersion[128];
+} RTL_OSVERSIONINFOW, *PRTL_OSVERSIONINFOW;
+NTSTATUS RtlGetVersion(PRTL_OSVERSIONINFOW lpVersionInformation);
+
+/* pool */
+
+typedef enum _POOL_TYPE {
+    NonPagedPool,
+    PagedPool,
+    NonPagedPoolMustSucceed = NonPagedPool + 2,
+    NonPagedPoolNx = 512,
+} POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+void ExFreePool(PVOID P);
+void ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+/* interlocked */
+
+#define InterlockedIncrement(p) __sync_add_and_fetch((p), 1)
+#define InterlockedDecrement(p) __sync_sub_and_fetch((p), 1)
+#define InterlockedIncrement64(p) __sync_add_and_fetch((p), 1)
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(p, v) __atomic_exchange_n((p), (LONG64)(v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedExchangeAdd64(p, v) __sync_fetch_and_add((p), (v))
+#define InterlockedCompareExchange(p, e, c) __sync_val_compare_and_swap((p), (c), (e))
+#define InterlockedCompareExchange64(p, e, c) __sync_val_compare_and_swap((p), (c), (e))
+#define InterlockedOr(p, v) __sync_fetch_and_or((p), (v))
+#define InterlockedAnd(p, v) __sync_fetch_and_and((p), (v))
+#define MemoryBarrier() __sync_synchronize()
+#define KeMemoryBarrier() __sync_synchronize()
+
+/* dispatcher objects, every one starts with the header so that
+   KeWaitForSingleObject can take any of them */
+
+typedef enum _SHIM_OBJECT_TYPE {
+    ShimEventObject = 1,
+    ShimMutexObject,
+    ShimThreadObject,
+    ShimTimerObject,
+    ShimFileObject,
+} SHIM_OBJECT_TYPE;
+
+typedef struct _DISPATCHER_HEADER {
+    LONG Type;
+    LONG SignalState;
+    BOOLEAN AutoReset;
+} DISPATCHER_HEADER;
+
+typedef struct _KEVENT {
+    DISPATCHER_HEADER Header;
+} KEVENT, *PKEVENT, *PRKEVENT;
+
+typedef struct _KMUTEX {
+    DISPATCHER_HEADER Header;
+    PVOID Owner;
+    LONG Recursion;
+} KMUTEX, *PKMUTEX, *PRKMUTEX;
+
+struct _KDPC;
+typedef void KDEFERRED_ROUTINE(struct _KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC {
+    PKDEFERRED_ROUTINE DeferredRoutine;
+    PVOID DeferredContext;
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+    DISPATCHER_HEADER Header;
+    PVOID Shim;
+} KTIMER, *PKTIMER;
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+typedef enum _MODE {
+    KernelMode,
+    UserMode
+} KPROCESSOR_MODE, MODE;
+
+typedef LONG KPRIORITY;
+#define IO_NO_INCREMENT 0
+#define PASSIVE_LEVEL 0
+#define DISPATCH_LEVEL 2
+#define HIGH_LEVEL 15
+
+void KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+void KeClearEvent(PRKEVENT Event);
+LONG KeResetEvent(PRKEVENT Event);
+void KeInitializeMutex(PRKMUTEX Mutex, ULONG Level);
+LONG KeReleaseMutex(PRKMUTEX Mutex, BOOLEAN Wait);
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+NTSTATUS KeDelayExecutionThread(KPROCESSOR_MODE WaitMode, BOOLEAN Alertable, PLARGE_INTEGER Interval);
+
+void KeInitializeDpc(PRKDPC Dpc, PKDEFERRED_ROUTINE DeferredRoutine, PVOID DeferredContext);
+void KeInitializeTimer(PKTIMER Timer);
+BOOLEAN KeSetTimer(PKTIMER Timer, LARGE_INTEGER DueTime, PKDPC Dpc);
+BOOLEAN KeSetTimerEx(PKTIMER Timer, LARGE_INTEGER DueTime, LONG Period, PKDPC Dpc);
+BOOLEAN KeCancelTimer(PKTIMER Timer);
+void KeFlushQueuedDpcs(void);
+ULONG ExSetTimerResolution(ULONG DesiredTime, BOOLEAN SetResolution);
+
+void KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+void KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql);
+void KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+void KeAcquireSpinLockAtDpcLevel(PKSPIN_LOCK SpinLock);
+void KeReleaseSpinLockFromDpcLevel(PKSPIN_LOCK SpinLock);
+KIRQL KeGetCurrentIrql(void);
+
+void KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+ULONGLONG KeQueryInterruptTime(void);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+
+/* processors, one group */
+
+#define ALL_PROCESSOR_GROUPS 0xffff
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR Number;
+    UCHAR Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+
+/* threads and handles */
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG Length;
+    HANDLE RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG Attributes;
+    PVOID SecurityDescriptor;
+    PVOID SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define OBJ_KERNEL_HANDLE 0x00000200L
+#define OBJ_CASE_INSENSITIVE 0x00000040L
+#define InitializeObjectAttributes(p, n, a, r, s) do { \
+    (p)->Length = sizeof(OBJECT_ATTRIBUTES);          \
+    (p)->RootDirectory = (r);                         \
+    (p)->Attributes = (a);                            \
+    (p)->ObjectName = (n);                            \
+    (p)->SecurityDescriptor = (s);                    \
+    (p)->SecurityQualityOfService = NULL;             \
+} while (0)
+
+#define THREAD_ALL_ACCESS 0x1fffff
+#define KEY_SET_VALUE 0x0002
+#define KEY_QUERY_VALUE 0x0001
+#define KEY_READ 0x20019
+#define KEY_WRITE 0x20006
+#define KEY_ALL_ACCESS 0xf003f
+
+typedef void KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+typedef struct _CLIENT_ID {
+    HANDLE UniqueProcess;
+    HANDLE UniqueThread;
+} CLIENT_ID, *PCLIENT_ID;
+typedef PVOID POBJECT_TYPE;
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                              HANDLE ProcessHandle, PCLIENT_ID ClientId, PKSTART_ROUTINE StartRoutine,
+                              PVOID StartContext);
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus);
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess, POBJECT_TYPE ObjectType,
+                                   KPROCESSOR_MODE AccessMode, PVOID *Object, PVOID HandleInformation);
+#define ObDereferenceObject(o) ShimDereferenceObject(o)
+void ShimDereferenceObject(PVOID Object);
+NTSTATUS ZwClose(HANDLE Handle);
+KPRIORITY KeSetPriorityThread(PVOID Thread, KPRIORITY Priority);
+PVOID KeGetCurrentThread(void);
+HANDLE PsGetCurrentThreadId(void);
+
+/* registry */
+
+#define REG_NONE 0
+#define REG_SZ 1
+#define REG_BINARY 3
+#define REG_DWORD 4
+#define REG_MULTI_SZ 7
+#define REG_QWORD 11
+
+typedef enum _KEY_VALUE_INFORMATION_CLASS {
+    KeyValueBasicInformation,
+    KeyValueFullInformation,
+    KeyValuePartialInformation
+} KEY_VALUE_INFORMATION_CLASS;
+
+typedef struct _KEY_VALUE_PARTIAL_INFORMATION {
+    ULONG TitleIndex;
+    ULONG Type;
+    ULONG DataLength;
+    UCHAR Data[1];
+} KEY_VALUE_PARTIAL_INFORMATION, *PKEY_VALUE_PARTIAL_INFORMATION;
+
+NTSTATUS ZwSetValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName, ULONG TitleIndex, ULONG Type,
+                       PVOID Data, ULONG DataSize);
+NTSTATUS ZwQueryValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName,
+                         KEY_VALUE_INFORMATION_CLASS KeyValueInformationClass,
+                         PVOID KeyValueInformation, ULONG Length, PULONG ResultLength);
+NTSTATUS ZwDeleteValueKey(HANDLE KeyHandle, PUNICODE_STRING ValueName);
+
+typedef NTSTATUS RTL_QUERY_REGISTRY_ROUTINE(PWSTR ValueName, ULONG ValueType, PVOID ValueData,
+                                            ULONG ValueLength, PVOID Context, PVOID EntryContext);
+typedef RTL_QUERY_REGISTRY_ROUTINE *PRTL_QUERY_REGISTRY_ROUTINE;
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+    PRTL_QUERY_REGISTRY_ROUTINE QueryRoutine;
+    ULONG Flags;
+    PWSTR Name;
+    PVOID EntryContext;
+    ULONG DefaultType;
+    PVOID DefaultData;
+    ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+#define RTL_QUERY_REGISTRY_SUBKEY 0x00000001
+#define RTL_QUERY_REGISTRY_REQUIRED 0x00000004
+#define RTL_QUERY_REGISTRY_DIRECT 0x00000020
+#define RTL_QUERY_REGISTRY_TYPECHECK 0x00000100
+#define RTL_REGISTRY_ABSOLUTE 0
+
+NTSTATUS RtlQueryRegistryValues(ULONG RelativeTo, PCWSTR Path, PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                PVOID Context, PVOID Environment);
+
+/* files, only the NT paths mapped with ShimMapFile can be created */
+
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef void (*PIO_APC_ROUTINE)(PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved);
+
+#define GENERIC_READ 0x80000000L
+#define GENERIC_WRITE 0x40000000L
+#define SYNCHRONIZE 0x00100000L
+#define FILE_APPEND_DATA 0x0004
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define FILE_SHARE_READ 0x00000001
+#define FILE_SHARE_WRITE 0x00000002
+#define FILE_SUPERSEDE 0x00000000
+#define FILE_OPEN 0x00000001
+#define FILE_CREATE 0x00000002
+#define FILE_OPEN_IF 0x00000003
+#define FILE_OVERWRITE 0x00000004
+#define FILE_OVERWRITE_IF 0x00000005
+#define FILE_SEQUENTIAL_ONLY 0x00000004
+#define FILE_SYNCHRONOUS_IO_NONALERT 0x00000020
+#define FILE_NON_DIRECTORY_FILE 0x00000040
+
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess, POBJECT_ATTRIBUTES ObjectAttributes,
+                      PIO_STATUS_BLOCK IoStatusBlock, PLARGE_INTEGER AllocationSize, ULONG FileAttributes,
+                      ULONG ShareAccess, ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer,
+                      ULONG EaLength);
+NTSTATUS ZwWriteFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine, PVOID ApcContext,
+                     PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer, ULONG Length, PLARGE_INTEGER ByteOffset,
+                     PULONG Key);
+
+/* devices and memory mapping */
+
+typedef struct _DEVICE_OBJECT {
+    PVOID DeviceExtension;
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _DRIVER_OBJECT {
+    PVOID DriverExtension;
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+
+#define PLUGPLAY_REGKEY_DEVICE 1
+#define PLUGPLAY_REGKEY_DRIVER 2
+NTSTATUS IoOpenDeviceRegistryKey(PDEVICE_OBJECT DeviceObject, ULONG DevInstKeyType,
+                                 ACCESS_MASK DesiredAccess, PHANDLE DevInstRegKey);
+
+typedef enum _MEMORY_CACHING_TYPE {
+    MmNonCached = 0,
+    MmCached = 1,
+    MmWriteCombined = 2,
+} MEMORY_CACHING_TYPE;
+
+#define PAGE_READWRITE 0x04
+#define PAGE_NOCACHE 0x200
+#define PAGE_WRITECOMBINE 0x400
+
+PVOID MmMapIoSpace(PHYSICAL_ADDRESS PhysicalAddress, SIZE_T NumberOfBytes, MEMORY_CACHING_TYPE CacheType);
+PVOID MmMapIoSpaceEx(PHYSICAL_ADDRESS PhysicalAddress, SIZE_T NumberOfBytes, ULONG Protect);
+void MmUnmapIoSpace(PVOID BaseAddress, SIZE_T NumberOfBytes);
+PVOID MmGetSystemRoutineAddress(PUNICODE_STRING SystemRoutineName);
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    PVOID StartVa;
+    ULONG ByteCount;
+    ULONG MdlFlags;
+} MDL, *PMDL;
+
+typedef enum _LOCK_OPERATION {
+    IoReadAccess,
+    IoWriteAccess,
+    IoModifyAccess
+} LOCK_OPERATION;
+
+typedef enum _MM_PAGE_PRIORITY {
+    LowPagePriority,
+    NormalPagePriority = 16,
+    HighPagePriority = 32
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute 0x40000000
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer, BOOLEAN ChargeQuota, PVOID Irp);
+void IoFreeMdl(PMDL Mdl);
+void MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation);
+void MmUnlockPages(PMDL Mdl);
+PVOID MmGetSystemAddressForMdlSafe(PMDL Mdl, ULONG Priority);
+
+/* port i/o goes to the mock device */
+
+UCHAR READ_PORT_UCHAR(PUCHAR Port);
+void WRITE_PORT_UCHAR(PUCHAR Port, UCHAR Value);
+void WRITE_PORT_BUFFER_UCHAR(PUCHAR Port, PUCHAR Buffer, ULONG Count);
+USHORT READ_PORT_USHORT(PUSHORT Port);
+void WRITE_PORT_USHORT(PUSHORT Port, USHORT Value);
+ULONG READ_PORT_ULONG(PULONG Port);
+void WRITE_PORT_ULONG(PULONG Port, ULONG Value);
+
+/* power */
+
+typedef enum _DEVICE_POWER_STATE {
+    PowerDeviceUnspecified = 0,
+    PowerDeviceD0,
+    PowerDeviceD1,
+    PowerDeviceD2,
+    PowerDeviceD3,
+    PowerDeviceMaximum
+} DEVICE_POWER_STATE, *PDEVICE_POWER_STATE;
+
+typedef enum _POWER_ACTION {
+    PowerActionNone = 0,
+    PowerActionReserved,
+    PowerActionSleep,
+    PowerActionHibernate,
+    PowerActionShutdown,
+    PowerActionShutdownReset,
+    PowerActionShutdownOff,
+    PowerActionWarmEject,
+    PowerActionDisplayOff
+} POWER_ACTION, *PPOWER_ACTION;
+
+/* resources */
+
+#define CmResourceTypeNull 0
+#define CmResourceTypePort 1
+#define CmResourceTypeInterrupt 2
+#define CmResourceTypeMemory 3
+#define CmResourceTypeDma 4
+#define CmResourceTypeDeviceSpecific 5
+#define CmResourceTypeBusNumber 6
+#define CM_RESOURCE_PORT_IO 0x0004
+
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR {
+    UCHAR Type;
+    UCHAR ShareDisposition;
+    USHORT Flags;
+    union {
+        struct {
+            PHYSICAL_ADDRESS Start;
+            ULONG Length;
+        } Generic, Port, Memory;
+        struct {
+            ULONG Level;
+            ULONG Vector;
+            KAFFINITY Affinity;
+        } Interrupt;
+    } u;
+} CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+typedef struct _CM_PARTIAL_RESOURCE_LIST {
+    USHORT Version;
+    USHORT Revision;
+    ULONG Count;
+    CM_PARTIAL_RESOURCE_DESCRIPTOR PartialDescriptors[1];
+} CM_PARTIAL_RESOURCE_LIST;
+
+typedef struct _CM_FULL_RESOURCE_DESCRIPTOR {
+    ULONG InterfaceType;
+    ULONG BusNumber;
+    CM_PARTIAL_RESOURCE_LIST PartialResourceList;
+} CM_FULL_RESOURCE_DESCRIPTOR, *PCM_FULL_RESOURCE_DESCRIPTOR;
+
+typedef struct _CM_RESOURCE_LIST {
+    ULONG Count;
+    CM_FULL_RESOURCE_DESCRIPTOR List[1];
+} CM_RESOURCE_LIST, *PCM_RESOURCE_LIST;
+
+typedef struct _PCI_COMMON_HEADER {
+    USHORT VendorID;
+    USHORT DeviceID;
+    USHORT Command;
+    USHORT Status;
+    UCHAR RevisionID;
+    UCHAR ProgIf;
+    UCHAR SubClass;
+    UCHAR BaseClass;
+    UCHAR CacheLineSize;
+    UCHAR LatencyTimer;
+    UCHAR HeaderType;
+    UCHAR BIST;
+    union {
+        struct _PCI_HEADER_TYPE_0 {
+            ULONG BaseAddresses[6];
+            ULONG CIS;
+            USHORT SubVendorID;
+            USHORT SubSystemID;
+            ULONG ROMBaseAddress;
+            UCHAR CapabilitiesPtr;
+            UCHAR Reserved1[3];
+            ULONG Reserved2;
+            UCHAR InterruptLine;
+            UCHAR InterruptPin;
+            UCHAR MinimumGrant;
+            UCHAR MaximumLatency;
+        } type0;
+    } u;
+} PCI_COMMON_HEADER, *PPCI_COMMON_HEADER;
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "dxgk.h"
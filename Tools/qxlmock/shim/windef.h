@@ -0,0 +1,3 @@
+/* forwards to the user-space stand-in, see wdk.h */
+#pragma once
+#include "wdk.h"
@@ -0,0 +1,154 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+TraceReader::~TraceReader()
+{
+    if (m_File) {
+        fclose(m_File);
+    }
+}
+
+bool TraceReader::Open(const char *Path)
+{
+    m_File = fopen(Path, "rb");
+    if (!m_File) {
+        perror(Path);
+        return false;
+    }
+    if (fread(&m_Header, sizeof(m_Header), 1, m_File) != 1 ||
+        m_Header.magic != QXL_PRESENT_TRACE_MAGIC) {
+        fprintf(stderr, "%s: not a present trace\n", Path);
+        return false;
+    }
+    if (m_Header.version != QXL_PRESENT_TRACE_VERSION ||
+        m_Header.header_size < sizeof(m_Header) ||
+        m_Header.frame_size < sizeof(QXLPresentTraceFrame)) {
+        fprintf(stderr, "%s: unsupported trace version %u\n", Path, m_Header.version);
+        return false;
+    }
+    return Rewind();
+}
+
+bool TraceReader::Rewind()
+{
+    return fseek(m_File, m_Header.header_size, SEEK_SET) == 0;
+}
+
+bool TraceReader::Next(TraceFrame &Frame)
+{
+    QXLPresentTraceFrame &h = Frame.Header;
+    memset(&h, 0, sizeof(h));
+    if (fread(&h, sizeof(h), 1, m_File) != 1) {
+        return false;
+    }
+    if (m_Header.frame_size > sizeof(h) && fseek(m_File, m_Header.frame_size - sizeof(h), SEEK_CUR)) {
+        return false;
+    }
+    size_t Tables = h.num_moves * sizeof(QXLPresentTraceMove) + h.num_rects * sizeof(QXLPresentTraceRect);
+    if (h.size < m_Header.frame_size + Tables) {
+        fprintf(stderr, "trace: bad record size %u\n", h.size);
+        return false;
+    }
+    Frame.Moves.resize(h.num_moves);
+    Frame.Rects.resize(h.num_rects);
+    Frame.Pixels.resize(h.size - m_Header.frame_size - Tables);
+    if ((h.num_moves && fread(Frame.Moves.data(), sizeof(QXLPresentTraceMove), h.num_moves, m_File) != h.num_moves) ||
+        (h.num_rects && fread(Frame.Rects.data(), sizeof(QXLPresentTraceRect), h.num_rects, m_File) != h.num_rects) ||
+        (Frame.Pixels.size() && fread(Frame.Pixels.data(), Frame.Pixels.size(), 1, m_File) != 1)) {
+        return false;
+    }
+    return true;
+}
+
+TraceWriter::~TraceWriter()
+{
+    Close();
+}
+
+bool TraceWriter::Open(const char *Path)
+{
+    QXLPresentTraceHeader Header;
+    struct timespec Now;
+
+    m_File = fopen(Path, "wb");
+    if (!m_File) {
+        perror(Path);
+        return false;
+    }
+    clock_gettime(CLOCK_REALTIME, &Now);
+    Header.magic = QXL_PRESENT_TRACE_MAGIC;
+    Header.version = QXL_PRESENT_TRACE_VERSION;
+    Header.header_size = sizeof(Header);
+    Header.frame_size = sizeof(QXLPresentTraceFrame);
+    // system time, 100ns since 1601
+    Header.start_time = ((ULONGLONG)Now.tv_sec + 11644473600ULL) * 10000000ULL + Now.tv_nsec / 100;
+    return fwrite(&Header, sizeof(Header), 1, m_File) == 1;
+}
+
+bool TraceWriter::Write(ULONGLONG Time, UINT Width, UINT Height, const UINT32 *pSurface,
+                        const std::vector<QXLPresentTraceMove> &Moves,
+                        const std::vector<QXLPresentTraceRect> &Rects)
+{
+    QXLPresentTraceFrame Frame;
+    std::vector<QXLPresentTraceRect> Clipped(Rects);
+
+    Frame.size = sizeof(Frame) + Moves.size() * sizeof(QXLPresentTraceMove) +
+                 Rects.size() * sizeof(QXLPresentTraceRect);
+    // clipped to the surface like the driver records them
+    for (QXLPresentTraceRect &r : Clipped) {
+        r.left = std::max(r.left, 0);
+        r.top = std::max(r.top, 0);
+        r.right = std::min(r.right, (int32_t)Width);
+        r.bottom = std::min(r.bottom, (int32_t)Height);
+        if (r.right <= r.left || r.bottom <= r.top) {
+            r.left = r.top = r.right = r.bottom = 0;
+        }
+        Frame.size += (r.right - r.left) * (r.bottom - r.top) * 4;
+    }
+    Frame.source_id = 0;
+    Frame.time = Time;
+    Frame.width = Width;
+    Frame.height = Height;
+    Frame.bytes_per_pixel = 4;
+    Frame.rotation = D3DKMDT_VPPR_IDENTITY;
+    Frame.num_moves = Moves.size();
+    Frame.num_rects = Rects.size();
+
+    bool Ok = fwrite(&Frame, sizeof(Frame), 1, m_File) == 1;
+    if (Moves.size()) {
+        Ok = Ok && fwrite(Moves.data(), sizeof(QXLPresentTraceMove), Moves.size(), m_File) == Moves.size();
+    }
+    if (Clipped.size()) {
+        Ok = Ok && fwrite(Clipped.data(), sizeof(QXLPresentTraceRect), Clipped.size(), m_File) == Clipped.size();
+    }
+    for (const QXLPresentTraceRect &r : Clipped) {
+        for (int32_t y = r.top; Ok && y < r.bottom; y++) {
+            Ok = fwrite(&pSurface[(size_t)y * Width + r.left], 4, r.right - r.left, m_File) ==
+                 (size_t)(r.right - r.left);
+        }
+    }
+    return Ok;
+}
+
+bool TraceWriter::Close()
+{
+    bool Ok = true;
+    if (m_File) {
+        Ok = fclose(m_File) == 0;
+        m_File = NULL;
+    }
+    return Ok;
+}
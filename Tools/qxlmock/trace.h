@@ -0,0 +1,64 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Present traces in the qxl_present_trace.h format, read by qxlreplay
+ * and written by qxltracegen.
+ */
+
+#pragma once
+
+#include "qxlmock.h"
+#include "qxl_present_trace.h"
+
+#include <cstdio>
+#include <vector>
+
+struct TraceFrame
+{
+    QXLPresentTraceFrame Header;
+    std::vector<QXLPresentTraceMove> Moves;
+    std::vector<QXLPresentTraceRect> Rects;
+    std::vector<UCHAR> Pixels;
+};
+
+class TraceReader
+{
+public:
+    TraceReader() : m_File(NULL) {}
+    ~TraceReader();
+
+    bool Open(const char *Path);
+    bool Rewind();
+    // false at the end of the trace, a truncated last record ends it too
+    bool Next(TraceFrame &Frame);
+
+private:
+    FILE *m_File;
+    QXLPresentTraceHeader m_Header;
+};
+
+class TraceWriter
+{
+public:
+    TraceWriter() : m_File(NULL) {}
+    ~TraceWriter();
+
+    bool Open(const char *Path);
+    // one present of a 32bpp surface, the pixels of the dirty rects are
+    // taken from pSurface, which has Width * 4 bytes per row
+    bool Write(ULONGLONG Time, UINT Width, UINT Height, const UINT32 *pSurface,
+               const std::vector<QXLPresentTraceMove> &Moves,
+               const std::vector<QXLPresentTraceRect> &Rects);
+    bool Close();
+
+private:
+    FILE *m_File;
+};
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * qxlstats: prints the counters of the qxldod driver, read with the
+ * QXL_ESCAPE_GET_STATS escape. With -t it has the driver write its trace
+ * ring to %SystemRoot%\Temp\qxldod.ring instead.
+ *
+ *   qxlstats [-i SECONDS | -t] [\\.\DISPLAYn]
+ *
+ * Build from a developer command prompt with
+ *
+ *   cl /EHsc /W4 qxlstats.cpp gdi32.lib user32.lib
+ */
+
+#include <windows.h>
+#include <winternl.h>
+#include <d3dkmthk.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "qxlstats.h"
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#endif
+
+// the escape buffer of the driver, see QXLEscape in QxlDod.cpp
+#include "../../qxldod/include/start-packed.h"
+typedef struct SPICE_ATTR_PACKED QXLStatsEscape {
+    uint32_t ioctl;
+    QXLEscapeStats stats;
+} QXLStatsEscape;
+#include "../../qxldod/include/end-packed.h"
+
+static bool OpenAdapter(const wchar_t *Name, D3DKMT_HANDLE *phAdapter)
+{
+    D3DKMT_OPENADAPTERFROMGDIDISPLAYNAME Open = {};
+
+    wcsncpy_s(Open.DeviceName, Name, _TRUNCATE);
+    if (!NT_SUCCESS(D3DKMTOpenAdapterFromGdiDisplayName(&Open))) {
+        return false;
+    }
+    *phAdapter = Open.hAdapter;
+    return true;
+}
+
+static void CloseAdapter(D3DKMT_HANDLE hAdapter)
+{
+    D3DKMT_CLOSEADAPTER Close = {};
+
+    Close.hAdapter = hAdapter;
+    D3DKMTCloseAdapter(&Close);
+}
+
+static NTSTATUS GetStats(D3DKMT_HANDLE hAdapter, QXLEscapeStats *pStats)
+{
+    QXLStatsEscape Data = {};
+    D3DKMT_ESCAPE Escape = {};
+
+    Data.ioctl = QXL_ESCAPE_GET_STATS;
+    Escape.hAdapter = hAdapter;
+    Escape.Type = D3DKMT_ESCAPE_DRIVERPRIVATE;
+    Escape.pPrivateDriverData = &Data;
+    Escape.PrivateDriverDataSize = sizeof(Data);
+    NTSTATUS Status = D3DKMTEscape(&Escape);
+    if (NT_SUCCESS(Status)) {
+        *pStats = Data.stats;
+    }
+    return Status;
+}
+
+static NTSTATUS DumpTraceRing(D3DKMT_HANDLE hAdapter)
+{
+    uint32_t ioctl = QXL_ESCAPE_DUMP_TRACE_RING;
+    D3DKMT_ESCAPE Escape = {};
+
+    Escape.hAdapter = hAdapter;
+    Escape.Type = D3DKMT_ESCAPE_DRIVERPRIVATE;
+    Escape.pPrivateDriverData = &ioctl;
+    Escape.PrivateDriverDataSize = sizeof(ioctl);
+    return D3DKMTEscape(&Escape);
+}
+
+// the first display whose driver answers the escape, the VGA fallback
+// and other drivers reject it
+static bool FindQxlAdapter(wchar_t *Name, size_t NameSize, D3DKMT_HANDLE *phAdapter)
+{
+    DISPLAY_DEVICEW Device = { sizeof(Device) };
+    QXLEscapeStats Stats;
+
+    for (DWORD i = 0; EnumDisplayDevicesW(NULL, i, &Device, 0); i++) {
+        if (!(Device.StateFlags & DISPLAY_DEVICE_ATTACHED_TO_DESKTOP) ||
+            !OpenAdapter(Device.DeviceName, phAdapter)) {
+            continue;
+        }
+        if (NT_SUCCESS(GetStats(*phAdapter, &Stats))) {
+            wcsncpy_s(Name, NameSize, Device.DeviceName, _TRUNCATE);
+            return true;
+        }
+        CloseAdapter(*phAdapter);
+    }
+    return false;
+}
+
+int wmain(int argc, wchar_t **argv)
+{
+    wchar_t Name[32] = L"";
+    ULONG Interval = 0;
+    bool bDumpRing = false;
+    D3DKMT_HANDLE hAdapter;
+
+    for (int i = 1; i < argc; i++) {
+        if (!wcscmp(argv[i], L"-i") && i + 1 < argc) {
+            Interval = wcstoul(argv[++i], NULL, 0);
+        } else if (!wcscmp(argv[i], L"-t")) {
+            bDumpRing = true;
+        } else if (argv[i][0] != L'-' && !Name[0]) {
+            wcsncpy_s(Name, argv[i], _TRUNCATE);
+        } else {
+            fprintf(stderr, "usage: qxlstats [-i SECONDS | -t] [\\\\.\\DISPLAYn]\n");
+            return 2;
+        }
+    }
+
+    if (Name[0] ? !OpenAdapter(Name, &hAdapter) : !FindQxlAdapter(Name, _countof(Name), &hAdapter)) {
+        fprintf(stderr, "qxlstats: no qxldod display found\n");
+        return 1;
+    }
+
+    int Result = 0;
+    if (bDumpRing) {
+        NTSTATUS Status = DumpTraceRing(hAdapter);
+        if (NT_SUCCESS(Status)) {
+            printf("%ls: trace ring written to %%SystemRoot%%\\Temp\\qxldod.ring\n", Name);
+        } else {
+            // STATUS_NOT_SUPPORTED when the TraceRing parameter is not set
+            fprintf(stderr, "qxlstats: %ls: dump failed with 0x%X\n", Name, Status);
+            Result = 1;
+        }
+        CloseAdapter(hAdapter);
+        return Result;
+    }
+    for (;;) {
+        QXLEscapeStats Stats;
+        NTSTATUS Status = GetStats(hAdapter, &Stats);
+        if (!NT_SUCCESS(Status)) {
+            fprintf(stderr, "qxlstats: %ls: escape failed with 0x%X\n", Name, Status);
+            Result = 1;
+            break;
+        }
+        printf("%ls\n", Name);
+        PrintQxlStats(stdout, &Stats);
+        if (!Interval) {
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+        Sleep(Interval * 1000);
+    }
+    CloseAdapter(hAdapter);
+    return Result;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 Red Hat, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ * http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Printing of the QXL_ESCAPE_GET_STATS result, shared by qxlstats and
+ * Tools/qxlmock.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../../qxldod/include/qxl_windows.h"
+
+// true if the driver filled Field
+#define QXL_STATS_HAS(s, Field) \
+    ((s)->size >= offsetof(QXLEscapeStats, Field) + sizeof((s)->Field))
+
+static inline void PrintQxlStats(FILE *f, const QXLEscapeStats *s)
+{
+    static const char *const Spaces[] = { "devram", "vram" };
+
+    fprintf(f, "stats version   %u, %u bytes\n", s->version, s->size);
+    if (!QXL_STATS_HAS(s, alloc_failures)) {
+        return;
+    }
+    fprintf(f, "presents        %llu\n", (unsigned long long)s->presents);
+    fprintf(f, "drawables       %llu\n", (unsigned long long)s->drawables);
+    fprintf(f, "bytes uploaded  %llu\n", (unsigned long long)s->bytes_uploaded);
+    fprintf(f, "ring waits      cmd %llu, cursor %llu\n",
+            (unsigned long long)s->cmd_ring_waits, (unsigned long long)s->cursor_ring_waits);
+    fprintf(f, "oom notifies    %llu\n", (unsigned long long)s->oom_notifies);
+    fprintf(f, "delayed chunks  %llu\n", (unsigned long long)s->delayed_chunks);
+    fprintf(f, "releases        %llu entries, %llu outputs\n",
+            (unsigned long long)s->release_entries, (unsigned long long)s->released_outputs);
+    fprintf(f, "alloc failures  %llu\n", (unsigned long long)s->alloc_failures);
+    if (!QXL_STATS_HAS(s, mem)) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(s->mem) / sizeof(s->mem[0]); i++) {
+        const QXLEscapeStatsMem *m = &s->mem[i];
+        fprintf(f, "%-6s          %llu KB in use of %llu KB, %llu KB free in %llu chunks, top %llu KB\n",
+                Spaces[i], (unsigned long long)m->in_use >> 10, (unsigned long long)m->capacity >> 10,
+                (unsigned long long)m->free >> 10, (unsigned long long)m->free_chunks,
+                (unsigned long long)m->top >> 10);
+    }
+    if (!QXL_STATS_HAS(s, headless_uploads)) {
+        return;
+    }
+    fprintf(f, "encodings       lossless %llu, 16bpp %llu, headless %llu\n",
+            (unsigned long long)s->presents_lossless, (unsigned long long)s->presents_16bpp,
+            (unsigned long long)s->presents_headless);
+    fprintf(f, "headless        %llu uploads of the shadows\n", (unsigned long long)s->headless_uploads);
+    if (!QXL_STATS_HAS(s, cmd_queue_max)) {
+        return;
+    }
+    fprintf(f, "command queue   %llu queued, %llu merged, %llu promoted, depth %llu, max %llu\n",
+            (unsigned long long)s->cmds_queued, (unsigned long long)s->cmds_merged,
+            (unsigned long long)s->cmds_promoted, (unsigned long long)s->cmd_queue_depth,
+            (unsigned long long)s->cmd_queue_max);
+    if (!QXL_STATS_HAS(s, source_mdls)) {
+        return;
+    }
+    fprintf(f, "source mapping  %llu pages locked in %llu MDLs, %llu mapping from row 0\n",
+            (unsigned long long)s->source_pages_locked, (unsigned long long)s->source_mdls,
+            (unsigned long long)s->source_pages_whole);
+    if (!QXL_STATS_HAS(s, cursor_ops_deferred)) {
+        return;
+    }
+    fprintf(f, "cursor          %llu commands deferred\n", (unsigned long long)s->cursor_ops_deferred);
+    if (!QXL_STATS_HAS(s, cursor_notifies_saved)) {
+        return;
+    }
+    fprintf(f, "cursor cache    %llu hits, %llu misses\n",
+            (unsigned long long)s->cursor_cache_hits, (unsigned long long)s->cursor_cache_misses);
+    fprintf(f, "cursor moves    %llu coalesced, %llu notifies saved\n",
+            (unsigned long long)s->cursor_moves_coalesced, (unsigned long long)s->cursor_notifies_saved);
+    if (!QXL_STATS_HAS(s, offscreen_evicted)) {
+        return;
+    }
+    fprintf(f, "offscreen       %llu hits, %llu parked, %llu evicted\n",
+            (unsigned long long)s->offscreen_hits, (unsigned long long)s->offscreen_parked,
+            (unsigned long long)s->offscreen_evicted);
+    if (!QXL_STATS_HAS(s, custom_modes_added)) {
+        return;
+    }
+    fprintf(f, "custom modes    %llu reused, %llu added\n",
+            (unsigned long long)s->custom_modes_reused, (unsigned long long)s->custom_modes_added);
+    if (!QXL_STATS_HAS(s, client_monitors_bad_crc)) {
+        return;
+    }
+    fprintf(f, "client monitors %llu applied, %llu unchanged, %llu bad crc\n",
+            (unsigned long long)s->client_monitors_applied, (unsigned long long)s->client_monitors_unchanged,
+            (unsigned long long)s->client_monitors_bad_crc);
+    if (!QXL_STATS_HAS(s, vga_presents_sync)) {
+        return;
+    }
+    fprintf(f, "vga presents    %llu staged, %llu coalesced, %llu blitted in the call\n",
+            (unsigned long long)s->vga_presents_staged, (unsigned long long)s->vga_presents_coalesced,
+            (unsigned long long)s->vga_presents_sync);
+}
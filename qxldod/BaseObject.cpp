@@ -61,6 +61,19 @@ void* __cdecl operator new[](size_t Size, POOL_TYPE PoolType)
     return pObject;
 }
 
+_When_((PoolType & NonPagedPoolMustSucceed) != 0,
+    __drv_reportError("Must succeed pool allocations are forbidden. "
+            "Allocation failures cause a system crash"))
+void* __cdecl operator new[](size_t Size, POOL_TYPE PoolType, NoInitTag)
+{
+    PAGED_CODE();
+
+    Size = (Size != 0) ? Size : 1;
+
+    // not even the DBG fill, the caller writes every byte
+    return ExAllocatePoolWithTag(PoolType, Size, QXLTAG);
+}
+
 void __cdecl operator delete(void* pObject)
 {
     PAGED_CODE();
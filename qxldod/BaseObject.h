@@ -65,6 +65,15 @@ _When_((PoolType & NonPagedPoolMustSucceed) != 0,
     __drv_reportError("Must succeed pool allocations are forbidden. "
             "Allocation failures cause a system crash"))
 void* __cdecl operator new[](size_t Size, POOL_TYPE PoolType = PagedPool);
+
+// The operators above fill every allocation. Bulk pixel buffers that are
+// written in full before they are read take NoInit and skip the fill,
+// e.g. new (PagedPool, NoInit) BYTE[Size]
+enum NoInitTag { NoInit };
+_When_((PoolType & NonPagedPoolMustSucceed) != 0,
+    __drv_reportError("Must succeed pool allocations are forbidden. "
+            "Allocation failures cause a system crash"))
+void* __cdecl operator new[](size_t Size, POOL_TYPE PoolType, NoInitTag);
 void  __cdecl operator delete(void* pObject);
 void  __cdecl operator delete(void *pObject, size_t s);
 void  __cdecl operator delete[](void* pObject);
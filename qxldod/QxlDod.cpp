@@ -12,6 +12,9 @@
 #include "qxldod.h"
 #include "qxl_windows.h"
 #include "compat.h"
+#ifdef _M_X64
+#include <emmintrin.h>
+#endif
 
 #pragma code_seg("PAGE")
 
@@ -19,10 +22,94 @@
                           (QXL_INTERRUPT_CURSOR) | \
                           (QXL_INTERRUPT_IO_CMD))
 
+// a client monitors config whose CRC does not match is read again this
+// many times, 1 ms apart; qemu rewrites the ROM without any lock
+#define CLIENT_MONITORS_RETRIES 10
+
 #define VSYNC_PERIOD    200 // ms, use 0 for auto
 #define VSYNC_RATE      75
+// adaptive VSync: after g_VSyncIdleTicks ticks without any present
+// the timer is stretched to VSYNC_IDLE_PERIOD, 0 disables it
+#define VSYNC_IDLE_TICKS    10
+#define VSYNC_IDLE_PERIOD   1000 // ms
+// ticks between jitter statistics dumps
+#define VSYNC_STATS_TICKS   1000
+// 100ns units
+#define VSYNC_COARSE_TICK       156250
+#define VSYNC_TIMER_RESOLUTION  10000
+
+#define PRESENT_TRACE_FILE      L"\\SystemRoot\\Temp\\qxldod.trace"
+#define PRESENT_TRACE_BACKLOG   (64 * 1024 * 1024)
+
+#define TRACE_RING_FILE         L"\\SystemRoot\\Temp\\qxldod.ring"
+// events kept per processor, a power of two
+#define TRACE_RING_RECORDS      2048
+
+// host log: pending messages are sent at this period, and at most
+// HOST_LOG_FLUSHES QXL_IO_LOG exits are taken per second
+#define HOST_LOG_FLUSH_PERIOD   250 // ms
+#define HOST_LOG_FLUSHES        8
+#define HOST_LOG_LINE           256
+// end of log_buf kept for the count of dropped messages
+#define HOST_LOG_RESERVE        48
 
 BOOLEAN g_bSupportVSync;
+ULONG g_VSyncIdleTicks = VSYNC_IDLE_TICKS;
+// VSync rate in mHz, 0 keeps VSYNC_PERIOD
+ULONG g_VSyncRate;
+// share of the VRAM bar in percent given to offscreen surfaces, 0 disables them
+ULONG g_OffscreenBudget = 25;
+// depth of the QXL primary surface, 16 halves the bitmap traffic
+ULONG g_SurfaceBpp = QXL_BPP;
+// size limit of the present trace in MB, 0 disables recording
+ULONG g_PresentTrace;
+// level of the events kept in the trace ring, 0 disables it
+ULONG g_TraceRing;
+// take the monitor layout of the client from the device ROM, 0 leaves it
+// to the guest agent
+ULONG g_ClientMonitorsConfig = 1;
+// ENCODING_POLICY_*, how bitmaps are sent while a client is connected
+ULONG g_EncodingPolicy;
+// ms between two uploads of what was presented while no client is
+// connected, 0 sends every present
+ULONG g_HeadlessPeriod = 1000;
+// VGA presents are staged and blitted by a worker thread
+ULONG g_VgaAsyncPresent = 1;
+
+// one ring per processor, so writers on different processors never
+// touch the same cache lines; Written counts the events ever written
+typedef struct TraceRingCpu {
+    LONG64 Written;
+    QXLTraceRecord Records[TRACE_RING_RECORDS];
+} TraceRingCpu;
+
+static TraceRingCpu *g_TraceRings;
+static ULONG g_TraceRingCpus;
+
+// messages up to this trace level also go to the host, 0 leaves it to the
+// log_level of the device ROM
+ULONG g_HostLogLevel;
+// level DbgPrint sends to the host at, 0 while no device logs
+ULONG g_HostLogPrintLevel;
+
+// the log_buf of the QXLRam of the first QXL device, filled with lines
+// and handed to the host with one QXL_IO_LOG once full or on the timer
+typedef struct HostLog {
+    KSPIN_LOCK Lock;
+    PUCHAR Buf;
+    PUCHAR Port;
+    ULONG Used;                 // bytes in Buf, without the terminating 0
+    LONG Dropped;               // messages lost since the last flush
+    ULONG Flushes;              // QXL_IO_LOG exits in the current second
+    ULONGLONG Second;           // interrupt time the second started
+    KTIMER Timer;
+    KDPC Dpc;
+} HostLog;
+
+static HostLog g_HostLog;
+
+QXL_NON_PAGED static VOID HostLogFlush(VOID);
+QXL_NON_PAGED static VOID HostLogTimerDpc(_In_ _KDPC *Dpc, _In_ PVOID Context, _In_ PVOID Arg1, _In_ PVOID Arg2);
 
 // BEGIN: Non-Paged Code
 
@@ -67,6 +154,7 @@ struct QXLEscape {
     union {
         QXLEscapeSetCustomDisplay custom_display;
         QXLHead monitor_config;
+        QXLEscapeStats stats;
     };
 };
 
@@ -86,8 +174,24 @@ QxlDod::QxlDod(_In_ DEVICE_OBJECT* pPhysicalDeviceObject) : m_pPhysicalDevice(pP
 
     KeInitializeDpc(&m_VsyncTimerDpc, VsyncTimerProcGate, this);
     KeInitializeTimer(&m_VsyncTimer);
+    KeInitializeSpinLock(&m_VsyncLock);
     m_VsyncFiredCounter = 0;
     m_bVsyncEnabled = FALSE;
+    m_VsyncPresents = 0;
+    m_VsyncIdleTicks = 0;
+    m_VsyncIdle = FALSE;
+    m_VsyncWakeupsSaved = 0;
+    m_VsyncDeadline = 0;
+    m_VsyncPeriod = 0;
+    m_VsyncPeriodRem = 0;
+    m_VsyncPeriodAcc = 0;
+    m_VsyncRate = 0;
+    m_bVsyncTimerResolution = FALSE;
+    m_VsyncTicks = 0;
+    m_VsyncMissed = 0;
+    m_VsyncLateMin = 0;
+    m_VsyncLateMax = 0;
+    m_VsyncLateSum = 0;
 
     DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
 }
@@ -152,7 +256,11 @@ NTSTATUS QxlDod::StartDevice(_In_  DXGK_START_INFO*   pDxgkStartInfo,
     RtlCopyMemory(&m_DxgkInterface, pDxgkInterface, sizeof(m_DxgkInterface));
     RtlZeroMemory(m_CurrentModes, sizeof(m_CurrentModes));
 //CHECK ME!!!!!!!!!!!!!
-    m_CurrentModes[0].DispInfo.TargetId = D3DDDI_ID_UNINITIALIZED;
+    for (UINT SourceId = 0; SourceId < MAX_VIEWS; ++SourceId)
+    {
+        m_CurrentModes[SourceId].SourceId = SourceId;
+        m_CurrentModes[SourceId].DispInfo.TargetId = D3DDDI_ID_UNINITIALIZED;
+    }
     // Get device information from OS.
     NTSTATUS Status = m_DxgkInterface.DxgkCbGetDeviceInformation(m_DxgkInterface.DeviceHandle, &m_DeviceInfo);
     if (!NT_SUCCESS(Status))
@@ -194,8 +302,8 @@ NTSTATUS QxlDod::StartDevice(_In_  DXGK_START_INFO*   pDxgkStartInfo,
         return Status;
     }
 
-   *pNumberOfViews = MAX_VIEWS;
-   *pNumberOfChildren = MAX_CHILDREN;
+   *pNumberOfViews = m_pHWDevice->GetNumHeads();
+   *pNumberOfChildren = m_pHWDevice->GetNumHeads();
     m_Flags.DriverStarted = TRUE;
     DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
     return STATUS_SUCCESS;
@@ -206,6 +314,11 @@ NTSTATUS QxlDod::StopDevice(VOID)
     PAGED_CODE();
     m_Flags.DriverStarted = FALSE;
     EnableVsync(FALSE);
+    m_PresentTrace.Close();
+    if (g_TraceRing)
+    {
+        TraceRingDump();
+    }
     return STATUS_SUCCESS;
 }
 
@@ -336,7 +449,7 @@ NTSTATUS QxlDod::QueryChildRelations(_Out_writes_bytes_(ChildRelationsSize) DXGK
     for (UINT ChildIndex = 0; ChildIndex < ChildRelationsCount; ++ChildIndex)
     {
         pChildRelations[ChildIndex].ChildDeviceType = TypeVideoOutput;
-        pChildRelations[ChildIndex].ChildCapabilities.HpdAwareness = (DeviceId == 0) ? HpdAwarenessAlwaysConnected : HpdAwarenessInterruptible;
+        pChildRelations[ChildIndex].ChildCapabilities.HpdAwareness = (DeviceId == 0 && ChildIndex == 0) ? HpdAwarenessAlwaysConnected : HpdAwarenessInterruptible;
         pChildRelations[ChildIndex].ChildCapabilities.Type.VideoOutput.InterfaceTechnology = D3DKMDT_VOT_HD15;
         pChildRelations[ChildIndex].ChildCapabilities.Type.VideoOutput.MonitorOrientationAwareness = D3DKMDT_MOA_NONE;
         pChildRelations[ChildIndex].ChildCapabilities.Type.VideoOutput.SupportsSdtvModes = FALSE;
@@ -364,7 +477,8 @@ NTSTATUS QxlDod::QueryChildStatus(_Inout_ DXGK_CHILD_STATUS* pChildStatus,
         {
             // HpdAwarenessInterruptible was reported since HpdAwarenessNone is deprecated.
             // However, BDD has no knowledge of HotPlug events, so just always return connected.
-            pChildStatus->HotPlug.Connected = IsDriverActive();
+            pChildStatus->HotPlug.Connected = IsDriverActive() &&
+                m_pHWDevice->IsChildConnected(pChildStatus->ChildUid);
             return STATUS_SUCCESS;
         }
 
@@ -586,6 +700,12 @@ NTSTATUS QxlDod::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPre
     QXL_ASSERT(pPresentDisplayOnly != NULL);
     QXL_ASSERT(pPresentDisplayOnly->VidPnSourceId < MAX_VIEWS);
 
+    InterlockedIncrement(&m_VsyncPresents);
+    if (m_VsyncIdle)
+    {
+        VsyncWakeUp();
+    }
+
     if (pPresentDisplayOnly->BytesPerPixel < 4)
     {
         // Only >=32bpp modes are reported, therefore this Present should never pass anything less than 4 bytes per pixel
@@ -619,6 +739,10 @@ NTSTATUS QxlDod::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPre
             m_CurrentModes[pPresentDisplayOnly->VidPnSourceId].SrcModeWidth)*DstBitPerPixel/8;
         pDst += (int)CenterShift/2;
     }
+    if (g_PresentTrace)
+    {
+        m_PresentTrace.Record(pPresentDisplayOnly, &m_CurrentModes[pPresentDisplayOnly->VidPnSourceId], RotationNeededByFb);
+    }
     Status = m_pHWDevice->ExecutePresentDisplayOnly(
                         pDst,
                         DstBitPerPixel,
@@ -630,11 +754,444 @@ NTSTATUS QxlDod::PresentDisplayOnly(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPre
                         pPresentDisplayOnly->NumDirtyRects,
                         pPresentDisplayOnly->pDirtyRect,
                         RotationNeededByFb,
-                        &m_CurrentModes[0]);
+                        &m_CurrentModes[pPresentDisplayOnly->VidPnSourceId]);
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return Status;
 }
 
+PresentTrace::PresentTrace(void)
+{
+    PAGED_CODE();
+    KeInitializeMutex(&m_Lock, 0);
+    KeInitializeEvent(&m_WriterEvent, SynchronizationEvent, FALSE);
+    InitializeListHead(&m_Records);
+    m_hFile = NULL;
+    m_hWriter = NULL;
+    m_Queued = 0;
+    m_Size = 0;
+    m_Limit = 0;
+    m_StartTime = 0;
+    m_Frames = 0;
+    m_Dropped = 0;
+    m_Skipped = 0;
+    m_bStop = FALSE;
+    m_bFailed = FALSE;
+}
+
+PresentTrace::~PresentTrace(void)
+{
+    PAGED_CODE();
+    Close();
+}
+
+// Called with m_Lock held
+NTSTATUS PresentTrace::Open(VOID)
+{
+    PAGED_CODE();
+    UNICODE_STRING FileName;
+    OBJECT_ATTRIBUTES Attributes;
+    IO_STATUS_BLOCK IoStatus;
+    PRESENT_TRACE_RECORD* pRecord;
+    QXLPresentTraceHeader* pHeader;
+    LARGE_INTEGER Now;
+
+    pRecord = reinterpret_cast<PRESENT_TRACE_RECORD*>(
+        new (PagedPool, NoInit) BYTE[FIELD_OFFSET(PRESENT_TRACE_RECORD, Data) + sizeof(*pHeader)]);
+    if (!pRecord)
+    {
+        return STATUS_NO_MEMORY;
+    }
+    RtlInitUnicodeString(&FileName, PRESENT_TRACE_FILE);
+    InitializeObjectAttributes(&Attributes, &FileName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+    NTSTATUS Status = ZwCreateFile(&m_hFile, GENERIC_WRITE | SYNCHRONIZE, &Attributes, &IoStatus, NULL,
+                                   FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+                                   FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+                                   NULL, 0);
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: cannot create %ws (0x%X)\n", __FUNCTION__, PRESENT_TRACE_FILE, Status));
+        m_hFile = NULL;
+        delete [] reinterpret_cast<BYTE*>(pRecord);
+        return Status;
+    }
+    InitializeObjectAttributes(&Attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    m_bStop = FALSE;
+    Status = PsCreateSystemThread(&m_hWriter, THREAD_ALL_ACCESS, &Attributes, NULL, NULL,
+                                  WriterRoutineWrapper, this);
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: cannot start the writer (0x%X)\n", __FUNCTION__, Status));
+        ZwClose(m_hFile);
+        m_hFile = NULL;
+        m_hWriter = NULL;
+        delete [] reinterpret_cast<BYTE*>(pRecord);
+        return Status;
+    }
+    m_Size = 0;
+    m_Limit = (ULONGLONG)g_PresentTrace << 20;
+    m_StartTime = KeQueryInterruptTime();
+    m_Frames = 0;
+    m_Dropped = 0;
+    m_Skipped = 0;
+
+    KeQuerySystemTime(&Now);
+    pRecord->Size = sizeof(*pHeader);
+    pHeader = reinterpret_cast<QXLPresentTraceHeader*>(pRecord->Data);
+    pHeader->magic = QXL_PRESENT_TRACE_MAGIC;
+    pHeader->version = QXL_PRESENT_TRACE_VERSION;
+    pHeader->header_size = sizeof(*pHeader);
+    pHeader->frame_size = sizeof(QXLPresentTraceFrame);
+    pHeader->start_time = Now.QuadPart;
+    Queue(pRecord);
+    DbgPrint(TRACE_LEVEL_WARNING, ("Recording presents to %ws, up to %d MB\n", PRESENT_TRACE_FILE, g_PresentTrace));
+    return STATUS_SUCCESS;
+}
+
+// The writer empties the queue before it stops
+VOID PresentTrace::Close(VOID)
+{
+    PAGED_CODE();
+    PVOID pDispatcherObject;
+
+    BOOLEAN locked = WaitForObject(&m_Lock, NULL);
+    m_bStop = TRUE;
+    ReleaseMutex(&m_Lock, locked);
+    if (m_hWriter)
+    {
+        KeSetEvent(&m_WriterEvent, IO_NO_INCREMENT, FALSE);
+        NTSTATUS Status = ObReferenceObjectByHandle(
+            m_hWriter, 0, NULL, KernelMode, &pDispatcherObject, NULL);
+        if (NT_SUCCESS(Status))
+        {
+            WaitForObject(pDispatcherObject, NULL);
+            ObDereferenceObject(pDispatcherObject);
+        }
+        ZwClose(m_hWriter);
+        m_hWriter = NULL;
+    }
+
+    locked = WaitForObject(&m_Lock, NULL);
+    if (m_hFile)
+    {
+        ZwClose(m_hFile);
+        m_hFile = NULL;
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: %d presents in %I64d bytes, %d dropped over the limit, %d behind the writer\n",
+            __FUNCTION__, m_Frames, m_Size, m_Dropped, m_Skipped));
+    }
+    m_bStop = FALSE;
+    ReleaseMutex(&m_Lock, locked);
+}
+
+// Called with m_Lock held
+VOID PresentTrace::Queue(_In_ PRESENT_TRACE_RECORD* pRecord)
+{
+    PAGED_CODE();
+    InsertTailList(&m_Records, &pRecord->Link);
+    m_Queued += pRecord->Size;
+    m_Size += pRecord->Size;
+    KeSetEvent(&m_WriterEvent, IO_NO_INCREMENT, FALSE);
+}
+
+VOID PresentTrace::WriterRoutine(VOID)
+{
+    PAGED_CODE();
+    IO_STATUS_BLOCK IoStatus;
+
+    for (;;)
+    {
+        BOOLEAN locked = WaitForObject(&m_Lock, NULL);
+        if (IsListEmpty(&m_Records))
+        {
+            BOOLEAN bStop = m_bStop;
+            ReleaseMutex(&m_Lock, locked);
+            if (bStop)
+            {
+                break;
+            }
+            WaitForObject(&m_WriterEvent, NULL);
+            continue;
+        }
+        PRESENT_TRACE_RECORD* pRecord = CONTAINING_RECORD(RemoveHeadList(&m_Records), PRESENT_TRACE_RECORD, Link);
+        BOOLEAN bFailed = m_bFailed;
+        ReleaseMutex(&m_Lock, locked);
+
+        NTSTATUS Status = bFailed ? STATUS_SUCCESS :
+            ZwWriteFile(m_hFile, NULL, NULL, NULL, &IoStatus, pRecord->Data, pRecord->Size, NULL, NULL);
+
+        locked = WaitForObject(&m_Lock, NULL);
+        if (!NT_SUCCESS(Status))
+        {
+            DbgPrint(TRACE_LEVEL_ERROR, ("%s: write failed (0x%X), recording stopped\n", __FUNCTION__, Status));
+            m_bFailed = TRUE;
+        }
+        m_Queued -= pRecord->Size;
+        ReleaseMutex(&m_Lock, locked);
+        delete [] reinterpret_cast<BYTE*>(pRecord);
+    }
+}
+
+static VOID ClipTraceRect(_Out_ QXLPresentTraceRect* pDst, _In_ CONST RECT* pSrc, _In_ CONST CURRENT_BDD_MODE* pMode)
+{
+    PAGED_CODE();
+    pDst->left = MAX(pSrc->left, 0);
+    pDst->top = MAX(pSrc->top, 0);
+    pDst->right = MIN(pSrc->right, (LONG)pMode->SrcModeWidth);
+    pDst->bottom = MIN(pSrc->bottom, (LONG)pMode->SrcModeHeight);
+    if (pDst->right <= pDst->left || pDst->bottom <= pDst->top)
+    {
+        pDst->left = pDst->top = pDst->right = pDst->bottom = 0;
+    }
+}
+
+VOID PresentTrace::Record(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresent,
+                          _In_ CONST CURRENT_BDD_MODE* pMode,
+                          _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation)
+{
+    PAGED_CODE();
+    QXLPresentTraceFrame* pFrame;
+    QXLPresentTraceMove* pMove;
+    QXLPresentTraceRect* pRect;
+    QXLPresentTraceRect Rect;
+    PRESENT_TRACE_RECORD* pRecord;
+    SOURCE_MAP SrcMap;
+    BLT_INFO SrcBltInfo;
+    BYTE* pNow;
+    ULONG Size;
+    ULONG i;
+
+    Size = sizeof(*pFrame) + pPresent->NumMoves * sizeof(*pMove) + pPresent->NumDirtyRects * sizeof(*pRect);
+    for (i = 0; i < pPresent->NumDirtyRects; i++)
+    {
+        ClipTraceRect(&Rect, &pPresent->pDirtyRect[i], pMode);
+        Size += (Rect.right - Rect.left) * (Rect.bottom - Rect.top) * pPresent->BytesPerPixel;
+    }
+
+    BOOLEAN locked = WaitForObject(&m_Lock, NULL);
+    if (m_bFailed || (!m_hFile && !NT_SUCCESS(Open())))
+    {
+        m_bFailed = TRUE;
+        ReleaseMutex(&m_Lock, locked);
+        return;
+    }
+    if (m_Size + Size > m_Limit)
+    {
+        if (!m_Dropped++)
+        {
+            DbgPrint(TRACE_LEVEL_WARNING, ("%s: limit of %d MB reached after %d presents\n",
+                __FUNCTION__, g_PresentTrace, m_Frames));
+        }
+        ReleaseMutex(&m_Lock, locked);
+        return;
+    }
+    pRecord = m_Queued + Size > PRESENT_TRACE_BACKLOG ? NULL : reinterpret_cast<PRESENT_TRACE_RECORD*>(
+        new (PagedPool, NoInit) BYTE[FIELD_OFFSET(PRESENT_TRACE_RECORD, Data) + Size]);
+    // the source is in user mode, only its locked system mapping is read
+    if (!pRecord ||
+        !NT_SUCCESS(MapSourceRects((BYTE*)pPresent->pSource, pPresent->Pitch, pMode->SrcModeHeight,
+                                   pPresent->NumDirtyRects, pPresent->pDirtyRect, 0, NULL, &SrcMap)))
+    {
+        if (!m_Skipped++)
+        {
+            DbgPrint(TRACE_LEVEL_WARNING, ("%s: present %d dropped, %Id bytes not written yet\n",
+                __FUNCTION__, m_Frames, m_Queued));
+        }
+        delete [] reinterpret_cast<BYTE*>(pRecord);
+        ReleaseMutex(&m_Lock, locked);
+        return;
+    }
+
+    pRecord->Size = Size;
+    pFrame = reinterpret_cast<QXLPresentTraceFrame*>(pRecord->Data);
+    pFrame->size = Size;
+    pFrame->source_id = pPresent->VidPnSourceId;
+    pFrame->time = KeQueryInterruptTime() - m_StartTime;
+    pFrame->width = pMode->SrcModeWidth;
+    pFrame->height = pMode->SrcModeHeight;
+    pFrame->bytes_per_pixel = pPresent->BytesPerPixel;
+    pFrame->rotation = Rotation;
+    pFrame->num_moves = pPresent->NumMoves;
+    pFrame->num_rects = pPresent->NumDirtyRects;
+
+    pMove = reinterpret_cast<QXLPresentTraceMove*>(pFrame + 1);
+    for (i = 0; i < pPresent->NumMoves; i++, pMove++)
+    {
+        pMove->src_x = pPresent->pMoves[i].SourcePoint.x;
+        pMove->src_y = pPresent->pMoves[i].SourcePoint.y;
+        pMove->dest.left = pPresent->pMoves[i].DestRect.left;
+        pMove->dest.top = pPresent->pMoves[i].DestRect.top;
+        pMove->dest.right = pPresent->pMoves[i].DestRect.right;
+        pMove->dest.bottom = pPresent->pMoves[i].DestRect.bottom;
+    }
+    pRect = reinterpret_cast<QXLPresentTraceRect*>(pMove);
+    for (i = 0; i < pPresent->NumDirtyRects; i++)
+    {
+        ClipTraceRect(&pRect[i], &pPresent->pDirtyRect[i], pMode);
+    }
+
+    RtlZeroMemory(&SrcBltInfo, sizeof(SrcBltInfo));
+    SrcBltInfo.Pitch = pPresent->Pitch;
+    SrcBltInfo.BitsPerPel = pPresent->BytesPerPixel * BITS_PER_BYTE;
+    SrcBltInfo.Width = pMode->SrcModeWidth;
+    SrcBltInfo.Height = pMode->SrcModeHeight;
+    pNow = reinterpret_cast<BYTE*>(pRect + pPresent->NumDirtyRects);
+    for (i = 0; i < pPresent->NumDirtyRects; i++)
+    {
+        RECT Clipped = { pRect[i].left, pRect[i].top, pRect[i].right, pRect[i].bottom };
+        ULONG Line = (Clipped.right - Clipped.left) * pPresent->BytesPerPixel;
+        BLT_INFO RectBltInfo = SourceBltInfo(&SrcMap, &SrcBltInfo, &Clipped);
+        if (!RectBltInfo.pBits)
+        {
+            // empty once clipped, it has no pixels in the record
+            continue;
+        }
+        CONST BYTE* pRow = (CONST BYTE*)RectBltInfo.pBits + (Clipped.top + RectBltInfo.Offset.y) * pPresent->Pitch +
+                           Clipped.left * pPresent->BytesPerPixel;
+        for (LONG y = Clipped.top; y < Clipped.bottom; y++, pNow += Line, pRow += pPresent->Pitch)
+        {
+            RtlCopyMemory(pNow, pRow, Line);
+        }
+    }
+    UnmapSourceRects(&SrcMap);
+
+    Queue(pRecord);
+    m_Frames++;
+    ReleaseMutex(&m_Lock, locked);
+}
+
+VOID TraceRingInit(VOID)
+{
+    PAGED_CODE();
+    if (!g_TraceRing)
+    {
+        return;
+    }
+    g_TraceRingCpus = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    g_TraceRings = reinterpret_cast<TraceRingCpu*>(new (NonPagedPoolNx) BYTE[g_TraceRingCpus * sizeof(TraceRingCpu)]);
+    if (!g_TraceRings)
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: no memory for %d processors, tracing disabled\n", __FUNCTION__, g_TraceRingCpus));
+        g_TraceRing = 0;
+        return;
+    }
+    RtlZeroMemory(g_TraceRings, g_TraceRingCpus * sizeof(TraceRingCpu));
+    DbgPrint(TRACE_LEVEL_WARNING, ("Trace ring at level %d, %d events on each of %d processors\n",
+        g_TraceRing, TRACE_RING_RECORDS, g_TraceRingCpus));
+}
+
+VOID TraceRingFree(VOID)
+{
+    PAGED_CODE();
+    g_TraceRing = 0;
+    delete [] reinterpret_cast<BYTE*>(g_TraceRings);
+    g_TraceRings = NULL;
+}
+
+// Writes the rings to TRACE_RING_FILE in the qxl_trace_ring.h format.
+// Events keep being recorded meanwhile, the ones written during the dump
+// may show up half updated
+NTSTATUS TraceRingDump(VOID)
+{
+    PAGED_CODE();
+    UNICODE_STRING FileName;
+    OBJECT_ATTRIBUTES Attributes;
+    IO_STATUS_BLOCK IoStatus;
+    QXLTraceRingHeader Header;
+    LARGE_INTEGER Frequency;
+    LARGE_INTEGER Now;
+    HANDLE hFile;
+
+    if (!g_TraceRings)
+    {
+        return STATUS_NOT_SUPPORTED;
+    }
+    RtlInitUnicodeString(&FileName, TRACE_RING_FILE);
+    InitializeObjectAttributes(&Attributes, &FileName, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+    NTSTATUS Status = ZwCreateFile(&hFile, GENERIC_WRITE | SYNCHRONIZE, &Attributes, &IoStatus, NULL,
+                                   FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OVERWRITE_IF,
+                                   FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_SEQUENTIAL_ONLY,
+                                   NULL, 0);
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: cannot create %ws (0x%X)\n", __FUNCTION__, TRACE_RING_FILE, Status));
+        return Status;
+    }
+
+    Header.magic = QXL_TRACE_RING_MAGIC;
+    Header.version = QXL_TRACE_RING_VERSION;
+    Header.header_size = sizeof(Header);
+    Header.record_size = sizeof(QXLTraceRecord);
+    Header.num_cpus = g_TraceRingCpus;
+    Header.records_per_cpu = TRACE_RING_RECORDS;
+    Header.dump_time = KeQueryPerformanceCounter(&Frequency).QuadPart;
+    Header.frequency = Frequency.QuadPart;
+    KeQuerySystemTime(&Now);
+    Header.system_time = Now.QuadPart;
+    Status = ZwWriteFile(hFile, NULL, NULL, NULL, &IoStatus, &Header, sizeof(Header), NULL, NULL);
+    for (ULONG i = 0; NT_SUCCESS(Status) && i < g_TraceRingCpus; ++i)
+    {
+        Status = ZwWriteFile(hFile, NULL, NULL, NULL, &IoStatus, &g_TraceRings[i], sizeof(TraceRingCpu), NULL, NULL);
+    }
+    ZwClose(hFile);
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: write failed (0x%X)\n", __FUNCTION__, Status));
+    }
+    return Status;
+}
+
+// Sends the messages of the given device to the host, with the level of
+// the HostLogLevel parameter or, when not set, of the ROM log_level that
+// qemu takes from the guestdebug property. Only one device logs
+VOID HostLogStart(PUCHAR LogBuf, PUCHAR LogPort, ULONG RomLevel)
+{
+    PAGED_CODE();
+    LARGE_INTEGER DueTime;
+
+    if (g_HostLog.Buf)
+    {
+        return;
+    }
+    ULONG Level = g_HostLogLevel ? g_HostLogLevel : min(RomLevel, (ULONG)TRACE_LEVEL_VERBOSE);
+    if (!Level)
+    {
+        return;
+    }
+    KeInitializeSpinLock(&g_HostLog.Lock);
+    KeInitializeTimer(&g_HostLog.Timer);
+    KeInitializeDpc(&g_HostLog.Dpc, HostLogTimerDpc, NULL);
+    g_HostLog.Port = LogPort;
+    g_HostLog.Used = 0;
+    g_HostLog.Dropped = 0;
+    g_HostLog.Flushes = 0;
+    g_HostLog.Second = KeQueryInterruptTime();
+    LogBuf[0] = 0;
+    g_HostLog.Buf = LogBuf;
+    DueTime.QuadPart = -(LONGLONG)HOST_LOG_FLUSH_PERIOD * 10000;
+    KeSetTimerEx(&g_HostLog.Timer, DueTime, HOST_LOG_FLUSH_PERIOD, &g_HostLog.Dpc);
+    g_HostLogPrintLevel = Level;
+    DbgPrint(TRACE_LEVEL_WARNING, ("qxldod host log at level %d\n", Level));
+}
+
+// Sends what is pending, whatever the rate, and stops logging to LogBuf
+VOID HostLogStop(PUCHAR LogBuf)
+{
+    PAGED_CODE();
+    KIRQL OldIrql;
+
+    if (!g_HostLog.Buf || g_HostLog.Buf != LogBuf)
+    {
+        return;
+    }
+    g_HostLogPrintLevel = 0;
+    KeCancelTimer(&g_HostLog.Timer);
+    KeFlushQueuedDpcs();
+    KeAcquireSpinLock(&g_HostLog.Lock, &OldIrql);
+    g_HostLog.Flushes = 0;
+    HostLogFlush();
+    g_HostLog.Buf = NULL;
+    KeReleaseSpinLock(&g_HostLog.Lock, OldIrql);
+}
+
 NTSTATUS QxlDod::QueryInterface(_In_ CONST PQUERY_INTERFACE pQueryInterface)
 {
     PAGED_CODE();
@@ -727,7 +1284,8 @@ NTSTATUS QxlDod::IsSupportedVidPn(_Inout_ DXGKARG_ISSUPPORTEDVIDPN* pIsSupported
         return Status;
     }
 
-    // For every source in this topology, make sure they don't have more paths than there are targets
+    // For every source in this topology, make sure they don't have more paths than there are targets,
+    // every head has its own place in the primary surface so cloning is not supported
     for (D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId = 0; SourceId < MAX_VIEWS; ++SourceId)
     {
         SIZE_T NumPathsFromSource = 0;
@@ -742,7 +1300,7 @@ NTSTATUS QxlDod::IsSupportedVidPn(_Inout_ DXGKARG_ISSUPPORTEDVIDPN* pIsSupported
                            Status, hVidPnTopology, SourceId));
             return Status;
         }
-        else if (NumPathsFromSource > MAX_CHILDREN)
+        else if (NumPathsFromSource > 1)
         {
             // This VidPn is not supported, which has already been set as the default
             return STATUS_SUCCESS;
@@ -780,7 +1338,10 @@ NTSTATUS QxlDod::RecommendMonitorModes(_In_ CONST DXGKARG_RECOMMENDMONITORMODES*
     PAGED_CODE();
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
-    return AddSingleMonitorMode(pRecommendMonitorModes);
+    BOOLEAN locked = m_pHWDevice->LockModes();
+    NTSTATUS Status = AddSingleMonitorMode(pRecommendMonitorModes);
+    m_pHWDevice->UnlockModes(locked);
+    return Status;
 }
 
 
@@ -848,15 +1409,24 @@ static VOID FillSignalInfo(D3DKMDT_VIDEO_SIGNAL_INFO& SignalInfo, const VIDEO_MO
     SignalInfo.ActiveSize = SignalInfo.TotalSize;
     if (g_bSupportVSync)
     {
-        UINT val;
-        SignalInfo.VSyncFreq.Numerator = VSYNC_RATE;
-        SignalInfo.VSyncFreq.Denominator = 1;
+        UINT64 val;
+        if (g_VSyncRate)
+        {
+            SignalInfo.VSyncFreq.Numerator = g_VSyncRate;
+            SignalInfo.VSyncFreq.Denominator = 1000;
+        }
+        else
+        {
+            SignalInfo.VSyncFreq.Numerator = VSYNC_RATE;
+            SignalInfo.VSyncFreq.Denominator = 1;
+        }
         val =
-            SignalInfo.VSyncFreq.Numerator *
+            (UINT64)SignalInfo.VSyncFreq.Numerator *
             pVideoModeInfo->VisScreenWidth *
-            pVideoModeInfo->VisScreenHeight;
+            pVideoModeInfo->VisScreenHeight /
+            SignalInfo.VSyncFreq.Denominator;
         SignalInfo.PixelRate = val;
-        SignalInfo.HSyncFreq.Numerator = val / pVideoModeInfo->VisScreenHeight;
+        SignalInfo.HSyncFreq.Numerator = (UINT)(val / pVideoModeInfo->VisScreenHeight);
         SignalInfo.HSyncFreq.Denominator = 1;
         DbgPrint(TRACE_LEVEL_INFORMATION, ("by %s: filling with frequency data for %dx%d\n", caller, pVideoModeInfo->VisScreenWidth, pVideoModeInfo->VisScreenHeight));
     }
@@ -935,7 +1505,7 @@ NTSTATUS QxlDod::AddSingleMonitorMode(_In_ CONST DXGKARG_RECOMMENDMONITORMODES*
         return Status;
     }
 
-    pVbeModeInfo = m_pHWDevice->GetModeInfo(m_pHWDevice->GetCurrentModeIndex());
+    pVbeModeInfo = m_pHWDevice->GetModeInfo(m_pHWDevice->GetPreferredModeIndex(pRecommendMonitorModes->VideoPresentTargetId));
 
     // Since we don't know the real monitor timing information, just use the current display mode (from the POST device) with unknown frequencies
     FillSignalInfo(pMonitorSourceMode->VideoSignalInfo, pVbeModeInfo, __FUNCTION__);
@@ -1418,6 +1988,7 @@ NTSTATUS QxlDod::CommitVidPn(_In_ CONST DXGKARG_COMMITVIDPN* CONST pCommitVidPn)
 
     NTSTATUS                                 Status;
     SIZE_T                                   NumPaths = 0;
+    SIZE_T                                   NumPathsFromSource = 0;
     D3DKMDT_HVIDPNTOPOLOGY                   hVidPnTopology = 0;
     D3DKMDT_HVIDPNSOURCEMODESET              hVidPnSourceModeSet = 0;
     CONST DXGK_VIDPN_INTERFACE*              pVidPnInterface = NULL;
@@ -1498,6 +2069,7 @@ NTSTATUS QxlDod::CommitVidPn(_In_ CONST DXGKARG_COMMITVIDPN* CONST pCommitVidPn)
     if (pPinnedVidPnSourceModeInfo == NULL)
     {
         // There is no mode to pin on this source, any old paths here have already been cleared
+        m_pHWDevice->DisableSource(pCommitVidPn->AffectedVidPnSourceId);
         Status = STATUS_SUCCESS;
         goto CommitVidPnExit;
     }
@@ -1509,7 +2081,6 @@ NTSTATUS QxlDod::CommitVidPn(_In_ CONST DXGKARG_COMMITVIDPN* CONST pCommitVidPn)
     }
 
     // Get the number of paths from this source so we can loop through all paths
-    SIZE_T NumPathsFromSource = 0;
     Status = pVidPnTopologyInterface->pfnGetNumPathsFromSource(hVidPnTopology, pCommitVidPn->AffectedVidPnSourceId, &NumPathsFromSource);
     if (!NT_SUCCESS(Status))
     {
@@ -1624,7 +2195,7 @@ NTSTATUS QxlDod::SetSourceModeAndPath(CONST D3DKMDT_VIDPN_SOURCE_MODE* pSourceMo
              if (pCurrentBddMode->DispInfo.Width == pModeInfo->VisScreenWidth &&
                  pCurrentBddMode->DispInfo.Height == pModeInfo->VisScreenHeight )
              {
-                 Status = m_pHWDevice->SetCurrentMode(m_pHWDevice->GetModeNumber(ModeIndex));
+                 Status = m_pHWDevice->SetCurrentMode(m_pHWDevice->GetModeNumber(ModeIndex), pPath->VidPnSourceId);
                  if (NT_SUCCESS(Status))
                  {
                      m_pHWDevice->SetCurrentModeIndex(ModeIndex);
@@ -1741,6 +2312,148 @@ NTSTATUS QxlDod::UpdateActiveVidPnPresentPath(_In_ CONST DXGKARG_UPDATEACTIVEVID
 //
 // Non-Paged Code
 //
+QXL_NON_PAGED
+VOID TraceRingWrite(USHORT Event, ULONG64 Arg0, ULONG64 Arg1, ULONG64 Arg2,
+                    ULONG64 Arg3, ULONG64 Arg4, ULONG64 Arg5)
+{
+    ULONG Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (!g_TraceRings || Cpu >= g_TraceRingCpus)
+    {
+        return;
+    }
+    // a thread preempted between here and the write may share its slot
+    // with a later event once the ring wraps, the loss of one is accepted
+    TraceRingCpu *pRing = &g_TraceRings[Cpu];
+    LONG64 Slot = InterlockedIncrement64(&pRing->Written) - 1;
+    QXLTraceRecord *pRecord = &pRing->Records[Slot & (TRACE_RING_RECORDS - 1)];
+    pRecord->time = KeQueryPerformanceCounter(NULL).QuadPart;
+    pRecord->cpu = (uint16_t)Cpu;
+    pRecord->thread = (uint32_t)(ULONG_PTR)PsGetCurrentThreadId();
+    pRecord->args[0] = Arg0;
+    pRecord->args[1] = Arg1;
+    pRecord->args[2] = Arg2;
+    pRecord->args[3] = Arg3;
+    pRecord->args[4] = Arg4;
+    pRecord->args[5] = Arg5;
+    pRecord->event = Event;
+}
+
+// The IRQL the caller runs at decides what can be logged: wide strings
+// only convert at PASSIVE_LEVEL and the lock is not taken above
+// DISPATCH_LEVEL, such messages are counted as dropped
+QXL_NON_PAGED
+static BOOLEAN HostLogFormatSafe(const char *Format)
+{
+    if (KeGetCurrentIrql() > DISPATCH_LEVEL)
+    {
+        return FALSE;
+    }
+    if (KeGetCurrentIrql() == PASSIVE_LEVEL)
+    {
+        return TRUE;
+    }
+    for (const char *p = strchr(Format, '%'); p; p = strchr(p + 1, '%'))
+    {
+        p += strspn(p + 1, "-+ #0123456789.*hlIL") + 1;
+        if (*p == 'S' || *p == 'C' || *p == 'w' || (*p == 's' && p[-1] == 'l'))
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Called with the lock held. A QXL_IO_LOG exit is taken only while the
+// rate allows it, otherwise the lines stay pending for the timer
+QXL_NON_PAGED
+static VOID HostLogFlush(VOID)
+{
+    ULONGLONG Now = KeQueryInterruptTime();
+
+    if (Now - g_HostLog.Second >= 10000000)
+    {
+        g_HostLog.Second = Now;
+        g_HostLog.Flushes = 0;
+    }
+    if ((!g_HostLog.Used && !g_HostLog.Dropped) || g_HostLog.Flushes >= HOST_LOG_FLUSHES)
+    {
+        return;
+    }
+    LONG Dropped = InterlockedExchange(&g_HostLog.Dropped, 0);
+    if (Dropped)
+    {
+        RtlStringCbPrintfA((char *)g_HostLog.Buf + g_HostLog.Used, QXL_LOG_BUF_SIZE - g_HostLog.Used,
+                           "qxldod: %d messages dropped\n", Dropped);
+    }
+    g_HostLog.Flushes++;
+    WRITE_PORT_UCHAR(g_HostLog.Port, 0);
+    g_HostLog.Used = 0;
+    g_HostLog.Buf[0] = 0;
+}
+
+QXL_NON_PAGED
+static VOID HostLogTimerDpc(_In_ _KDPC *Dpc, _In_ PVOID Context, _In_ PVOID Arg1, _In_ PVOID Arg2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Arg1);
+    UNREFERENCED_PARAMETER(Arg2);
+    KeAcquireSpinLockAtDpcLevel(&g_HostLog.Lock);
+    if (g_HostLog.Buf)
+    {
+        HostLogFlush();
+    }
+    KeReleaseSpinLockFromDpcLevel(&g_HostLog.Lock);
+}
+
+// Appends one message, stamped with the interrupt time in ms since the
+// host prints a batch at once. It never waits for the host: when the
+// buffer is full and the rate is used up the message is dropped
+QXL_NON_PAGED
+VOID HostLogWrite(const char *Format, va_list Args)
+{
+    char Line[HOST_LOG_LINE];
+    KIRQL OldIrql;
+
+    if (!g_HostLog.Buf)
+    {
+        return;
+    }
+    if (!HostLogFormatSafe(Format))
+    {
+        InterlockedIncrement(&g_HostLog.Dropped);
+        return;
+    }
+    ULONGLONG Ms = KeQueryInterruptTime() / 10000;
+    RtlStringCbPrintfA(Line, sizeof(Line), "%I64u.%03u ", Ms / 1000, (ULONG)(Ms % 1000));
+    size_t Len = strlen(Line);
+    RtlStringCbVPrintfA(Line + Len, sizeof(Line) - Len, Format, Args);
+    Len = strlen(Line);
+    if (Line[Len - 1] != '\n')
+    {
+        // truncated or a message continued by the next call
+        Len = min(Len, sizeof(Line) - 2);
+        Line[Len++] = '\n';
+        Line[Len] = 0;
+    }
+
+    KeAcquireSpinLock(&g_HostLog.Lock, &OldIrql);
+    if (g_HostLog.Buf && g_HostLog.Used + Len >= QXL_LOG_BUF_SIZE - HOST_LOG_RESERVE)
+    {
+        HostLogFlush();
+    }
+    if (!g_HostLog.Buf || g_HostLog.Used + Len >= QXL_LOG_BUF_SIZE - HOST_LOG_RESERVE)
+    {
+        InterlockedIncrement(&g_HostLog.Dropped);
+    }
+    else
+    {
+        RtlCopyMemory(g_HostLog.Buf + g_HostLog.Used, Line, Len + 1);
+        g_HostLog.Used += (ULONG)Len;
+    }
+    KeReleaseSpinLock(&g_HostLog.Lock, OldIrql);
+}
+
 QXL_NON_PAGED
 VOID QxlDod::DpcRoutine(VOID)
 {
@@ -2364,6 +3077,58 @@ VOID BltBits (
     }
 }
 
+/****************************Internal*Routine******************************\
+ * MoveBits
+ *
+ *
+ * Copies a move rect within an unrotated surface of any bpp, the pixels at
+ * SourcePoint to DestRect. The rows are copied in the order that keeps
+ * overlapping source and destination intact, and within a row
+ * RtlMoveMemory takes care of the overlap.
+ *
+\**************************************************************************/
+
+QXL_NON_PAGED
+VOID MoveBits(
+    BLT_INFO* pBltInfo,
+    CONST D3DKMT_MOVE_RECT* pMove)
+{
+    CONST RECT* pRect = &pMove->DestRect;
+    LONG BytesPerPixel = pBltInfo->BitsPerPel / BITS_PER_BYTE;
+    LONG RowPitch = pBltInfo->Pitch;
+
+    NT_ASSERT(pBltInfo->Rotation == D3DKMDT_VPPR_IDENTITY);
+    NT_ASSERT(pRect->right >= pRect->left);
+    NT_ASSERT(pRect->bottom >= pRect->top);
+
+    UINT NumRows = pRect->bottom - pRect->top;
+    SIZE_T BytesToCopy = (SIZE_T)(pRect->right - pRect->left) * BytesPerPixel;
+    BYTE* pDstRow = (BYTE*)pBltInfo->pBits +
+                    (pRect->top + pBltInfo->Offset.y) * RowPitch +
+                    (pRect->left + pBltInfo->Offset.x) * BytesPerPixel;
+    CONST BYTE* pSrcRow = (BYTE*)pBltInfo->pBits +
+                          (pMove->SourcePoint.y + pBltInfo->Offset.y) * RowPitch +
+                          (pMove->SourcePoint.x + pBltInfo->Offset.x) * BytesPerPixel;
+
+    if (!NumRows || !BytesToCopy)
+    {
+        return;
+    }
+    // moving down, start from the bottom row
+    if (pRect->top > pMove->SourcePoint.y)
+    {
+        pDstRow += (NumRows - 1) * RowPitch;
+        pSrcRow += (NumRows - 1) * RowPitch;
+        RowPitch = -RowPitch;
+    }
+    for (UINT i = 0; i < NumRows; ++i)
+    {
+        RtlMoveMemory(pDstRow, pSrcRow, BytesToCopy);
+        pDstRow += RowPitch;
+        pSrcRow += RowPitch;
+    }
+}
+
 VgaDevice::VgaDevice(_In_ QxlDod* pQxlDod)
 {
     PAGED_CODE();
@@ -2373,6 +3138,16 @@ VgaDevice::VgaDevice(_In_ QxlDod* pQxlDod)
     m_ModeNumbers = NULL;
     m_CurrentMode = 0;
     m_Id = 0;
+    m_ModeCache = NULL;
+    m_PresentThread = NULL;
+    KeInitializeMutex(&m_PresentLock, 0);
+    KeInitializeEvent(&m_PresentEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&m_PresentIdleEvent, NotificationEvent, TRUE);
+    RtlZeroMemory(m_Frames, sizeof(m_Frames));
+    m_PendingFrame = 0;
+    m_bBlitting = FALSE;
+    m_bStopPresent = FALSE;
+    RtlZeroMemory(&m_Counters, sizeof(m_Counters));
 }
 
 VgaDevice::~VgaDevice(void)
@@ -2381,6 +3156,8 @@ VgaDevice::~VgaDevice(void)
     HWClose();
     delete [] m_ModeInfo;
     delete [] m_ModeNumbers;
+    delete [] reinterpret_cast<BYTE*>(m_ModeCache);
+    m_ModeCache = NULL;
     m_ModeInfo = NULL;
     m_ModeNumbers = NULL;
     m_CurrentMode = 0;
@@ -2437,6 +3214,9 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     VBE_INFO VbeInfo = {0};
     ULONG Length;
     VBE_MODEINFO tmpModeInfo;
+    VBE_MODE_CACHE CacheKey;
+    PVBE_MODE_CACHE_ENTRY pCacheModes = NULL;
+    TimeMeasurement tm;
     UINT Height = pDispInfo->Height;
     UINT Width = pDispInfo->Width;
     UINT BitsPerPixel = BPPFromPixelFormat(pDispInfo->ColorFormat);
@@ -2451,7 +3231,7 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     }
     DbgPrint(TRACE_LEVEL_INFORMATION, ("x86BiosAllocateBuffer 0x%x (%x.%x)\n", VbeInfo.VideoModePtr, m_Segment, m_Offset));
 
-    Status = x86BiosWriteMemory (m_Segment, m_Offset, "VBE2", 4);
+    Status = x86BiosWriteMemory (m_Segment, m_Offset, (PVOID)"VBE2", 4);
 
     if (!NT_SUCCESS (Status))
     {
@@ -2487,6 +3267,16 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     DbgPrint(TRACE_LEVEL_INFORMATION, ("VideoModePtr = 0x%x (0x%x.0x%x)\n", VbeInfo.VideoModePtr, HIWORD( VbeInfo.VideoModePtr), LOWORD( VbeInfo.VideoModePtr)));
     DbgPrint(TRACE_LEVEL_INFORMATION, ("pDispInfo = %p %dx%d@%d\n", pDispInfo, Width, Height, BitsPerPixel));
 
+    if (NT_SUCCESS(GetModeCacheKey(&CacheKey, &VbeInfo, BitsPerPixel)) &&
+        NT_SUCCESS(ReadModeCache(&CacheKey)))
+    {
+        x86BiosFreeBuffer (m_Segment, m_Offset);
+        tm.Stop();
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: %d modes from cache in %d ms, enumeration took %d ms\n",
+            __FUNCTION__, m_ModeCount, tm.Diff(), m_ModeCache->EnumTime));
+        return STATUS_SUCCESS;
+    }
+
    for (ModeCount = 0; ; ModeCount++)
    {
         /* Read the VBE mode number. */
@@ -2533,6 +3323,9 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     }
     RtlZeroMemory(m_ModeNumbers, sizeof (USHORT) * ModeCount);
 
+    // failing to allocate only disables the cache
+    pCacheModes = new (PagedPool) VBE_MODE_CACHE_ENTRY[ModeCount];
+
     m_CurrentMode = 0;
     DbgPrint(TRACE_LEVEL_INFORMATION, ("m_ModeInfo = 0x%p, m_ModeNumbers = 0x%p\n", m_ModeInfo, m_ModeNumbers));
     for (CurrentMode = 0, SuitableModeCount = 0;
@@ -2559,6 +3352,7 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
         if (!x86BiosCall (0x10, &regs))
         {
            DbgPrint(TRACE_LEVEL_ERROR, ("x86BiosCall failed\n"));
+           delete [] pCacheModes;
            return STATUS_UNSUCCESSFUL;
         }
         Status = x86BiosReadMemory (
@@ -2576,6 +3370,11 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
         {
             m_ModeNumbers[SuitableModeCount] = ModeTemp;
             SetVideoModeInfo(SuitableModeCount, &tmpModeInfo);
+            if (pCacheModes)
+            {
+                pCacheModes[SuitableModeCount].ModeNumber = ModeTemp;
+                pCacheModes[SuitableModeCount].ModeInfo = tmpModeInfo;
+            }
             if (tmpModeInfo.XResolution == MIN_WIDTH_SIZE &&
                 tmpModeInfo.YResolution == MIN_HEIGHT_SIZE)
             {
@@ -2606,10 +3405,272 @@ NTSTATUS VgaDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     {
         x86BiosFreeBuffer (m_Segment, m_Offset);
     }
+    tm.Stop();
+    DbgPrint(TRACE_LEVEL_WARNING, ("%s: %d modes enumerated in %d ms\n", __FUNCTION__, m_ModeCount, tm.Diff()));
+    if (pCacheModes && NT_SUCCESS(Status) && CacheKey.CacheVersion)
+    {
+        CacheKey.EnumTime = tm.Diff();
+        WriteModeCache(&CacheKey, pCacheModes, m_ModeCount);
+    }
+    delete [] pCacheModes;
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return Status;
 }
 
+NTSTATUS VgaDevice::GetModeCacheKey(PVBE_MODE_CACHE pKey, PVBE_INFO pVbeInfo, UINT BitsPerPixel)
+{
+    PAGED_CODE();
+    PDXGKRNL_INTERFACE pDxgkInterface = m_pQxlDod->GetDxgkInterface();
+    PCI_COMMON_HEADER Header = {0};
+    ULONG BytesRead;
+
+    RtlZeroMemory(pKey, sizeof(VBE_MODE_CACHE));
+    NTSTATUS Status = pDxgkInterface->DxgkCbReadDeviceSpace(pDxgkInterface->DeviceHandle,
+                                                   DXGK_WHICHSPACE_CONFIG,
+                                                   &Header,
+                                                   0,
+                                                   sizeof(Header),
+                                                   &BytesRead);
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("DxgkCbReadDeviceSpace failed with status 0x%X\n", Status));
+        return Status;
+    }
+
+    pKey->CacheVersion = VBE_MODE_CACHE_VERSION;
+    pKey->VendorID = Header.VendorID;
+    pKey->DeviceID = Header.DeviceID;
+    pKey->SubVendorID = Header.u.type0.SubVendorID;
+    pKey->SubSystemID = Header.u.type0.SubSystemID;
+    pKey->RevisionID = Header.RevisionID;
+    pKey->VbeVersion = pVbeInfo->Version;
+    pKey->TotalMemory = pVbeInfo->TotalMemory;
+    pKey->OemSoftwareRevision = pVbeInfo->OemSoftwareRevision;
+    pKey->BitsPerPixel = BitsPerPixel;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS VgaDevice::ReadModeCache(PVBE_MODE_CACHE pKey)
+{
+    PAGED_CODE();
+    HANDLE hKey;
+    UNICODE_STRING ValueName;
+    ULONG Length = 0;
+    PKEY_VALUE_PARTIAL_INFORMATION pInfo = NULL;
+    PVBE_MODE_CACHE pCache = NULL;
+
+    NTSTATUS Status = IoOpenDeviceRegistryKey(m_pQxlDod->GetPhysicalDevice(), PLUGPLAY_REGKEY_DRIVER, KEY_QUERY_VALUE, &hKey);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+    RtlInitUnicodeString(&ValueName, VBE_MODE_CACHE_VALUE);
+    Status = ZwQueryValueKey(hKey, &ValueName, KeyValuePartialInformation, NULL, 0, &Length);
+    if (Status == STATUS_BUFFER_TOO_SMALL || Status == STATUS_BUFFER_OVERFLOW)
+    {
+        pInfo = reinterpret_cast<PKEY_VALUE_PARTIAL_INFORMATION>(new (PagedPool) BYTE[Length]);
+        Status = pInfo ?
+            ZwQueryValueKey(hKey, &ValueName, KeyValuePartialInformation, pInfo, Length, &Length) :
+            STATUS_NO_MEMORY;
+    }
+    ZwClose(hKey);
+
+    if (NT_SUCCESS(Status))
+    {
+        pCache = reinterpret_cast<PVBE_MODE_CACHE>(pInfo->Data);
+        if (pInfo->Type != REG_BINARY ||
+            pInfo->DataLength < FIELD_OFFSET(VBE_MODE_CACHE, Modes) ||
+            !RtlEqualMemory(pCache, pKey, FIELD_OFFSET(VBE_MODE_CACHE, EnumTime)) ||
+            !pCache->ModeCount || pCache->ModeCount > VBE_MODE_CACHE_MAX ||
+            pInfo->DataLength < FIELD_OFFSET(VBE_MODE_CACHE, Modes) + pCache->ModeCount * sizeof(VBE_MODE_CACHE_ENTRY))
+        {
+            DbgPrint(TRACE_LEVEL_WARNING, ("%s: stale mode cache\n", __FUNCTION__));
+            Status = STATUS_REVISION_MISMATCH;
+        }
+    }
+    if (NT_SUCCESS(Status))
+    {
+        delete [] m_ModeInfo;
+        delete [] m_ModeNumbers;
+        m_ModeInfo = new (PagedPool) VIDEO_MODE_INFORMATION[pCache->ModeCount];
+        m_ModeNumbers = new (PagedPool) USHORT[pCache->ModeCount];
+        delete [] reinterpret_cast<BYTE*>(m_ModeCache);
+        m_ModeCache = reinterpret_cast<PVBE_MODE_CACHE>(new (PagedPool) BYTE[pInfo->DataLength]);
+        if (!m_ModeInfo || !m_ModeNumbers || !m_ModeCache)
+        {
+            Status = STATUS_NO_MEMORY;
+        }
+    }
+    if (NT_SUCCESS(Status))
+    {
+        RtlCopyMemory(m_ModeCache, pCache, pInfo->DataLength);
+        RtlZeroMemory(m_ModeInfo, sizeof (VIDEO_MODE_INFORMATION) * pCache->ModeCount);
+        m_CurrentMode = 0;
+        for (ULONG idx = 0; idx < pCache->ModeCount; idx++)
+        {
+            PVBE_MODEINFO pModeInfo = &pCache->Modes[idx].ModeInfo;
+            m_ModeNumbers[idx] = pCache->Modes[idx].ModeNumber;
+            SetVideoModeInfo(idx, pModeInfo);
+            if (pModeInfo->XResolution == MIN_WIDTH_SIZE &&
+                pModeInfo->YResolution == MIN_HEIGHT_SIZE)
+            {
+                m_CurrentMode = (USHORT)idx;
+            }
+        }
+        m_ModeCount = pCache->ModeCount;
+    }
+    else if (Status == STATUS_NO_MEMORY)
+    {
+        // GetModeList allocates the tables again
+        delete [] reinterpret_cast<BYTE*>(m_ModeCache);
+        m_ModeCache = NULL;
+    }
+    delete [] reinterpret_cast<BYTE*>(pInfo);
+    return Status;
+}
+
+VOID VgaDevice::WriteModeCache(PVBE_MODE_CACHE pKey, PVBE_MODE_CACHE_ENTRY pModes, ULONG ModeCount)
+{
+    PAGED_CODE();
+    HANDLE hKey;
+    UNICODE_STRING ValueName;
+    ULONG Length = FIELD_OFFSET(VBE_MODE_CACHE, Modes) + ModeCount * sizeof(VBE_MODE_CACHE_ENTRY);
+    PVBE_MODE_CACHE pCache;
+
+    if (!ModeCount || ModeCount > VBE_MODE_CACHE_MAX)
+    {
+        return;
+    }
+    pCache = reinterpret_cast<PVBE_MODE_CACHE>(new (PagedPool) BYTE[Length]);
+    if (!pCache)
+    {
+        return;
+    }
+    RtlCopyMemory(pCache, pKey, FIELD_OFFSET(VBE_MODE_CACHE, Modes));
+    pCache->ModeCount = ModeCount;
+    RtlCopyMemory(pCache->Modes, pModes, ModeCount * sizeof(VBE_MODE_CACHE_ENTRY));
+
+    NTSTATUS Status = IoOpenDeviceRegistryKey(m_pQxlDod->GetPhysicalDevice(), PLUGPLAY_REGKEY_DRIVER, KEY_SET_VALUE, &hKey);
+    if (NT_SUCCESS(Status))
+    {
+        RtlInitUnicodeString(&ValueName, VBE_MODE_CACHE_VALUE);
+        Status = ZwSetValueKey(hKey, &ValueName, 0, REG_BINARY, pCache, Length);
+        ZwClose(hKey);
+    }
+    if (!NT_SUCCESS(Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s failed with Status: 0x%X\n", __FUNCTION__, Status));
+    }
+    delete [] reinterpret_cast<BYTE*>(pCache);
+}
+
+VOID VgaDevice::InvalidateModeCache(VOID)
+{
+    PAGED_CODE();
+    HANDLE hKey;
+    UNICODE_STRING ValueName;
+
+    NTSTATUS Status = IoOpenDeviceRegistryKey(m_pQxlDod->GetPhysicalDevice(), PLUGPLAY_REGKEY_DRIVER, KEY_SET_VALUE, &hKey);
+    if (NT_SUCCESS(Status))
+    {
+        RtlInitUnicodeString(&ValueName, VBE_MODE_CACHE_VALUE);
+        ZwDeleteValueKey(hKey, &ValueName);
+        ZwClose(hKey);
+    }
+}
+
+// Checks a mode taken from the cache against the BIOS on its first use,
+// a mismatch refreshes the mode and drops the cache for the next start
+NTSTATUS VgaDevice::ValidateCachedMode(ULONG Mode)
+{
+    PAGED_CODE();
+    USHORT Segment;
+    USHORT Offset;
+    ULONG Length = sizeof(VBE_MODEINFO);
+    VBE_MODEINFO ModeInfo;
+    ULONG idx, pending = 0;
+    PVBE_MODE_CACHE_ENTRY pEntry = NULL;
+
+    if (!m_ModeCache)
+    {
+        return STATUS_SUCCESS;
+    }
+    for (idx = 0; idx < m_ModeCache->ModeCount; idx++)
+    {
+        if (m_ModeCache->Modes[idx].ModeNumber == Mode)
+        {
+            pEntry = &m_ModeCache->Modes[idx];
+            break;
+        }
+    }
+    if (!pEntry)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Status = x86BiosAllocateBuffer (&Length, &Segment, &Offset);
+    if (!NT_SUCCESS (Status))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("x86BiosAllocateBuffer failed with Status: 0x%X\n", Status));
+        return Status;
+    }
+    X86BIOS_REGISTERS regs = {0};
+    regs.Eax = 0x4F01;
+    regs.Ecx = Mode;
+    regs.Edi = Offset;
+    regs.SegEs = Segment;
+    if (!x86BiosCall (0x10, &regs))
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("x86BiosCall failed\n"));
+        Status = STATUS_UNSUCCESSFUL;
+    }
+    else
+    {
+        Status = x86BiosReadMemory (Segment, Offset, &ModeInfo, sizeof(VBE_MODEINFO));
+    }
+    x86BiosFreeBuffer (Segment, Offset);
+    if (!NT_SUCCESS (Status))
+    {
+        return Status;
+    }
+
+    if (ModeInfo.XResolution != pEntry->ModeInfo.XResolution ||
+        ModeInfo.YResolution != pEntry->ModeInfo.YResolution ||
+        ModeInfo.BitsPerPixel != pEntry->ModeInfo.BitsPerPixel ||
+        ModeInfo.NumberOfPlanes != pEntry->ModeInfo.NumberOfPlanes ||
+        ModeInfo.LinBytesPerScanLine != pEntry->ModeInfo.LinBytesPerScanLine ||
+        ModeInfo.PhysBasePtr != pEntry->ModeInfo.PhysBasePtr)
+    {
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: mode 0x%X changed (%dx%d@%d), dropping the cache\n", __FUNCTION__,
+            Mode, ModeInfo.XResolution, ModeInfo.YResolution, ModeInfo.BitsPerPixel));
+        InvalidateModeCache();
+        if (ModeInfo.XResolution != pEntry->ModeInfo.XResolution ||
+            ModeInfo.YResolution != pEntry->ModeInfo.YResolution ||
+            ModeInfo.BitsPerPixel != pEntry->ModeInfo.BitsPerPixel ||
+            ModeInfo.PhysBasePtr == 0)
+        {
+            // not the mode the OS asked for anymore
+            return STATUS_UNSUCCESSFUL;
+        }
+        SetVideoModeInfo(idx, &ModeInfo);
+    }
+
+    pEntry->ModeNumber = 0;
+    for (idx = 0; idx < m_ModeCache->ModeCount; idx++)
+    {
+        if (m_ModeCache->Modes[idx].ModeNumber)
+        {
+            pending++;
+        }
+    }
+    if (!pending)
+    {
+        delete [] reinterpret_cast<BYTE*>(m_ModeCache);
+        m_ModeCache = NULL;
+    }
+    return STATUS_SUCCESS;
+}
+
 NTSTATUS VgaDevice::QueryCurrentMode(PVIDEO_MODE RequestedMode)
 {
     PAGED_CODE();
@@ -2620,12 +3681,19 @@ NTSTATUS VgaDevice::QueryCurrentMode(PVIDEO_MODE RequestedMode)
     return Status;
 }
 
-NTSTATUS VgaDevice::SetCurrentMode(ULONG Mode)
+NTSTATUS VgaDevice::SetCurrentMode(ULONG Mode, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
 {
     PAGED_CODE();
+    UNREFERENCED_PARAMETER(SourceId);
 
     NTSTATUS Status = STATUS_SUCCESS;
     DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s Mode = %x\n", __FUNCTION__, Mode));
+    Status = ValidateCachedMode(Mode);
+    if (!NT_SUCCESS(Status))
+    {
+        return Status;
+    }
+    FlushPresents();
     X86BIOS_REGISTERS regs = {0};
     regs.Eax = 0x4F02;
     regs.Ebx = Mode | 0x000;
@@ -2690,6 +3758,14 @@ NTSTATUS VgaDevice::HWInit(PCM_RESOURCE_LIST pResList, DXGK_DISPLAY_INFORMATION*
     {
         pDispInfo->PhysicAddress.QuadPart = GetVgaFrameBuffer(*pResList);
     }
+    if (g_VgaAsyncPresent && !m_PresentThread)
+    {
+        NTSTATUS Status = StartPresentThread();
+        if (!NT_SUCCESS(Status))
+        {
+            DbgPrint(TRACE_LEVEL_ERROR, ("%s: no present thread (0x%X), presents are blitted in the call\n", __FUNCTION__, Status));
+        }
+    }
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return GetModeList(pDispInfo);
 }
@@ -2699,6 +3775,7 @@ NTSTATUS VgaDevice::HWClose(void)
     PAGED_CODE();
 
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    StopPresentThread();
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return STATUS_SUCCESS;
 }
@@ -2708,6 +3785,7 @@ NTSTATUS VgaDevice::SetPowerState(DEVICE_POWER_STATE DevicePowerState, DXGK_DISP
     PAGED_CODE();
 
     DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s\n", __FUNCTION__));
+    FlushPresents();
 
     X86BIOS_REGISTERS regs = {0};
     regs.Eax = 0x4F10;
@@ -2776,6 +3854,8 @@ VgaDevice::ExecutePresentDisplayOnly(
 
     PAGED_CODE();
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    UNREFERENCED_PARAMETER(SrcBytesPerPixel);
+    QXL_COUNT(Presents, 1);
 
     NTSTATUS Status = STATUS_SUCCESS;
 
@@ -2808,52 +3888,6 @@ VgaDevice::ExecutePresentDisplayOnly(
     ctx->Mdl              = NULL;
     ctx->DisplaySource    = this;
 
-    // Alternate between synch and asynch execution, for demonstrating 
-    // that a real hardware implementation can do either
-
-    {
-        // Map Source into kernel space, as Blt will be executed by system worker thread
-        UINT sizeToMap = SrcBytesPerPixel * ctx->SrcWidth * ctx->SrcHeight;
-
-        PMDL mdl = IoAllocateMdl((PVOID)SrcAddr, sizeToMap,  FALSE, FALSE, NULL);
-        if(!mdl)
-        {
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
-        KPROCESSOR_MODE AccessMode = static_cast<KPROCESSOR_MODE>(( SrcAddr <=
-                        (BYTE* const) MM_USER_PROBE_ADDRESS)?UserMode:KernelMode);
-        __try
-        {
-            // Probe and lock the pages of this buffer in physical memory.
-            // We need only IoReadAccess.
-            MmProbeAndLockPages(mdl, AccessMode, IoReadAccess);
-        }
-        #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
-        __except(EXCEPTION_EXECUTE_HANDLER)
-        {
-            Status = GetExceptionCode();
-            IoFreeMdl(mdl);
-            return Status;
-        }
-
-        // Map the physical pages described by the MDL into system space.
-        // Note: double mapping the buffer this way causes lot of system
-        // overhead for large size buffers.
-        ctx->SrcAddr = reinterpret_cast<BYTE*>
-            (MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
-
-        if(!ctx->SrcAddr) {
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            MmUnlockPages(mdl);
-            IoFreeMdl(mdl);
-            return Status;
-        }
-
-        // Save Mdl to unmap and unlock the pages in worker thread
-        ctx->Mdl = mdl;
-    }
-
     BYTE* rects = reinterpret_cast<BYTE*>(ctx+1);
 
     // copy moves and update pointer
@@ -2882,9 +3916,9 @@ VgaDevice::ExecutePresentDisplayOnly(
     DstBltInfo.Width = ctx->SrcWidth;
     DstBltInfo.Height = ctx->SrcHeight;
 
-    // Set up source blt info
+    // Set up source blt info, the rows of each rect are mapped below
     BLT_INFO SrcBltInfo;
-    SrcBltInfo.pBits = ctx->SrcAddr;
+    SrcBltInfo.pBits = NULL;
     SrcBltInfo.Pitch = ctx->SrcPitch;
     SrcBltInfo.BitsPerPel = 32;
     SrcBltInfo.Offset.x = 0;
@@ -2902,128 +3936,467 @@ VgaDevice::ExecutePresentDisplayOnly(
         SrcBltInfo.Height = DstBltInfo.Height;
     }
 
+    // Source bitmap is in user mode: lock and map only the rows the
+    // present reads, those of the dirty rects and of the moves when they
+    // are rotated
+    SOURCE_MAP SrcMap;
+    Status = MapSourceRects(SrcAddr, ctx->SrcPitch, SrcBltInfo.Height,
+                            ctx->NumDirtyRects, ctx->DirtyRect,
+                            ctx->Rotation != D3DKMDT_VPPR_IDENTITY ? ctx->NumMoves : 0, ctx->Moves,
+                            &SrcMap);
+    if (!NT_SUCCESS(Status))
+    {
+        delete [] reinterpret_cast<BYTE*>(ctx);
+        return Status;
+    }
+    QXL_COUNT(SourcePages, SrcMap.Pages);
+    QXL_COUNT(SourcePagesWhole, SrcMap.WholePages);
+    QXL_COUNT(SourceMdls, SrcMap.NumBands);
 
-    // Copy all the scroll rects from source image to video frame buffer.
+    // With the present thread running, stage the present for it and
+    // leave the copies below nothing to do
+    if (m_PresentThread &&
+        StagePresent(&DstBltInfo, &SrcMap, &SrcBltInfo, ctx->NumMoves, ctx->Moves, ctx->NumDirtyRects, ctx->DirtyRect))
+    {
+        ctx->NumMoves = 0;
+        ctx->NumDirtyRects = 0;
+    }
+
+    // Apply the scroll rects in order. Unrotated, the pixels are already in
+    // the video frame buffer: move them there and leave the source alone,
+    // the strips they uncover come as dirty rects. Rotated, copy them from
+    // the source image.
     for (UINT i = 0; i < ctx->NumMoves; i++)
     {
+        if (ctx->Rotation == D3DKMDT_VPPR_IDENTITY)
+        {
+            MoveBits(&DstBltInfo, &ctx->Moves[i]);
+            continue;
+        }
         RECT*    pDestRect = &ctx->Moves[i].DestRect;
-        BltBits(&DstBltInfo,
-        &SrcBltInfo,
-        1, // NumRects
-        pDestRect);
+        BLT_INFO RectBltInfo = SourceBltInfo(&SrcMap, &SrcBltInfo, pDestRect);
+        if (RectBltInfo.pBits)
+        {
+            BltBits(&DstBltInfo,
+            &RectBltInfo,
+            1, // NumRects
+            pDestRect);
+        }
     }
 
     // Copy all the dirty rects from source image to video frame buffer.
     for (UINT i = 0; i < ctx->NumDirtyRects; i++)
     {
         RECT*    pDirtyRect = &ctx->DirtyRect[i];
-        BltBits(&DstBltInfo,
-        &SrcBltInfo,
-        1, // NumRects
-        pDirtyRect);
+        BLT_INFO RectBltInfo = SourceBltInfo(&SrcMap, &SrcBltInfo, pDirtyRect);
+        if (RectBltInfo.pBits)
+        {
+            BltBits(&DstBltInfo,
+            &RectBltInfo,
+            1, // NumRects
+            pDirtyRect);
+        }
     } 
 
     // Unmap unmap and unlock the pages.
-    if (ctx->Mdl)
-    {
-        MmUnlockPages(ctx->Mdl);
-        IoFreeMdl(ctx->Mdl);
-    }
+    UnmapSourceRects(&SrcMap);
     delete [] reinterpret_cast<BYTE*>(ctx);
 
     return STATUS_SUCCESS;
 }
 
-VOID VgaDevice::BlackOutScreen(CURRENT_BDD_MODE* pCurrentBddMod)
+static SIZE_T StagedBytes(CONST RECT* pRect)
 {
-    PAGED_CODE();
-
-    UINT ScreenHeight = pCurrentBddMod->DispInfo.Height;
-    UINT ScreenPitch = pCurrentBddMod->DispInfo.Pitch;
-
-    PHYSICAL_ADDRESS NewPhysAddrStart = pCurrentBddMod->DispInfo.PhysicAddress;
-    PHYSICAL_ADDRESS NewPhysAddrEnd;
-    NewPhysAddrEnd.QuadPart = NewPhysAddrStart.QuadPart + (ScreenHeight * ScreenPitch);
-
-    if (pCurrentBddMod->Flags.FrameBufferIsActive)
+    if (pRect->right <= pRect->left || pRect->bottom <= pRect->top)
     {
-        BYTE* MappedAddr = reinterpret_cast<BYTE*>(pCurrentBddMod->FrameBuffer.Ptr);
-
-        // Zero any memory at the start that hasn't been zeroed recently
-        if (NewPhysAddrStart.QuadPart < pCurrentBddMod->ZeroedOutStart.QuadPart)
-        {
-            if (NewPhysAddrEnd.QuadPart < pCurrentBddMod->ZeroedOutStart.QuadPart)
-            {
-                // No overlap
-                RtlZeroMemory(MappedAddr, ScreenHeight * ScreenPitch);
-            }
-            else
-            {
-                RtlZeroMemory(MappedAddr, (UINT)(pCurrentBddMod->ZeroedOutStart.QuadPart - NewPhysAddrStart.QuadPart));
-            }
-        }
-
-        // Zero any memory at the end that hasn't been zeroed recently
-        if (NewPhysAddrEnd.QuadPart > pCurrentBddMod->ZeroedOutEnd.QuadPart)
-        {
-            if (NewPhysAddrStart.QuadPart > pCurrentBddMod->ZeroedOutEnd.QuadPart)
-            {
-                // No overlap
-                // NOTE: When actual pixels were the most recent thing drawn, ZeroedOutStart & ZeroedOutEnd will both be 0
-                // and this is the path that will be used to black out the current screen.
-                RtlZeroMemory(MappedAddr, ScreenHeight * ScreenPitch);
-            }
-            else
-            {
-                RtlZeroMemory(MappedAddr, (UINT)(NewPhysAddrEnd.QuadPart - pCurrentBddMod->ZeroedOutEnd.QuadPart));
-            }
-        }
+        return 0;
     }
-
-    pCurrentBddMod->ZeroedOutStart.QuadPart = NewPhysAddrStart.QuadPart;
-    pCurrentBddMod->ZeroedOutEnd.QuadPart = NewPhysAddrEnd.QuadPart;
+    return (SIZE_T)(pRect->right - pRect->left) * (pRect->bottom - pRect->top) * 4;
 }
 
-QXL_NON_PAGED
-BOOLEAN VgaDevice::InterruptRoutine(_In_ PDXGKRNL_INTERFACE pDxgkInterface, _In_  ULONG MessageNumber)
+// the staged pixels of a rect, packed 32bpp rows addressed with the
+// coordinates of the rect
+static BLT_INFO StagedBltInfo(CONST VgaPresentFrame* pFrame, CONST VgaPresentOp* pOp)
 {
-    UNREFERENCED_PARAMETER(pDxgkInterface);
-    UNREFERENCED_PARAMETER(MessageNumber);
-    return FALSE;
+    BLT_INFO Info;
+    Info.pBits = pFrame->Staging + pOp->Offset;
+    Info.Pitch = (pOp->Rect.right - pOp->Rect.left) * 4;
+    Info.BitsPerPel = 32;
+    Info.Offset.x = -pOp->Rect.left;
+    Info.Offset.y = -pOp->Rect.top;
+    Info.Rotation = D3DKMDT_VPPR_IDENTITY;
+    Info.Width = pOp->Rect.right - pOp->Rect.left;
+    Info.Height = pOp->Rect.bottom - pOp->Rect.top;
+    return Info;
 }
 
-QXL_NON_PAGED
-VOID VgaDevice::DpcRoutine(PVOID)
+static BOOLEAN SameBltTarget(CONST BLT_INFO* a, CONST BLT_INFO* b)
 {
+    return a->pBits == b->pBits && a->Pitch == b->Pitch && a->BitsPerPel == b->BitsPerPel &&
+           a->Rotation == b->Rotation && a->Width == b->Width && a->Height == b->Height;
 }
 
-QXL_NON_PAGED
-VOID VgaDevice::ResetDevice(VOID)
+static VOID StageRect(VgaPresentFrame* pFrame, CONST SOURCE_MAP* pMap, CONST BLT_INFO* pSrc, CONST RECT* pRect)
 {
+    BLT_INFO RectBltInfo = SourceBltInfo(pMap, pSrc, pRect);
+    if (!StagedBytes(pRect) || !RectBltInfo.pBits)
+    {
+        return;
+    }
+    VgaPresentOp* pOp = &pFrame->Ops[pFrame->NumOps++];
+    pOp->Rect = *pRect;
+    pOp->bMove = FALSE;
+    pOp->Offset = pFrame->Used;
+    BLT_INFO Staged = StagedBltInfo(pFrame, pOp);
+    BltBits(&Staged, &RectBltInfo, 1, pRect);
+    pFrame->Used += StagedBytes(pRect);
 }
 
-NTSTATUS VgaDevice::AcquireFrameBuffer(CURRENT_BDD_MODE* pCurrentBddMode)
+BOOLEAN VgaDevice::StagePresent(CONST BLT_INFO* pDst, CONST SOURCE_MAP* pMap, CONST BLT_INFO* pSrc, ULONG NumMoves,
+                                CONST D3DKMT_MOVE_RECT* pMoves, ULONG NumDirtyRects, CONST RECT* pDirtyRect)
+/*++
+
+  Routine Description:
+
+    Copies the dirty pixels of a present to the pending frame of the
+    present worker, with the moves, and wakes it up. A present that comes
+    before the worker took the previous one is added to it, up to a
+    screen of pixels; past that, or for another destination, the call
+    waits for the worker to finish.
+
+  Return Value:
+
+    FALSE when the present is small and the worker idle, or when the
+    staging buffers cannot grow; the worker is done then and the caller
+    blits the present itself
+
+--*/
 {
     PAGED_CODE();
-    if (pCurrentBddMode->Flags.DoNotMapOrUnmap) {
-        return STATUS_UNSUCCESSFUL;
-    }
+    BOOLEAN bRotated = (pDst->Rotation != D3DKMDT_VPPR_IDENTITY);
+    UINT NumOps = NumMoves + NumDirtyRects;
+    SIZE_T MaxBytes = (SIZE_T)pSrc->Width * pSrc->Height * 4;
+    SIZE_T Bytes = 0;
+    SIZE_T MovedBytes = 0;
 
-    // Map the new frame buffer
-    QXL_ASSERT(pCurrentBddMode->FrameBuffer.Ptr == NULL);
-    NTSTATUS status = MapFrameBuffer(pCurrentBddMode->DispInfo.PhysicAddress,
-        pCurrentBddMode->DispInfo.Pitch * pCurrentBddMode->DispInfo.Height,
-        &(pCurrentBddMode->FrameBuffer.Ptr));
-    if (NT_SUCCESS(status))
+    // rotated, the moves are copied from the source like dirty rects
+    for (ULONG i = 0; i < NumMoves; i++)
     {
-        pCurrentBddMode->Flags.FrameBufferIsActive = TRUE;
-    }
+        if (bRotated)
+        {
+            Bytes += StagedBytes(&pMoves[i].DestRect);
+        }
+        else
+        {
+            MovedBytes += StagedBytes(&pMoves[i].DestRect);
+        }
+    }
+    for (ULONG i = 0; i < NumDirtyRects; i++)
+    {
+        Bytes += StagedBytes(&pDirtyRect[i]);
+    }
+
+    BOOLEAN locked = WaitForObject(&m_PresentLock, NULL);
+    VgaPresentFrame* pFrame = &m_Frames[m_PendingFrame];
+    if (!pFrame->NumOps && !m_bBlitting && Bytes + MovedBytes < VGA_ASYNC_MIN_BYTES)
+    {
+        ReleaseMutex(&m_PresentLock, locked);
+        QXL_COUNT(VgaPresentsSync, 1);
+        return FALSE;
+    }
+    if (pFrame->NumOps &&
+        (!SameBltTarget(&pFrame->Dst, pDst) || pFrame->Used + Bytes > MaxBytes))
+    {
+        ReleaseMutex(&m_PresentLock, locked);
+        FlushPresents();
+        locked = WaitForObject(&m_PresentLock, NULL);
+        pFrame = &m_Frames[m_PendingFrame];
+    }
+
+    if (pFrame->NumOps + NumOps > pFrame->MaxOps)
+    {
+        UINT MaxOps = max(max(pFrame->NumOps + NumOps, pFrame->MaxOps * 2), 64);
+        VgaPresentOp* pOps = new (PagedPool, NoInit) VgaPresentOp[MaxOps];
+        if (!pOps)
+        {
+            ReleaseMutex(&m_PresentLock, locked);
+            FlushPresents();
+            QXL_COUNT(VgaPresentsSync, 1);
+            return FALSE;
+        }
+        if (pFrame->NumOps)
+        {
+            RtlCopyMemory(pOps, pFrame->Ops, pFrame->NumOps * sizeof(VgaPresentOp));
+        }
+        delete [] pFrame->Ops;
+        pFrame->Ops = pOps;
+        pFrame->MaxOps = MaxOps;
+    }
+    if (pFrame->Used + Bytes > pFrame->Size)
+    {
+        SIZE_T Size = max(pFrame->Used + Bytes, pFrame->Size * 2);
+        BYTE* pStaging = new (PagedPool, NoInit) BYTE[Size];
+        if (!pStaging)
+        {
+            ReleaseMutex(&m_PresentLock, locked);
+            FlushPresents();
+            QXL_COUNT(VgaPresentsSync, 1);
+            return FALSE;
+        }
+        if (pFrame->Used)
+        {
+            RtlCopyMemory(pStaging, pFrame->Staging, pFrame->Used);
+        }
+        delete [] pFrame->Staging;
+        pFrame->Staging = pStaging;
+        pFrame->Size = Size;
+    }
+
+    pFrame->Dst = *pDst;
+    for (ULONG i = 0; i < NumMoves; i++)
+    {
+        if (bRotated)
+        {
+            StageRect(pFrame, pMap, pSrc, &pMoves[i].DestRect);
+            continue;
+        }
+        VgaPresentOp* pOp = &pFrame->Ops[pFrame->NumOps++];
+        pOp->Rect = pMoves[i].DestRect;
+        pOp->SourcePoint = pMoves[i].SourcePoint;
+        pOp->bMove = TRUE;
+    }
+    for (ULONG i = 0; i < NumDirtyRects; i++)
+    {
+        StageRect(pFrame, pMap, pSrc, &pDirtyRect[i]);
+    }
+    if (pFrame->Presents++)
+    {
+        QXL_COUNT(VgaPresentsCoalesced, 1);
+    }
+    QXL_COUNT(VgaPresentsStaged, 1);
+    ReleaseMutex(&m_PresentLock, locked);
+    KeSetEvent(&m_PresentEvent, IO_NO_INCREMENT, FALSE);
+    return TRUE;
+}
+
+VOID VgaDevice::FlushPresents(VOID)
+{
+    PAGED_CODE();
+    if (!m_PresentThread)
+    {
+        return;
+    }
+    BOOLEAN locked = WaitForObject(&m_PresentLock, NULL);
+    BOOLEAN bBusy = m_bBlitting || m_Frames[m_PendingFrame].NumOps;
+    if (bBusy)
+    {
+        KeClearEvent(&m_PresentIdleEvent);
+    }
+    ReleaseMutex(&m_PresentLock, locked);
+    if (bBusy)
+    {
+        KeSetEvent(&m_PresentEvent, IO_NO_INCREMENT, FALSE);
+        WaitForObject(&m_PresentIdleEvent, NULL);
+    }
+}
+
+VOID VgaDevice::PresentThreadRoutine(VOID)
+{
+    PAGED_CODE();
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s\n", __FUNCTION__));
+    for (;;)
+    {
+        BOOLEAN locked = WaitForObject(&m_PresentLock, NULL);
+        VgaPresentFrame* pFrame = &m_Frames[m_PendingFrame];
+        if (!pFrame->NumOps)
+        {
+            BOOLEAN bStop = m_bStopPresent;
+            KeSetEvent(&m_PresentIdleEvent, IO_NO_INCREMENT, FALSE);
+            ReleaseMutex(&m_PresentLock, locked);
+            if (bStop)
+            {
+                break;
+            }
+            WaitForObject(&m_PresentEvent, NULL);
+            continue;
+        }
+        // the DDI stages the next presents in the other frame meanwhile
+        m_PendingFrame ^= 1;
+        m_bBlitting = TRUE;
+        ReleaseMutex(&m_PresentLock, locked);
+
+        for (UINT i = 0; i < pFrame->NumOps; i++)
+        {
+            CONST VgaPresentOp* pOp = &pFrame->Ops[i];
+            if (pOp->bMove)
+            {
+                D3DKMT_MOVE_RECT Move;
+                Move.SourcePoint = pOp->SourcePoint;
+                Move.DestRect = pOp->Rect;
+                MoveBits(&pFrame->Dst, &Move);
+                continue;
+            }
+            BLT_INFO Staged = StagedBltInfo(pFrame, pOp);
+            BltBits(&pFrame->Dst, &Staged, 1, &pOp->Rect);
+        }
+        pFrame->NumOps = 0;
+        pFrame->Used = 0;
+        pFrame->Presents = 0;
+
+        locked = WaitForObject(&m_PresentLock, NULL);
+        m_bBlitting = FALSE;
+        ReleaseMutex(&m_PresentLock, locked);
+    }
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
+}
+
+NTSTATUS VgaDevice::StartPresentThread(VOID)
+{
+    PAGED_CODE();
+    OBJECT_ATTRIBUTES ObjectAttributes;
+
+    m_bStopPresent = FALSE;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    NTSTATUS Status = PsCreateSystemThread(
+        &m_PresentThread,
+        THREAD_ALL_ACCESS,
+        &ObjectAttributes,
+        NULL,
+        NULL,
+        PresentThreadRoutineWrapper,
+        this);
+    if (!NT_SUCCESS(Status))
+    {
+        m_PresentThread = NULL;
+    }
+    return Status;
+}
+
+VOID VgaDevice::StopPresentThread(VOID)
+{
+    PAGED_CODE();
+    PVOID pDispatcherObject;
+
+    if (!m_PresentThread)
+    {
+        return;
+    }
+    // the worker blits what is staged before it stops
+    BOOLEAN locked = WaitForObject(&m_PresentLock, NULL);
+    m_bStopPresent = TRUE;
+    ReleaseMutex(&m_PresentLock, locked);
+    KeSetEvent(&m_PresentEvent, IO_NO_INCREMENT, FALSE);
+    NTSTATUS Status = ObReferenceObjectByHandle(
+        m_PresentThread, 0, NULL, KernelMode, &pDispatcherObject, NULL);
+    if (NT_SUCCESS(Status))
+    {
+        WaitForObject(pDispatcherObject, NULL);
+        ObDereferenceObject(pDispatcherObject);
+    }
+    ZwClose(m_PresentThread);
+    m_PresentThread = NULL;
+
+    for (UINT i = 0; i < ARRAYSIZE(m_Frames); i++)
+    {
+        delete [] m_Frames[i].Ops;
+        delete [] m_Frames[i].Staging;
+    }
+    RtlZeroMemory(m_Frames, sizeof(m_Frames));
+    m_PendingFrame = 0;
+}
+
+VOID VgaDevice::BlackOutScreen(CURRENT_BDD_MODE* pCurrentBddMod)
+{
+    PAGED_CODE();
+    FlushPresents();
+
+    UINT ScreenHeight = pCurrentBddMod->DispInfo.Height;
+    UINT ScreenPitch = pCurrentBddMod->DispInfo.Pitch;
+
+    PHYSICAL_ADDRESS NewPhysAddrStart = pCurrentBddMod->DispInfo.PhysicAddress;
+    PHYSICAL_ADDRESS NewPhysAddrEnd;
+    NewPhysAddrEnd.QuadPart = NewPhysAddrStart.QuadPart + (ScreenHeight * ScreenPitch);
+
+    if (pCurrentBddMod->Flags.FrameBufferIsActive)
+    {
+        BYTE* MappedAddr = reinterpret_cast<BYTE*>(pCurrentBddMod->FrameBuffer.Ptr);
+
+        // Zero any memory at the start that hasn't been zeroed recently
+        if (NewPhysAddrStart.QuadPart < pCurrentBddMod->ZeroedOutStart.QuadPart)
+        {
+            if (NewPhysAddrEnd.QuadPart < pCurrentBddMod->ZeroedOutStart.QuadPart)
+            {
+                // No overlap
+                RtlZeroMemory(MappedAddr, ScreenHeight * ScreenPitch);
+            }
+            else
+            {
+                RtlZeroMemory(MappedAddr, (UINT)(pCurrentBddMod->ZeroedOutStart.QuadPart - NewPhysAddrStart.QuadPart));
+            }
+        }
+
+        // Zero any memory at the end that hasn't been zeroed recently
+        if (NewPhysAddrEnd.QuadPart > pCurrentBddMod->ZeroedOutEnd.QuadPart)
+        {
+            if (NewPhysAddrStart.QuadPart > pCurrentBddMod->ZeroedOutEnd.QuadPart)
+            {
+                // No overlap
+                // NOTE: When actual pixels were the most recent thing drawn, ZeroedOutStart & ZeroedOutEnd will both be 0
+                // and this is the path that will be used to black out the current screen.
+                RtlZeroMemory(MappedAddr, ScreenHeight * ScreenPitch);
+            }
+            else
+            {
+                RtlZeroMemory(MappedAddr, (UINT)(NewPhysAddrEnd.QuadPart - pCurrentBddMod->ZeroedOutEnd.QuadPart));
+            }
+        }
+    }
+
+    pCurrentBddMod->ZeroedOutStart.QuadPart = NewPhysAddrStart.QuadPart;
+    pCurrentBddMod->ZeroedOutEnd.QuadPart = NewPhysAddrEnd.QuadPart;
+}
+
+QXL_NON_PAGED
+BOOLEAN VgaDevice::InterruptRoutine(_In_ PDXGKRNL_INTERFACE pDxgkInterface, _In_  ULONG MessageNumber)
+{
+    UNREFERENCED_PARAMETER(pDxgkInterface);
+    UNREFERENCED_PARAMETER(MessageNumber);
+    return FALSE;
+}
+
+QXL_NON_PAGED
+VOID VgaDevice::DpcRoutine(PVOID)
+{
+}
+
+QXL_NON_PAGED
+VOID VgaDevice::ResetDevice(VOID)
+{
+}
+
+NTSTATUS VgaDevice::AcquireFrameBuffer(CURRENT_BDD_MODE* pCurrentBddMode)
+{
+    PAGED_CODE();
+    if (pCurrentBddMode->Flags.DoNotMapOrUnmap) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    // Map the new frame buffer
+    QXL_ASSERT(pCurrentBddMode->FrameBuffer.Ptr == NULL);
+    NTSTATUS status = MapFrameBuffer(pCurrentBddMode->DispInfo.PhysicAddress,
+        pCurrentBddMode->DispInfo.Pitch * pCurrentBddMode->DispInfo.Height,
+        &(pCurrentBddMode->FrameBuffer.Ptr));
+    if (NT_SUCCESS(status))
+    {
+        pCurrentBddMode->Flags.FrameBufferIsActive = TRUE;
+    }
     return status;
 }
 
 NTSTATUS VgaDevice::ReleaseFrameBuffer(CURRENT_BDD_MODE* pCurrentBddMode)
 {
     PAGED_CODE();
+    FlushPresents();
     NTSTATUS status = UnmapFrameBuffer(pCurrentBddMode->FrameBuffer.Ptr, pCurrentBddMode->DispInfo.Height * pCurrentBddMode->DispInfo.Pitch);
     pCurrentBddMode->FrameBuffer.Ptr = NULL;
     pCurrentBddMode->Flags.FrameBufferIsActive = FALSE;
@@ -3047,9 +4420,24 @@ NTSTATUS VgaDevice::SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pS
 NTSTATUS VgaDevice::Escape(_In_ CONST DXGKARG_ESCAPE* pEscap)
 {
     PAGED_CODE();
+    QXLEscape* pQXLEscape = (QXLEscape*)pEscap->pPrivateDriverData;
+    NTSTATUS Status = STATUS_NOT_IMPLEMENTED;
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    // only the counters, there is no device memory to report
+    if (pEscap->PrivateDriverDataSize >= sizeof(uint32_t) && pQXLEscape->ioctl == QXL_ESCAPE_GET_STATS)
+    {
+        if (pEscap->PrivateDriverDataSize < sizeof(uint32_t) + FIELD_OFFSET(QXLEscapeStats, presents))
+        {
+            Status = STATUS_INVALID_BUFFER_SIZE;
+        }
+        else
+        {
+            GetStats(&pQXLEscape->stats, pEscap->PrivateDriverDataSize - sizeof(uint32_t));
+            Status = STATUS_SUCCESS;
+        }
+    }
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
-    return STATUS_NOT_IMPLEMENTED;
+    return Status;
 }
 
 QxlDevice::QxlDevice(_In_ QxlDod* pQxlDod)
@@ -3060,11 +4448,39 @@ QxlDevice::QxlDevice(_In_ QxlDod* pQxlDod)
     m_ModeCount = 0;
     m_ModeNumbers = NULL;
     m_CurrentMode = 0;
-    m_CustomMode = 0;
+    m_CustomModeBase = 0;
+    ResetCustomModes();
     m_FreeOutputs = 0;
     m_Pending = 0;
-    m_PresentThread = NULL;
     m_bActive = FALSE;
+    RtlZeroMemory(m_Heads, sizeof(m_Heads));
+    m_ConnectedHeads = 1;
+    m_PrimaryWidth = m_PrimaryHeight = m_PrimaryFormat = 0;
+    m_SurfaceBpp = QXL_BPP;
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        m_Heads[i].id = i;
+        m_PresentWorkers[i].thread = NULL;
+        m_PresentWorkers[i].blackouts = 0;
+        m_PresentWorkers[i].blackout_pending = 0;
+        m_PresentWorkers[i].dev = this;
+    }
+    ResetCursorCache();
+    m_PendingMove = NULL;
+    RtlZeroMemory(&m_Counters, sizeof(m_Counters));
+    m_PendingMoveProd = 0;
+    m_CursorOpsPending = 0;
+    m_PointerVisible = 0;
+    RtlZeroMemory(m_Offscreen, sizeof(m_Offscreen));
+    m_NumOffscreen = 0;
+    m_NumOffscreenCmds = 0;
+    InitializeListHead(&m_OffscreenLru);
+    m_ClientMonitorsPending = 0;
+    m_bClientMonitorsValid = FALSE;
+    RtlZeroMemory(m_Headless, sizeof(m_Headless));
+    InitializeListHead(&m_CmdQueue);
+    InitializeListHead(&m_CmdQueueFree);
+    m_CmdQueueDepth = 0;
 }
 
 QxlDevice::~QxlDevice(void)
@@ -3157,7 +4573,7 @@ NTSTATUS QxlDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
     m_ModeInfo = NULL;
     m_ModeNumbers = NULL;
 
-    ModeCount += 2;
+    ModeCount += CUSTOM_MODE_COUNT;
     m_ModeInfo = new (PagedPool) VIDEO_MODE_INFORMATION[ModeCount];
     if (!m_ModeInfo)
     {
@@ -3188,6 +4604,23 @@ NTSTATUS QxlDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
         BitsPerPixel = QXL_BPP;
     }
 
+    // a 16bpp primary surface needs the ROM to list 16bpp modes
+    m_SurfaceBpp = QXL_BPP;
+    for (CurrentMode = 0;
+         g_SurfaceBpp != QXL_BPP && CurrentMode < modes->n_modes;
+         CurrentMode++)
+    {
+        if (modes->modes[CurrentMode].bits == g_SurfaceBpp)
+        {
+            m_SurfaceBpp = g_SurfaceBpp;
+            break;
+        }
+    }
+    if (m_SurfaceBpp != g_SurfaceBpp)
+    {
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: no %d bpp modes, using %d bpp\n", __FUNCTION__, g_SurfaceBpp, m_SurfaceBpp));
+    }
+
     for (CurrentMode = 0, SuitableModeCount = 0;
          CurrentMode < modes->n_modes;
          CurrentMode++)
@@ -3199,7 +4632,7 @@ NTSTATUS QxlDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
 
         if (tmpModeInfo->x_res >= MIN_WIDTH_SIZE &&
             tmpModeInfo->y_res >= MIN_HEIGHT_SIZE &&
-            tmpModeInfo->bits == QXL_BPP)
+            tmpModeInfo->bits == m_SurfaceBpp)
         {
             m_ModeNumbers[SuitableModeCount] = SuitableModeCount;
             SetVideoModeInfo(SuitableModeCount, tmpModeInfo);
@@ -3218,15 +4651,22 @@ NTSTATUS QxlDevice::GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo)
         Status = STATUS_UNSUCCESSFUL;
     }
 
-    m_CustomMode = SuitableModeCount;
+    // custom sizes survive the mode list being rebuilt, free slots
+    // repeat the default mode
+    m_CustomModeBase = SuitableModeCount;
     for (CurrentMode = SuitableModeCount;
-         CurrentMode < SuitableModeCount + 2;
+         CurrentMode < SuitableModeCount + CUSTOM_MODE_COUNT;
          CurrentMode++)
     {
+        CustomMode *mode = &m_CustomModes[CurrentMode - SuitableModeCount];
         m_ModeNumbers[CurrentMode] = CurrentMode;
         memcpy(&m_ModeInfo[CurrentMode], &m_ModeInfo[m_CurrentMode], sizeof(VIDEO_MODE_INFORMATION));
+        if (mode->xres)
+        {
+            UpdateVideoModeInfo(CurrentMode, mode->xres, mode->yres, m_SurfaceBpp);
+        }
     }
-    m_ModeCount = SuitableModeCount + 2;
+    m_ModeCount = SuitableModeCount + CUSTOM_MODE_COUNT;
     DbgPrint(TRACE_LEVEL_INFORMATION, ("ModeCount filtered %d\n", m_ModeCount));
     for (ULONG idx = 0; idx < GetModeCount(); idx++)
     {
@@ -3266,42 +4706,135 @@ __forceinline QxlPresentOperation *BuildQxlOperation(Closure &&closure)
     return new (PagedPool) QxlGenericOperation<Closure>(closure);
 }
 
-NTSTATUS QxlDevice::SetCurrentMode(ULONG Mode)
+NTSTATUS QxlDevice::SetCurrentMode(ULONG Mode, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s - %d: Mode = %d\n", __FUNCTION__, m_Id, Mode));
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s - %d: Mode = %d, source %d\n", __FUNCTION__, m_Id, Mode, SourceId));
+    BOOLEAN modeLocked = WaitForObject(&m_ModeLock, NULL);
     for (ULONG idx = 0; idx < GetModeCount(); idx++)
     {
         if (Mode == m_ModeNumbers[idx])
         {
-            if (!m_PresentThread)
+            if (!m_PresentWorkers[0].thread)
                 break;
             DbgPrint(TRACE_LEVEL_INFORMATION, ("%s device %d: setting current mode %d (%d x %d)\n",
                 __FUNCTION__, m_Id, Mode, m_ModeInfo[idx].VisScreenWidth,
                 m_ModeInfo[idx].VisScreenHeight));
 
-            // execute the operation in the worker thread to avoiding
-            // executing drawing commands while changing resolution
-            KEVENT finishEvent;
-            KeInitializeEvent(&finishEvent, SynchronizationEvent, FALSE);
-            ++m_DrawGeneration;
-            QxlPresentOperation *operation = BuildQxlOperation([=, this, &finishEvent]() {
-                PAGED_CODE();
+            // the primary surface is shared by all heads, hold the command
+            // ring so that workers either push their drawables before the
+            // change or check them against the new layout
+            BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+            QXLHead heads[MAX_VIEWS];
+            VIDEO_MODE_INFORMATION ModeInfo = m_ModeInfo[idx];
+            ULONG width, height;
+            RtlCopyMemory(heads, m_Heads, sizeof(heads));
+            m_Heads[SourceId].width = ModeInfo.VisScreenWidth;
+            m_Heads[SourceId].height = ModeInfo.VisScreenHeight;
+            if (!LayoutHeads(&width, &height))
+            {
+                RtlCopyMemory(m_Heads, heads, sizeof(heads));
+                ReleaseMutex(&m_CmdLock, locked);
+                break;
+            }
+            ModeInfo.VisScreenWidth = width;
+            ModeInfo.VisScreenHeight = height;
+            ModeInfo.ScreenStride = width * ModeInfo.BitsPerPlane / BITS_PER_BYTE;
+
+            BOOLEAN bMoved = FALSE;
+            for (UINT i = 0; i < MAX_VIEWS; ++i)
+            {
+                bMoved |= heads[i].x != m_Heads[i].x;
+            }
+            if (m_PrimaryWidth == width && m_PrimaryHeight == height &&
+                m_PrimaryFormat == ModeInfo.BitsPerPlane && !bMoved)
+            {
+                DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: primary surface unchanged\n", __FUNCTION__));
+            }
+            else if (m_PrimaryWidth && m_PrimaryFormat == ModeInfo.BitsPerPlane)
+            {
+                // size or layout change, LayoutHeads checked it against
+                // surface0_area_size. The device has no resize command,
+                // the surface is recreated on the same memory and memslot
+                // with the other heads moved to their new place in it, and
+                // queued drawables stay with the workers
+                DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: resizing primary surface %dx%d -> %dx%d\n",
+                    __FUNCTION__, m_PrimaryWidth, m_PrimaryHeight, width, height));
+                BOOLEAN bKeep = KeepHeadsContent(heads, SourceId, width, height);
                 DestroyPrimarySurface();
-                CreatePrimarySurface(&m_ModeInfo[idx]);
-                KeSetEvent(&finishEvent, IO_NO_INCREMENT, FALSE);
-            });
-            if (!operation)
-                return STATUS_NO_MEMORY;
-            PostToWorkerThread(operation);
-            WaitForObject(&finishEvent, NULL);
+                CreatePrimarySurface(&ModeInfo, bKeep);
+            }
+            else
+            {
+                ++m_DrawGeneration;
+                if (m_PrimaryWidth)
+                {
+                    DestroyPrimarySurface();
+                }
+                CreatePrimarySurface(&ModeInfo);
+            }
+            ReleaseMutex(&m_CmdLock, locked);
+            UpdateMonitorConfig();
+            ReleaseMutex(&m_ModeLock, modeLocked);
             return STATUS_SUCCESS;
         }
     }
+    ReleaseMutex(&m_ModeLock, modeLocked);
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s failed\n", __FUNCTION__));
     return STATUS_UNSUCCESSFUL;
 }
 
+// Places the heads with a mode side by side, returns the size of the
+// primary surface holding all of them
+BOOLEAN QxlDevice::LayoutHeads(ULONG *pWidth, ULONG *pHeight)
+{
+    PAGED_CODE();
+    ULONG width = 0, height = 0;
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        m_Heads[i].x = width;
+        m_Heads[i].y = 0;
+        width += m_Heads[i].width;
+        height = MAX(height, m_Heads[i].height);
+    }
+    *pWidth = width;
+    *pHeight = height;
+    if ((ULONGLONG)width * height * m_SurfaceBpp / BITS_PER_BYTE > m_RomHdr->surface0_area_size)
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: heads (%dx%d) don't fit in memory (%d)\n",
+            __FUNCTION__, width, height, m_RomHdr->surface0_area_size));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+VOID QxlDevice::DisableSource(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
+{
+    PAGED_CODE();
+    if (SourceId >= MAX_VIEWS || !m_Heads[SourceId].width)
+    {
+        return;
+    }
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: head %d\n", __FUNCTION__, SourceId));
+    // the primary surface keeps its size, only the host stops showing
+    // the head; the next mode change packs the remaining heads
+    // the present path reads the layout under m_CmdLock
+    BOOLEAN modeLocked = WaitForObject(&m_ModeLock, NULL);
+    BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+    m_Heads[SourceId].width = 0;
+    m_Heads[SourceId].height = 0;
+    ReleaseMutex(&m_CmdLock, locked);
+    InterlockedAnd(&m_PointerVisible, ~(1 << SourceId));
+    UpdateMonitorConfig();
+    ReleaseMutex(&m_ModeLock, modeLocked);
+}
+
+BOOLEAN QxlDevice::IsChildConnected(ULONG ChildUid)
+{
+    PAGED_CODE();
+    return ChildUid < MAX_CHILDREN && (m_ConnectedHeads & (1 << ChildUid));
+}
+
 NTSTATUS QxlDevice::GetCurrentMode(ULONG* pMode)
 {
     PAGED_CODE();
@@ -3480,17 +5013,24 @@ NTSTATUS QxlDevice::StartPresentThread()
 {
     PAGED_CODE();
     OBJECT_ATTRIBUTES ObjectAttributes;
-    NTSTATUS Status;
+    NTSTATUS Status = STATUS_SUCCESS;
 
     InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
-    Status = PsCreateSystemThread(
-        &m_PresentThread,
-        THREAD_ALL_ACCESS,
-        &ObjectAttributes,
-        NULL,
-        NULL,
-        PresentThreadRoutineWrapper,
-        this);
+    for (UINT i = 0; i < MAX_VIEWS && NT_SUCCESS(Status); ++i)
+    {
+        Status = PsCreateSystemThread(
+            &m_PresentWorkers[i].thread,
+            THREAD_ALL_ACCESS,
+            &ObjectAttributes,
+            NULL,
+            NULL,
+            PresentThreadRoutineWrapper,
+            &m_PresentWorkers[i]);
+    }
+    if (!NT_SUCCESS(Status))
+    {
+        StopPresentThread();
+    }
 
     return Status;
 }
@@ -3515,10 +5055,27 @@ NTSTATUS QxlDevice::QxlInit(DXGK_DISPLAY_INFORMATION* pDispInfo)
     }
 
     WRITE_PORT_UCHAR((PUCHAR)(m_IoBase + QXL_IO_RESET), 0);
+    HostLogStart(m_LogBuf, m_LogPort, m_RomHdr->log_level);
+    m_PrimaryWidth = m_PrimaryHeight = m_PrimaryFormat = 0;
     CreateRings();
     m_RamHdr->int_mask = WIN_QXL_INT_MASK;
+    m_bClientMonitorsValid = FALSE;
+    if (g_ClientMonitorsConfig) {
+        // spice-server stops sending the layout to the agent once the
+        // guest takes the interrupt; a layout set before the driver
+        // started is applied when the present thread starts
+        m_RamHdr->int_mask |= QXL_INTERRUPT_CLIENT_MONITORS_CONFIG;
+        m_ClientMonitorsPending = 1;
+    }
+    if (g_HeadlessPeriod) {
+        // the shadows of the heads are uploaded as soon as a client connects
+        m_RamHdr->int_mask |= QXL_INTERRUPT_CLIENT;
+    }
     CreateMemSlots();
+    ResetCursorCache();
     InitDeviceMemoryResources();
+    ResetOffscreen();
+    ResetCmdQueue();
     Status = InitMonitorConfig();
     if (!NT_SUCCESS(Status))
     {
@@ -3542,7 +5099,15 @@ void QxlDevice::QxlClose()
     PAGED_CODE();
     m_bActive = FALSE;
     StopPresentThread();
+    ResetCursorCache();
+    FreeOffscreen();
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        delete[] m_Headless[i].Shadow;
+    }
+    RtlZeroMemory(m_Headless, sizeof(m_Headless));
+    ResetCmdQueue();
     DestroyMemSlots();
+    HostLogStop(m_LogBuf);
 }
 
 void QxlDevice::UnmapMemory(void)
@@ -3591,12 +5156,15 @@ void QxlDevice::DestroyMemSlots(void)
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
-void QxlDevice::CreatePrimarySurface(PVIDEO_MODE_INFORMATION pModeInfo)
+void QxlDevice::CreatePrimarySurface(PVIDEO_MODE_INFORMATION pModeInfo, BOOLEAN bKeepData)
 {
     PAGED_CODE();
     QXLSurfaceCreate *primary_surface_create;
     DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s - %d: (%d x %d)\n", __FUNCTION__, m_Id,
         pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight));
+    // the device takes the primary surface commands through the i/o
+    // port, after what is in the command ring only
+    FlushCmdQueue();
     primary_surface_create = &m_RamHdr->create_surface;
     primary_surface_create->format = pModeInfo->BitsPerPlane;
     primary_surface_create->width = pModeInfo->VisScreenWidth;
@@ -3605,29 +5173,118 @@ void QxlDevice::CreatePrimarySurface(PVIDEO_MODE_INFORMATION pModeInfo)
 
     primary_surface_create->mem = PA(m_RamStart);
 
-    primary_surface_create->flags = 0;
+    // with QXL_SURF_FLAG_KEEP_DATA the host takes the memory as it is and
+    // sends it to the client, instead of starting from a blank surface
+    primary_surface_create->flags = bKeepData ? QXL_SURF_FLAG_KEEP_DATA : 0;
     primary_surface_create->type = QXL_SURF_TYPE_PRIMARY;
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--> %s format = %d, width = %d, height = %d, stride = %d\n", __FUNCTION__, pModeInfo->BitsPerPlane, pModeInfo->VisScreenWidth, pModeInfo->VisScreenHeight,
                                      pModeInfo->ScreenStride));
 //    AsyncIo(QXL_IO_CREATE_PRIMARY_ASYNC, 0);
     SyncIo(QXL_IO_CREATE_PRIMARY, 0);
+    m_PrimaryWidth = pModeInfo->VisScreenWidth;
+    m_PrimaryHeight = pModeInfo->VisScreenHeight;
+    m_PrimaryFormat = pModeInfo->BitsPerPlane;
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
+// Called under m_CmdLock before the primary surface is recreated for a new
+// layout: has the host render the surface into its memory and moves every
+// head other than SourceId that kept its size from its place in pOldHeads
+// to its new one, the rest of the surface black. Returns FALSE if the
+// content could not be kept
+BOOLEAN QxlDevice::KeepHeadsContent(CONST QXLHead *pOldHeads, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId,
+                                    ULONG width, ULONG height)
+{
+    PAGED_CODE();
+    ULONG bpp = m_PrimaryFormat / BITS_PER_BYTE;
+    SIZE_T oldStride = (SIZE_T)m_PrimaryWidth * bpp;
+    SIZE_T stride = (SIZE_T)width * bpp;
+    BOOLEAN bAny = FALSE;
+
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        bAny |= i != SourceId && m_Heads[i].width &&
+                m_Heads[i].width == pOldHeads[i].width && m_Heads[i].height == pOldHeads[i].height;
+    }
+    if (!bAny) {
+        return FALSE;
+    }
+    UINT8 *copy = new (PagedPool, NoInit) UINT8[oldStride * m_PrimaryHeight];
+    if (!copy) {
+        return FALSE;
+    }
+
+    // the drawables of the heads are all in the command ring
+    FlushCmdQueue();
+    m_RamHdr->update_area.left = 0;
+    m_RamHdr->update_area.top = 0;
+    m_RamHdr->update_area.right = m_PrimaryWidth;
+    m_RamHdr->update_area.bottom = m_PrimaryHeight;
+    m_RamHdr->update_surface = 0;
+    SyncIo(QXL_IO_UPDATE_AREA, 0);
+
+    RtlCopyMemory(copy, m_RamStart, oldStride * m_PrimaryHeight);
+    RtlZeroMemory(m_RamStart, stride * height);
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        CONST QXLHead *old = &pOldHeads[i];
+        if (i == SourceId || !m_Heads[i].width ||
+            m_Heads[i].width != old->width || m_Heads[i].height != old->height) {
+            continue;
+        }
+        for (UINT32 y = 0; y < old->height; ++y) {
+            RtlCopyMemory(m_RamStart + y * stride + (SIZE_T)m_Heads[i].x * bpp,
+                          copy + y * oldStride + (SIZE_T)old->x * bpp, (SIZE_T)old->width * bpp);
+        }
+    }
+    delete[] copy;
+    return TRUE;
+}
+
 void QxlDevice::DestroyPrimarySurface(void)
 {
     PAGED_CODE();
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    FlushCmdQueue();
 //    AsyncIo(QXL_IO_DESTROY_PRIMARY_ASYNC, 0);
     SyncIo(QXL_IO_DESTROY_PRIMARY, 0);
+    m_PrimaryWidth = m_PrimaryHeight = m_PrimaryFormat = 0;
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
-inline QXLPHYSICAL QxlDevice::PA(PVOID virt)
+// Checks a drawable built for a head against the current layout, called
+// under m_CmdLock. A drawable is still valid if its head kept its place
+// and it stays inside the head
+BOOLEAN QxlDevice::DrawableFitsHead(QXLDrawable *drawable, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, LONG offset)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--> %s\n", __FUNCTION__));
+    QXLHead *head = &m_Heads[SourceId];
+    LONG right = head->x + head->width;
+    LONG bottom = head->height;
+
+    if (drawable->surface_id) {
+        // copy of a head area into an offscreen surface
+        QXLRect *src = &drawable->surfaces_rects[0];
+        return (LONG)head->x == offset &&
+            src->left >= offset && src->right <= right &&
+            src->top >= 0 && src->bottom <= bottom;
+    }
+    if ((LONG)head->x != offset ||
+        drawable->bbox.left < offset || drawable->bbox.right > right ||
+        drawable->bbox.top < 0 || drawable->bbox.bottom > bottom) {
+        return FALSE;
+    }
+    if (drawable->type == QXL_COPY_BITS) {
+        QXLPoint *src = &drawable->u.copy_bits.src_pos;
+        if (src->x < offset || src->x + drawable->bbox.right - drawable->bbox.left > right ||
+            src->y < 0 || src->y + drawable->bbox.bottom - drawable->bbox.top > bottom) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 
+inline QXLPHYSICAL QxlDevice::PA(PVOID virt)
+{
+    PAGED_CODE();
     const MemSlot *pSlot = m_MemSlots;
     if (virt < pSlot->start_virt_addr || virt > pSlot->last_virt_addr)
         ++pSlot;
@@ -3637,8 +5294,6 @@ inline QXLPHYSICAL QxlDevice::PA(PVOID virt)
 inline UINT8 *QxlDevice::VA(QXLPHYSICAL paddr)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
-
     UINT8 slot_id = UINT8(paddr >> (64 - m_SlotIdBits)) - m_RomHdr->slots_start;
     const MemSlot *pSlot = &m_MemSlots[slot_id & 1];
     return pSlot->start_virt_addr + (paddr & m_VaSlotMask);
@@ -3667,16 +5322,22 @@ BOOL QxlDevice::CreateEvents()
     KeInitializeEvent(&m_IoCmdEvent,
                       SynchronizationEvent,
                       FALSE);
-    KeInitializeEvent(&m_PresentEvent,
-                      SynchronizationEvent,
-                      FALSE);
-    KeInitializeEvent(&m_PresentThreadReadyEvent,
-                      SynchronizationEvent,
-                      FALSE);
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        KeInitializeEvent(&m_PresentWorkers[i].event,
+                          SynchronizationEvent,
+                          FALSE);
+        KeInitializeEvent(&m_PresentWorkers[i].ready_event,
+                          SynchronizationEvent,
+                          FALSE);
+        KeInitializeMutex(&m_PresentWorkers[i].lock, 0);
+    }
     KeInitializeMutex(&m_MemLock, 0);
     KeInitializeMutex(&m_CmdLock, 0);
     KeInitializeMutex(&m_IoLock, 0);
     KeInitializeMutex(&m_CrsLock, 0);
+    KeInitializeMutex(&m_HeadlessLock, 0);
+    KeInitializeMutex(&m_ModeLock, 0);
 
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return TRUE;
@@ -3689,7 +5350,11 @@ BOOL QxlDevice::CreateRings()
     m_CommandRing = &(m_RamHdr->cmd_ring);
     m_CursorRing = &(m_RamHdr->cursor_ring);
     m_ReleaseRing = &(m_RamHdr->release_ring);
-    SPICE_RING_INIT(m_PresentRing);
+    m_PendingMove = NULL;
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        SPICE_RING_INIT(m_PresentWorkers[i].ring);
+    }
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return TRUE;
 }
@@ -3771,7 +5436,7 @@ void QxlDevice::InitDeviceMemoryResources(void)
 NTSTATUS QxlDevice::InitMonitorConfig(void)
 {
     PAGED_CODE();
-    size_t config_size = sizeof(QXLMonitorsConfig) + sizeof(QXLHead);
+    size_t config_size = sizeof(QXLMonitorsConfig) + MAX_VIEWS * sizeof(QXLHead);
     m_monitor_config = (QXLMonitorsConfig*) AllocMem(MSPACE_TYPE_DEVRAM, config_size, TRUE);
     if (m_monitor_config) {
         RtlZeroMemory(m_monitor_config, config_size);
@@ -3800,6 +5465,223 @@ void QxlDevice::ResetDevice(void)
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
+// offscreen surface a drawable fills or reads from, 0 if none
+static FORCEINLINE UINT32 OffscreenId(QXLDrawable *drawable)
+{
+    if (drawable->surface_id) {
+        return drawable->surface_id;
+    }
+    return drawable->surfaces_dest[0] > 0 ? drawable->surfaces_dest[0] : 0;
+}
+
+// Locks the first Size bytes of a present source in physical memory and
+// maps them to system space; the source is in user mode, probing it may
+// raise an exception
+static NTSTATUS MapSourceBits(BYTE *SrcAddr, UINT Size, PMDL *pMdl, BYTE **ppBits)
+{
+    PAGED_CODE();
+    NTSTATUS Status;
+
+    PMDL mdl = IoAllocateMdl((PVOID)SrcAddr, Size,  FALSE, FALSE, NULL);
+    if(!mdl)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KPROCESSOR_MODE AccessMode = static_cast<KPROCESSOR_MODE>(( SrcAddr <=
+                    (BYTE* const) MM_USER_PROBE_ADDRESS)?UserMode:KernelMode);
+    __try
+    {
+        // Probe and lock the pages of this buffer in physical memory.
+        // We need only IoReadAccess.
+        MmProbeAndLockPages(mdl, AccessMode, IoReadAccess);
+    }
+    #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
+    __except(EXCEPTION_EXECUTE_HANDLER)
+    {
+        Status = GetExceptionCode();
+        IoFreeMdl(mdl);
+        return Status;
+    }
+
+    // Map the physical pages described by the MDL into system space.
+    // Note: double mapping the buffer this way causes lot of system
+    // overhead for large size buffers.
+    *ppBits = reinterpret_cast<BYTE*>
+        (MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
+
+    if(!*ppBits) {
+        MmUnlockPages(mdl);
+        IoFreeMdl(mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    *pMdl = mdl;
+    return STATUS_SUCCESS;
+}
+
+static void UnmapSourceBits(PMDL mdl)
+{
+    PAGED_CODE();
+    MmUnlockPages(mdl);
+    IoFreeMdl(mdl);
+}
+
+// Rows [*pTop, *pBottom) of a source SrcHeight rows high that a rect reads
+static BOOLEAN SourceRows(CONST RECT* pRect, LONG SrcHeight, LONG* pTop, LONG* pBottom)
+{
+    *pTop = MAX(pRect->top, 0);
+    *pBottom = MIN(pRect->bottom, SrcHeight);
+    return pRect->left < pRect->right && *pTop < *pBottom;
+}
+
+// Rows between a band and rows [Top, Bottom), 0 or less when they touch
+static LONG SourceGap(CONST SOURCE_BAND* pBand, LONG Top, LONG Bottom)
+{
+    return MAX(Top - pBand->Bottom, pBand->Top - Bottom);
+}
+
+// Adds rows [Top, Bottom) to the nearest band if at most GapRows rows lie
+// between them, or to a band of their own; with all bands in use they
+// join the one that takes the fewest rows nobody reads
+static VOID AddSourceRows(SOURCE_MAP* pMap, LONG Top, LONG Bottom, LONG GapRows)
+{
+    SOURCE_BAND* pBest = NULL;
+    LONG BestGap = 0;
+
+    for (UINT i = 0; i < pMap->NumBands; i++)
+    {
+        LONG Gap = SourceGap(&pMap->Bands[i], Top, Bottom);
+        if (!pBest || Gap < BestGap)
+        {
+            pBest = &pMap->Bands[i];
+            BestGap = Gap;
+        }
+    }
+    if (!pBest || (BestGap > GapRows && pMap->NumBands < SOURCE_MAP_BANDS))
+    {
+        pBest = &pMap->Bands[pMap->NumBands++];
+        pBest->Top = Top;
+        pBest->Bottom = Bottom;
+        return;
+    }
+    pBest->Top = MIN(pBest->Top, Top);
+    pBest->Bottom = MAX(pBest->Bottom, Bottom);
+}
+
+// Locks and maps the source rows that the rects and the destination rects
+// of the moves read, in at most SOURCE_MAP_BANDS bands, instead of every
+// row from the first one down. The source holds the final pixels of the
+// moves, so they read their destination rows
+NTSTATUS MapSourceRects(BYTE* SrcAddr, LONG SrcPitch, LONG SrcHeight, UINT NumRects, CONST RECT* pRects,
+                        UINT NumMoves, CONST D3DKMT_MOVE_RECT* pMoves, SOURCE_MAP* pMap)
+{
+    PAGED_CODE();
+    LONG GapRows = SrcPitch > 0 ? SOURCE_MAP_GAP / SrcPitch : 0;
+    LONG Top, Bottom, LastRow = 0;
+    BOOLEAN bMerged;
+
+    RtlZeroMemory(pMap, sizeof(*pMap));
+    for (UINT i = 0; i < NumRects + NumMoves; i++)
+    {
+        CONST RECT* pRect = i < NumRects ? &pRects[i] : &pMoves[i - NumRects].DestRect;
+        if (SourceRows(pRect, SrcHeight, &Top, &Bottom))
+        {
+            AddSourceRows(pMap, Top, Bottom, GapRows);
+        }
+    }
+
+    // bands that grew may have come close to each other
+    do
+    {
+        bMerged = FALSE;
+        for (UINT i = 0; i < pMap->NumBands && !bMerged; i++)
+        {
+            for (UINT j = i + 1; j < pMap->NumBands && !bMerged; j++)
+            {
+                SOURCE_BAND* pBand = &pMap->Bands[i];
+                SOURCE_BAND* pOther = &pMap->Bands[j];
+                if (SourceGap(pBand, pOther->Top, pOther->Bottom) <= GapRows)
+                {
+                    pBand->Top = MIN(pBand->Top, pOther->Top);
+                    pBand->Bottom = MAX(pBand->Bottom, pOther->Bottom);
+                    *pOther = pMap->Bands[--pMap->NumBands];
+                    bMerged = TRUE;
+                }
+            }
+        }
+    } while (bMerged);
+
+    for (UINT i = 0; i < pMap->NumBands; i++)
+    {
+        SOURCE_BAND* pBand = &pMap->Bands[i];
+        BYTE* pFirst = SrcAddr + (SIZE_T)pBand->Top * SrcPitch;
+        UINT Size = (UINT)(pBand->Bottom - pBand->Top) * SrcPitch;
+        NTSTATUS Status = MapSourceBits(pFirst, Size, &pBand->Mdl, &pBand->pBits);
+        if (!NT_SUCCESS(Status))
+        {
+            pMap->NumBands = i;
+            UnmapSourceRects(pMap);
+            return Status;
+        }
+        pMap->Pages += ADDRESS_AND_SIZE_TO_SPAN_PAGES(pFirst, Size);
+        LastRow = MAX(LastRow, pBand->Bottom);
+    }
+    pMap->WholePages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(SrcAddr, (SIZE_T)LastRow * SrcPitch);
+    return STATUS_SUCCESS;
+}
+
+VOID UnmapSourceRects(SOURCE_MAP* pMap)
+{
+    PAGED_CODE();
+    for (UINT i = 0; i < pMap->NumBands; i++)
+    {
+        UnmapSourceBits(pMap->Bands[i].Mdl);
+    }
+    pMap->NumBands = 0;
+}
+
+// The blt info of pSrc, a source without offset, for reading a rect
+// through the band mapping its rows; pBits is NULL if the rect reaches out of the source or was not
+// among the rects mapped
+BLT_INFO SourceBltInfo(CONST SOURCE_MAP* pMap, CONST BLT_INFO* pSrc, CONST RECT* pRect)
+{
+    BLT_INFO Info = *pSrc;
+    LONG Top, Bottom;
+
+    Info.pBits = NULL;
+    if (!SourceRows(pRect, (LONG)pSrc->Height, &Top, &Bottom) ||
+        Top != pRect->top || Bottom != pRect->bottom)
+    {
+        return Info;
+    }
+    for (UINT i = 0; i < pMap->NumBands; i++)
+    {
+        CONST SOURCE_BAND* pBand = &pMap->Bands[i];
+        if (pBand->Top <= Top && Bottom <= pBand->Bottom)
+        {
+            Info.pBits = pBand->pBits;
+            Info.Offset.y = -pBand->Top;
+            break;
+        }
+    }
+    return Info;
+}
+
+static BOOLEAN IsFullscreenPresent(ULONG NumDirtyRects, CONST RECT *pDirtyRect, CONST CURRENT_BDD_MODE *pModeCur)
+{
+    for (ULONG i = 0; i < NumDirtyRects; i++)
+    {
+        if (pDirtyRect[i].left <= 0 && pDirtyRect[i].top <= 0 &&
+            pDirtyRect[i].right >= (LONG)pModeCur->SrcModeWidth &&
+            pDirtyRect[i].bottom >= (LONG)pModeCur->SrcModeHeight)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 NTSTATUS
 QxlDevice::ExecutePresentDisplayOnly(
     _In_ BYTE*             DstAddr,
@@ -3815,11 +5697,31 @@ QxlDevice::ExecutePresentDisplayOnly(
     _In_ const CURRENT_BDD_MODE* pModeCur)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
     NTSTATUS Status = STATUS_SUCCESS;
+    QxlEncoding encoding = ChooseEncoding();
+    UINT bitmapBpp = encoding == QXL_ENCODING_16BPP ? 16 : m_SurfaceBpp;
+
+    QXL_COUNT(Presents, 1);
+    QXL_TRACE(PRESENT, pModeCur->SourceId, NumMoves, NumDirtyRects);
+
+    if (encoding == QXL_ENCODING_HEADLESS) {
+        Status = PresentHeadless(SrcAddr, SrcPitch, NumMoves, Moves, NumDirtyRects, DirtyRect, Rotation, pModeCur);
+        // without a shadow the present is sent as usual
+        if (Status != STATUS_NO_MEMORY) {
+            return Status;
+        }
+    } else {
+        EndHeadless(pModeCur->SourceId);
+    }
+    if (encoding == QXL_ENCODING_16BPP) {
+        QXL_COUNT(Presents16Bpp, 1);
+    } else {
+        QXL_COUNT(PresentsLossless, 1);
+    }
 
-    QXLDrawable **pDrawables = new (NonPagedPoolNx) QXLDrawable *[NumDirtyRects + NumMoves + 1];
+    // a dirty rect may add the copy into an offscreen surface
+    QXLDrawable **pDrawables = new (NonPagedPoolNx) QXLDrawable *[NumDirtyRects * 2 + NumMoves + 1];
     UINT nIndex = 0;
 
     if (!pDrawables)
@@ -3845,54 +5747,6 @@ QxlDevice::ExecutePresentDisplayOnly(
     ctx->Mdl              = NULL;
     ctx->DisplaySource    = this;
 
-    // Source bitmap is in user mode, must be locked under __try/__except
-    // and mapped to kernel space before use.
-    {
-        LONG maxHeight = GetMaxSourceMappingHeight(ctx->DirtyRect, ctx->NumDirtyRects);
-        UINT sizeToMap = ctx->SrcPitch * maxHeight;
-
-        PMDL mdl = IoAllocateMdl((PVOID)SrcAddr, sizeToMap,  FALSE, FALSE, NULL);
-        if(!mdl)
-        {
-            delete[] pDrawables;
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-
-        KPROCESSOR_MODE AccessMode = static_cast<KPROCESSOR_MODE>(( SrcAddr <=
-                        (BYTE* const) MM_USER_PROBE_ADDRESS)?UserMode:KernelMode);
-        __try
-        {
-            // Probe and lock the pages of this buffer in physical memory.
-            // We need only IoReadAccess.
-            MmProbeAndLockPages(mdl, AccessMode, IoReadAccess);
-        }
-        #pragma prefast(suppress: __WARNING_EXCEPTIONEXECUTEHANDLER, "try/except is only able to protect against user-mode errors and these are the only errors we try to catch here");
-        __except(EXCEPTION_EXECUTE_HANDLER)
-        {
-            Status = GetExceptionCode();
-            IoFreeMdl(mdl);
-            delete[] pDrawables;
-            return Status;
-        }
-
-        // Map the physical pages described by the MDL into system space.
-        // Note: double mapping the buffer this way causes lot of system
-        // overhead for large size buffers.
-        ctx->SrcAddr = reinterpret_cast<BYTE*>
-            (MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute));
-
-        if(!ctx->SrcAddr) {
-            Status = STATUS_INSUFFICIENT_RESOURCES;
-            MmUnlockPages(mdl);
-            IoFreeMdl(mdl);
-            delete[] pDrawables;
-            return Status;
-        }
-
-        // Save Mdl to unmap and unlock the pages in worker thread
-        ctx->Mdl = mdl;
-    }
-
     // Set up destination blt info
     BLT_INFO DstBltInfo;
     DstBltInfo.pBits = ctx->DstAddr;
@@ -3904,9 +5758,9 @@ QxlDevice::ExecutePresentDisplayOnly(
     DstBltInfo.Width = ctx->SrcWidth;
     DstBltInfo.Height = ctx->SrcHeight;
 
-    // Set up source blt info
+    // Set up source blt info, the rows of each rect are mapped below
     BLT_INFO SrcBltInfo;
-    SrcBltInfo.pBits = ctx->SrcAddr;
+    SrcBltInfo.pBits = NULL;
     SrcBltInfo.Pitch = ctx->SrcPitch;
     SrcBltInfo.BitsPerPel = 32;
     SrcBltInfo.Offset.x = 0;
@@ -3924,21 +5778,73 @@ QxlDevice::ExecutePresentDisplayOnly(
         SrcBltInfo.Height = DstBltInfo.Height;
     }
 
+    // Source bitmap is in user mode, must be locked under __try/__except
+    // and mapped to kernel space before use; only the rows of the dirty
+    // rects are, the moves are done by the device
+    SOURCE_MAP SrcMap;
+    Status = MapSourceRects(SrcAddr, ctx->SrcPitch, SrcBltInfo.Height, ctx->NumDirtyRects, ctx->DirtyRect,
+                            0, NULL, &SrcMap);
+    if (!NT_SUCCESS(Status)) {
+        delete[] pDrawables;
+        return Status;
+    }
+    QXL_COUNT(SourcePages, SrcMap.Pages);
+    QXL_COUNT(SourcePagesWhole, SrcMap.WholePages);
+    QXL_COUNT(SourceMdls, SrcMap.NumBands);
+
     uint16_t currentGeneration = m_DrawGeneration;
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId = pModeCur->SourceId;
+    LONG offset = m_Heads[SourceId].x;
+    UINT32 headWidth = m_Heads[SourceId].width;
+    UINT32 headHeight = m_Heads[SourceId].height;
     QxlPresentOperation *operation = BuildQxlOperation([=, this]() {
         PAGED_CODE();
         ULONG delayed = 0;
+        UINT i, n;
 
-        for (UINT i = 0; pDrawables[i]; ++i)
+        for (i = n = 0; pDrawables[i]; ++i)
         {
-            ULONG n = PrepareDrawable(pDrawables[i]);
+            delayed += PrepareDrawable(pDrawables[i]);
             // only reason why drawables[i] is zeroed is stop flow
             if (pDrawables[i]) {
-                delayed += n;
-                if (currentGeneration == m_DrawGeneration)
-                    PushDrawable(pDrawables[i]);
-                else
-                    DiscardDrawable(pDrawables[i]);
+                pDrawables[n++] = pDrawables[i];
+            }
+        }
+        // a mode change of any head may move the heads in the primary
+        // surface, the layout and the generation are stable while
+        // m_CmdLock is held
+        BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+        // the offscreen surfaces the drawables fill or read
+        PushOffscreenCmds();
+        BOOLEAN bStale = currentGeneration != m_DrawGeneration;
+        // a head that only moved because another one changed size keeps
+        // its content, see KeepHeadsContent; its drawables move with it,
+        // except the copies reading the primary surface into offscreen ones
+        LONG shift = (LONG)m_Heads[SourceId].x - offset;
+        BOOLEAN bMoved = shift && m_Heads[SourceId].width == headWidth &&
+                         m_Heads[SourceId].height == headHeight;
+        for (i = 0; i < n; ++i)
+        {
+            // the drawable may be released as soon as it is pushed
+            UINT32 offscreen = OffscreenId(pDrawables[i]);
+            BOOLEAN fill = pDrawables[i]->surface_id != 0;
+            if (bMoved && !fill) {
+                OffsetDrawable(pDrawables[i], shift);
+            }
+            if (!bStale && !(bMoved && fill) &&
+                DrawableFitsHead(pDrawables[i], SourceId, bMoved ? offset + shift : offset)) {
+                PushDrawable(pDrawables[i]);
+                pDrawables[i] = NULL;
+            }
+            if (offscreen) {
+                OffscreenDone(offscreen, fill && !pDrawables[i]);
+            }
+        }
+        ReleaseMutex(&m_CmdLock, locked);
+        for (i = 0; i < n; ++i)
+        {
+            if (pDrawables[i]) {
+                DiscardDrawable(pDrawables[i]);
             }
         }
         delete[] pDrawables;
@@ -3947,8 +5853,7 @@ QxlDevice::ExecutePresentDisplayOnly(
         }
     });
     if (!operation) {
-        MmUnlockPages(ctx->Mdl);
-        IoFreeMdl(ctx->Mdl);
+        UnmapSourceRects(&SrcMap);
         delete[] pDrawables;
         return STATUS_NO_MEMORY;
     }
@@ -3959,12 +5864,12 @@ QxlDevice::ExecutePresentDisplayOnly(
         POINT*   pSourcePoint = &ctx->Moves[i].SourcePoint;
         RECT*    pDestRect = &ctx->Moves[i].DestRect;
 
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("--- %d SourcePoint.x = %ld, SourcePoint.y = %ld, DestRect.bottom = %ld, DestRect.left = %ld, DestRect.right = %ld, DestRect.top = %ld\n", 
-            i , pSourcePoint->x, pSourcePoint->y, pDestRect->bottom, pDestRect->left, pDestRect->right, pDestRect->top));
+        QXL_TRACE(PRESENT_MOVE, pSourcePoint->x, pSourcePoint->y,
+                  pDestRect->left, pDestRect->top, pDestRect->right, pDestRect->bottom);
 
         pDrawables[nIndex] = PrepareCopyBits(*pDestRect, *pSourcePoint);
 
-        if (pDrawables[nIndex]) nIndex++;
+        if (pDrawables[nIndex]) OffsetDrawable(pDrawables[nIndex++], offset);
     }
 
     // Copy all the dirty rects from source image to video frame buffer.
@@ -3975,80 +5880,387 @@ QxlDevice::ExecutePresentDisplayOnly(
         sourcePoint.x = pDirtyRect->left;
         sourcePoint.y = pDirtyRect->top;
 
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("--- %d pDirtyRect->bottom = %ld, pDirtyRect->left = %ld, pDirtyRect->right = %ld, pDirtyRect->top = %ld\n",
-            i, pDirtyRect->bottom, pDirtyRect->left, pDirtyRect->right, pDirtyRect->top));
+        QXL_TRACE(PRESENT_DIRTY, pDirtyRect->left, pDirtyRect->top, pDirtyRect->right, pDirtyRect->bottom);
 
-        pDrawables[nIndex] = PrepareBltBits(&DstBltInfo,
-        &SrcBltInfo,
-        1,
-        pDirtyRect,
-        &sourcePoint);
+        BLT_INFO RectBltInfo = SourceBltInfo(&SrcMap, &SrcBltInfo, pDirtyRect);
+        if (!RectBltInfo.pBits) {
+            continue;
+        }
+        QXLDrawable *fill;
+        pDrawables[nIndex] = PrepareOffscreen(&RectBltInfo, pDirtyRect, offset, &fill);
+        if (!pDrawables[nIndex]) {
+            pDrawables[nIndex] = PrepareBltBits(&DstBltInfo,
+            &RectBltInfo,
+            1,
+            pDirtyRect,
+            &sourcePoint,
+            bitmapBpp);
+        }
 
-        if (pDrawables[nIndex]) nIndex++;
+        if (pDrawables[nIndex]) OffsetDrawable(pDrawables[nIndex++], offset);
+        else if (fill) {
+            OffscreenDone(fill->surface_id, FALSE);
+            DiscardDrawable(fill);
+            fill = NULL;
+        }
+        if (fill) pDrawables[nIndex++] = fill;
     }
 
     // Unmap unmap and unlock the pages.
-    if (ctx->Mdl)
-    {
-        MmUnlockPages(ctx->Mdl);
-        IoFreeMdl(ctx->Mdl);
-    }
+    UnmapSourceRects(&SrcMap);
 
     pDrawables[nIndex] = NULL;
 
-    PostToWorkerThread(operation);
+    // a black out still queued ahead of a present that paints the whole
+    // source is not needed any more
+    QxlPresentWorker *worker = &m_PresentWorkers[pModeCur->SourceId];
+    if (worker->blackout_pending && IsFullscreenPresent(NumDirtyRects, DirtyRect, pModeCur)) {
+        BOOLEAN locked = WaitForObject(&worker->lock, NULL);
+        InterlockedExchange(&worker->blackout_pending, 0);
+        PostToWorkerThread(operation, pModeCur->SourceId);
+        ReleaseMutex(&worker->lock, locked);
+    } else {
+        PostToWorkerThread(operation, pModeCur->SourceId);
+    }
 
     return STATUS_SUCCESS;
 }
 
-void QxlDevice::WaitForReleaseRing(void)
+// Picks the encoding of a present from whether qemu reports a client in
+// the ROM. The ROM says nothing about what the client decodes: spice-server
+// only forwards its SIZED_STREAM, MONITORS_CONFIG, COMPOSITE and A8_SURFACE
+// capabilities to client_capabilities, and compression_level is a host
+// setting that defaults to 9. 16bpp bitmaps are therefore only sent when
+// EncodingPolicy 2 asks for them
+QxlEncoding QxlDevice::ChooseEncoding(void)
 {
     PAGED_CODE();
-    int wait;
-    BOOLEAN locked;
-
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("--->%s\n", __FUNCTION__));
-
-    locked = WaitForObject(&m_MemLock, NULL);
-    for (;;) {
-        LARGE_INTEGER timeout;
 
-        if (SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
-            ReleaseMutex(&m_MemLock, locked);
-            QXL_SLEEP(10);
-            locked = WaitForObject(&m_MemLock, NULL);
-            if (!SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
-                break;
-            }
-            SyncIo(QXL_IO_NOTIFY_OOM, 0);
-        }
-        SPICE_RING_CONS_WAIT(m_ReleaseRing, wait);
+    // only HeadlessPeriod decides on the shadows, with 0 presents without
+    // a client are sent as usual
+    if (!m_RomHdr->client_present && g_HeadlessPeriod) {
+        return QXL_ENCODING_HEADLESS;
+    }
+    if (!m_RomHdr->client_present || g_EncodingPolicy == ENCODING_POLICY_LOSSLESS) {
+        return QXL_ENCODING_LOSSLESS;
+    }
+    // a 16bpp surface has nothing left to save
+    if (m_SurfaceBpp == QXL_BPP && g_EncodingPolicy == ENCODING_POLICY_16BPP) {
+        return QXL_ENCODING_16BPP;
+    }
+    return QXL_ENCODING_LOSSLESS;
+}
 
-        if (!wait || !m_bActive) {
-            break;
-        }
+static FORCEINLINE BOOLEAN RectIsEmpty(CONST RECT *pRect)
+{
+    return pRect->left >= pRect->right || pRect->top >= pRect->bottom;
+}
 
-        ReleaseMutex(&m_MemLock, locked);
-        timeout.QuadPart = -30 * 1000 * 10; //30ms
-        WaitForObject(&m_DisplayEvent, &timeout);
-        locked = WaitForObject(&m_MemLock, NULL);
+// Copies a rect, clipped to the shadow, from the source of a present
+// mapped in pMap and adds it to the damage
+static void CopyToShadow(HeadlessHead *head, CONST SOURCE_MAP *pMap, LONG pitch, CONST RECT *pRect, RECT *pDamage)
+{
+    PAGED_CODE();
+    RECT r = { MAX(pRect->left, 0), MAX(pRect->top, 0),
+               MIN(pRect->right, (LONG)head->Width), MIN(pRect->bottom, (LONG)head->Height) };
+    BLT_INFO shadow = {};
 
-        if (SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
-            SyncIo(QXL_IO_NOTIFY_OOM, 0);
-        }
+    if (r.left >= r.right || r.top >= r.bottom) {
+        return;
+    }
+    shadow.Height = head->Height;
+    BLT_INFO src = SourceBltInfo(pMap, &shadow, &r);
+    if (!src.pBits) {
+        return;
+    }
+    for (LONG y = r.top; y < r.bottom; ++y) {
+        RtlCopyMemory(head->Shadow + ((SIZE_T)y * head->Width + r.left) * 4,
+                      (CONST BYTE*)src.pBits + (SIZE_T)(y + src.Offset.y) * pitch + r.left * 4,
+                      (r.right - r.left) * 4);
+    }
+    if (RectIsEmpty(pDamage)) {
+        *pDamage = r;
+    } else {
+        pDamage->left = MIN(pDamage->left, r.left);
+        pDamage->top = MIN(pDamage->top, r.top);
+        pDamage->right = MAX(pDamage->right, r.right);
+        pDamage->bottom = MAX(pDamage->bottom, r.bottom);
     }
-    ReleaseMutex(&m_MemLock, locked);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("%s: <---\n", __FUNCTION__));
 }
 
-void QxlDevice::FlushReleaseRing()
+// Without a client nobody sees the primary surface: the present only goes
+// to the shadow of the head, and the worker of head 0 uploads the damage
+// of the shadows as one bitmap every g_HeadlessPeriod ms and as soon as a
+// client connects. Returns STATUS_NO_MEMORY, before touching the source,
+// if there is no shadow for the present
+NTSTATUS QxlDevice::PresentHeadless(BYTE* SrcAddr, LONG SrcPitch, ULONG NumMoves, D3DKMT_MOVE_RECT* pMoves,
+                                    ULONG NumDirtyRects, RECT* pDirtyRect,
+                                    D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation, const CURRENT_BDD_MODE* pModeCur)
 {
     PAGED_CODE();
-    UINT64 output;
-    int notify;
-    int num_to_release = 50;
-
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId = pModeCur->SourceId;
+    HeadlessHead *head = &m_Headless[SourceId];
+    UINT width = pModeCur->SrcModeWidth;
+    UINT height = pModeCur->SrcModeHeight;
+    NTSTATUS Status;
+    SOURCE_MAP map;
+
+    if (Rotation == D3DKMDT_VPPR_ROTATE90 || Rotation == D3DKMDT_VPPR_ROTATE270) {
+        UINT t = width;
+        width = height;
+        height = t;
+    }
+
+    BOOLEAN locked = WaitForObject(&m_HeadlessLock, NULL);
+    BOOLEAN bWasClean = RectIsEmpty(&head->Damage);
+    BOOLEAN bSeed = !head->Valid || head->Width != width || head->Height != height ||
+                    head->Generation != m_DrawGeneration;
+    if (bSeed && (!head->Shadow || head->Width != width || head->Height != height)) {
+        delete[] head->Shadow;
+        head->Shadow = new (PagedPool, NoInit) UINT8[(SIZE_T)width * height * 4];
+        head->Valid = FALSE;
+        head->Width = width;
+        head->Height = height;
+        RtlZeroMemory(&head->Damage, sizeof(head->Damage));
+        if (!head->Shadow) {
+            ReleaseMutex(&m_HeadlessLock, locked);
+            return STATUS_NO_MEMORY;
+        }
+    }
+
+    // a new shadow takes the whole frame, later ones the moved and dirty
+    // rects, whose source already holds the final pixels
+    RECT all = { 0, 0, (LONG)width, (LONG)height };
+    if (bSeed) {
+        Status = MapSourceRects(SrcAddr, SrcPitch, height, 1, &all, 0, NULL, &map);
+    } else {
+        Status = MapSourceRects(SrcAddr, SrcPitch, height, NumDirtyRects, pDirtyRect, NumMoves, pMoves, &map);
+    }
+    if (!NT_SUCCESS(Status)) {
+        ReleaseMutex(&m_HeadlessLock, locked);
+        return Status;
+    }
+    QXL_COUNT(SourcePages, map.Pages);
+    QXL_COUNT(SourcePagesWhole, map.WholePages);
+    QXL_COUNT(SourceMdls, map.NumBands);
+    if (bSeed) {
+        CopyToShadow(head, &map, SrcPitch, &all, &head->Damage);
+        head->Valid = TRUE;
+        head->Generation = m_DrawGeneration;
+    } else {
+        for (UINT i = 0; i < NumMoves; ++i) {
+            CopyToShadow(head, &map, SrcPitch, &pMoves[i].DestRect, &head->Damage);
+        }
+        for (UINT i = 0; i < NumDirtyRects; ++i) {
+            CopyToShadow(head, &map, SrcPitch, &pDirtyRect[i], &head->Damage);
+        }
+    }
+    UnmapSourceRects(&map);
+    QXL_COUNT(PresentsHeadless, 1);
+    // the worker of head 0 sleeps until the next upload it knows of
+    BOOLEAN bWake = bWasClean && !RectIsEmpty(&head->Damage);
+    ReleaseMutex(&m_HeadlessLock, locked);
+    if (bWake) {
+        KeSetEvent(&m_PresentWorkers[0].event, IO_NO_INCREMENT, FALSE);
+    }
+    return STATUS_SUCCESS;
+}
+
+// A present of the head is sent as usual again: the damage left in its
+// shadow is uploaded first, ahead of the present in the queue of the head,
+// and the shadow goes away
+void QxlDevice::EndHeadless(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
+{
+    PAGED_CODE();
+    HeadlessHead *head = &m_Headless[SourceId];
+    BOOLEAN bPost = FALSE;
+
+    BOOLEAN locked = WaitForObject(&m_HeadlessLock, NULL);
+    if (head->Shadow) {
+        head->Valid = FALSE;
+        if (!RectIsEmpty(&head->Damage) && !head->FlushPosted) {
+            head->FlushPosted = bPost = TRUE;
+        } else if (!head->FlushPosted) {
+            delete[] head->Shadow;
+            head->Shadow = NULL;
+        }
+    }
+    ReleaseMutex(&m_HeadlessLock, locked);
+    if (bPost) {
+        PostHeadlessFlush(SourceId);
+    }
+}
+
+void QxlDevice::PostHeadlessFlush(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
+{
+    PAGED_CODE();
+    QxlPresentOperation *operation = BuildQxlOperation([=, this]() {
+        PAGED_CODE();
+        FlushHeadless(SourceId);
+    });
+    if (!operation) {
+        // the damage stays, the next service of worker 0 tries again
+        BOOLEAN locked = WaitForObject(&m_HeadlessLock, NULL);
+        m_Headless[SourceId].FlushPosted = FALSE;
+        ReleaseMutex(&m_HeadlessLock, locked);
+        return;
+    }
+    PostToWorkerThread(operation, SourceId);
+}
+
+// Uploads the damage of a shadow as one bitmap, in the worker of its head
+void QxlDevice::FlushHeadless(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
+{
+    PAGED_CODE();
+    HeadlessHead *head = &m_Headless[SourceId];
+    QXLDrawable *drawable = NULL;
+    uint16_t generation = 0;
+
+    BOOLEAN locked = WaitForObject(&m_HeadlessLock, NULL);
+    head->FlushPosted = FALSE;
+    head->LastFlush = KeQueryInterruptTime();
+    if (head->Shadow && !RectIsEmpty(&head->Damage)) {
+        BLT_INFO SrcBltInfo = {};
+        POINT sourcePoint = { head->Damage.left, head->Damage.top };
+
+        SrcBltInfo.pBits = head->Shadow;
+        SrcBltInfo.Pitch = head->Width * 4;
+        SrcBltInfo.BitsPerPel = 32;
+        SrcBltInfo.Rotation = D3DKMDT_VPPR_IDENTITY;
+        SrcBltInfo.Width = head->Width;
+        SrcBltInfo.Height = head->Height;
+        drawable = PrepareBltBits(NULL, &SrcBltInfo, 1, &head->Damage, &sourcePoint, m_SurfaceBpp);
+        if (drawable) {
+            generation = head->Generation;
+            RtlZeroMemory(&head->Damage, sizeof(head->Damage));
+            QXL_COUNT(HeadlessUploads, 1);
+        }
+    }
+    if (!head->Valid) {
+        delete[] head->Shadow;
+        head->Shadow = NULL;
+        RtlZeroMemory(&head->Damage, sizeof(head->Damage));
+    }
+    ReleaseMutex(&m_HeadlessLock, locked);
+    if (!drawable) {
+        return;
+    }
+
+    LONG offset = m_Heads[SourceId].x;
+    OffsetDrawable(drawable, offset);
+    PrepareDrawable(drawable);
+    if (!drawable) {
+        return;
+    }
+    locked = WaitForObject(&m_CmdLock, NULL);
+    if (generation == m_DrawGeneration && DrawableFitsHead(drawable, SourceId, offset)) {
+        PushDrawable(drawable);
+        drawable = NULL;
+    }
+    ReleaseMutex(&m_CmdLock, locked);
+    if (drawable) {
+        DiscardDrawable(drawable);
+    }
+}
+
+// Called by the worker of head 0 while its queue is empty. Uploads the
+// shadows that are due, all of them once a client is connected, and
+// returns in how many ms the next one is, 0 if no damage is waiting
+ULONG QxlDevice::ServiceHeadless(void)
+{
+    PAGED_CODE();
+    ULONGLONG now = KeQueryInterruptTime();
+    ULONGLONG period = (ULONGLONG)g_HeadlessPeriod * TIMEOUT_TO_MS;
+    BOOLEAN bClient = m_RomHdr->client_present != 0;
+    ULONGLONG next = 0;
+
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        HeadlessHead *head = &m_Headless[i];
+        BOOLEAN bDue = FALSE;
+
+        BOOLEAN locked = WaitForObject(&m_HeadlessLock, NULL);
+        if (!RectIsEmpty(&head->Damage) && !head->FlushPosted) {
+            if (bClient || now - head->LastFlush >= period) {
+                head->FlushPosted = bDue = TRUE;
+            } else {
+                ULONGLONG wait = head->LastFlush + period - now;
+                next = next ? MIN(next, wait) : wait;
+            }
+        }
+        ReleaseMutex(&m_HeadlessLock, locked);
+        if (!bDue) {
+            continue;
+        }
+        // posting to its own queue could block this worker on itself
+        if (i == 0) {
+            FlushHeadless(0);
+        } else {
+            PostHeadlessFlush(i);
+        }
+    }
+    return (ULONG)((next + TIMEOUT_TO_MS - 1) / TIMEOUT_TO_MS);
+}
+
+void QxlDevice::WaitForReleaseRing(void)
+{
+    PAGED_CODE();
+    int wait;
+    BOOLEAN locked;
+
+    QXL_TRACE(RELEASE_WAIT, 0);
+
+    locked = WaitForObject(&m_MemLock, NULL);
+    for (;;) {
+        LARGE_INTEGER timeout;
+
+        if (SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
+            ReleaseMutex(&m_MemLock, locked);
+            QXL_SLEEP(10);
+            locked = WaitForObject(&m_MemLock, NULL);
+            if (!SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
+                break;
+            }
+            QXL_COUNT(OomNotifies, 1);
+            QXL_TRACE(OOM_NOTIFY, 0);
+            SyncIo(QXL_IO_NOTIFY_OOM, 0);
+        }
+        SPICE_RING_CONS_WAIT(m_ReleaseRing, wait);
+
+        if (!wait || !m_bActive) {
+            break;
+        }
+
+        ReleaseMutex(&m_MemLock, locked);
+        // queued drawables hold memory too, move them on unless another
+        // thread has the command lock
+        if (m_CmdQueueDepth) {
+            timeout.QuadPart = 0;
+            BOOLEAN cmd_locked = WaitForObject(&m_CmdLock, &timeout);
+            if (cmd_locked) {
+                RefillCmdRing();
+                ReleaseMutex(&m_CmdLock, cmd_locked);
+            }
+        }
+        timeout.QuadPart = -30 * 1000 * 10; //30ms
+        WaitForObject(&m_DisplayEvent, &timeout);
+        locked = WaitForObject(&m_MemLock, NULL);
+
+        if (SPICE_RING_IS_EMPTY(m_ReleaseRing)) {
+            QXL_COUNT(OomNotifies, 1);
+            QXL_TRACE(OOM_NOTIFY, 0);
+            SyncIo(QXL_IO_NOTIFY_OOM, 0);
+        }
+    }
+    ReleaseMutex(&m_MemLock, locked);
+    QXL_TRACE(RELEASE_WAIT_END, 0);
+}
+
+void QxlDevice::FlushReleaseRing()
+{
+    PAGED_CODE();
+    UINT64 output;
+    int notify;
+    int num_to_release = 50;
 
     output = m_FreeOutputs;
 
@@ -4067,10 +6279,11 @@ void QxlDevice::FlushReleaseRing()
 
         output = *SPICE_RING_CONS_ITEM(m_ReleaseRing);
         SPICE_RING_POP(m_ReleaseRing, notify);
+        QXL_COUNT(ReleaseEntries, 1);
     }
 
     m_FreeOutputs = output;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+    QXL_TRACE(RELEASE_FLUSH, 50 - num_to_release);
 }
 
 UINT64 QxlDevice::ReleaseOutput(UINT64 output_id)
@@ -4082,14 +6295,13 @@ UINT64 QxlDevice::ReleaseOutput(UINT64 output_id)
     UINT64 next;
 
     ASSERT(output_id);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("--->%s 0x%x\n", __FUNCTION__, output));
 
     for (now = output->resources, end = now + output->num_res; now < end; now++) {
         RELEASE_RES(*now);
     }
     next = ((QXLReleaseInfo*)output->data)->next;
     FreeMem(output);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<---%s\n", __FUNCTION__));
+    QXL_COUNT(ReleasedOutputs, 1);
     return next;
 }
 
@@ -4100,10 +6312,6 @@ void *QxlDevice::AllocMem(UINT32 mspace_type, size_t size, BOOL force)
     BOOLEAN locked = FALSE;
 
     ASSERT(m_MSInfo[mspace_type]._mspace);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("--->%s: %p(%d) size %u\n", __FUNCTION__,
-        m_MSInfo[mspace_type]._mspace,
-        mspace_footprint(m_MSInfo[mspace_type]._mspace),
-        size));
 #ifdef DBG
      mspace_malloc_stats(m_MSInfo[mspace_type]._mspace);
 #endif
@@ -4153,16 +6361,21 @@ void *QxlDevice::AllocMem(UINT32 mspace_type, size_t size, BOOL force)
 
     ReleaseMutex(&m_MemLock, locked);
 
+    if (!ptr) {
+        QXL_COUNT(AllocFailures, 1);
+        QXL_TRACE(ALLOC_FAILED, size, mspace_type, force);
+    } else {
+        QXL_TRACE(ALLOC, size, mspace_type, (ULONG_PTR)ptr);
+    }
     ASSERT((!ptr && (!force || !m_bActive)) || (ptr >= m_MSInfo[mspace_type].mspace_start &&
                                       ptr < m_MSInfo[mspace_type].mspace_end));
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<---%s: ptr 0x%x\n", __FUNCTION__, ptr));
     return ptr;
 }
 
 void QxlDevice::FreeMem(void *ptr)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    QXL_TRACE(FREE, (ULONG_PTR)ptr);
 
     for (const MspaceInfo *info = m_MSInfo; ; ++info)
     {
@@ -4180,7 +6393,6 @@ void QxlDevice::FreeMem(void *ptr)
             break;
         }
     }
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
 QXLDrawable *QxlDevice::GetDrawable()
@@ -4196,11 +6408,10 @@ QXLDrawable *QxlDevice::GetDrawable()
     output->num_res = 0;
     RESOURCE_TYPE(output, RESOURCE_TYPE_DRAWABLE);
     ((QXLDrawable *)output->data)->release_info.id = (UINT64)output;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--> %s 0x%x\n", __FUNCTION__, output));
     return(QXLDrawable *)output->data;
 }
 
-QXLCursorCmd *QxlDevice::CursorCmd()
+QXLCursorCmd *QxlDevice::CursorCmd(BOOLEAN bForce)
 {
     PAGED_CODE();
     QXLCursorCmd *cursor_cmd;
@@ -4208,11 +6419,12 @@ QXLCursorCmd *QxlDevice::CursorCmd()
 
     DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
     // commands must be allocated into Bar0 (DEVRAM)
-    output = (QXLOutput *)AllocMem(MSPACE_TYPE_DEVRAM, sizeof(QXLOutput) + sizeof(QXLCursorCmd), TRUE);
+    output = (QXLOutput *)AllocMem(MSPACE_TYPE_DEVRAM, sizeof(QXLOutput) + sizeof(QXLCursorCmd), bForce);
     if (!output) {
         return NULL;
     }
     output->num_res = 0;
+    InitializeListHead(&output->list);
     RESOURCE_TYPE(output, RESOURCE_TYPE_CURSOR);
     cursor_cmd = (QXLCursorCmd *)output->data;
     cursor_cmd->release_info.id = (UINT64)output;
@@ -4277,6 +6489,13 @@ static FORCEINLINE PLIST_ENTRY DelayedList(QXLDrawable *pd)
     return &output->list;
 }
 
+static FORCEINLINE PLIST_ENTRY DelayedList(QXLCursorCmd *pcmd)
+{
+    QXLOutput *output;
+    output = (QXLOutput *)((UINT8 *)pcmd - sizeof(QXLOutput));
+    return &output->list;
+}
+
 void QxlDevice::CursorCmdAddRes(QXLCursorCmd *cmd, Resource *res)
 {
     PAGED_CODE();
@@ -4289,7 +6508,6 @@ void QxlDevice::CursorCmdAddRes(QXLCursorCmd *cmd, Resource *res)
 void QxlDevice::FreeClipRectsEx(Resource *res)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--> %s\n", __FUNCTION__));
     QxlDevice* pqxl = (QxlDevice*)res->ptr;
     pqxl->FreeClipRects(res);
 }
@@ -4298,7 +6516,6 @@ void QxlDevice::FreeClipRects(Resource *res)
 {
     PAGED_CODE();
     QXLPHYSICAL chunk_phys;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
     chunk_phys = ((QXLClipRects *)res->res)->chunk.next_chunk;
     while (chunk_phys) {
@@ -4307,13 +6524,11 @@ void QxlDevice::FreeClipRects(Resource *res)
         FreeMem(chunk);
     }
     FreeMem(res);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
 void QxlDevice::FreeBitmapImageEx(Resource *res)
 {
     PAGED_CODE();
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--> %s\n", __FUNCTION__));
     QxlDevice* pqxl = (QxlDevice*)res->ptr;
     pqxl->FreeBitmapImage(res);
 }
@@ -4323,7 +6538,6 @@ void QxlDevice::FreeBitmapImage(Resource *res)
     PAGED_CODE();
     InternalImage *internal;
     QXLPHYSICAL chunk_phys;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
     internal = (InternalImage *)res->res;
 
@@ -4335,7 +6549,6 @@ void QxlDevice::FreeBitmapImage(Resource *res)
     }
 
     FreeMem(res);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
 void QxlDevice::FreeCursorEx(Resource *res)
@@ -4363,140 +6576,677 @@ void QxlDevice::FreeCursor(Resource *res)
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
-QXLDrawable *QxlDevice::Drawable(UINT8 type, CONST RECT *area, CONST RECT *clip, UINT32 surface_id)
+static FORCEINLINE Resource *CursorResource(InternalCursor *internal)
 {
-    PAGED_CODE();
-    QXLDrawable *drawable;
-
-    ASSERT(area);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    return (Resource *)((UINT8 *)internal - sizeof(Resource));
+}
 
-    drawable = GetDrawable();
-    if (!drawable) {
-        return NULL;
-    }
-    drawable->surface_id = surface_id;
-    drawable->type = type;
-    drawable->effect = QXL_EFFECT_OPAQUE;
-    drawable->self_bitmap = 0;
-    drawable->mm_time = m_RomHdr->mm_clock;
-    drawable->surfaces_dest[0] = -1;
-    drawable->surfaces_dest[1] = - 1;
-    drawable->surfaces_dest[2] = -1;
-    CopyRect(&drawable->bbox, area);
-    InitializeListHead(DelayedList(drawable));
+// 64-bit FNV-1a, used to give each cursor shape a stable unique id
+#define CURSOR_HASH_BASIS 0xcbf29ce484222325ULL
+#define CURSOR_HASH_PRIME 0x100000001b3ULL
 
-    if (!SetClip(clip, drawable)) {
-        DbgPrint(TRACE_LEVEL_VERBOSE, ("%s: set clip failed\n", __FUNCTION__));
-        ReleaseOutput(drawable->release_info.id);
-        drawable = NULL;
+static FORCEINLINE UINT64 CursorHashBytes(UINT64 hash, CONST UINT8 *data, size_t size)
+{
+    while (size--) {
+        hash ^= *data++;
+        hash *= CURSOR_HASH_PRIME;
     }
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
-    return drawable;
+    return hash;
 }
 
-void QxlDevice::PushDrawable(QXLDrawable *drawable)
+// caller must hold m_MemLock, the cached resources are also
+// referenced and released by FlushReleaseRing
+// header.unique is a hash of the shape and does not rule out another one
+// with the same hash, so a hit also compares the bytes kept in the chunks
+// of the cached shape. The host caches shapes by unique as well, a shape
+// that collides is sent with unique 0 and not cached
+BOOLEAN QxlDevice::CursorShapeEqual(InternalCursor *internal, CONST UINT8 *src, LONG pitch,
+                                    UINT line_size, UINT num_lines)
 {
     PAGED_CODE();
-    QXLCommand *cmd;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    QXLDataChunk *chunk = &internal->cursor.chunk;
+    UINT32 offset = 0;
 
-    BOOLEAN locked = FALSE;
-    locked = WaitForObject(&m_CmdLock, NULL);
-    WaitForCmdRing();
-    cmd = SPICE_RING_PROD_ITEM(m_CommandRing);
-    cmd->type = QXL_CMD_DRAW;
-    cmd->data = PA(drawable);
-    PushCmd();
-    ReleaseMutex(&m_CmdLock, locked);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+    if (internal->cursor.data_size != line_size * num_lines) {
+        return FALSE;
+    }
+    for (; num_lines; --num_lines, src += pitch) {
+        UINT done = 0;
+        while (done < line_size) {
+            if (offset == chunk->data_size) {
+                if (!chunk->next_chunk) {
+                    return FALSE;
+                }
+                chunk = (QXLDataChunk *)VA(chunk->next_chunk);
+                offset = 0;
+                continue;
+            }
+            UINT n = MIN(line_size - done, chunk->data_size - offset);
+            if (RtlCompareMemory(chunk->data + offset, src + done, n) != n) {
+                return FALSE;
+            }
+            offset += n;
+            done += n;
+        }
+    }
+    return TRUE;
 }
 
-void QxlDevice::PushCursorCmd(QXLCursorCmd *cursor_cmd)
+InternalCursor *QxlDevice::CursorCacheLookup(CONST QXLCursorHeader *header, CONST UINT8 *src, LONG pitch,
+                                             UINT line_size, UINT num_lines, BOOLEAN *pbCollision)
 {
     PAGED_CODE();
-    QXLCommand *cmd;
-
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+    InternalCursor *internal = m_CursorCache[CURSOR_HASH_VAL(header->unique)];
 
-    BOOLEAN locked = FALSE;
-    locked = WaitForObject(&m_CrsLock, NULL);
-    WaitForCursorRing();
-    cmd = SPICE_RING_PROD_ITEM(m_CursorRing);
-    cmd->type = QXL_CMD_CURSOR;
-    cmd->data = PA(cursor_cmd);
-    PushCursor();
-    ReleaseMutex(&m_CrsLock, locked);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+    for (; internal; internal = internal->next) {
+        CONST QXLCursorHeader *cached = &internal->cursor.header;
+        if (cached->unique == header->unique &&
+            cached->type == header->type &&
+            cached->width == header->width &&
+            cached->height == header->height &&
+            cached->hot_spot_x == header->hot_spot_x &&
+            cached->hot_spot_y == header->hot_spot_y) {
+            if (!CursorShapeEqual(internal, src, pitch, line_size, num_lines)) {
+                *pbCollision = TRUE;
+                return NULL;
+            }
+            RemoveEntryList(&internal->lru_link);
+            InsertHeadList(&m_CursorCacheLru, &internal->lru_link);
+            return internal;
+        }
+    }
+    return NULL;
 }
 
-VOID QxlDevice::SetImageId(InternalImage *internal,
-    BOOL cache_me,
-    LONG width,
-    LONG height,
-    UINT8 format, UINT32 key)
+// caller must hold m_MemLock
+void QxlDevice::CursorCacheAdd(InternalCursor *internal)
 {
     PAGED_CODE();
-    UINT32 image_info = IMAGE_HASH_INIT_VAL(width, height, format);
+    InternalCursor **pnow;
 
-    if (cache_me) {
-        QXL_SET_IMAGE_ID(&internal->image, ((UINT32)QXL_IMAGE_GROUP_DRIVER << 30) |
-                         image_info, key);
-        internal->image.descriptor.flags = QXL_IMAGE_CACHE;
-    } else {
-        QXL_SET_IMAGE_ID(&internal->image, ((UINT32)QXL_IMAGE_GROUP_DRIVER_DONT_CACHE  << 30) |
-                         image_info, key);
-        internal->image.descriptor.flags = 0;
+    if (m_NumCachedCursors == CURSOR_CACHE_SIZE) {
+        InternalCursor *oldest = CONTAINING_RECORD(RemoveTailList(&m_CursorCacheLru), InternalCursor, lru_link);
+        for (pnow = &m_CursorCache[CURSOR_HASH_VAL(oldest->cursor.header.unique)]; *pnow; pnow = &(*pnow)->next) {
+            if (*pnow == oldest) {
+                *pnow = oldest->next;
+                break;
+            }
+        }
+        m_NumCachedCursors--;
+        RELEASE_RES(CursorResource(oldest));
     }
+
+    pnow = &m_CursorCache[CURSOR_HASH_VAL(internal->cursor.header.unique)];
+    internal->next = *pnow;
+    *pnow = internal;
+    InsertHeadList(&m_CursorCacheLru, &internal->lru_link);
+    m_NumCachedCursors++;
+    GET_RES(CursorResource(internal));
 }
 
-QXLDrawable *QxlDevice::PrepareCopyBits(const RECT& rect, const POINT& sourcePoint)
+void QxlDevice::CacheCursor(InternalCursor *internal, BOOLEAN bForce)
 {
     PAGED_CODE();
-    QXLDrawable *drawable;
-
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s device %d\n", __FUNCTION__,m_Id));
+    BOOLEAN locked;
 
-    if (!(drawable = Drawable(QXL_COPY_BITS, &rect, NULL, 0))) {
-        DbgPrint(TRACE_LEVEL_ERROR, ("Cannot get Drawable.\n"));
-        return NULL;
+    // a shape that collided with a cached one, see CursorShapeEqual
+    if (!internal->cursor.header.unique) {
+        return;
     }
-
-    drawable->u.copy_bits.src_pos.x = sourcePoint.x;
-    drawable->u.copy_bits.src_pos.y = sourcePoint.y;
-
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
-
-    return drawable;
+    if (bForce) {
+        locked = WaitForObject(&m_MemLock, NULL);
+    } else {
+        LARGE_INTEGER doNotWait;
+        doNotWait.QuadPart = 0;
+        locked = WaitForObject(&m_MemLock, &doNotWait);
+        if (!locked) {
+            // not cached this time, the shape is uploaded again when used next time
+            return;
+        }
+    }
+    CursorCacheAdd(internal);
+    ReleaseMutex(&m_MemLock, locked);
 }
 
-BOOLEAN QxlDevice::AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src_end, INT pitch, BOOLEAN bForce)
+// Attaches the shape to the cursor command, either from the cache or by
+// uploading it to device memory. Without bForce it never waits for
+// m_MemLock: if the resource can't be allocated it returns FALSE and the
+// command is left untouched, if only later chunks can't be allocated the
+// rest of the shape is kept in the delayed list of the command and must
+// be completed by PrepareCursor
+BOOLEAN QxlDevice::AttachCursorShape(QXLCursorCmd *cursor_cmd, CONST QXLCursorHeader *header,
+                                     UINT8 *src, LONG pitch, int line_size, UINT num_lines, BOOLEAN bForce)
 {
     PAGED_CODE();
-    LONG width, height;
-    size_t alloc_size;
-    UINT32 line_size;
-    Resource *image_res;
-    InternalImage *internal;
+    InternalCursor *internal;
+    QXLCursor *cursor;
+    Resource *res;
     QXLDataChunk *chunk;
-    PLIST_ENTRY pDelayedList = bForce ? NULL : DelayedList(drawable);
-    UINT8* dest, *dest_end;
+    UINT8 *now;
+    UINT8 *end;
+    size_t alloc_size;
+    size_t data_size = line_size * num_lines;
+    PLIST_ENTRY pDelayed = bForce ? NULL : DelayedList(cursor_cmd);
+    BOOLEAN locked;
+    BOOLEAN complete = TRUE;
+    BOOLEAN bCollision = FALSE;
 
-    height = drawable->u.copy.src_area.bottom;
-    width = drawable->u.copy.src_area.right;
-    line_size = width * 4;
+    cursor_cmd->type = QXL_CURSOR_SET;
 
-    alloc_size = BITMAP_ALLOC_BASE + BITS_BUF_MAX - BITS_BUF_MAX % line_size;
-    alloc_size = MIN(BITMAP_ALLOC_BASE + height * line_size, alloc_size);
-    image_res = (Resource*)AllocMem(MSPACE_TYPE_VRAM, alloc_size, bForce);
+    cursor_cmd->u.set.visible = TRUE;
+    cursor_cmd->u.set.position.x = 0;
+    cursor_cmd->u.set.position.y = 0;
 
-    if (image_res) {
+    if (bForce) {
+        locked = WaitForObject(&m_MemLock, NULL);
+    } else {
+        LARGE_INTEGER doNotWait;
+        doNotWait.QuadPart = 0;
+        locked = WaitForObject(&m_MemLock, &doNotWait);
+        if (!locked) {
+            return FALSE;
+        }
+    }
+    internal = CursorCacheLookup(header, src, pitch, line_size, num_lines, &bCollision);
+    if (internal) {
+        CursorCmdAddRes(cursor_cmd, CursorResource(internal));
+    }
+    ReleaseMutex(&m_MemLock, locked);
+
+    if (internal) {
+        QXL_COUNT(CursorCacheHits, 1);
+        DbgPrint(TRACE_LEVEL_VERBOSE, ("%s: cursor %I64x found in cache\n", __FUNCTION__, header->unique));
+        cursor_cmd->u.set.shape = PA(&internal->cursor);
+        return TRUE;
+    }
+
+    alloc_size = MIN(CURSOR_ALLOC_SIZE, sizeof(Resource) + sizeof(InternalCursor) + data_size);
+    res = (Resource *)AllocMem(MSPACE_TYPE_VRAM, alloc_size, bForce);
+    if (!res) {
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: Failed to allocate cursor data (force %d)\n", __FUNCTION__, bForce));
+        return FALSE;
+    }
+    QXL_COUNT(CursorCacheMisses, 1);
+
+    res->refs = 1;
+    res->free = FreeCursorEx;
+    res->ptr = this;
+    RESOURCE_TYPE(res, RESOURCE_TYPE_CURSOR);
+
+    internal = (InternalCursor *)res->res;
+    internal->next = NULL;
+
+    cursor = &internal->cursor;
+    cursor->header = *header;
+    cursor->data_size = (UINT32)data_size;
+    if (bCollision) {
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: cursor %I64x collides with a cached one\n", __FUNCTION__, header->unique));
+        cursor->header.unique = 0;
+    }
+
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("<--> %s %d::%d::%d::%d::%d unique %I64x\n", __FUNCTION__,
+        cursor->header.width, cursor->header.height, cursor->header.hot_spot_x, cursor->header.hot_spot_y, cursor->data_size,
+        cursor->header.unique));
+
+    chunk = &cursor->chunk;
+    chunk->data_size = 0;
+    chunk->prev_chunk = 0;
+    chunk->next_chunk = 0;
+
+    now = chunk->data;
+    end = (UINT8 *)res + alloc_size;
+    // large shapes continue in chained chunks of up to BITS_BUF_MAX
+    for (; num_lines; --num_lines, src += pitch) {
+        if (!PutBytesAlign(&chunk, &now, &end, src, line_size, line_size * num_lines, pDelayed)) {
+            DbgPrint(TRACE_LEVEL_ERROR, ("%s: failed to push part of shape\n", __FUNCTION__));
+            complete = FALSE;
+            break;
+        }
+    }
+    CursorCmdAddRes(cursor_cmd, res);
+    RELEASE_RES(res);
+    cursor_cmd->u.set.shape = PA(&internal->cursor);
+    if (complete && (!pDelayed || IsListEmpty(pDelayed))) {
+        CacheCursor(internal, bForce);
+    }
+    return TRUE;
+}
+
+// Moves the delayed part of the shape to device memory, executed by the
+// worker thread before the command is pushed
+ULONG QxlDevice::PrepareCursor(QXLCursorCmd*& cursor_cmd)
+{
+    PAGED_CODE();
+    ULONG n = 0;
+    BOOLEAN bFail;
+    PLIST_ENTRY pe = DelayedList(cursor_cmd);
+    QXLDataChunk *chunk, *lastchunk = NULL;
+
+    if (IsListEmpty(pe)) {
+        return 0;
+    }
+
+    bFail = !m_bActive;
+
+    while (!IsListEmpty(pe)) {
+        DelayedChunk *pdc = (DelayedChunk *)RemoveHeadList(pe);
+        if (!lastchunk) {
+            lastchunk = (QXLDataChunk *)pdc->chunk.prev_chunk;
+        }
+        if (!bFail) {
+            chunk = MakeChunk(pdc);
+            if (chunk) {
+                chunk->prev_chunk = PA(lastchunk);
+                lastchunk->next_chunk = PA(chunk);
+                lastchunk = chunk;
+                ++n;
+            } else {
+                bFail = TRUE;
+            }
+        }
+        delete[] reinterpret_cast<BYTE*>(pdc);
+    }
+    if (bFail) {
+        ReleaseOutput(cursor_cmd->release_info.id);
+        cursor_cmd = NULL;
+    } else {
+        QXLCursor *cursor = (QXLCursor *)VA(cursor_cmd->u.set.shape);
+        CacheCursor(CONTAINING_RECORD(cursor, InternalCursor, cursor), TRUE);
+    }
+    return n;
+}
+
+// the cached shapes live in device memory which is reinitialized
+// together with the device, so they are forgotten rather than freed
+void QxlDevice::ResetCursorCache(void)
+{
+    PAGED_CODE();
+    RtlZeroMemory(m_CursorCache, sizeof(m_CursorCache));
+    InitializeListHead(&m_CursorCacheLru);
+    m_NumCachedCursors = 0;
+}
+
+QXLDrawable *QxlDevice::Drawable(UINT8 type, CONST RECT *area, CONST RECT *clip, UINT32 surface_id)
+{
+    PAGED_CODE();
+    QXLDrawable *drawable;
+
+    ASSERT(area);
+
+    drawable = GetDrawable();
+    if (!drawable) {
+        return NULL;
+    }
+    drawable->surface_id = surface_id;
+    drawable->type = type;
+    drawable->effect = QXL_EFFECT_OPAQUE;
+    drawable->self_bitmap = 0;
+    drawable->mm_time = m_RomHdr->mm_clock;
+    drawable->surfaces_dest[0] = -1;
+    drawable->surfaces_dest[1] = - 1;
+    drawable->surfaces_dest[2] = -1;
+    CopyRect(&drawable->bbox, area);
+    InitializeListHead(DelayedList(drawable));
+
+    if (!SetClip(clip, drawable)) {
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: set clip failed\n", __FUNCTION__));
+        ReleaseOutput(drawable->release_info.id);
+        drawable = NULL;
+    }
+    if (drawable) {
+        QXL_TRACE(DRAWABLE, (ULONG_PTR)drawable, type, surface_id);
+    }
+    return drawable;
+}
+
+// Moves a drawable of a head to the head position in the primary surface
+void QxlDevice::OffsetDrawable(QXLDrawable *drawable, LONG dx)
+{
+    PAGED_CODE();
+    if (!dx) {
+        return;
+    }
+    drawable->bbox.left += dx;
+    drawable->bbox.right += dx;
+    if (drawable->surfaces_dest[0] == 0) {
+        drawable->surfaces_rects[0].left += dx;
+        drawable->surfaces_rects[0].right += dx;
+    }
+    if (drawable->self_bitmap) {
+        drawable->self_bitmap_area.left += dx;
+        drawable->self_bitmap_area.right += dx;
+    }
+    if (drawable->type == QXL_COPY_BITS) {
+        drawable->u.copy_bits.src_pos.x += dx;
+    }
+}
+
+// a copy of a bitmap to the primary surface, with nothing read from the
+// surfaces; the queue may drop it when covered or move it when disjoint
+static BOOLEAN IsPlainDrawable(QXLDrawable *drawable)
+{
+    return drawable->type == QXL_DRAW_COPY && drawable->surface_id == 0 && drawable->self_bitmap &&
+        drawable->clip.type == SPICE_CLIP_TYPE_NONE &&
+        drawable->u.copy.rop_descriptor == SPICE_ROPD_OP_PUT;
+}
+
+static FORCEINLINE BOOLEAN QxlRectsIntersect(CONST QXLRect *a, CONST QXLRect *b)
+{
+    return a->left < b->right && b->left < a->right && a->top < b->bottom && b->top < a->bottom;
+}
+
+static FORCEINLINE BOOLEAN QxlRectInside(CONST QXLRect *inner, CONST QXLRect *outer)
+{
+    return inner->left >= outer->left && inner->right <= outer->right &&
+        inner->top >= outer->top && inner->bottom <= outer->bottom;
+}
+
+void QxlDevice::ResetCmdQueue(void)
+{
+    PAGED_CODE();
+    // the device forgets the queued commands on reset and their memory
+    // was handed back with the mspace
+    InitializeListHead(&m_CmdQueue);
+    InitializeListHead(&m_CmdQueueFree);
+    for (UINT i = 0; i < CMD_QUEUE_SIZE; ++i) {
+        InsertTailList(&m_CmdQueueFree, &m_CmdQueueEntries[i].link);
+    }
+    m_CmdQueueDepth = 0;
+}
+
+// Puts a command in the command ring, called under m_CmdLock with room
+// in the ring
+void QxlDevice::RingCmd(UINT32 type, PVOID ptr)
+{
+    PAGED_CODE();
+    QXLCommand *cmd = SPICE_RING_PROD_ITEM(m_CommandRing);
+    cmd->type = type;
+    cmd->data = PA(ptr);
+    PushCmd();
+    if (type == QXL_CMD_DRAW) {
+        QXL_COUNT(Drawables, 1);
+        QXL_TRACE(DRAWABLE_PUSH, (ULONG_PTR)ptr);
+    }
+}
+
+// Moves queued commands to the command ring while it has room, called
+// under m_CmdLock. While some are left the device is asked for
+// QXL_INTERRUPT_DISPLAY once it consumed CMD_QUEUE_REFILL commands, the
+// DPC then wakes the worker of head 0 to come back here
+void QxlDevice::RefillCmdRing(void)
+{
+    PAGED_CODE();
+    ULONG n = 0;
+
+    while (!IsListEmpty(&m_CmdQueue)) {
+        if (SPICE_RING_IS_FULL(m_CommandRing)) {
+            m_CommandRing->notify_on_cons = m_CommandRing->cons + CMD_QUEUE_REFILL;
+            spice_mb();
+            // the device may have moved on before it saw the request
+            if (SPICE_RING_IS_FULL(m_CommandRing)) {
+                break;
+            }
+            continue;
+        }
+        QueuedCmd *queued = CONTAINING_RECORD(RemoveHeadList(&m_CmdQueue), QueuedCmd, link);
+        RingCmd(queued->type, queued->ptr);
+        InsertTailList(&m_CmdQueueFree, &queued->link);
+        --m_CmdQueueDepth;
+        ++n;
+    }
+    if (n) {
+        QXL_TRACE(CMD_REFILL, n, m_CmdQueueDepth);
+    }
+}
+
+// Drops the queued drawables a drawable going to the queue covers whole.
+// Each one is only dropped if no command queued after it reads its area,
+// the scan stops at the first command that is not a plain drawable.
+// Called under m_CmdLock
+void QxlDevice::MergeQueuedDrawables(QXLDrawable *drawable)
+{
+    PAGED_CODE();
+    // bounding box of the drawables passed and kept, they may read the
+    // ones before them through their self bitmap
+    QXLRect kept = { 0, 0, 0, 0 };
+    PLIST_ENTRY prev;
+
+    if (!IsPlainDrawable(drawable)) {
+        return;
+    }
+    for (PLIST_ENTRY e = m_CmdQueue.Blink; e != &m_CmdQueue; e = prev) {
+        QueuedCmd *queued = CONTAINING_RECORD(e, QueuedCmd, link);
+        QXLDrawable *older = (QXLDrawable *)queued->ptr;
+
+        prev = e->Blink;
+        if (queued->type != QXL_CMD_DRAW || !IsPlainDrawable(older)) {
+            break;
+        }
+        if (QxlRectInside(&older->bbox, &drawable->bbox) && !QxlRectsIntersect(&older->bbox, &kept)) {
+            RemoveEntryList(e);
+            InsertTailList(&m_CmdQueueFree, e);
+            --m_CmdQueueDepth;
+            // prepared, no delayed chunks left
+            ReleaseOutput(older->release_info.id);
+            QXL_COUNT(CmdsMerged, 1);
+            continue;
+        }
+        if (kept.right <= kept.left) {
+            kept = older->bbox;
+        } else {
+            kept.left = MIN(kept.left, older->bbox.left);
+            kept.top = MIN(kept.top, older->bbox.top);
+            kept.right = MAX(kept.right, older->bbox.right);
+            kept.bottom = MAX(kept.bottom, older->bbox.bottom);
+        }
+    }
+}
+
+// Hands a command to the device without waiting for it: straight to the
+// command ring if nothing is queued and it has room, else to the queue in
+// front of it. A small plain drawable goes ahead of the large plain ones
+// queued last, as long as they do not overlap. Only a full queue with
+// nothing to merge waits for the device. Called under m_CmdLock
+void QxlDevice::QueueCmd(UINT32 type, PVOID ptr)
+{
+    PAGED_CODE();
+    PLIST_ENTRY after;
+
+    RefillCmdRing();
+    if (IsListEmpty(&m_CmdQueue) && !SPICE_RING_IS_FULL(m_CommandRing)) {
+        RingCmd(type, ptr);
+        return;
+    }
+    if (type == QXL_CMD_DRAW) {
+        MergeQueuedDrawables((QXLDrawable *)ptr);
+    }
+    while (IsListEmpty(&m_CmdQueueFree)) {
+        WaitForCmdRing();
+        RefillCmdRing();
+    }
+    if (IsListEmpty(&m_CmdQueue) && !SPICE_RING_IS_FULL(m_CommandRing)) {
+        RingCmd(type, ptr);
+        return;
+    }
+
+    QueuedCmd *queued = CONTAINING_RECORD(RemoveHeadList(&m_CmdQueueFree), QueuedCmd, link);
+    queued->type = type;
+    queued->ptr = ptr;
+    after = m_CmdQueue.Blink;
+    if (type == QXL_CMD_DRAW && IsPlainDrawable((QXLDrawable *)ptr)) {
+        QXLRect *bbox = &((QXLDrawable *)ptr)->bbox;
+        if ((LONGLONG)(bbox->right - bbox->left) * (bbox->bottom - bbox->top) <= CMD_QUEUE_SMALL_PIXELS) {
+            while (after != &m_CmdQueue) {
+                QueuedCmd *older = CONTAINING_RECORD(after, QueuedCmd, link);
+                QXLDrawable *drawable = (QXLDrawable *)older->ptr;
+                if (older->type != QXL_CMD_DRAW || !IsPlainDrawable(drawable) ||
+                    (LONGLONG)(drawable->bbox.right - drawable->bbox.left) *
+                    (drawable->bbox.bottom - drawable->bbox.top) <= CMD_QUEUE_SMALL_PIXELS ||
+                    QxlRectsIntersect(&drawable->bbox, bbox)) {
+                    break;
+                }
+                after = after->Blink;
+            }
+            if (after != m_CmdQueue.Blink) {
+                QXL_COUNT(CmdsPromoted, 1);
+            }
+        }
+    }
+    InsertHeadList(after, &queued->link);
+    ++m_CmdQueueDepth;
+    QXL_COUNT(CmdsQueued, 1);
+    if (m_CmdQueueDepth > m_Counters.CmdQueueMax) {
+        InterlockedExchange64(&m_Counters.CmdQueueMax, (LONG64)m_CmdQueueDepth);
+    }
+    QXL_TRACE(CMD_QUEUED, m_CmdQueueDepth);
+    // ask for the interrupt, or push right away if the ring drained
+    RefillCmdRing();
+}
+
+// Pushes every queued command, waiting for the device as needed, before
+// commands that bypass the ring such as a primary surface change
+void QxlDevice::FlushCmdQueue(void)
+{
+    PAGED_CODE();
+    BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+    for (RefillCmdRing(); !IsListEmpty(&m_CmdQueue); RefillCmdRing()) {
+        WaitForCmdRing();
+    }
+    ReleaseMutex(&m_CmdLock, locked);
+}
+
+void QxlDevice::PushDrawable(QXLDrawable *drawable)
+{
+    PAGED_CODE();
+    BOOLEAN locked = FALSE;
+    locked = WaitForObject(&m_CmdLock, NULL);
+    QueueCmd(QXL_CMD_DRAW, drawable);
+    ReleaseMutex(&m_CmdLock, locked);
+}
+
+void QxlDevice::PushCursorCmd(QXLCursorCmd *cursor_cmd)
+{
+    PAGED_CODE();
+    QXLCommand *cmd;
+
+    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
+
+    BOOLEAN locked = FALSE;
+    locked = WaitForObject(&m_CrsLock, NULL);
+    WaitForCursorRing();
+    cmd = SPICE_RING_PROD_ITEM(m_CursorRing);
+    cmd->type = QXL_CMD_CURSOR;
+    cmd->data = PA(cursor_cmd);
+    // any other command breaks the coalescing, later moves must
+    // not be reordered before it
+    m_PendingMove = (cursor_cmd->type == QXL_CURSOR_MOVE) ? cursor_cmd : NULL;
+    m_PendingMoveProd = m_CursorRing->prod;
+    PushCursor();
+    ReleaseMutex(&m_CrsLock, locked);
+    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+}
+
+VOID QxlDevice::SetImageId(InternalImage *internal,
+    BOOL cache_me,
+    LONG width,
+    LONG height,
+    UINT8 format, UINT32 key)
+{
+    PAGED_CODE();
+    UINT32 image_info = IMAGE_HASH_INIT_VAL(width, height, format);
+
+    if (cache_me) {
+        QXL_SET_IMAGE_ID(&internal->image, ((UINT32)QXL_IMAGE_GROUP_DRIVER << 30) |
+                         image_info, key);
+        internal->image.descriptor.flags = QXL_IMAGE_CACHE;
+    } else {
+        QXL_SET_IMAGE_ID(&internal->image, ((UINT32)QXL_IMAGE_GROUP_DRIVER_DONT_CACHE  << 30) |
+                         image_info, key);
+        internal->image.descriptor.flags = 0;
+    }
+}
+
+QXLDrawable *QxlDevice::PrepareCopyBits(const RECT& rect, const POINT& sourcePoint)
+{
+    PAGED_CODE();
+    QXLDrawable *drawable;
+
+    if (!(drawable = Drawable(QXL_COPY_BITS, &rect, NULL, 0))) {
+        DbgPrint(TRACE_LEVEL_ERROR, ("Cannot get Drawable.\n"));
+        return NULL;
+    }
+
+    drawable->u.copy_bits.src_pos.x = sourcePoint.x;
+    drawable->u.copy_bits.src_pos.y = sourcePoint.y;
+
+    return drawable;
+}
+
+// x8r8g8b8 to x1r5g5b5, eight pixels per step with SSE2 on x64 where
+// the kernel keeps the XMM state of the thread
+static void ConvertLine32To16(UINT16 *dst, CONST UINT32 *src, UINT32 count)
+{
+    UINT32 i = 0;
+#ifdef _M_X64
+    const __m128i mask_b = _mm_set1_epi32(0x001f);
+    const __m128i mask_g = _mm_set1_epi32(0x03e0);
+    const __m128i mask_r = _mm_set1_epi32(0x7c00);
+    for (; i + 8 <= count; i += 8) {
+        __m128i p0 = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i p1 = _mm_loadu_si128((const __m128i *)(src + i + 4));
+        p0 = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p0, 9), mask_r),
+                                       _mm_and_si128(_mm_srli_epi32(p0, 6), mask_g)),
+                          _mm_and_si128(_mm_srli_epi32(p0, 3), mask_b));
+        p1 = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(p1, 9), mask_r),
+                                       _mm_and_si128(_mm_srli_epi32(p1, 6), mask_g)),
+                          _mm_and_si128(_mm_srli_epi32(p1, 3), mask_b));
+        // values are below 0x8000, the signed saturation keeps them
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(p0, p1));
+    }
+#endif
+    for (; i < count; ++i) {
+        UINT32 p = src[i];
+        dst[i] = (UINT16)(((p >> 9) & 0x7c00) | ((p >> 6) & 0x03e0) | ((p >> 3) & 0x001f));
+    }
+}
+
+BOOLEAN QxlDevice::AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src_end, INT pitch, BOOLEAN bForce, BOOLEAN bConverted, UINT bpp)
+{
+    PAGED_CODE();
+    LONG width, height;
+    size_t alloc_size;
+    UINT32 line_size;
+    Resource *image_res;
+    InternalImage *internal;
+    QXLDataChunk *chunk;
+    PLIST_ENTRY pDelayedList = bForce ? NULL : DelayedList(drawable);
+    UINT8* dest, *dest_end;
+    UINT16 *line16 = NULL;
+
+    height = drawable->u.copy.src_area.bottom;
+    width = drawable->u.copy.src_area.right;
+    line_size = width * bpp / BITS_PER_BYTE;
+    // delayed bitmaps are already in the bitmap format
+    if (bpp == 16 && !bConverted) {
+        line16 = new (PagedPool, NoInit) UINT16[width];
+        if (!line16) {
+            DbgPrint(TRACE_LEVEL_ERROR, ("Cannot allocate conversion line for drawable\n"));
+            return FALSE;
+        }
+    }
+
+    alloc_size = BITMAP_ALLOC_BASE + BITS_BUF_MAX - BITS_BUF_MAX % line_size;
+    alloc_size = MIN(BITMAP_ALLOC_BASE + height * line_size, alloc_size);
+    image_res = (Resource*)AllocMem(MSPACE_TYPE_VRAM, alloc_size, bForce);
+
+    if (image_res) {
         image_res->refs = 1;
         image_res->free = FreeBitmapImageEx;
         image_res->ptr = this;
 
         internal = (InternalImage *)image_res->res;
-        SetImageId(internal, FALSE, width, height, SPICE_BITMAP_FMT_32BIT, 0);
+        SetImageId(internal, FALSE, width, height,
+                   bpp == 16 ? SPICE_BITMAP_FMT_16BIT : SPICE_BITMAP_FMT_32BIT, 0);
         internal->image.descriptor.flags = 0;
         internal->image.descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
 
@@ -4508,7 +7258,7 @@ BOOLEAN QxlDevice::AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src
         internal->image.bitmap.flags = 0;
         internal->image.descriptor.width = internal->image.bitmap.x = width;
         internal->image.descriptor.height = internal->image.bitmap.y = height;
-        internal->image.bitmap.format = SPICE_BITMAP_FMT_RGBA;
+        internal->image.bitmap.format = bpp == 16 ? SPICE_BITMAP_FMT_16BIT : SPICE_BITMAP_FMT_RGBA;
         internal->image.bitmap.stride = line_size;
         internal->image.bitmap.palette = 0;
 
@@ -4523,10 +7273,12 @@ BOOLEAN QxlDevice::AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src
     } else if (!bForce) {
         alloc_size = height * line_size;
         // allocate delayed chunck for entire bitmap without limitation
-        DelayedChunk *pChunk = (DelayedChunk *)new (PagedPool)BYTE[alloc_size + sizeof(DelayedChunk)];
+        DelayedChunk *pChunk = (DelayedChunk *)new (PagedPool, NoInit) BYTE[alloc_size + sizeof(DelayedChunk)];
         if (pChunk) {
             // add it to delayed list
             InsertTailList(pDelayedList, &pChunk->list);
+            QXL_COUNT(DelayedChunks, 1);
+            QXL_TRACE(DELAYED_CHUNK, alloc_size);
             // PutBytesAlign do not need to allocate additional memory
             pDelayedList = NULL;
             chunk = &pChunk->chunk;
@@ -4539,27 +7291,50 @@ BOOLEAN QxlDevice::AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src
         } else {
             // can't allocate memory
             DbgPrint(TRACE_LEVEL_ERROR, ("Cannot allocate delayed bitmap for drawable\n"));
+            delete[] line16;
             return FALSE;
         }
     } else {
         // can't allocate memory (forced), driver abort flow
         DbgPrint(TRACE_LEVEL_ERROR, ("Cannot get bitmap for drawable (stopping)\n"));
+        delete[] line16;
         return FALSE;
     }
 
     for (; src != src_end; src -= pitch, alloc_size -= line_size) {
-        if (!PutBytesAlign(&chunk, &dest, &dest_end, src, line_size, alloc_size, pDelayedList)) {
+        UINT8 *line = src;
+        if (line16) {
+            ConvertLine32To16(line16, (CONST UINT32 *)src, width);
+            line = (UINT8 *)line16;
+        }
+        if (!PutBytesAlign(&chunk, &dest, &dest_end, line, line_size, alloc_size, pDelayedList)) {
             if (pitch < 0 && bForce) {
                 DbgPrint(TRACE_LEVEL_WARNING, ("%s: aborting copy of lines (forced)\n", __FUNCTION__));
             } else {
                 DbgPrint(TRACE_LEVEL_WARNING, ("%s: unexpected aborting copy of lines (force %d, pitch %d)\n", __FUNCTION__, bForce, pitch));
             }
+            delete[] line16;
             return FALSE;
         }
     }
+    delete[] line16;
+    QXL_COUNT(BytesUploaded, height * line_size);
+    QXL_TRACE(BITMAP, width, height, height * line_size);
     return TRUE;
 }
 
+void QxlDevice::DiscardCursorCmd(QXLCursorCmd *cursor_cmd)
+{
+    PAGED_CODE();
+    PLIST_ENTRY pDelayedList = DelayedList(cursor_cmd);
+    while (!IsListEmpty(pDelayedList)) {
+        DelayedChunk *pdc = (DelayedChunk *)RemoveHeadList(pDelayedList);
+        delete[] reinterpret_cast<BYTE*>(pdc);
+    }
+    ReleaseOutput(cursor_cmd->release_info.id);
+    DbgPrint(TRACE_LEVEL_WARNING, ("%s\n", __FUNCTION__));
+}
+
 void QxlDevice::DiscardDrawable(QXLDrawable *drawable)
 {
     PAGED_CODE();
@@ -4578,14 +7353,14 @@ QXLDrawable *QxlDevice::PrepareBltBits (
     CONST BLT_INFO* pSrc,
     UINT  NumRects,
     _In_reads_(NumRects) CONST RECT *pRects,
-    POINT*   pSourcePoint)
+    POINT*   pSourcePoint,
+    UINT  BitmapBpp)
 {
     PAGED_CODE();
     QXLDrawable *drawable;
     LONG width;
     LONG height;
 
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s device %d\n", __FUNCTION__,m_Id));
     UNREFERENCED_PARAMETER(NumRects);
     UNREFERENCED_PARAMETER(pDst);
 
@@ -4616,29 +7391,373 @@ QXLDrawable *QxlDevice::PrepareBltBits (
     CopyRect(&drawable->surfaces_rects[1], pRect);
 
     UINT8* src = (UINT8*)pSrc->pBits +
-        (pSourcePoint->y) * pSrc->Pitch +
-        (pSourcePoint->x * 4);
+        (pSourcePoint->y + pSrc->Offset.y) * pSrc->Pitch +
+        ((pSourcePoint->x + pSrc->Offset.x) * 4);
     UINT8* src_end = src - pSrc->Pitch;
     src += pSrc->Pitch * (height - 1);
 
-    if (!AttachNewBitmap(drawable, src, src_end, (INT)pSrc->Pitch, !g_bSupportVSync)) {
+    if (!AttachNewBitmap(drawable, src, src_end, (INT)pSrc->Pitch, !g_bSupportVSync, FALSE, BitmapBpp)) {
         DiscardDrawable(drawable);
         drawable = NULL;
-    } else {
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s drawable= %p type = %d, effect = %d Dest right(%d) left(%d) top(%d) bottom(%d) src_bitmap= %p.\n", __FUNCTION__,
-            drawable, drawable->type, drawable->effect, drawable->surfaces_rects[0].right, drawable->surfaces_rects[0].left,
-            drawable->surfaces_rects[0].top, drawable->surfaces_rects[0].bottom,
-            drawable->u.copy.src_bitmap));
     }
 
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+    return drawable;
+}
+
+static UINT64 OffscreenHash(CONST UINT8 *src, LONG pitch, UINT32 width, UINT32 height)
+{
+    UINT64 hash = CURSOR_HASH_BASIS ^ (((UINT64)width << 32) | height);
+
+    for (UINT32 y = 0; y < height; ++y, src += pitch) {
+        CONST UINT32 *line = (CONST UINT32 *)src;
+        for (UINT32 x = 0; x < width; ++x) {
+            hash = (hash ^ line[x]) * CURSOR_HASH_PRIME;
+        }
+    }
+    // key 0 marks a free surface
+    return hash ? hash : 1;
+}
 
+// Compares the copy of the content of a surface with the source rect, or
+// with bUpdate replaces the copy by it
+static BOOLEAN OffscreenPixels(OffscreenSurface *surface, CONST UINT8 *src, LONG pitch, BOOLEAN bUpdate)
+{
+    SIZE_T line = (SIZE_T)surface->width * 4;
+    UINT8 *pixels = surface->pixels;
+
+    for (UINT32 y = 0; y < surface->height; ++y, src += pitch, pixels += line) {
+        if (bUpdate) {
+            RtlCopyMemory(pixels, src, line);
+        } else if (RtlCompareMemory(pixels, src, line) != line) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Restores a dirty rect from an offscreen surface holding the same pixels.
+// Returns NULL if there is none; a content seen for the second time gets
+// a surface and *ppFill receives the drawable copying it there from the
+// primary surface, to be queued after the drawable updating the rect
+QXLDrawable *QxlDevice::PrepareOffscreen(CONST BLT_INFO* pSrc, CONST RECT *pRect, LONG offset, QXLDrawable **ppFill)
+{
+    PAGED_CODE();
+    UINT32 width = pRect->right - pRect->left;
+    UINT32 height = pRect->bottom - pRect->top;
+    QXLDrawable *drawable = NULL;
+    OffscreenSurface *surface;
+    CONST UINT8 *src;
+    UINT64 key;
+
+    *ppFill = NULL;
+    if (!m_NumOffscreen ||
+        width * height < OFFSCREEN_MIN_PIXELS || width * height > OFFSCREEN_MAX_PIXELS) {
+        return NULL;
+    }
+    src = (CONST UINT8 *)pSrc->pBits + (pRect->top + pSrc->Offset.y) * pSrc->Pitch +
+          (pRect->left + pSrc->Offset.x) * 4;
+    key = OffscreenHash(src, pSrc->Pitch, width, height);
+
+    BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+    surface = FindOffscreen(key, width, height);
+    if (!surface) {
+        UINT64 *seen = &m_OffscreenSeen[key % OFFSCREEN_SEEN_SIZE];
+        if (*seen == key) {
+            *seen = 0;
+            surface = CreateOffscreen(key, width, height);
+        } else {
+            *seen = key;
+        }
+    } else if (surface->filled && !OffscreenPixels(surface, src, pSrc->Pitch, FALSE)) {
+        // another content with the same key
+        surface = NULL;
+    } else if (surface->filled) {
+        RECT src_area = { 0, 0, (LONG)width, (LONG)height };
+        drawable = SurfaceCopy(pRect, 0, (UINT32)(surface - m_Offscreen) + 1, &src_area, width, height);
+        if (drawable) {
+            surface->pending++;
+            RemoveEntryList(&surface->lru_link);
+            InsertTailList(&m_OffscreenLru, &surface->lru_link);
+            QXL_COUNT(OffscreenHits, 1);
+        }
+    }
+    // a new surface or one whose fill was discarded
+    if (surface && !surface->filled && !surface->pending) {
+        RECT area = { 0, 0, (LONG)width, (LONG)height };
+        RECT src_area = { pRect->left + offset, pRect->top, pRect->right + offset, pRect->bottom };
+        *ppFill = SurfaceCopy(&area, (UINT32)(surface - m_Offscreen) + 1, 0, &src_area,
+                              m_PrimaryWidth, m_PrimaryHeight);
+        if (*ppFill) {
+            surface->pending++;
+            OffscreenPixels(surface, src, pSrc->Pitch, TRUE);
+        }
+    }
+    ReleaseMutex(&m_CmdLock, locked);
     return drawable;
 }
 
+// Copies src_area of surface src_id to area of surface surface_id
+QXLDrawable *QxlDevice::SurfaceCopy(CONST RECT *area, UINT32 surface_id, UINT32 src_id, CONST RECT *src_area, UINT32 width, UINT32 height)
+{
+    PAGED_CODE();
+    QXLDrawable *drawable;
+    Resource *image_res;
+    InternalImage *internal;
+
+    if (!(drawable = Drawable(QXL_DRAW_COPY, area, NULL, surface_id))) {
+        return NULL;
+    }
+    image_res = (Resource *)AllocMem(MSPACE_TYPE_VRAM, sizeof(Resource) + sizeof(InternalImage), FALSE);
+    if (!image_res) {
+        DiscardDrawable(drawable);
+        return NULL;
+    }
+    image_res->refs = 1;
+    image_res->free = FreeSurfaceResEx;
+    image_res->ptr = this;
+
+    internal = (InternalImage *)image_res->res;
+    SetImageId(internal, FALSE, width, height,
+               m_SurfaceBpp == 16 ? SPICE_BITMAP_FMT_16BIT : SPICE_BITMAP_FMT_32BIT, 0);
+    internal->image.descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
+    internal->image.descriptor.width = width;
+    internal->image.descriptor.height = height;
+    internal->image.surface_image.surface_id = src_id;
+
+    drawable->u.copy.src_bitmap = PA(&internal->image);
+    CopyRect(&drawable->u.copy.src_area, src_area);
+    drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+    drawable->u.copy.mask.bitmap = 0;
+    drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    drawable->surfaces_dest[0] = src_id;
+    CopyRect(&drawable->surfaces_rects[0], src_area);
+
+    DrawableAddRes(drawable, image_res);
+    RELEASE_RES(image_res);
+    return drawable;
+}
+
+// The device forgets all surfaces on reset and their memory, as well as
+// the surface commands not pushed yet, was handed back with the mspace
+void QxlDevice::FreeOffscreen(void)
+{
+    PAGED_CODE();
+    for (UINT i = 0; i < OFFSCREEN_MAX; ++i) {
+        delete[] m_Offscreen[i].pixels;
+    }
+    RtlZeroMemory(m_Offscreen, sizeof(m_Offscreen));
+    RtlZeroMemory(m_OffscreenHash, sizeof(m_OffscreenHash));
+    InitializeListHead(&m_OffscreenLru);
+    m_NumOffscreenCmds = 0;
+    m_OffscreenUsed = 0;
+    m_NumOffscreen = 0;
+}
+
+void QxlDevice::ResetOffscreen(void)
+{
+    PAGED_CODE();
+    FreeOffscreen();
+    RtlZeroMemory(m_OffscreenSeen, sizeof(m_OffscreenSeen));
+    m_OffscreenBudget = 0;
+    if (m_RomHdr->n_surfaces < 2 || !g_OffscreenBudget) {
+        return;
+    }
+    m_NumOffscreen = MIN(m_RomHdr->n_surfaces - 1, OFFSCREEN_MAX);
+    m_OffscreenBudget = (SIZE_T)m_VRamSize / 100 * MIN(g_OffscreenBudget, 100);
+    for (UINT i = 0; i < m_NumOffscreen; ++i) {
+        InsertTailList(&m_OffscreenLru, &m_Offscreen[i].lru_link);
+    }
+}
+
+OffscreenSurface *QxlDevice::FindOffscreen(UINT64 key, UINT32 width, UINT32 height)
+{
+    PAGED_CODE();
+    OffscreenSurface *surface = m_OffscreenHash[OFFSCREEN_HASH_VAL(key)];
+    for (; surface; surface = surface->next) {
+        if (surface->key == key && surface->width == width && surface->height == height) {
+            return surface;
+        }
+    }
+    return NULL;
+}
+
+// Called with m_CmdLock held on the present path; the create command is
+// left for the present worker, which pushes it before the drawables of
+// the present, see PushOffscreenCmds
+OffscreenSurface *QxlDevice::CreateOffscreen(UINT64 key, UINT32 width, UINT32 height)
+{
+    PAGED_CODE();
+    SIZE_T size = (SIZE_T)width * height * m_SurfaceBpp / BITS_PER_BYTE;
+    OffscreenSurface *surface;
+    QXLSurfaceCmd *surface_cmd;
+    Resource *res;
+    UINT8 *pixels;
+
+    if (size > m_OffscreenBudget) {
+        return NULL;
+    }
+    for (;;) {
+        OffscreenSurface *victim = NULL;
+        surface = NULL;
+        for (PLIST_ENTRY entry = m_OffscreenLru.Flink; entry != &m_OffscreenLru; entry = entry->Flink) {
+            OffscreenSurface *now = CONTAINING_RECORD(entry, OffscreenSurface, lru_link);
+            if (!now->key) {
+                surface = surface ? surface : now;
+            } else if (!now->pending && !victim) {
+                victim = now;
+            }
+        }
+        if (surface && m_OffscreenUsed + size <= m_OffscreenBudget &&
+            m_NumOffscreenCmds < OFFSCREEN_CMDS) {
+            break;
+        }
+        if (!victim || !DestroyOffscreen(victim)) {
+            return NULL;
+        }
+    }
+
+    // the copy is of the 32bpp source the content is hashed from
+    pixels = new (PagedPool, NoInit) UINT8[(SIZE_T)width * height * 4];
+    if (!pixels) {
+        return NULL;
+    }
+    res = (Resource *)AllocMem(MSPACE_TYPE_VRAM, sizeof(Resource) + size, FALSE);
+    if (!res) {
+        delete[] pixels;
+        return NULL;
+    }
+    res->refs = 1;
+    res->free = FreeSurfaceResEx;
+    res->ptr = this;
+    surface_cmd = SurfaceCmd(QXL_SURFACE_CMD_CREATE, (UINT32)(surface - m_Offscreen) + 1);
+    if (!surface_cmd) {
+        FreeMem(res);
+        delete[] pixels;
+        return NULL;
+    }
+    // same format as the primary surface they are filled from
+    surface_cmd->u.surface_create.format = m_SurfaceBpp == 16 ? SPICE_SURFACE_FMT_16_555 : SPICE_SURFACE_FMT_32_xRGB;
+    surface_cmd->u.surface_create.width = width;
+    surface_cmd->u.surface_create.height = height;
+    surface_cmd->u.surface_create.stride = width * m_SurfaceBpp / BITS_PER_BYTE;
+    surface_cmd->u.surface_create.data = PA(res->res);
+    m_OffscreenCmds[m_NumOffscreenCmds++] = surface_cmd;
+
+    surface->key = key;
+    surface->width = width;
+    surface->height = height;
+    surface->res = res;
+    surface->pixels = pixels;
+    surface->filled = FALSE;
+    surface->pending = 0;
+    surface->next = m_OffscreenHash[OFFSCREEN_HASH_VAL(key)];
+    m_OffscreenHash[OFFSCREEN_HASH_VAL(key)] = surface;
+    RemoveEntryList(&surface->lru_link);
+    InsertTailList(&m_OffscreenLru, &surface->lru_link);
+    m_OffscreenUsed += size;
+    QXL_COUNT(OffscreenParked, 1);
+    return surface;
+}
+
+// The surface memory goes with the destroy command and is freed when
+// the device releases it; the command waits for a present worker like
+// the create one
+BOOLEAN QxlDevice::DestroyOffscreen(OffscreenSurface *surface)
+{
+    PAGED_CODE();
+    if (m_NumOffscreenCmds == OFFSCREEN_CMDS) {
+        return FALSE;
+    }
+    QXLSurfaceCmd *surface_cmd = SurfaceCmd(QXL_SURFACE_CMD_DESTROY, (UINT32)(surface - m_Offscreen) + 1);
+    if (!surface_cmd) {
+        return FALSE;
+    }
+    AddRes((QXLOutput *)((UINT8 *)surface_cmd - sizeof(QXLOutput)), surface->res);
+    RELEASE_RES(surface->res);
+    m_OffscreenCmds[m_NumOffscreenCmds++] = surface_cmd;
+    delete[] surface->pixels;
+
+    for (OffscreenSurface **pnow = &m_OffscreenHash[OFFSCREEN_HASH_VAL(surface->key)]; *pnow; pnow = &(*pnow)->next) {
+        if (*pnow == surface) {
+            *pnow = surface->next;
+            break;
+        }
+    }
+    m_OffscreenUsed -= (SIZE_T)surface->width * surface->height * m_SurfaceBpp / BITS_PER_BYTE;
+    surface->next = NULL;
+    surface->key = 0;
+    surface->res = NULL;
+    surface->pixels = NULL;
+    surface->filled = FALSE;
+    RemoveEntryList(&surface->lru_link);
+    InsertHeadList(&m_OffscreenLru, &surface->lru_link);
+    QXL_COUNT(OffscreenEvicted, 1);
+    return TRUE;
+}
+
+// A drawable filling or reading an offscreen surface reached the ring
+// or was discarded
+void QxlDevice::OffscreenDone(UINT32 surface_id, BOOLEAN filled)
+{
+    PAGED_CODE();
+    if (!surface_id || surface_id > m_NumOffscreen) {
+        return;
+    }
+    BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+    OffscreenSurface *surface = &m_Offscreen[surface_id - 1];
+    if (surface->pending) {
+        surface->pending--;
+    }
+    if (filled && surface->key) {
+        surface->filled = TRUE;
+    }
+    ReleaseMutex(&m_CmdLock, locked);
+}
+
+QXLSurfaceCmd *QxlDevice::SurfaceCmd(UINT8 type, UINT32 surface_id)
+{
+    PAGED_CODE();
+    QXLSurfaceCmd *surface_cmd;
+    QXLOutput *output;
+
+    // commands must be allocated into Bar0 (DEVRAM)
+    output = (QXLOutput *)AllocMem(MSPACE_TYPE_DEVRAM, sizeof(QXLOutput) + sizeof(QXLSurfaceCmd), FALSE);
+    if (!output) {
+        return NULL;
+    }
+    output->num_res = 0;
+    InitializeListHead(&output->list);
+    RESOURCE_TYPE(output, RESOURCE_TYPE_SURFACE);
+    surface_cmd = (QXLSurfaceCmd *)output->data;
+    surface_cmd->release_info.id = (UINT64)output;
+    surface_cmd->surface_id = surface_id;
+    surface_cmd->type = type;
+    surface_cmd->flags = 0;
+    return surface_cmd;
+}
+
+// Called with m_CmdLock held by a present worker, queueing may wait for
+// the command ring, which the DDI threads must not
+void QxlDevice::PushOffscreenCmds(void)
+{
+    PAGED_CODE();
+    for (UINT i = 0; i < m_NumOffscreenCmds; ++i) {
+        QueueCmd(QXL_CMD_SURFACE, m_OffscreenCmds[i]);
+    }
+    m_NumOffscreenCmds = 0;
+}
+
+// surface memory and surface images, no chunks attached
+void QxlDevice::FreeSurfaceResEx(Resource *res)
+{
+    PAGED_CODE();
+    QxlDevice* pqxl = (QxlDevice*)res->ptr;
+    pqxl->FreeMem(res);
+}
+
 // can work in 2 modes:
-// forced - as before, when pDelayed not provided or if VSync is not in use
-// non-forced, if VSync is active and pDelayed provided. In this case, if memory
+// forced - as before, when pDelayed not provided
+// non-forced, if pDelayed provided. In this case, if memory
 // can't be allocated immediately, allocates 'delayed chunk' and copies data
 // to it. Further, before send to the device, this 'delayed chunk' should be processed,
 // regular chunk allocated from device memory and the data copied to it
@@ -4648,13 +7767,12 @@ BOOLEAN QxlDevice::PutBytesAlign(QXLDataChunk **chunk_ptr, UINT8 **now_ptr,
 {
     PAGED_CODE();
     BOOLEAN bResult = TRUE;
-    BOOLEAN bForced = !g_bSupportVSync || !pDelayed;
+    BOOLEAN bForced = !pDelayed;
     QXLDataChunk *chunk = *chunk_ptr;
     UINT8 *now = *now_ptr;
     UINT8 *end = *end_ptr;
     size_t maxAllocSize = BITS_BUF_MAX - BITS_BUF_MAX % size;
     alloc_size = MIN(alloc_size, maxAllocSize);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
     while (size) {
         int cp_size = (int)MIN(end - now, size);
@@ -4667,11 +7785,14 @@ BOOLEAN QxlDevice::PutBytesAlign(QXLDataChunk **chunk_ptr, UINT8 **now_ptr,
                 chunk->next_chunk = 0;
             }
             if (!ptr && pDelayed) {
-                ptr = new (PagedPool)BYTE[alloc_size + sizeof(DelayedChunk)];
+                ptr = new (PagedPool, NoInit) BYTE[alloc_size + sizeof(DelayedChunk)];
                 if (ptr) {
                     DelayedChunk *pChunk = (DelayedChunk *)ptr;
                     InsertTailList(pDelayed, &pChunk->list);
+                    QXL_COUNT(DelayedChunks, 1);
+                    QXL_TRACE(DELAYED_CHUNK, alloc_size);
                     pChunk->chunk.prev_chunk = (QXLPHYSICAL)chunk;
+                    pChunk->chunk.next_chunk = 0;
                     chunk = &pChunk->chunk;
                 } 
             }
@@ -4694,20 +7815,50 @@ BOOLEAN QxlDevice::PutBytesAlign(QXLDataChunk **chunk_ptr, UINT8 **now_ptr,
     *chunk_ptr = chunk;
     *now_ptr = now;
     *end_ptr = end;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return bResult;
 }
 
 VOID QxlDevice::BlackOutScreen(CURRENT_BDD_MODE* pCurrentBddMod)
 {
-    QXLDrawable *drawable;
-    RECT Rect;
     PAGED_CODE();
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId = pCurrentBddMod->SourceId;
+    RECT Rect;
     Rect.bottom = pCurrentBddMod->SrcModeHeight;
     Rect.top = 0;
     Rect.left = 0;
     Rect.right = pCurrentBddMod->SrcModeWidth;
-    if (!(drawable = Drawable(QXL_DRAW_FILL, &Rect, NULL, 0)))
+
+    // in the queue of the head, after the presents already posted to it,
+    // so that none of them paints over the black. It is skipped when a
+    // later black out or a full screen present was posted behind it; the
+    // number and the post are taken together under the lock of the queue
+    QxlPresentWorker *worker = &m_PresentWorkers[SourceId];
+    QxlPresentOperation *operation = NULL;
+    if (worker->thread) {
+        BOOLEAN locked = WaitForObject(&worker->lock, NULL);
+        LONG blackout = ++worker->blackouts;
+        operation = BuildQxlOperation([=, this]() {
+            PAGED_CODE();
+            if (InterlockedCompareExchange(&worker->blackout_pending, 0, blackout) == blackout) {
+                PushBlackOut(SourceId, &Rect);
+            }
+        });
+        if (operation) {
+            InterlockedExchange(&worker->blackout_pending, blackout);
+            PostToWorkerThread(operation, SourceId);
+        }
+        ReleaseMutex(&worker->lock, locked);
+    }
+    if (!operation) {
+        PushBlackOut(SourceId, &Rect);
+    }
+}
+
+void QxlDevice::PushBlackOut(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, CONST RECT *pRect)
+{
+    PAGED_CODE();
+    QXLDrawable *drawable;
+    if (!(drawable = Drawable(QXL_DRAW_FILL, pRect, NULL, 0)))
     {
         DbgPrint(TRACE_LEVEL_ERROR, ("Cannot get Drawable.\n"));
         return;
@@ -4719,7 +7870,11 @@ VOID QxlDevice::BlackOutScreen(CURRENT_BDD_MODE* pCurrentBddMod)
     drawable->u.fill.mask.pos.x = 0;
     drawable->u.fill.mask.pos.y = 0;
     drawable->u.fill.mask.bitmap = 0;
+    // the head may have moved since the black out was posted
+    BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+    OffsetDrawable(drawable, m_Heads[SourceId].x);
     PushDrawable(drawable);
+    ReleaseMutex(&m_CmdLock, locked);
 }
 
 NTSTATUS QxlDevice::HWClose(void)
@@ -4746,85 +7901,108 @@ NTSTATUS  QxlDevice::SetPointerShape(_In_ CONST DXGKARG_SETPOINTERSHAPE* pSetPoi
     if (!pSetPointerShape->Flags.Monochrome && !pSetPointerShape->Flags.Color)
         return STATUS_UNSUCCESSFUL;
 
-    QXLCursorCmd *cursor_cmd;
-    InternalCursor *internal;
-    QXLCursor *cursor;
-    Resource *res;
-    QXLDataChunk *chunk;
+    QXLCursorCmd *cursor_cmd = NULL;
+    QXLCursorHeader header;
     UINT8 *src;
     UINT8 *src_end;
-    UINT8 *now;
-    UINT8 *end;
+    UINT8 *pixels = NULL;
     int line_size;
     int num_images = 1;
-
-    cursor_cmd = CursorCmd();
-    if (!cursor_cmd) {
-        DbgPrint(TRACE_LEVEL_ERROR, ("%s: Failed to allocate cursor command\n", __FUNCTION__));
-        return STATUS_INSUFFICIENT_RESOURCES;
+    UINT num_lines;
+    BOOLEAN attached = FALSE;
+
+    header.type = pSetPointerShape->Flags.Monochrome ? SPICE_CURSOR_TYPE_MONO : SPICE_CURSOR_TYPE_ALPHA;
+    header.width = (UINT16)pSetPointerShape->Width;
+    header.height = (UINT16)pSetPointerShape->Height;
+    header.hot_spot_x = (UINT16)pSetPointerShape->XHot;
+    header.hot_spot_y = (UINT16)pSetPointerShape->YHot;
+    if (header.type == SPICE_CURSOR_TYPE_MONO) {
+        line_size = ALIGN(header.width, 8) >> 3;
+        num_images = 2;
+    } else {
+        line_size = header.width << 2;
     }
+    num_lines = pSetPointerShape->Height * num_images;
 
-    cursor_cmd->type = QXL_CURSOR_SET;
-
-    cursor_cmd->u.set.visible = TRUE;
-    cursor_cmd->u.set.position.x = 0;
-    cursor_cmd->u.set.position.y = 0;
-
-    res = (Resource *)AllocMem(MSPACE_TYPE_VRAM, CURSOR_ALLOC_SIZE, TRUE);
-    if (!res) {
-        DbgPrint(TRACE_LEVEL_ERROR, ("%s: Failed to allocate cursor data\n", __FUNCTION__));
-        ReleaseOutput(cursor_cmd->release_info.id);
-        return STATUS_INSUFFICIENT_RESOURCES;
+    // the hash of the shape is used as unique id, so the same shape
+    // always gets the same id and the host can cache it as well
+    src = (UINT8*)pSetPointerShape->pPixels;
+    src_end = src + (pSetPointerShape->Pitch * num_lines);
+    header.unique = CursorHashBytes(CURSOR_HASH_BASIS, (UINT8 *)&header.type, sizeof(header) - sizeof(header.unique));
+    for (; src != src_end; src += pSetPointerShape->Pitch) {
+        header.unique = CursorHashBytes(header.unique, src, line_size);
     }
-
-    res->refs = 1;
-    res->free = FreeCursorEx;
-    res->ptr = this;
-    RESOURCE_TYPE(res, RESOURCE_TYPE_CURSOR);
-
-    internal = (InternalCursor *)res->res;
-
-    cursor = &internal->cursor;
-    cursor->header.type = pSetPointerShape->Flags.Monochrome ? SPICE_CURSOR_TYPE_MONO : SPICE_CURSOR_TYPE_ALPHA;
-    cursor->header.unique = 0;
-    cursor->header.width = (UINT16)pSetPointerShape->Width;
-    cursor->header.height = (UINT16)pSetPointerShape->Height;
-    if (cursor->header.type == SPICE_CURSOR_TYPE_MONO) {
-        line_size = ALIGN(cursor->header.width, 8) >> 3;
-        cursor->data_size = line_size * pSetPointerShape->Height * 2;
-        num_images = 2;
-    } else {
-        line_size = cursor->header.width << 2;
-        cursor->data_size = line_size * pSetPointerShape->Height;
+    if (!header.unique) {
+        header.unique = 1;
     }
 
-    cursor->header.hot_spot_x = (UINT16)pSetPointerShape->XHot;
-    cursor->header.hot_spot_y = (UINT16)pSetPointerShape->YHot;
+    // this is the input path, do not wait for device memory here. Whatever
+    // can't be done immediately is completed by the worker thread, which
+    // also executes all following cursor commands to keep them in order
+    if (!m_CursorOpsPending) {
+        cursor_cmd = CursorCmd(FALSE);
+        if (cursor_cmd) {
+            attached = AttachCursorShape(cursor_cmd, &header, (UINT8*)pSetPointerShape->pPixels,
+                                         pSetPointerShape->Pitch, line_size, num_lines, FALSE);
+        }
+        if (attached && IsListEmpty(DelayedList(cursor_cmd))) {
+            PushCursorCmd(cursor_cmd);
+            DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+            return STATUS_SUCCESS;
+        }
+    }
 
-    DbgPrint(TRACE_LEVEL_INFORMATION, ("<--> %s %d::%d::%d::%d::%d\n", __FUNCTION__, cursor->header.width, cursor->header.height, cursor->header.hot_spot_x, cursor->header.hot_spot_y, cursor->data_size));
+    if (!attached) {
+        // keep a copy of the shape for the worker thread
+        pixels = new (PagedPool, NoInit) BYTE[line_size * num_lines];
+        if (!pixels) {
+            DbgPrint(TRACE_LEVEL_ERROR, ("%s: Failed to allocate cursor shape copy\n", __FUNCTION__));
+            if (cursor_cmd) {
+                DiscardCursorCmd(cursor_cmd);
+            }
+            return STATUS_NO_MEMORY;
+        }
+        src = (UINT8*)pSetPointerShape->pPixels;
+        for (UINT i = 0; i < num_lines; ++i, src += pSetPointerShape->Pitch) {
+            RtlCopyMemory(pixels + i * line_size, src, line_size);
+        }
+    }
 
-    chunk = &cursor->chunk;
-    chunk->data_size = 0;
-    chunk->prev_chunk = 0;
-    chunk->next_chunk = 0;
+    QxlPresentOperation *operation = BuildQxlOperation([=, this]() {
+        PAGED_CODE();
+        QXLCursorCmd *cmd = cursor_cmd;
+        BOOLEAN bAttached = attached;
 
-    src = (UINT8*)pSetPointerShape->pPixels;
-    now = chunk->data;
-    end = (UINT8 *)res + CURSOR_ALLOC_SIZE;
-    src_end = src + (pSetPointerShape->Pitch * pSetPointerShape->Height * num_images);
-    for (; src != src_end; src += pSetPointerShape->Pitch) {
-        if (!PutBytesAlign(&chunk, &now, &end, src, line_size, PAGE_SIZE - PAGE_SIZE % line_size, NULL)) {
-            // we have a chance to get here only with color cursor bigger than 45*45
-            // and only if we modify this procedure to use non-forced allocation  
-            DbgPrint(TRACE_LEVEL_ERROR, ("%s: failed to push part of shape\n", __FUNCTION__));
-            break;
+        if (!cmd && m_bActive) {
+            cmd = CursorCmd(TRUE);
+        }
+        if (cmd && !bAttached && m_bActive) {
+            bAttached = AttachCursorShape(cmd, &header, pixels, line_size, line_size, num_lines, TRUE);
+        }
+        delete[] pixels;
+        if (cmd && !bAttached) {
+            ReleaseOutput(cmd->release_info.id);
+            cmd = NULL;
+        }
+        if (cmd) {
+            PrepareCursor(cmd);
+        }
+        if (cmd) {
+            PushCursorCmd(cmd);
+        }
+        InterlockedDecrement(&m_CursorOpsPending);
+    });
+    if (!operation) {
+        delete[] pixels;
+        if (cursor_cmd) {
+            DiscardCursorCmd(cursor_cmd);
         }
+        return STATUS_NO_MEMORY;
     }
-    CursorCmdAddRes(cursor_cmd, res);
-    RELEASE_RES(res);
-    cursor_cmd->u.set.shape = PA(&internal->cursor);
-    PushCursorCmd(cursor_cmd);
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
+    InterlockedIncrement(&m_CursorOpsPending);
+    QXL_COUNT(CursorOpsDeferred, 1);
+    PostToWorkerThread(operation, 0);
+    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s deferred\n", __FUNCTION__));
 
     return STATUS_SUCCESS;
 }
@@ -4838,25 +8016,108 @@ NTSTATUS QxlDevice::SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pS
                                  pSetPointerPosition->VidPnSourceId,
                                  pSetPointerPosition->X,
                                  pSetPointerPosition->Y));
-    QXLCursorCmd *cursor_cmd = CursorCmd();
+    BOOLEAN hide = pSetPointerPosition->X < 0 || !pSetPointerPosition->Flags.Visible;
+    LONG bit = 1 << pSetPointerPosition->VidPnSourceId;
+    if (hide) {
+        // the pointer left this head, another one may show it now
+        if (InterlockedAnd(&m_PointerVisible, ~bit) & ~bit) {
+            DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s visible on another head\n", __FUNCTION__));
+            return STATUS_SUCCESS;
+        }
+    } else {
+        InterlockedOr(&m_PointerVisible, bit);
+    }
+    INT16 x = (INT16)(pSetPointerPosition->X + m_Heads[pSetPointerPosition->VidPnSourceId].x);
+    INT16 y = (INT16)(pSetPointerPosition->Y + m_Heads[pSetPointerPosition->VidPnSourceId].y);
+    QXLCursorCmd *cursor_cmd = NULL;
+
+    if (!m_CursorOpsPending) {
+        if (!hide && CoalesceCursorMove(x, y)) {
+            DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s coalesced\n", __FUNCTION__));
+            return STATUS_SUCCESS;
+        }
+        cursor_cmd = CursorCmd(FALSE);
+    }
     if (!cursor_cmd) {
-        DbgPrint(TRACE_LEVEL_ERROR, ("%s: Failed to allocate cursor command\n", __FUNCTION__));
-        return STATUS_INSUFFICIENT_RESOURCES;
+        // keep the order with cursor commands executed by the worker thread
+        QxlPresentOperation *operation = BuildQxlOperation([=, this]() {
+            PAGED_CODE();
+            QXLCursorCmd *cmd = m_bActive ? CursorCmd(TRUE) : NULL;
+            if (cmd) {
+                if (hide) {
+                    cmd->type = QXL_CURSOR_HIDE;
+                } else {
+                    cmd->type = QXL_CURSOR_MOVE;
+                    cmd->u.position.x = x;
+                    cmd->u.position.y = y;
+                }
+                PushCursorCmd(cmd);
+            }
+            InterlockedDecrement(&m_CursorOpsPending);
+        });
+        if (!operation) {
+            DbgPrint(TRACE_LEVEL_ERROR, ("%s: Failed to allocate cursor command\n", __FUNCTION__));
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        InterlockedIncrement(&m_CursorOpsPending);
+        QXL_COUNT(CursorOpsDeferred, 1);
+        // all cursor commands go through the queue of head 0
+        PostToWorkerThread(operation, 0);
+        DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s deferred\n", __FUNCTION__));
+        return STATUS_SUCCESS;
     }
 
-    if (pSetPointerPosition->X < 0 || !pSetPointerPosition->Flags.Visible) {
+    if (hide) {
         cursor_cmd->type = QXL_CURSOR_HIDE;
     } else {
         cursor_cmd->type = QXL_CURSOR_MOVE;
-        cursor_cmd->u.position.x = (INT16)pSetPointerPosition->X;
-        cursor_cmd->u.position.y = (INT16)pSetPointerPosition->Y;
+        cursor_cmd->u.position.x = x;
+        cursor_cmd->u.position.y = y;
     }
     PushCursorCmd(cursor_cmd);
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
     return STATUS_SUCCESS;
 }
 
-NTSTATUS QxlDevice::UpdateChildStatus(BOOLEAN connect)
+// Updates the position of the last pushed move command if the host
+// did not take it from the cursor ring yet
+BOOLEAN QxlDevice::CoalesceCursorMove(INT16 x, INT16 y)
+{
+    PAGED_CODE();
+    BOOLEAN bCoalesced = FALSE;
+    BOOLEAN crsLocked;
+    BOOLEAN memLocked = FALSE;
+
+    crsLocked = WaitForObject(&m_CrsLock, NULL);
+    if (m_PendingMove) {
+        // holding m_MemLock guarantees the command is not released
+        // and reused while it is updated, do not wait for it
+        LARGE_INTEGER doNotWait;
+        doNotWait.QuadPart = 0;
+        memLocked = WaitForObject(&m_MemLock, &doNotWait);
+    }
+    if (memLocked && (INT32)(m_CursorRing->cons - m_PendingMoveProd) <= 0) {
+        m_PendingMove->u.position.x = x;
+        m_PendingMove->u.position.y = y;
+        spice_mb();
+        // the host could take the command while it was updated,
+        // in this case the new position might be lost
+        bCoalesced = (INT32)(m_CursorRing->cons - m_PendingMoveProd) <= 0;
+    }
+    if (bCoalesced) {
+        QXL_COUNT(CursorMovesCoalesced, 1);
+        if (m_CursorRing->prod + 1 == m_CursorRing->notify_on_prod) {
+            QXL_COUNT(CursorNotifiesSaved, 1);
+        }
+    } else if (memLocked) {
+        m_PendingMove = NULL;
+    }
+    ReleaseMutex(&m_MemLock, memLocked);
+    ReleaseMutex(&m_CrsLock, crsLocked);
+    return bCoalesced;
+}
+
+NTSTATUS QxlDevice::UpdateChildStatus(ULONG ChildUid, BOOLEAN connect)
 {
     PAGED_CODE();
     NTSTATUS           Status(STATUS_SUCCESS);
@@ -4864,63 +8125,350 @@ NTSTATUS QxlDevice::UpdateChildStatus(BOOLEAN connect)
     PDXGKRNL_INTERFACE pDXGKInterface(m_pQxlDod->GetDxgkInterface());
 
     ChildStatus.Type = StatusConnection;
-    ChildStatus.ChildUid = 0;
+    ChildStatus.ChildUid = ChildUid;
     ChildStatus.HotPlug.Connected = connect;
     Status = pDXGKInterface->DxgkCbIndicateChildStatus(pDXGKInterface->DeviceHandle, &ChildStatus);
     return Status;
 }
 
-NTSTATUS QxlDevice::SetCustomDisplay(QXLEscapeSetCustomDisplay* custom_display)
+NTSTATUS QxlDevice::SetCustomDisplay(QXLEscapeSetCustomDisplay* custom_display, BOOLEAN bPreferred, UINT ChildUid)
 {
     PAGED_CODE();
     NTSTATUS status;
     UINT xres = custom_display->xres;
     UINT yres = custom_display->yres;
-    UINT bpp = QXL_BPP;
+    UINT bpp = m_SurfaceBpp;
     DbgPrint(TRACE_LEVEL_WARNING, ("%s - %d (%dx%d#%d)\n", __FUNCTION__, m_Id, xres, yres, bpp));
     if (xres < MIN_WIDTH_SIZE || yres < MIN_HEIGHT_SIZE) {
         DbgPrint(TRACE_LEVEL_VERBOSE, ("%s: (%dx%d#%d) less than (%dxd)\n", __FUNCTION__,
             xres, yres, bpp, MIN_WIDTH_SIZE, MIN_HEIGHT_SIZE));
     }
-    m_CustomMode =(USHORT) ((m_CustomMode == m_ModeCount-1)?  m_ModeCount - 2 : m_ModeCount - 1);
 
     if ((xres * yres * bpp / 8) > m_RomHdr->surface0_area_size) {
         DbgPrint(TRACE_LEVEL_ERROR, ("%s: Mode (%dx%d#%d) doesn't fit in memory (%d)\n",
                     __FUNCTION__, xres, yres, bpp, m_RomHdr->surface0_area_size));
         return ERROR_NOT_ENOUGH_MEMORY;
     }
-    UpdateVideoModeInfo(m_CustomMode, xres, yres, bpp);
-    status = UpdateChildStatus(TRUE);
+
+    // the OS has seen the mode when it was added, only refresh its age
+    CustomMode *mode = FindCustomMode(xres, yres);
+    if (mode) {
+        RemoveEntryList(&mode->lru_link);
+        InsertTailList(&m_CustomModeLru, &mode->lru_link);
+        QXL_COUNT(CustomModesReused, 1);
+        if (!bPreferred || m_PreferredModes[ChildUid] == mode) {
+            return STATUS_SUCCESS;
+        }
+    } else {
+        QXL_COUNT(CustomModesAdded, 1);
+        mode = EvictCustomMode();
+        mode->xres = xres;
+        mode->yres = yres;
+        mode->next = m_CustomModeHash[CUSTOM_MODE_HASH_VAL(xres, yres)];
+        m_CustomModeHash[CUSTOM_MODE_HASH_VAL(xres, yres)] = mode;
+        InsertTailList(&m_CustomModeLru, &mode->lru_link);
+        UpdateVideoModeInfo(m_CustomModeBase + (UINT)(mode - m_CustomModes), xres, yres, bpp);
+    }
+    if (bPreferred) {
+        // RecommendMonitorModes offers it to the child as the preferred mode
+        m_PreferredModes[ChildUid] = mode;
+    }
+    // a child not connected yet is plugged by SetMonitorConfig
+    status = IsChildConnected(ChildUid) ? UpdateChildStatus(ChildUid, TRUE) : STATUS_SUCCESS;
     return status;
 }
 
+USHORT QxlDevice::GetPreferredModeIndex(ULONG ChildUid)
+{
+    PAGED_CODE();
+    if (ChildUid < MAX_VIEWS && m_PreferredModes[ChildUid]) {
+        return m_CustomModeBase + (USHORT)(m_PreferredModes[ChildUid] - m_CustomModes);
+    }
+    return m_CurrentMode;
+}
+
+void QxlDevice::ResetCustomModes(void)
+{
+    PAGED_CODE();
+    RtlZeroMemory(m_CustomModes, sizeof(m_CustomModes));
+    RtlZeroMemory(m_CustomModeHash, sizeof(m_CustomModeHash));
+    RtlZeroMemory(m_PreferredModes, sizeof(m_PreferredModes));
+    InitializeListHead(&m_CustomModeLru);
+    for (UINT i = 0; i < CUSTOM_MODE_COUNT; ++i) {
+        InsertTailList(&m_CustomModeLru, &m_CustomModes[i].lru_link);
+    }
+}
+
+CustomMode *QxlDevice::FindCustomMode(UINT32 xres, UINT32 yres)
+{
+    PAGED_CODE();
+    CustomMode *mode = m_CustomModeHash[CUSTOM_MODE_HASH_VAL(xres, yres)];
+    for (; mode; mode = mode->next) {
+        if (mode->xres == xres && mode->yres == yres) {
+            return mode;
+        }
+    }
+    return NULL;
+}
+
+// Takes the least recently used entry out of the LRU list and the hash,
+// sizes shown by a head or preferred for one are skipped as the OS may
+// still use their mode
+CustomMode *QxlDevice::EvictCustomMode(void)
+{
+    PAGED_CODE();
+    CustomMode *victim = NULL;
+    PLIST_ENTRY entry;
+
+    for (entry = m_CustomModeLru.Flink; entry != &m_CustomModeLru && !victim; entry = entry->Flink) {
+        CustomMode *mode = CONTAINING_RECORD(entry, CustomMode, lru_link);
+        victim = mode;
+        for (UINT i = 0; i < MAX_VIEWS && mode->xres; ++i) {
+            if ((m_Heads[i].width == mode->xres && m_Heads[i].height == mode->yres) ||
+                m_PreferredModes[i] == mode) {
+                victim = NULL;
+                break;
+            }
+        }
+    }
+    if (!victim) {
+        // more heads than entries cannot happen, take the oldest anyway
+        victim = CONTAINING_RECORD(m_CustomModeLru.Flink, CustomMode, lru_link);
+    }
+    RemoveEntryList(&victim->lru_link);
+    if (victim->xres) {
+        CustomMode **pnow = &m_CustomModeHash[CUSTOM_MODE_HASH_VAL(victim->xres, victim->yres)];
+        for (; *pnow; pnow = &(*pnow)->next) {
+            if (*pnow == victim) {
+                *pnow = victim->next;
+                break;
+            }
+        }
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: %dx%d\n", __FUNCTION__, victim->xres, victim->yres));
+    }
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        if (m_PreferredModes[i] == victim) {
+            m_PreferredModes[i] = NULL;
+        }
+    }
+    victim->next = NULL;
+    return victim;
+}
+
 void QxlDevice::SetMonitorConfig(QXLHead * monitor_config)
 {
     PAGED_CODE();
-    m_monitor_config->count = 1;
-    m_monitor_config->max_allowed = 1;
+    UINT32 id = monitor_config->id;
+    if (id >= MAX_VIEWS) {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s:%d invalid head %d\n", __FUNCTION__, m_Id, id));
+        return;
+    }
+
+    DbgPrint(TRACE_LEVEL_VERBOSE, ("%s:%d configuring monitor %d at (%d, %d)  (%dx%d)\n", __FUNCTION__, m_Id, id,
+        monitor_config->x, monitor_config->y,
+        monitor_config->width, monitor_config->height));
+    if (id && !(m_ConnectedHeads & (1 << id)) && monitor_config->width) {
+        // a new head, let the OS pick a mode for it, the mode
+        // change updates the configuration again
+        m_ConnectedHeads |= 1 << id;
+        UpdateChildStatus(id, TRUE);
+        return;
+    }
+    if (id && (m_ConnectedHeads & (1 << id)) && !monitor_config->width) {
+        m_ConnectedHeads &= ~(1 << id);
+        UpdateChildStatus(id, FALSE);
+        return;
+    }
+    UpdateMonitorConfig();
+}
 
-    memcpy(&m_monitor_config->heads[0], monitor_config, sizeof(QXLHead));
-    m_monitor_config->heads[0].id = 0;
-    m_monitor_config->heads[0].surface_id = 0;
+// crc32 of the client monitors config the way qemu computes it: reflected,
+// starting from 0 and without the final xor
+static UINT32 ClientMonitorsConfigCrc(CONST UCHAR *data, SIZE_T size)
+{
+    PAGED_CODE();
+    UINT32 crc = 0;
+    while (size--) {
+        crc ^= *data++;
+        for (UINT bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (CLIENT_MONITORS_CONFIG_CRC32_POLY & (0 - (crc & 1)));
+        }
+    }
+    return crc;
+}
 
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("%s:%d configuring monitor at (%d, %d)  (%dx%d)\n", __FUNCTION__, m_Id,
-        m_monitor_config->heads[0].x, m_monitor_config->heads[0].y,
-        m_monitor_config->heads[0].width, m_monitor_config->heads[0].height));
-    AsyncIo(QXL_IO_MONITORS_CONFIG_ASYNC, 0);
+// Takes the layout a client wrote to the ROM with
+// QXL_INTERRUPT_CLIENT_MONITORS_CONFIG: every head gets the requested size
+// as its preferred mode, the heads but 0 are plugged or unplugged
+void QxlDevice::ApplyClientMonitorsConfig(void)
+{
+    PAGED_CODE();
+    QXLClientMonitorsConfig config;
+    UINT retry;
+
+    for (retry = 0; retry < CLIENT_MONITORS_RETRIES; ++retry) {
+        RtlCopyMemory(&config, &m_RomHdr->client_monitors_config, sizeof(config));
+        KeMemoryBarrier();
+        if (ClientMonitorsConfigCrc((CONST UCHAR *)&config, sizeof(config)) == m_RomHdr->client_monitors_config_crc) {
+            break;
+        }
+        QXL_SLEEP(1);
+    }
+    if (retry == CLIENT_MONITORS_RETRIES) {
+        DbgPrint(TRACE_LEVEL_ERROR, ("%s: bad crc, config ignored\n", __FUNCTION__));
+        QXL_COUNT(ClientMonitorsBadCrc, 1);
+        return;
+    }
+    // the escapes and the DDIs see the layout applied as a whole
+    BOOLEAN locked = WaitForObject(&m_ModeLock, NULL);
+    // no client, or a layout already applied, e.g. the one seen at start
+    if (!config.count ||
+        (m_bClientMonitorsValid && RtlEqualMemory(&config, &m_ClientMonitors, sizeof(config)))) {
+        DbgPrint(TRACE_LEVEL_VERBOSE, ("%s: %d heads, unchanged\n", __FUNCTION__, config.count));
+        QXL_COUNT(ClientMonitorsUnchanged, 1);
+        ReleaseMutex(&m_ModeLock, locked);
+        return;
+    }
+    m_ClientMonitors = config;
+    m_bClientMonitorsValid = TRUE;
+    QXL_COUNT(ClientMonitorsApplied, 1);
+
+    for (UINT i = 0; i < MAX_VIEWS; ++i) {
+        CONST QXLURect *rect = &config.heads[i];
+        QXLEscapeSetCustomDisplay custom_display;
+        QXLHead head;
+
+        RtlZeroMemory(&head, sizeof(head));
+        head.id = i;
+        if (i < config.count && rect->right > rect->left && rect->bottom > rect->top) {
+            head.x = rect->left;
+            head.y = rect->top;
+            head.width = rect->right - rect->left;
+            head.height = rect->bottom - rect->top;
+        }
+        DbgPrint(TRACE_LEVEL_WARNING, ("%s: head %d at (%d, %d) (%dx%d)\n", __FUNCTION__, i,
+            head.x, head.y, head.width, head.height));
+        if (head.width) {
+            custom_display.xres = head.width;
+            custom_display.yres = head.height;
+            custom_display.bpp = m_SurfaceBpp;
+            if (!NT_SUCCESS(SetCustomDisplay(&custom_display, TRUE, i)) && i) {
+                // a head of this size does not fit in the primary surface
+                head.width = head.height = 0;
+            }
+        }
+        if (i) {
+            SetMonitorConfig(&head);
+        }
+    }
+    ReleaseMutex(&m_ModeLock, locked);
 }
 
-LONG QxlDevice::GetMaxSourceMappingHeight(RECT* DirtyRects, ULONG NumDirtyRects)
+// Reports every head with a mode and its place in the primary surface
+void QxlDevice::UpdateMonitorConfig(void)
 {
     PAGED_CODE();
-    LONG maxHeight = 0;
-    if (DirtyRects != NULL) {
-        for (UINT i = 0; i < NumDirtyRects; i++) {
-            const RECT&    pDirtyRect = DirtyRects[i];
-            maxHeight = MAX(maxHeight, pDirtyRect.bottom);
+    UINT16 count = 0;
+    if (!m_monitor_config) {
+        return;
+    }
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        if (m_Heads[i].width) {
+            m_monitor_config->heads[count] = m_Heads[i];
+            m_monitor_config->heads[count].surface_id = 0;
+            DbgPrint(TRACE_LEVEL_VERBOSE, ("%s:%d monitor %d at (%d, %d)  (%dx%d)\n", __FUNCTION__, m_Id, i,
+                m_Heads[i].x, m_Heads[i].y, m_Heads[i].width, m_Heads[i].height));
+            ++count;
+        }
+    }
+    // no mode set yet
+    if (!count) {
+        return;
+    }
+    m_monitor_config->count = count;
+    m_monitor_config->max_allowed = MAX_VIEWS;
+    AsyncIo(QXL_IO_MONITORS_CONFIG_ASYNC, 0);
+}
+
+static FORCEINLINE uint64_t ReadCounter(LONG64 *counter)
+{
+    // a plain 64 bit read may tear on x86
+    return (uint64_t)InterlockedCompareExchange64(counter, 0, 0);
+}
+
+void HwDeviceInterface::GetStats(QXLEscapeStats* stats, SIZE_T size)
+{
+    PAGED_CODE();
+    QXLEscapeStats result;
+
+    RtlZeroMemory(&result, sizeof(result));
+    result.version = QXL_ESCAPE_STATS_VERSION;
+    result.size = (uint32_t)MIN(size, sizeof(result));
+    result.presents = ReadCounter(&m_Counters.Presents);
+    result.drawables = ReadCounter(&m_Counters.Drawables);
+    result.bytes_uploaded = ReadCounter(&m_Counters.BytesUploaded);
+    result.cmd_ring_waits = ReadCounter(&m_Counters.CmdRingWaits);
+    result.cursor_ring_waits = ReadCounter(&m_Counters.CursorRingWaits);
+    result.oom_notifies = ReadCounter(&m_Counters.OomNotifies);
+    result.delayed_chunks = ReadCounter(&m_Counters.DelayedChunks);
+    result.release_entries = ReadCounter(&m_Counters.ReleaseEntries);
+    result.released_outputs = ReadCounter(&m_Counters.ReleasedOutputs);
+    result.alloc_failures = ReadCounter(&m_Counters.AllocFailures);
+    result.presents_lossless = ReadCounter(&m_Counters.PresentsLossless);
+    result.presents_16bpp = ReadCounter(&m_Counters.Presents16Bpp);
+    result.presents_headless = ReadCounter(&m_Counters.PresentsHeadless);
+    result.headless_uploads = ReadCounter(&m_Counters.HeadlessUploads);
+    result.cmds_queued = ReadCounter(&m_Counters.CmdsQueued);
+    result.cmds_merged = ReadCounter(&m_Counters.CmdsMerged);
+    result.cmds_promoted = ReadCounter(&m_Counters.CmdsPromoted);
+    result.cmd_queue_max = ReadCounter(&m_Counters.CmdQueueMax);
+    result.source_pages_locked = ReadCounter(&m_Counters.SourcePages);
+    result.source_pages_whole = ReadCounter(&m_Counters.SourcePagesWhole);
+    result.source_mdls = ReadCounter(&m_Counters.SourceMdls);
+    result.cursor_ops_deferred = ReadCounter(&m_Counters.CursorOpsDeferred);
+    result.cursor_cache_hits = ReadCounter(&m_Counters.CursorCacheHits);
+    result.cursor_cache_misses = ReadCounter(&m_Counters.CursorCacheMisses);
+    result.cursor_moves_coalesced = ReadCounter(&m_Counters.CursorMovesCoalesced);
+    result.cursor_notifies_saved = ReadCounter(&m_Counters.CursorNotifiesSaved);
+    result.offscreen_hits = ReadCounter(&m_Counters.OffscreenHits);
+    result.offscreen_parked = ReadCounter(&m_Counters.OffscreenParked);
+    result.offscreen_evicted = ReadCounter(&m_Counters.OffscreenEvicted);
+    result.custom_modes_reused = ReadCounter(&m_Counters.CustomModesReused);
+    result.custom_modes_added = ReadCounter(&m_Counters.CustomModesAdded);
+    result.client_monitors_applied = ReadCounter(&m_Counters.ClientMonitorsApplied);
+    result.client_monitors_unchanged = ReadCounter(&m_Counters.ClientMonitorsUnchanged);
+    result.client_monitors_bad_crc = ReadCounter(&m_Counters.ClientMonitorsBadCrc);
+    result.vga_presents_staged = ReadCounter(&m_Counters.VgaPresentsStaged);
+    result.vga_presents_coalesced = ReadCounter(&m_Counters.VgaPresentsCoalesced);
+    result.vga_presents_sync = ReadCounter(&m_Counters.VgaPresentsSync);
+    GetDeviceStats(&result);
+
+    RtlCopyMemory(stats, &result, result.size);
+}
+
+VOID QxlDevice::GetDeviceStats(QXLEscapeStats* stats)
+{
+    PAGED_CODE();
+    C_ASSERT(NUM_MSPACES == ARRAYSIZE(stats->mem));
+    stats->cmd_queue_depth = (uint64_t)m_CmdQueueDepth;
+
+    // mspace_mallinfo walks all chunks of the space, this is only
+    // done on request and the spaces are gone while the device is stopped
+    BOOLEAN locked = WaitForObject(&m_MemLock, NULL);
+    for (UINT i = 0; m_bActive && i < NUM_MSPACES; ++i) {
+        const MspaceInfo *info = &m_MSInfo[i];
+        if (!info->_mspace) {
+            continue;
         }
+        struct mallinfo mi = mspace_mallinfo(info->_mspace);
+        stats->mem[i].capacity = info->mspace_end - info->mspace_start;
+        stats->mem[i].in_use = mi.uordblks;
+        stats->mem[i].free = mi.fordblks;
+        stats->mem[i].free_chunks = mi.ordblks;
+        stats->mem[i].top = mi.keepcost;
     }
-    return maxHeight;
+    ReleaseMutex(&m_MemLock, locked);
 }
 
 NTSTATUS QxlDevice::Escape(_In_ CONST DXGKARG_ESCAPE* pEscape)
@@ -4938,7 +8486,9 @@ NTSTATUS QxlDevice::Escape(_In_ CONST DXGKARG_ESCAPE* pEscape)
             status = STATUS_INVALID_BUFFER_SIZE;
             break;
         }
+        BOOLEAN locked = WaitForObject(&m_ModeLock, NULL);
         status = SetCustomDisplay(&pQXLEscape->custom_display);
+        ReleaseMutex(&m_ModeLock, locked);
         break;
     }
     case QXL_ESCAPE_MONITOR_CONFIG: {
@@ -4947,10 +8497,31 @@ NTSTATUS QxlDevice::Escape(_In_ CONST DXGKARG_ESCAPE* pEscape)
             status = STATUS_INVALID_BUFFER_SIZE;
             break;
         }
+        BOOLEAN locked = WaitForObject(&m_ModeLock, NULL);
         SetMonitorConfig(&pQXLEscape->monitor_config);
+        ReleaseMutex(&m_ModeLock, locked);
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case QXL_ESCAPE_GET_STATS: {
+        // any size from version and size up, see qxl_windows.h
+        data_size += FIELD_OFFSET(QXLEscapeStats, presents);
+        if (pEscape->PrivateDriverDataSize < data_size) {
+            status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        GetStats(&pQXLEscape->stats, pEscape->PrivateDriverDataSize - sizeof(uint32_t));
         status = STATUS_SUCCESS;
         break;
     }
+    case QXL_ESCAPE_DUMP_TRACE_RING: {
+        if (pEscape->PrivateDriverDataSize != data_size) {
+            status = STATUS_INVALID_BUFFER_SIZE;
+            break;
+        }
+        status = TraceRingDump();
+        break;
+    }
     default:
         DbgPrint(TRACE_LEVEL_ERROR, ("%s: invalid Escape 0x%x\n", __FUNCTION__, pQXLEscape->ioctl));
         status = STATUS_INVALID_PARAMETER;
@@ -4968,7 +8539,6 @@ VOID QxlDevice::WaitForCmdRing()
 {
     PAGED_CODE();
     int wait;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
 
     for (;;) {
         SPICE_RING_PROD_WAIT(m_CommandRing, wait);
@@ -4976,21 +8546,20 @@ VOID QxlDevice::WaitForCmdRing()
         if (!wait) {
             break;
         }
+        QXL_COUNT(CmdRingWaits, 1);
+        QXL_TRACE(CMD_RING_WAIT, 0);
         WaitForObject(&m_DisplayEvent, NULL);
     }
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
 
 VOID QxlDevice::PushCmd()
 {
     PAGED_CODE();
     int notify;
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("---> %s\n", __FUNCTION__));
     SPICE_RING_PUSH(m_CommandRing, notify);
     if (notify) {
         SyncIo(QXL_IO_NOTIFY_CMD, 0);
     }
-    DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s notify = %d\n", __FUNCTION__, notify));
 }
 
 VOID QxlDevice::WaitForCursorRing(VOID)
@@ -5005,6 +8574,7 @@ VOID QxlDevice::WaitForCursorRing(VOID)
         if (!wait) {
             break;
         }
+        QXL_COUNT(CursorRingWaits, 1);
 
         LARGE_INTEGER timeout; // 1 => 100 nanoseconds
         timeout.QuadPart = -1 * (1000 * 1000 * 10); //negative  => relative // 1s
@@ -5066,6 +8636,10 @@ VOID QxlDevice::DpcRoutine(PVOID)
     if (intStatus & QXL_INTERRUPT_DISPLAY) {
         DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s m_DisplayEvent\n", __FUNCTION__));
         KeSetEvent (&m_DisplayEvent, IO_NO_INCREMENT, FALSE);
+        // room in the command ring for the queued commands
+        if (m_CmdQueueDepth) {
+            KeSetEvent (&m_PresentWorkers[0].event, IO_NO_INCREMENT, FALSE);
+        }
     }
     if (intStatus & QXL_INTERRUPT_CURSOR) {
         DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s m_CursorEvent\n", __FUNCTION__));
@@ -5075,6 +8649,19 @@ VOID QxlDevice::DpcRoutine(PVOID)
         DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s m_IoCmdEvent\n", __FUNCTION__));
         KeSetEvent (&m_IoCmdEvent, IO_NO_INCREMENT, FALSE);
     }
+    if (intStatus & QXL_INTERRUPT_CLIENT_MONITORS_CONFIG) {
+        // the mode list and the child status can only be changed at
+        // PASSIVE_LEVEL, the worker of head 0 picks it up
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s client monitors config\n", __FUNCTION__));
+        InterlockedExchange(&m_ClientMonitorsPending, 1);
+        KeSetEvent (&m_PresentWorkers[0].event, IO_NO_INCREMENT, FALSE);
+    }
+    if (intStatus & QXL_INTERRUPT_CLIENT) {
+        // a client connected or went away, the worker of head 0 uploads
+        // the shadows of the heads
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s client\n", __FUNCTION__));
+        KeSetEvent (&m_PresentWorkers[0].event, IO_NO_INCREMENT, FALSE);
+    }
 
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
 }
@@ -5174,8 +8761,13 @@ QXL_NON_PAGED BOOLEAN QxlDod::VsyncTimerSynchRoutine(PVOID context)
 QXL_NON_PAGED VOID QxlDod::VsyncTimerProc()
 {
     BOOLEAN bDummy;
+    ULONGLONG now = KeQueryInterruptTime();
     DbgPrint(TRACE_LEVEL_VERBOSE, ("<--- %s\n", __FUNCTION__));
-    if (m_bVsyncEnabled && m_AdapterPowerState == PowerDeviceD0)
+    if (!m_bVsyncEnabled)
+    {
+        return;
+    }
+    if (m_AdapterPowerState == PowerDeviceD0)
     {
         m_DxgkInterface.DxgkCbSynchronizeExecution(
             m_DxgkInterface.DeviceHandle,
@@ -5186,27 +8778,160 @@ QXL_NON_PAGED VOID QxlDod::VsyncTimerProc()
         );
         INCREMENT_VSYNC_COUNTER(&m_VsyncFiredCounter);
     }
+
+    KeAcquireSpinLockAtDpcLevel(&m_VsyncLock);
+    // EnableVsync(FALSE) could run while the indication was delivered
+    if (!m_bVsyncEnabled)
+    {
+        KeReleaseSpinLockFromDpcLevel(&m_VsyncLock);
+        return;
+    }
+    if (!m_VsyncIdle)
+    {
+        LONGLONG late = (LONGLONG)(now - m_VsyncDeadline);
+        if (!m_VsyncTicks || late < m_VsyncLateMin) m_VsyncLateMin = late;
+        if (!m_VsyncTicks || late > m_VsyncLateMax) m_VsyncLateMax = late;
+        m_VsyncLateSum += late;
+        if (!(++m_VsyncTicks % VSYNC_STATS_TICKS))
+        {
+            DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: %d ticks, %d missed, late min %I64d avg %I64d max %I64d us\n",
+                __FUNCTION__, m_VsyncTicks, m_VsyncMissed, m_VsyncLateMin / 10,
+                m_VsyncLateSum / m_VsyncTicks / 10, m_VsyncLateMax / 10));
+        }
+    }
+
+    if (!g_VSyncIdleTicks)
+    {
+        // nothing to do
+    }
+    else if (InterlockedExchange(&m_VsyncPresents, 0))
+    {
+        m_VsyncIdleTicks = 0;
+    }
+    else if (m_VsyncIdle)
+    {
+        InterlockedExchangeAdd(&m_VsyncWakeupsSaved,
+            (LONG)(VSYNC_IDLE_PERIOD * 10000ULL / m_VsyncPeriod) - 1);
+    }
+    else if (++m_VsyncIdleTicks >= g_VSyncIdleTicks)
+    {
+        // the timer is only stretched, DWM does not present
+        // anything new without VSync indications
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: idle after %d ticks (saved %d)\n", __FUNCTION__,
+            m_VsyncIdleTicks, m_VsyncWakeupsSaved));
+        m_VsyncIdle = TRUE;
+    }
+    ScheduleVsyncTick(now);
+    KeReleaseSpinLockFromDpcLevel(&m_VsyncLock);
+}
+
+// Called with m_VsyncLock held. The deadline is absolute (interrupt
+// time), so the latency of one DPC does not shift the following ticks.
+QXL_NON_PAGED VOID QxlDod::ScheduleVsyncTick(ULONGLONG now)
+{
+    LARGE_INTEGER li;
+    if (m_VsyncIdle)
+    {
+        m_VsyncDeadline = now + VSYNC_IDLE_PERIOD * 10000ULL;
+    }
+    else
+    {
+        m_VsyncDeadline += m_VsyncPeriod;
+        m_VsyncPeriodAcc += m_VsyncPeriodRem;
+        if (m_VsyncPeriodAcc >= m_VsyncRate)
+        {
+            m_VsyncPeriodAcc -= m_VsyncRate;
+            m_VsyncDeadline++;
+        }
+        if (m_VsyncDeadline <= now)
+        {
+            // too late, skip the lost ticks instead of firing a burst
+            ULONGLONG missed = (now - m_VsyncDeadline) / m_VsyncPeriod + 1;
+            m_VsyncMissed += (ULONG)missed;
+            m_VsyncDeadline += missed * m_VsyncPeriod;
+        }
+    }
+    li.QuadPart = -(LONGLONG)(m_VsyncDeadline - now);
+    KeSetTimer(&m_VsyncTimer, li, &m_VsyncTimerDpc);
+}
+
+QXL_NON_PAGED VOID QxlDod::VsyncWakeUp()
+{
+    KIRQL OldIrql;
+    KeAcquireSpinLock(&m_VsyncLock, &OldIrql);
+    if (m_bVsyncEnabled && m_VsyncIdle)
+    {
+        // back from idle, restart the full rate from now
+        ULONGLONG now = KeQueryInterruptTime();
+        m_VsyncIdle = FALSE;
+        m_VsyncIdleTicks = 0;
+        m_VsyncDeadline = now;
+        m_VsyncPeriodAcc = 0;
+        ScheduleVsyncTick(now);
+    }
+    KeReleaseSpinLock(&m_VsyncLock, OldIrql);
+}
+
+// effective VSync rate in mHz
+static ULONG GetVsyncRate()
+{
+    PAGED_CODE();
+    if (g_VSyncRate)
+    {
+        return g_VSyncRate;
+    }
+    return VSYNC_PERIOD ? 1000000 / VSYNC_PERIOD : VSYNC_RATE * 1000;
 }
 
 VOID QxlDod::EnableVsync(BOOLEAN bEnable)
 {
     PAGED_CODE();
+    KIRQL OldIrql;
     if (g_bSupportVSync)
     {
+        ULONG rate = GetVsyncRate();
+        KeAcquireSpinLock(&m_VsyncLock, &OldIrql);
         m_bVsyncEnabled = bEnable;
-        if (!m_bVsyncEnabled)
+        m_VsyncIdleTicks = 0;
+        m_VsyncIdle = FALSE;
+        if (m_bVsyncEnabled)
+        {
+            ULONGLONG now = KeQueryInterruptTime();
+            m_VsyncRate = rate;
+            m_VsyncPeriod = 10000000000ULL / m_VsyncRate;
+            m_VsyncPeriodRem = (ULONG)(10000000000ULL % m_VsyncRate);
+            m_VsyncPeriodAcc = 0;
+            m_VsyncDeadline = now;
+            ScheduleVsyncTick(now);
+        }
+        else
         {
-            DbgPrint(TRACE_LEVEL_WARNING, ("Disabled VSync(fired %d)\n", InterlockedExchange(&m_VsyncFiredCounter, 0)));
             KeCancelTimer(&m_VsyncTimer);
         }
+        KeReleaseSpinLock(&m_VsyncLock, OldIrql);
+
+        if (!m_bVsyncEnabled)
+        {
+            DbgPrint(TRACE_LEVEL_WARNING, ("Disabled VSync(fired %d, saved %d, ticks %d, missed %d, late min %I64d max %I64d us)\n",
+                InterlockedExchange(&m_VsyncFiredCounter, 0), m_VsyncWakeupsSaved,
+                m_VsyncTicks, m_VsyncMissed, m_VsyncLateMin / 10, m_VsyncLateMax / 10));
+            if (m_bVsyncTimerResolution)
+            {
+                ExSetTimerResolution(0, FALSE);
+                m_bVsyncTimerResolution = FALSE;
+            }
+        }
         else
         {
-            LARGE_INTEGER li;
-            LONG period = VSYNC_PERIOD;
-            if (!period) period = 1000 / VSYNC_RATE;
-            DbgPrint(TRACE_LEVEL_WARNING, ("Enabled VSync %d ms(fired %d)\n", period, m_VsyncFiredCounter));
-            li.QuadPart = -10000000 / VSYNC_RATE;
-            KeSetTimerEx(&m_VsyncTimer, li, period, &m_VsyncTimerDpc);
+            // the default clock tick (15.6 ms) is too coarse for
+            // refresh rates above 64 Hz
+            if (!m_bVsyncTimerResolution && m_VsyncPeriod < VSYNC_COARSE_TICK)
+            {
+                ExSetTimerResolution(VSYNC_TIMER_RESOLUTION, TRUE);
+                m_bVsyncTimerResolution = TRUE;
+            }
+            DbgPrint(TRACE_LEVEL_WARNING, ("Enabled VSync %d mHz(fired %d, adaptive after %d)\n",
+                m_VsyncRate, m_VsyncFiredCounter, g_VSyncIdleTicks));
         }
     }
 }
@@ -5221,24 +8946,29 @@ void QxlDevice::StopPresentThread()
 {
     PAGED_CODE();
     PVOID pDispatcherObject;
-    if (m_PresentThread)
-    {
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s\n", __FUNCTION__));
-        // this cause pending drawing operation to be discarded instead
-        // of executed, there's no reason to execute them if we are
-        // destroying the device
-        ++m_DrawGeneration;
-        PostToWorkerThread(NULL);
+    // this cause pending drawing operation to be discarded instead
+    // of executed, there's no reason to execute them if we are
+    // destroying the device
+    ++m_DrawGeneration;
+    for (UINT i = 0; i < MAX_VIEWS; ++i)
+    {
+        QxlPresentWorker *worker = &m_PresentWorkers[i];
+        if (!worker->thread)
+        {
+            continue;
+        }
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("---> %s %d\n", __FUNCTION__, i));
+        PostToWorkerThread(NULL, i);
         NTSTATUS Status = ObReferenceObjectByHandle(
-            m_PresentThread, 0, NULL, KernelMode, &pDispatcherObject, NULL);
+            worker->thread, 0, NULL, KernelMode, &pDispatcherObject, NULL);
         if (NT_SUCCESS(Status))
         {
             WaitForObject(pDispatcherObject, NULL);
             ObDereferenceObject(pDispatcherObject);
         }
-        ZwClose(m_PresentThread);
-        m_PresentThread = NULL;
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
+        ZwClose(worker->thread);
+        worker->thread = NULL;
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s %d\n", __FUNCTION__, i));
     }
 }
 
@@ -5272,14 +9002,17 @@ ULONG QxlDevice::PrepareDrawable(QXLDrawable*& drawable)
         }
         if (!bFail && !lastchunk) {
             // bitmap was not allocated, this is single delayed chunk
+            // holding all lines, which gives the depth they were taken at
             QXL_ASSERT(IsListEmpty(pe));
+            LONG width = drawable->u.copy.src_area.right;
+            UINT bpp = pdc->chunk.data_size * BITS_PER_BYTE / (width * drawable->u.copy.src_area.bottom);
 
             if (AttachNewBitmap(
                 drawable,
                 pdc->chunk.data,
                 pdc->chunk.data + pdc->chunk.data_size,
-                -(drawable->u.copy.src_area.right * 4),
-                TRUE)) {
+                -(width * (INT)bpp / BITS_PER_BYTE),
+                TRUE, TRUE, bpp)) {
                 ++n;
             } else {
                 bFail = TRUE;
@@ -5306,53 +9039,77 @@ ULONG QxlDevice::PrepareDrawable(QXLDrawable*& drawable)
     return n;
 }
 
-void QxlDevice::PresentThreadRoutine()
+void QxlDevice::PresentThreadRoutine(QxlPresentWorker *worker)
 {
     PAGED_CODE();
     int wait;
     int notify;
 
-    DbgPrint(TRACE_LEVEL_INFORMATION, ("--->%s\n", __FUNCTION__));
+    DbgPrint(TRACE_LEVEL_INFORMATION, ("--->%s %d\n", __FUNCTION__, (int)(worker - m_PresentWorkers)));
 
     while (1)
     {
+        if (worker == m_PresentWorkers && InterlockedExchange(&m_ClientMonitorsPending, 0)) {
+            ApplyClientMonitorsConfig();
+        }
         // Pop an operation from the ring
         // No need for a mutex, only one consumer thread
-        SPICE_RING_CONS_WAIT(m_PresentRing, wait);
-        while (wait) {
+        SPICE_RING_CONS_WAIT(worker->ring, wait);
+        if (wait) {
+            LARGE_INTEGER timeout;
+            PLARGE_INTEGER pTimeout = NULL;
+            ULONG next;
+            if (worker == m_PresentWorkers && m_CmdQueueDepth) {
+                BOOLEAN locked = WaitForObject(&m_CmdLock, NULL);
+                RefillCmdRing();
+                ReleaseMutex(&m_CmdLock, locked);
+            }
+            // the worker of head 0 wakes up for the next upload of a shadow
+            if (worker == m_PresentWorkers && g_HeadlessPeriod && (next = ServiceHeadless()) != 0) {
+                timeout.QuadPart = -(LONGLONG)next * TIMEOUT_TO_MS;
+                pTimeout = &timeout;
+            }
             // we do not want indication of long wait on this event
-            DoWaitForObject(&m_PresentEvent, NULL, NULL);
-            SPICE_RING_CONS_WAIT(m_PresentRing, wait);
+            DoWaitForObject(&worker->event, pTimeout, NULL);
+            continue;
         }
-        QxlPresentOperation *operation = *SPICE_RING_CONS_ITEM(m_PresentRing);
-        SPICE_RING_POP(m_PresentRing, notify);
+        QxlPresentOperation *operation = *SPICE_RING_CONS_ITEM(worker->ring);
+        SPICE_RING_POP(worker->ring, notify);
         if (notify) {
-            KeSetEvent(&m_PresentThreadReadyEvent, 0, FALSE);
+            KeSetEvent(&worker->ready_event, 0, FALSE);
         }
 
         if (!operation) {
             DbgPrint(TRACE_LEVEL_WARNING, ("%s is being terminated\n", __FUNCTION__));
             break;
         }
+        QXL_TRACE(OPERATION_BEGIN, worker - m_PresentWorkers);
         operation->Run();
         delete operation;
+        QXL_TRACE(OPERATION_END, worker - m_PresentWorkers);
     }
 }
 
-void QxlDevice::PostToWorkerThread(QxlPresentOperation *operation)
+void QxlDevice::PostToWorkerThread(QxlPresentOperation *operation, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId)
 {
     PAGED_CODE();
-    // Push drawables into PresentRing and notify worker thread
+    // Push drawables into the present ring of the head and notify its worker thread
+    QxlPresentWorker *worker = &m_PresentWorkers[SourceId];
     int notify, wait;
-    SPICE_RING_PROD_WAIT(m_PresentRing, wait);
+    ULONG waits = 0;
+    // the worker only pops, it never takes the lock of its ring
+    BOOLEAN locked = WaitForObject(&worker->lock, NULL);
+    SPICE_RING_PROD_WAIT(worker->ring, wait);
     while (wait) {
-        WaitForObject(&m_PresentThreadReadyEvent, NULL);
-        SPICE_RING_PROD_WAIT(m_PresentRing, wait);
+        WaitForObject(&worker->ready_event, NULL);
+        SPICE_RING_PROD_WAIT(worker->ring, wait);
+        ++waits;
     }
-    *SPICE_RING_PROD_ITEM(m_PresentRing) = operation;
-    SPICE_RING_PUSH(m_PresentRing, notify);
+    *SPICE_RING_PROD_ITEM(worker->ring) = operation;
+    SPICE_RING_PUSH(worker->ring, notify);
+    ReleaseMutex(&worker->lock, locked);
     if (notify) {
-        KeSetEvent(&m_PresentEvent, 0, FALSE);
+        KeSetEvent(&worker->event, 0, FALSE);
     }
-    DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
+    QXL_TRACE(PRESENT_POSTED, SourceId, waits);
 }
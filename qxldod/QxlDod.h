@@ -12,13 +12,15 @@
 #include "baseobject.h"
 #include "qxl_dev.h"
 #include "qxl_windows.h"
+#include "qxl_present_trace.h"
+#include "qxl_trace_ring.h"
 #include "mspace.h"
 
-#define MAX_CHILDREN               1
-#define MAX_VIEWS                  1
+#define MAX_CHILDREN               4
+#define MAX_VIEWS                  4
 #define BITS_PER_BYTE              8
 
-#define POINTER_SIZE               64
+#define POINTER_SIZE               256
 #define MIN_WIDTH_SIZE             1024
 #define MIN_HEIGHT_SIZE            768
 #define QXL_BPP                    32
@@ -27,6 +29,42 @@
 #define QXL_NON_PAGED __declspec(code_seg(".text"))
 
 extern BOOLEAN g_bSupportVSync;
+extern ULONG g_VSyncIdleTicks;
+extern ULONG g_VSyncRate;
+extern ULONG g_OffscreenBudget;
+extern ULONG g_SurfaceBpp;
+extern ULONG g_PresentTrace;
+extern ULONG g_TraceRing;
+extern ULONG g_ClientMonitorsConfig;
+extern ULONG g_EncodingPolicy;
+extern ULONG g_HeadlessPeriod;
+extern ULONG g_VgaAsyncPresent;
+extern ULONG g_HostLogLevel;
+
+// trace ring of the present path, see qxl_trace_ring.h; an event is
+// recorded when g_TraceRing is at least its level, the check is all
+// a disabled event costs
+enum {
+#define QXL_TRACE_LEVEL(name, level, format) QXL_TRACE_LEVEL_##name = level,
+    QXL_TRACE_EVENTS(QXL_TRACE_LEVEL)
+#undef QXL_TRACE_LEVEL
+};
+
+#define QXL_TRACE(event, ...) \
+    do { \
+        if (g_TraceRing >= QXL_TRACE_LEVEL_##event) \
+            TraceRingWrite(QXL_TRACE_##event, __VA_ARGS__); \
+    } while (0)
+
+VOID TraceRingInit(VOID);
+VOID TraceRingFree(VOID);
+NTSTATUS TraceRingDump(VOID);
+QXL_NON_PAGED VOID TraceRingWrite(USHORT Event, ULONG64 Arg0, ULONG64 Arg1 = 0, ULONG64 Arg2 = 0,
+                                  ULONG64 Arg3 = 0, ULONG64 Arg4 = 0, ULONG64 Arg5 = 0);
+
+// batched messages to the host through QXLRam log_buf and QXL_IO_LOG
+VOID HostLogStart(PUCHAR LogBuf, PUCHAR LogPort, ULONG RomLevel);
+VOID HostLogStop(PUCHAR LogBuf);
 
 typedef struct _QXL_FLAGS
 {
@@ -119,6 +157,37 @@ typedef struct
     CHAR Reserved4[189];
 } VBE_MODEINFO, *PVBE_MODEINFO;
 
+// VBE mode table kept in the device registry key, later starts skip the
+// emulated VBE calls for every mode when the adapter and BIOS match
+#define VBE_MODE_CACHE_VERSION     1
+#define VBE_MODE_CACHE_MAX         256
+#define VBE_MODE_CACHE_VALUE       L"VbeModeCache"
+
+typedef struct
+{
+    USHORT ModeNumber;
+    VBE_MODEINFO ModeInfo;
+} VBE_MODE_CACHE_ENTRY, *PVBE_MODE_CACHE_ENTRY;
+
+typedef struct
+{
+    // key, compared up to EnumTime
+    ULONG CacheVersion;
+    USHORT VendorID;
+    USHORT DeviceID;
+    USHORT SubVendorID;
+    USHORT SubSystemID;
+    UCHAR RevisionID;
+    USHORT VbeVersion;
+    USHORT TotalMemory;
+    USHORT OemSoftwareRevision;
+    ULONG BitsPerPixel;
+    // time the enumeration took, ms (checked builds only)
+    ULONG EnumTime;
+    ULONG ModeCount;
+    VBE_MODE_CACHE_ENTRY Modes[1];
+} VBE_MODE_CACHE, *PVBE_MODE_CACHE;
+
 #pragma pack(pop)
 
 typedef struct _X86BIOS_REGISTERS    // invented names
@@ -183,6 +252,29 @@ typedef struct _BLT_INFO
     UINT Height; // For the unrotated image
 } BLT_INFO;
 
+// Most bands of rows a present source is locked and mapped in, and the
+// bytes of source between two rects below which they share a band
+#define SOURCE_MAP_BANDS 4
+#define SOURCE_MAP_GAP (64 * 1024)
+
+typedef struct _SOURCE_BAND
+{
+    LONG Top;
+    LONG Bottom;
+    PMDL Mdl;
+    BYTE* pBits; // Row Top in system space
+} SOURCE_BAND;
+
+// The rows of a present source that its rects read, locked and mapped
+// in bands; the rows between the bands are not touched
+typedef struct _SOURCE_MAP
+{
+    UINT NumBands;
+    SOURCE_BAND Bands[SOURCE_MAP_BANDS];
+    ULONG Pages;      // Locked for the bands
+    ULONG WholePages; // Mapping from row 0 to the last band would lock
+} SOURCE_MAP;
+
 // Represents the current mode, may not always be set (i.e. frame buffer mapped) if representing the mode passed in on single mode setups.
 typedef struct _CURRENT_BDD_MODE
 {
@@ -199,6 +291,8 @@ typedef struct _CURRENT_BDD_MODE
     UINT SrcModeWidth;
     UINT SrcModeHeight;
 
+    D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId;
+
     // Various boolean flags the struct uses
     struct _CURRENT_BDD_MODE_FLAGS
     {
@@ -266,13 +360,57 @@ struct DelayedChunk
     QXLDataChunk chunk;
 };
 
+// counters returned by QXL_ESCAPE_GET_STATS, each one is updated with
+// an interlocked add by whichever thread hits it
+typedef struct QxlCounters {
+    LONG64 Presents;
+    LONG64 Drawables;
+    LONG64 BytesUploaded;
+    LONG64 CmdRingWaits;
+    LONG64 CursorRingWaits;
+    LONG64 OomNotifies;
+    LONG64 DelayedChunks;
+    LONG64 ReleaseEntries;
+    LONG64 ReleasedOutputs;
+    LONG64 AllocFailures;
+    LONG64 PresentsLossless;
+    LONG64 Presents16Bpp;
+    LONG64 PresentsHeadless;
+    LONG64 HeadlessUploads;
+    LONG64 CmdsQueued;
+    LONG64 CmdsMerged;
+    LONG64 CmdsPromoted;
+    LONG64 CmdQueueMax;
+    LONG64 SourcePages;
+    LONG64 SourcePagesWhole;
+    LONG64 SourceMdls;
+    LONG64 CursorOpsDeferred;
+    LONG64 CursorCacheHits;
+    LONG64 CursorCacheMisses;
+    LONG64 CursorMovesCoalesced;
+    LONG64 CursorNotifiesSaved;
+    LONG64 OffscreenHits;
+    LONG64 OffscreenParked;
+    LONG64 OffscreenEvicted;
+    LONG64 CustomModesReused;
+    LONG64 CustomModesAdded;
+    LONG64 ClientMonitorsApplied;
+    LONG64 ClientMonitorsUnchanged;
+    LONG64 ClientMonitorsBadCrc;
+    LONG64 VgaPresentsStaged;
+    LONG64 VgaPresentsCoalesced;
+    LONG64 VgaPresentsSync;
+} QxlCounters;
+
+#define QXL_COUNT(counter, n) InterlockedExchangeAdd64(&m_Counters.counter, (LONG64)(n))
+
 class QxlDod;
 
 class HwDeviceInterface {
 public:
     virtual ~HwDeviceInterface() {;}
     virtual NTSTATUS QueryCurrentMode(PVIDEO_MODE RequestedMode) = 0;
-    virtual NTSTATUS SetCurrentMode(ULONG Mode) = 0;
+    virtual NTSTATUS SetCurrentMode(ULONG Mode, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId) = 0;
     virtual NTSTATUS GetCurrentMode(ULONG* Mode) = 0;
     virtual NTSTATUS SetPowerState(DEVICE_POWER_STATE DevicePowerState, DXGK_DISPLAY_INFORMATION* pDispInfo) = 0;
     virtual NTSTATUS HWInit(PCM_RESOURCE_LIST pResList, DXGK_DISPLAY_INFORMATION* pDispInfo) = 0;
@@ -283,11 +421,20 @@ public:
     QXL_NON_PAGED virtual VOID VSyncInterruptPostProcess(_In_ PDXGKRNL_INTERFACE) = 0;
     virtual NTSTATUS AcquireFrameBuffer(CURRENT_BDD_MODE* pCurrentBddMode) { return STATUS_SUCCESS; }
     virtual NTSTATUS ReleaseFrameBuffer(CURRENT_BDD_MODE* pCurrentBddMode) { return STATUS_SUCCESS; }
+    virtual VOID DisableSource(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId) {}
+    virtual ULONG GetNumHeads(void) { return 1; }
+    virtual BOOLEAN IsChildConnected(ULONG ChildUid) { return ChildUid == 0; }
+    // held by a DDI reading the mode table, which may change from other
+    // threads of the device
+    virtual BOOLEAN LockModes(void) { return FALSE; }
+    virtual VOID UnlockModes(BOOLEAN locked) { UNREFERENCED_PARAMETER(locked); }
 
     ULONG GetModeCount(void) const {return m_ModeCount;}
     PVIDEO_MODE_INFORMATION GetModeInfo(UINT idx) {return &m_ModeInfo[idx];}
     USHORT GetModeNumber(USHORT idx) {return m_ModeNumbers[idx];}
     USHORT GetCurrentModeIndex(void) {return m_CurrentMode;}
+    // mode RecommendMonitorModes prefers for a child
+    virtual USHORT GetPreferredModeIndex(ULONG ChildUid) { UNREFERENCED_PARAMETER(ChildUid); return m_CurrentMode; }
     VOID SetCurrentModeIndex(USHORT idx) {m_CurrentMode = idx;}
     virtual NTSTATUS ExecutePresentDisplayOnly(_In_ BYTE*             DstAddr,
                                  _In_ UINT              DstBitPerPixel,
@@ -305,11 +452,14 @@ public:
     virtual NTSTATUS SetPointerShape(_In_ CONST DXGKARG_SETPOINTERSHAPE* pSetPointerShape) = 0;
     virtual NTSTATUS SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pSetPointerPosition) = 0;
     virtual NTSTATUS Escape(_In_ CONST DXGKARG_ESCAPE* pEscap) = 0;
+    void GetStats(QXLEscapeStats* stats, SIZE_T size);
     NTSTATUS AcquireDisplayInfo(DXGK_DISPLAY_INFORMATION& DispInfo);
     ULONG GetId(void) { return m_Id; }
     virtual BOOLEAN IsBIOSCompatible() { return TRUE; }
 protected:
     virtual NTSTATUS GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo) = 0;
+    // the fields of QXL_ESCAPE_GET_STATS that are not counters
+    virtual VOID GetDeviceStats(QXLEscapeStats* stats) { UNREFERENCED_PARAMETER(stats); }
 protected:
     QxlDod* m_pQxlDod;
     PVIDEO_MODE_INFORMATION m_ModeInfo;
@@ -317,8 +467,38 @@ protected:
     PUSHORT m_ModeNumbers;
     USHORT m_CurrentMode;
     ULONG  m_Id;
+    QxlCounters m_Counters;
 };
 
+// one step of a staged VGA present: a move within the frame buffer, or
+// a rect of source pixels copied to the staging buffer at Offset
+typedef struct VgaPresentOp
+{
+    RECT    Rect;
+    POINT   SourcePoint;    // moves only
+    SIZE_T  Offset;         // rects only
+    BOOLEAN bMove;
+} VgaPresentOp;
+
+// presents staged for the VGA present worker, applied in order to Dst.
+// The buffers are kept and only grow, the worker swaps the pending frame
+// with the one it blits
+typedef struct VgaPresentFrame
+{
+    BLT_INFO      Dst;
+    VgaPresentOp* Ops;
+    UINT          NumOps;
+    UINT          MaxOps;
+    BYTE*         Staging;
+    SIZE_T        Used;
+    SIZE_T        Size;
+    UINT          Presents;
+} VgaPresentFrame;
+
+// presents that copy fewer bytes are blitted in the call while the
+// worker is idle, waking it up would cost more
+#define VGA_ASYNC_MIN_BYTES (64 * 1024)
+
 class VgaDevice  :
     public HwDeviceInterface
 {
@@ -326,7 +506,7 @@ public:
     VgaDevice(_In_ QxlDod* pQxlDod);
     ~VgaDevice(void);
     NTSTATUS QueryCurrentMode(PVIDEO_MODE RequestedMode);
-    NTSTATUS SetCurrentMode(ULONG Mode);
+    NTSTATUS SetCurrentMode(ULONG Mode, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
     NTSTATUS GetCurrentMode(ULONG* Mode);
     NTSTATUS SetPowerState(DEVICE_POWER_STATE DevicePowerState, DXGK_DISPLAY_INFORMATION* pDispInfo);
     NTSTATUS HWInit(PCM_RESOURCE_LIST pResList, DXGK_DISPLAY_INFORMATION* pDispInfo);
@@ -356,6 +536,35 @@ protected:
     NTSTATUS GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo);
 private:
     BOOL SetVideoModeInfo(UINT Idx, PVBE_MODEINFO pModeInfo);
+    NTSTATUS GetModeCacheKey(PVBE_MODE_CACHE pKey, PVBE_INFO pVbeInfo, UINT BitsPerPixel);
+    NTSTATUS ReadModeCache(PVBE_MODE_CACHE pKey);
+    VOID WriteModeCache(PVBE_MODE_CACHE pKey, PVBE_MODE_CACHE_ENTRY pModes, ULONG ModeCount);
+    VOID InvalidateModeCache(VOID);
+    NTSTATUS ValidateCachedMode(ULONG Mode);
+    NTSTATUS StartPresentThread(VOID);
+    VOID StopPresentThread(VOID);
+    VOID PresentThreadRoutine(VOID);
+    static VOID PresentThreadRoutineWrapper(PVOID pVgaDevice) {
+        reinterpret_cast<VgaDevice*>(pVgaDevice)->PresentThreadRoutine();
+    }
+    BOOLEAN StagePresent(CONST BLT_INFO* pDst, CONST SOURCE_MAP* pMap, CONST BLT_INFO* pSrc, ULONG NumMoves,
+                         CONST D3DKMT_MOVE_RECT* pMoves, ULONG NumDirtyRects, CONST RECT* pDirtyRect);
+    VOID FlushPresents(VOID);
+private:
+    // mode table read from the registry, kept until every mode
+    // was checked against the BIOS on its first use
+    PVBE_MODE_CACHE m_ModeCache;
+    // asynchronous presents, with VgaAsyncPresent set: the DDI stages
+    // the dirty pixels in m_Frames[m_PendingFrame] and the worker blits
+    // the other one. m_PresentLock protects both frames and m_bBlitting
+    HANDLE m_PresentThread;
+    KMUTEX m_PresentLock;
+    KEVENT m_PresentEvent;
+    KEVENT m_PresentIdleEvent;
+    VgaPresentFrame m_Frames[2];
+    UINT m_PendingFrame;
+    BOOLEAN m_bBlitting;
+    BOOLEAN m_bStopPresent;
 };
 
 typedef struct _MemSlot {
@@ -378,6 +587,42 @@ enum {
     NUM_MSPACES,
 };
 
+// how the bitmaps of a present are sent, picked for every present from
+// client_present of the ROM and EncodingPolicy by ChooseEncoding
+typedef enum QxlEncoding {
+    // bitmaps in the format of the surface
+    QXL_ENCODING_LOSSLESS,
+    // x1r5g5b5 bitmaps on a 32bpp surface, half the bytes to upload
+    QXL_ENCODING_16BPP,
+    // no client is watching, presents go to a shadow, see PresentHeadless
+    QXL_ENCODING_HEADLESS,
+} QxlEncoding;
+
+// values of the EncodingPolicy parameter
+#define ENCODING_POLICY_AUTO        0
+#define ENCODING_POLICY_LOSSLESS    1
+#define ENCODING_POLICY_16BPP       2
+
+// copy of what the OS presented on a head while no client is connected,
+// see PresentHeadless; all fields are protected by m_HeadlessLock
+typedef struct HeadlessHead {
+    // 32bpp, Width * 4 bytes a line, NULL when the head is presented as usual
+    UINT8 *Shadow;
+    UINT Width;
+    UINT Height;
+    // FALSE once a present was sent as usual, the shadow goes away after
+    // its damage is uploaded
+    BOOLEAN Valid;
+    // m_DrawGeneration the shadow was taken at
+    uint16_t Generation;
+    // bounding box of the pixels not uploaded yet
+    RECT Damage;
+    // KeQueryInterruptTime of the last upload
+    ULONGLONG LastFlush;
+    // an upload is queued to the worker of the head
+    BOOLEAN FlushPosted;
+} HeadlessHead;
+
 #define RELEASE_RES(res) if (!--(res)->refs) (res)->free(res);
 #define GET_RES(res) (++(res)->refs)
 
@@ -490,10 +735,74 @@ typedef struct InternalImage {
 } InternalImage;
 
 typedef struct InternalCursor {
+    struct InternalCursor *next;
+    LIST_ENTRY lru_link;
     QXLCursor cursor;
 } InternalCursor;
 
 #define CURSOR_ALLOC_SIZE (PAGE_SIZE << 1)
+#define CURSOR_CACHE_SIZE 64
+#define CURSOR_HASH_SIZE 64
+#define CURSOR_HASH_VAL(unique) ((UINT32)((unique) ^ ((unique) >> 32)) & (CURSOR_HASH_SIZE - 1))
+
+// device side copy of a frequently re-exposed region, surface id is
+// its index in m_Offscreen + 1
+typedef struct OffscreenSurface {
+    struct OffscreenSurface *next;
+    LIST_ENTRY lru_link;
+    UINT64 key; // content hash, 0 if the id is free
+    UINT32 width;
+    UINT32 height;
+    Resource *res;
+    // copy of the content the surface was filled with, a hit on the key
+    // alone could restore the pixels of another content
+    UINT8 *pixels;
+    // queued drawables reading or filling the surface, it is not
+    // destroyed before they reach the ring
+    LONG pending;
+    BOOLEAN filled;
+} OffscreenSurface;
+
+#define OFFSCREEN_MAX 64
+#define OFFSCREEN_HASH_SIZE 64
+#define OFFSCREEN_HASH_VAL(key) ((UINT32)((key) ^ ((key) >> 32)) & (OFFSCREEN_HASH_SIZE - 1))
+// contents seen once, parked on the second sighting
+#define OFFSCREEN_SEEN_SIZE 256
+#define OFFSCREEN_MIN_PIXELS (64 * 64)
+#define OFFSCREEN_MAX_PIXELS (512 * 512)
+// surface commands waiting for a present worker, a destroy and a create
+// per surface at most
+#define OFFSCREEN_CMDS (2 * OFFSCREEN_MAX)
+
+// command waiting in the driver for room in the command ring, see
+// QueueCmd; the ring of the device only has QXL_COMMAND_RING_SIZE entries
+typedef struct QueuedCmd {
+    LIST_ENTRY link;
+    UINT32 type;
+    // the QXLDrawable or QXLSurfaceCmd
+    PVOID ptr;
+} QueuedCmd;
+
+#define CMD_QUEUE_SIZE 1024
+// the device raises QXL_INTERRUPT_DISPLAY once it consumed that many
+// commands of a full ring, the queue refills it then
+#define CMD_QUEUE_REFILL (QXL_COMMAND_RING_SIZE / 2)
+// queued drawables up to that many pixels go ahead of larger ones
+#define CMD_QUEUE_SMALL_PIXELS (64 * 64)
+
+typedef struct CustomMode {
+    struct CustomMode *next;
+    LIST_ENTRY lru_link;
+    UINT32 xres;
+    UINT32 yres;
+} CustomMode;
+
+// the head rectangles a client writes to the ROM, see QXLRom
+typedef decltype(QXLRom::client_monitors_config) QXLClientMonitorsConfig;
+
+#define CUSTOM_MODE_COUNT 16
+#define CUSTOM_MODE_HASH_SIZE 32
+#define CUSTOM_MODE_HASH_VAL(xres, yres) ((((xres) * 31) ^ (yres)) & (CUSTOM_MODE_HASH_SIZE - 1))
 
 typedef struct DpcCbContext {
     void* ptr;
@@ -522,6 +831,24 @@ public:
 SPICE_RING_DECLARE(QXLPresentOnlyRing, QxlPresentOperation*, 1024);
 #include "end-packed.h"
 
+class QxlDevice;
+
+// present queue and worker thread of one head, a busy head does not
+// stall the others. The ring takes one producer at a time, the present
+// and pointer DDIs and the worker of head 0 all post to it under lock
+typedef struct QxlPresentWorker {
+    QXLPresentOnlyRing ring[1];
+    KEVENT event;
+    KEVENT ready_event;
+    KMUTEX lock;
+    // number of the last black out posted and not yet done or covered by
+    // a full screen present, see BlackOutScreen; changed with lock held
+    LONG blackouts;
+    LONG blackout_pending;
+    HANDLE thread;
+    QxlDevice *dev;
+} QxlPresentWorker;
+
 class QxlDevice  :
     public HwDeviceInterface
 {
@@ -529,7 +856,7 @@ public:
     QxlDevice(_In_ QxlDod* pQxlDod);
     ~QxlDevice(void);
     NTSTATUS QueryCurrentMode(PVIDEO_MODE RequestedMode);
-    NTSTATUS SetCurrentMode(ULONG Mode);
+    NTSTATUS SetCurrentMode(ULONG Mode, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
     NTSTATUS GetCurrentMode(ULONG* Mode);
     NTSTATUS SetPowerState(DEVICE_POWER_STATE DevicePowerState, DXGK_DISPLAY_INFORMATION* pDispInfo);
     NTSTATUS HWInit(PCM_RESOURCE_LIST pResList, DXGK_DISPLAY_INFORMATION* pDispInfo);
@@ -554,22 +881,32 @@ public:
     NTSTATUS SetPointerPosition(_In_ CONST DXGKARG_SETPOINTERPOSITION* pSetPointerPosition);
     NTSTATUS Escape(_In_ CONST DXGKARG_ESCAPE* pEscap);
     BOOLEAN IsBIOSCompatible() { return FALSE; }
+    VOID DisableSource(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
+    ULONG GetNumHeads(void) { return MAX_VIEWS; }
+    BOOLEAN IsChildConnected(ULONG ChildUid);
+    USHORT GetPreferredModeIndex(ULONG ChildUid);
+    BOOLEAN LockModes(void) { return WaitForObject(&m_ModeLock, NULL); }
+    VOID UnlockModes(BOOLEAN locked) { ReleaseMutex(&m_ModeLock, locked); }
 protected:
     NTSTATUS GetModeList(DXGK_DISPLAY_INFORMATION* pDispInfo);
+    VOID GetDeviceStats(QXLEscapeStats* stats);
     QXLDrawable *PrepareBltBits (BLT_INFO* pDst,
                     CONST BLT_INFO* pSrc,
                     UINT  NumRects,
                     _In_reads_(NumRects) CONST RECT *pRects,
-                    POINT*   pSourcePoint);
+                    POINT*   pSourcePoint,
+                    UINT  BitmapBpp);
     QXLDrawable *PrepareCopyBits(const RECT& rect, const POINT& sourcePoint);
+    QXLDrawable *PrepareOffscreen(CONST BLT_INFO* pSrc, CONST RECT *pRect, LONG offset, QXLDrawable **ppFill);
     QXLDrawable *Drawable(UINT8 type,
                     CONST RECT *area,
                     CONST RECT *clip,
                     UINT32 surface_id);
     void PushDrawable(QXLDrawable *drawable);
+    void OffsetDrawable(QXLDrawable *drawable, LONG dx);
     void PushCursorCmd(QXLCursorCmd *cursor_cmd);
     QXLDrawable *GetDrawable();
-    QXLCursorCmd *CursorCmd();
+    QXLCursorCmd *CursorCmd(BOOLEAN bForce);
     void *AllocMem(UINT32 mspace_type, size_t size, BOOL force);
     VOID SetImageId(InternalImage *internal,
                     BOOL cache_me,
@@ -585,8 +922,12 @@ private:
     BOOL InitMemSlots(void);
     BOOL CreateMemSlots(void);
     void DestroyMemSlots(void);
-    void CreatePrimarySurface(PVIDEO_MODE_INFORMATION pModeInfo);
+    void CreatePrimarySurface(PVIDEO_MODE_INFORMATION pModeInfo, BOOLEAN bKeepData = FALSE);
+    BOOLEAN KeepHeadsContent(CONST QXLHead *pOldHeads, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId,
+                             ULONG width, ULONG height);
     void DestroyPrimarySurface(void);
+    BOOLEAN DrawableFitsHead(QXLDrawable *drawable, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, LONG offset);
+    void PushBlackOut(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId, CONST RECT *pRect);
     void SetupHWSlot(UINT8 Idx, MemSlot *pSlot);
     void SetupMemSlot(UINT8 Idx, UINT64 pastart, UINT64 paend, UINT8 *vastart, UINT8 *valast);
     BOOL CreateEvents(void);
@@ -610,34 +951,82 @@ private:
     void static FreeBitmapImageEx(Resource *res);
     void static FreeCursorEx(Resource *res);
     void FreeCursor(Resource *res);
+    BOOLEAN CoalesceCursorMove(INT16 x, INT16 y);
+    InternalCursor *CursorCacheLookup(CONST QXLCursorHeader *header, CONST UINT8 *src, LONG pitch,
+                                      UINT line_size, UINT num_lines, BOOLEAN *pbCollision);
+    BOOLEAN CursorShapeEqual(InternalCursor *internal, CONST UINT8 *src, LONG pitch,
+                             UINT line_size, UINT num_lines);
+    void CursorCacheAdd(InternalCursor *internal);
+    void ResetCursorCache(void);
+    void ResetOffscreen(void);
+    void ResetCmdQueue(void);
+    void QueueCmd(UINT32 type, PVOID ptr);
+    void RingCmd(UINT32 type, PVOID ptr);
+    void RefillCmdRing(void);
+    void FlushCmdQueue(void);
+    void MergeQueuedDrawables(QXLDrawable *drawable);
+    OffscreenSurface *FindOffscreen(UINT64 key, UINT32 width, UINT32 height);
+    OffscreenSurface *CreateOffscreen(UINT64 key, UINT32 width, UINT32 height);
+    void FreeOffscreen(void);
+    BOOLEAN DestroyOffscreen(OffscreenSurface *surface);
+    void OffscreenDone(UINT32 surface_id, BOOLEAN filled);
+    QXLDrawable *SurfaceCopy(CONST RECT *area, UINT32 surface_id, UINT32 src_id, CONST RECT *src_area, UINT32 width, UINT32 height);
+    QXLSurfaceCmd *SurfaceCmd(UINT8 type, UINT32 surface_id);
+    void PushOffscreenCmds(void);
+    void static FreeSurfaceResEx(Resource *res);
     void WaitForCmdRing(void);
     void PushCmd(void);
     void WaitForCursorRing(void);
     void PushCursor(void);
-    BOOLEAN AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src_end, INT pitch, BOOLEAN bForce);
+    BOOLEAN AttachNewBitmap(QXLDrawable *drawable, UINT8 *src, UINT8 *src_end, INT pitch, BOOLEAN bForce, BOOLEAN bConverted, UINT bpp);
+    QxlEncoding ChooseEncoding(void);
+    NTSTATUS PresentHeadless(BYTE* SrcAddr, LONG SrcPitch, ULONG NumMoves, D3DKMT_MOVE_RECT* pMoves,
+                             ULONG NumDirtyRects, RECT* pDirtyRect,
+                             D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation, const CURRENT_BDD_MODE* pModeCur);
+    void EndHeadless(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
+    void PostHeadlessFlush(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
+    void FlushHeadless(D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
+    ULONG ServiceHeadless(void);
     void DiscardDrawable(QXLDrawable *drawable);
+    void DiscardCursorCmd(QXLCursorCmd *cursor_cmd);
     BOOLEAN PutBytesAlign(QXLDataChunk **chunk_ptr, UINT8 **now_ptr,
                             UINT8 **end_ptr, UINT8 *src, int size,
                             size_t alloc_size, PLIST_ENTRY pDelayed);
     QXLDataChunk *MakeChunk(DelayedChunk *pdc);
     ULONG PrepareDrawable(QXLDrawable*& drawable);
+    BOOLEAN AttachCursorShape(QXLCursorCmd *cursor_cmd, CONST QXLCursorHeader *header,
+                            UINT8 *src, LONG pitch, int line_size, UINT num_lines, BOOLEAN bForce);
+    ULONG PrepareCursor(QXLCursorCmd*& cursor_cmd);
+    void CacheCursor(InternalCursor *internal, BOOLEAN bForce);
     void AsyncIo(UCHAR  Port, UCHAR Value);
     void SyncIo(UCHAR  Port, UCHAR Value);
-    NTSTATUS UpdateChildStatus(BOOLEAN connect);
-    NTSTATUS SetCustomDisplay(QXLEscapeSetCustomDisplay* custom_display);
+    NTSTATUS UpdateChildStatus(ULONG ChildUid, BOOLEAN connect);
+    NTSTATUS SetCustomDisplay(QXLEscapeSetCustomDisplay* custom_display, BOOLEAN bPreferred = FALSE, UINT ChildUid = 0);
+    void ResetCustomModes(void);
+    CustomMode *FindCustomMode(UINT32 xres, UINT32 yres);
+    CustomMode *EvictCustomMode(void);
     void SetMonitorConfig(QXLHead* monitor_config);
+    BOOLEAN LayoutHeads(ULONG *pWidth, ULONG *pHeight);
+    void UpdateMonitorConfig(void);
+    void ApplyClientMonitorsConfig(void);
     NTSTATUS StartPresentThread();
     void StopPresentThread();
-    void PresentThreadRoutine();
-    static void PresentThreadRoutineWrapper(HANDLE dev) {
-        ((QxlDevice *)dev)->PresentThreadRoutine();
+    void PresentThreadRoutine(QxlPresentWorker *worker);
+    static void PresentThreadRoutineWrapper(HANDLE worker) {
+        ((QxlPresentWorker *)worker)->dev->PresentThreadRoutine((QxlPresentWorker *)worker);
     }
-    void PostToWorkerThread(QxlPresentOperation *operation);
-
-    static LONG GetMaxSourceMappingHeight(RECT* DirtyRects, ULONG NumDirtyRects);
+    void PostToWorkerThread(QxlPresentOperation *operation, D3DDDI_VIDEO_PRESENT_SOURCE_ID SourceId);
 
 private:
-    USHORT m_CustomMode;
+    // sizes set by the custom display escape, each one owns the mode
+    // m_CustomModeBase + its index in m_CustomModes; free entries have
+    // xres 0 and sit at the head of the LRU list
+    CustomMode m_CustomModes[CUSTOM_MODE_COUNT];
+    CustomMode *m_CustomModeHash[CUSTOM_MODE_HASH_SIZE];
+    LIST_ENTRY m_CustomModeLru;
+    // size the client asked for per head, NULL for the current mode
+    CustomMode *m_PreferredModes[MAX_VIEWS];
+    USHORT m_CustomModeBase;
 
     PUCHAR m_IoBase;
     BOOLEAN m_IoMapped;
@@ -668,8 +1057,6 @@ private:
     KEVENT m_DisplayEvent;
     KEVENT m_CursorEvent;
     KEVENT m_IoCmdEvent;
-    KEVENT m_PresentEvent;
-    KEVENT m_PresentThreadReadyEvent;
 
     PUCHAR m_LogPort;
     PUCHAR m_LogBuf;
@@ -678,6 +1065,11 @@ private:
     KMUTEX m_CmdLock;
     KMUTEX m_IoLock;
     KMUTEX m_CrsLock;
+    KMUTEX m_HeadlessLock;
+    // the custom modes, the preferred mode, the heads and the connected
+    // children; the escapes, the mode changes and the client monitors
+    // config change them from different threads. Taken before m_CmdLock
+    KMUTEX m_ModeLock;
     MspaceInfo m_MSInfo[NUM_MSPACES];
 
     UINT64 m_FreeOutputs;
@@ -686,15 +1078,123 @@ private:
     QXLMonitorsConfig* m_monitor_config;
     QXLPHYSICAL* m_monitor_config_pa;
 
-    QXLPresentOnlyRing m_PresentRing[1];
-    // generation, updated when resolution change
-    // this is used to detect if a draw command is obsoleted
-    // and should not be executed
+    // cursor shapes already uploaded to the device, keyed by header.unique;
+    // every cached shape holds one reference on its resource
+    InternalCursor *m_CursorCache[CURSOR_HASH_SIZE];
+    LIST_ENTRY m_CursorCacheLru;
+    ULONG m_NumCachedCursors;
+
+    // offscreen surfaces, all fields are protected by m_CmdLock
+    OffscreenSurface m_Offscreen[OFFSCREEN_MAX];
+    OffscreenSurface *m_OffscreenHash[OFFSCREEN_HASH_SIZE];
+    LIST_ENTRY m_OffscreenLru;
+    UINT64 m_OffscreenSeen[OFFSCREEN_SEEN_SIZE];
+    QXLSurfaceCmd *m_OffscreenCmds[OFFSCREEN_CMDS];
+    UINT m_NumOffscreenCmds;
+    ULONG m_NumOffscreen;
+    SIZE_T m_OffscreenUsed;
+    SIZE_T m_OffscreenBudget;
+
+    // commands that found the command ring full, in the order they go to
+    // the ring; protected by m_CmdLock, the DPC only reads the depth
+    QueuedCmd m_CmdQueueEntries[CMD_QUEUE_SIZE];
+    LIST_ENTRY m_CmdQueue;
+    LIST_ENTRY m_CmdQueueFree;
+    volatile LONG m_CmdQueueDepth;
+
+    // last QXL_CURSOR_MOVE pushed to the cursor ring and its ring position,
+    // its position is updated in place until the host consumes it
+    QXLCursorCmd *m_PendingMove;
+    UINT32 m_PendingMoveProd;
+    // cursor operations handed over to the worker thread and not yet
+    // executed, while non-zero all cursor commands go through the worker
+    LONG m_CursorOpsPending;
+    // one bit per source that last reported the pointer visible, the
+    // single cursor of the device is hidden when none does
+    LONG m_PointerVisible;
+
+    // one head per source, placed side by side in the primary surface;
+    // width 0 marks a head without mode
+    QXLHead m_Heads[MAX_VIEWS];
+    // heads reported as connected, head 0 always is
+    ULONG m_ConnectedHeads;
+    // set by the DPC on QXL_INTERRUPT_CLIENT_MONITORS_CONFIG, the worker of
+    // head 0 applies the layout; m_ClientMonitors is the last one applied
+    LONG m_ClientMonitorsPending;
+    QXLClientMonitorsConfig m_ClientMonitors;
+    BOOLEAN m_bClientMonitorsValid;
+    // shadows of the heads while no client is connected, uploaded by the
+    // worker of head 0 every g_HeadlessPeriod ms and on client connect
+    HeadlessHead m_Headless[MAX_VIEWS];
+    // depth of the device surfaces, QXL_BPP or 16 (x1r5g5b5); the OS
+    // always presents 32bpp and bitmaps are converted on upload
+    UINT m_SurfaceBpp;
+    // size and format of the primary surface, width 0 if there is none
+    ULONG m_PrimaryWidth;
+    ULONG m_PrimaryHeight;
+    ULONG m_PrimaryFormat;
+
+    QxlPresentWorker m_PresentWorkers[MAX_VIEWS];
+    // generation, updated when the primary surface is recreated with
+    // a new format or the device stops; this is used to detect if a draw
+    // command is obsoleted and should not be executed, checked under
+    // m_CmdLock. A size-only change keeps it and lets the workers check
+    // each drawable against the new head layout
     uint16_t m_DrawGeneration;
-    HANDLE m_PresentThread;
     BOOLEAN m_bActive;
 };
 
+// A present, or the file header, waiting in PresentTrace for its writer
+typedef struct _PRESENT_TRACE_RECORD
+{
+    LIST_ENTRY Link;
+    ULONG Size;
+    BYTE Data[1];
+} PRESENT_TRACE_RECORD;
+
+// Appends every PresentDisplayOnly call to PRESENT_TRACE_FILE in the
+// qxl_present_trace.h format, so a customer workload can be replayed by
+// Tools/qxlmock. The dirty pixels are read through a locked mapping of
+// the source into a record of the present, which a thread of the trace
+// writes; the DDI drops a present rather than wait for the disk once
+// PRESENT_TRACE_BACKLOG bytes are queued. Recording stops at
+// g_PresentTrace MB.
+class PresentTrace {
+public:
+    PresentTrace(void);
+    ~PresentTrace(void);
+    VOID Record(_In_ CONST DXGKARG_PRESENT_DISPLAYONLY* pPresent,
+                _In_ CONST CURRENT_BDD_MODE* pMode,
+                _In_ D3DKMDT_VIDPN_PRESENT_PATH_ROTATION Rotation);
+    VOID Close(VOID);
+private:
+    NTSTATUS Open(VOID);
+    VOID Queue(_In_ PRESENT_TRACE_RECORD* pRecord);
+    VOID WriterRoutine(VOID);
+    static VOID WriterRoutineWrapper(PVOID pTrace) {
+        reinterpret_cast<PresentTrace*>(pTrace)->WriterRoutine();
+    }
+
+    KMUTEX m_Lock;
+    KEVENT m_WriterEvent;
+    HANDLE m_hFile;
+    HANDLE m_hWriter;
+    LIST_ENTRY m_Records;
+    // bytes of m_Records and of the record being written
+    SIZE_T m_Queued;
+    // bytes written or queued, checked against m_Limit
+    ULONGLONG m_Size;
+    ULONGLONG m_Limit;
+    ULONGLONG m_StartTime;
+    ULONG m_Frames;
+    ULONG m_Dropped;
+    // presents dropped with the writer behind or out of memory
+    ULONG m_Skipped;
+    BOOLEAN m_bStop;
+    // the file could not be created or written, nothing more is tried
+    BOOLEAN m_bFailed;
+};
+
 class QxlDod {
 private:
     DEVICE_OBJECT* m_pPhysicalDevice;
@@ -713,8 +1213,31 @@ private:
     HwDeviceInterface* m_pHWDevice;
     KTIMER m_VsyncTimer;
     KDPC   m_VsyncTimerDpc;
+    // protects the tick deadline against the present path
+    KSPIN_LOCK m_VsyncLock;
     BOOLEAN m_bVsyncEnabled;
     LONG m_VsyncFiredCounter;
+    // adaptive VSync: presents since the last tick, consecutive ticks
+    // without presents and whether the timer runs at the idle period
+    LONG m_VsyncPresents;
+    ULONG m_VsyncIdleTicks;
+    BOOLEAN m_VsyncIdle;
+    LONG m_VsyncWakeupsSaved;
+    // next tick as absolute interrupt time, the period is kept in
+    // 100ns units plus a remainder in 1/m_VsyncRate units to avoid drift
+    ULONGLONG m_VsyncDeadline;
+    ULONGLONG m_VsyncPeriod;
+    ULONG m_VsyncPeriodRem;
+    ULONG m_VsyncPeriodAcc;
+    ULONG m_VsyncRate;
+    BOOLEAN m_bVsyncTimerResolution;
+    // measured tick lateness, 100ns units
+    ULONG m_VsyncTicks;
+    ULONG m_VsyncMissed;
+    LONGLONG m_VsyncLateMin;
+    LONGLONG m_VsyncLateMax;
+    LONGLONG m_VsyncLateSum;
+    PresentTrace m_PresentTrace;
 public:
     QxlDod(_In_ DEVICE_OBJECT* pPhysicalDeviceObject);
     ~QxlDod(void);
@@ -808,6 +1331,7 @@ public:
                                  _In_                                     INT   PositionX,
                                  _In_                                     INT   PositionY);
     PDXGKRNL_INTERFACE GetDxgkInterface(void) { return &m_DxgkInterface;}
+    DEVICE_OBJECT* GetPhysicalDevice(void) { return m_pPhysicalDevice;}
     NTSTATUS AcquireDisplayInfo(DXGK_DISPLAY_INFORMATION& DispInfo)
     {
         return m_DxgkInterface.DxgkCbAcquirePostDisplayOwnership(m_DxgkInterface.DeviceHandle, &DispInfo);
@@ -839,6 +1363,8 @@ private:
     NTSTATUS IsVidPnPathFieldsValid(CONST D3DKMDT_VIDPN_PRESENT_PATH* pPath) const;
     NTSTATUS RegisterHWInfo(_In_ ULONG Id);
     QXL_NON_PAGED VOID VsyncTimerProc();
+    QXL_NON_PAGED VOID ScheduleVsyncTick(ULONGLONG now);
+    QXL_NON_PAGED VOID VsyncWakeUp();
     static QXL_NON_PAGED VOID VsyncTimerProcGate(_In_ _KDPC *dpc, _In_ PVOID context, _In_ PVOID arg1, _In_ PVOID arg2);
     QXL_NON_PAGED VOID IndicateVSyncInterrupt();
     static QXL_NON_PAGED BOOLEAN VsyncTimerSynchRoutine(PVOID context);
@@ -876,5 +1402,21 @@ QXL_NON_PAGED VOID BltBits (
                         UINT  NumRects,
                         _In_reads_(NumRects) CONST RECT *pRects);
 
+QXL_NON_PAGED VOID MoveBits(
+                        BLT_INFO* pBltInfo,
+                        CONST D3DKMT_MOVE_RECT* pMove);
+
+NTSTATUS MapSourceRects(
+                        _In_ BYTE* SrcAddr,
+                        LONG SrcPitch,
+                        LONG SrcHeight,
+                        UINT NumRects,
+                        _In_reads_opt_(NumRects) CONST RECT* pRects,
+                        UINT NumMoves,
+                        _In_reads_opt_(NumMoves) CONST D3DKMT_MOVE_RECT* pMoves,
+                        _Out_ SOURCE_MAP* pMap);
+VOID UnmapSourceRects(_Inout_ SOURCE_MAP* pMap);
+BLT_INFO SourceBltInfo(CONST SOURCE_MAP* pMap, CONST BLT_INFO* pSrc, CONST RECT* pRect);
+
 QXL_NON_PAGED BYTE* GetRowStart(_In_ CONST BLT_INFO* pBltInfo, CONST RECT* pRect);
 QXL_NON_PAGED VOID GetPitches(_In_ CONST BLT_INFO* pBltInfo, _Out_ LONG* pPixelPitch, _Out_ LONG* pRowPitch);
@@ -24,33 +24,44 @@ int nDebugLevel = TRACE_LEVEL_ERROR;
 // registry-based configuration is intended to be manual only
 // for VSync suppression during support and troubleshooting
 // and not expected to be made default
-static void QueryVSyncSetting(BOOLEAN& b, const UNICODE_STRING *path)
+static NTSTATUS QueryDwordSetting(PCWSTR name, ULONG& val, const UNICODE_STRING *path)
 {
     PAGED_CODE();
     WCHAR buffer[MAX_PATH];
-    ULONG val = b;
+    ULONG tmp = val;
     RTL_QUERY_REGISTRY_TABLE QueryTable[3] = {};
     if (path->Length >= sizeof(buffer))
-        return;
+        return STATUS_NAME_TOO_LONG;
 
     QueryTable[0].Flags = RTL_QUERY_REGISTRY_SUBKEY;
     QueryTable[0].Name = L"Parameters";
     QueryTable[1].Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK | RTL_QUERY_REGISTRY_REQUIRED;
-    QueryTable[1].Name = L"EnableVSync";
+    QueryTable[1].Name = (PWSTR)name;
     QueryTable[1].DefaultType = REG_DWORD << 24;
-    QueryTable[1].EntryContext = &val;
+    QueryTable[1].EntryContext = &tmp;
 
     RtlCopyMemory(buffer, path->Buffer, path->Length);
     buffer[path->Length/2] = 0;
     NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, buffer, QueryTable, NULL, NULL);
     if (NT_SUCCESS(status))
     {
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: val = %d\n", __FUNCTION__, val));
-        b = !!val;
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: %S = %d\n", __FUNCTION__, name, tmp));
+        val = tmp;
     }
     else
     {
-        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: status = %X\n", __FUNCTION__, status));
+        DbgPrint(TRACE_LEVEL_INFORMATION, ("%s: %S status = %X\n", __FUNCTION__, name, status));
+    }
+    return status;
+}
+
+static void QueryVSyncSetting(BOOLEAN& b, const UNICODE_STRING *path)
+{
+    PAGED_CODE();
+    ULONG val = b;
+    if (NT_SUCCESS(QueryDwordSetting(L"EnableVSync", val, path)))
+    {
+        b = !!val;
     }
 }
 
@@ -87,10 +98,52 @@ DriverEntry(
 
         // for support/troubleshooting be able to disable VSync on specific machine
         QueryVSyncSetting(g_bSupportVSync, pRegistryPath);
+        // number of VSync periods without presents before the timer
+        // is slowed down, 0 keeps it running at the full rate
+        QueryDwordSetting(L"AdaptiveVSync", g_VSyncIdleTicks, pRegistryPath);
+        // refresh rate in mHz (59940 for 59.94 Hz), 0 keeps the default
+        QueryDwordSetting(L"VSyncRate", g_VSyncRate, pRegistryPath);
+        if (g_VSyncRate && (g_VSyncRate < 1000 || g_VSyncRate > 240000))
+        {
+            DbgPrint(TRACE_LEVEL_ERROR, ("VSyncRate %d mHz out of range, ignored\n", g_VSyncRate));
+            g_VSyncRate = 0;
+        }
     }
-    DbgPrint(TRACE_LEVEL_WARNING, ("VSync support %sabled for %d.%d.%d\n",
+    DbgPrint(TRACE_LEVEL_WARNING, ("VSync support %sabled for %d.%d.%d (adaptive after %d, rate %d mHz)\n",
         g_bSupportVSync ? "en" : "dis",
-        versionInfo.dwMajorVersion, versionInfo.dwMinorVersion, versionInfo.dwBuildNumber));
+        versionInfo.dwMajorVersion, versionInfo.dwMinorVersion, versionInfo.dwBuildNumber,
+        g_VSyncIdleTicks, g_VSyncRate));
+
+    // share of the VRAM bar in percent for offscreen surfaces, 0 disables them
+    QueryDwordSetting(L"OffscreenBudget", g_OffscreenBudget, pRegistryPath);
+    // depth of the QXL primary surface, 16 or 32
+    QueryDwordSetting(L"SurfaceBpp", g_SurfaceBpp, pRegistryPath);
+    if (g_SurfaceBpp != 16 && g_SurfaceBpp != QXL_BPP)
+    {
+        DbgPrint(TRACE_LEVEL_ERROR, ("SurfaceBpp %d not supported, ignored\n", g_SurfaceBpp));
+        g_SurfaceBpp = QXL_BPP;
+    }
+    // record presents to %SystemRoot%\Temp\qxldod.trace, limit in MB
+    QueryDwordSetting(L"PresentTrace", g_PresentTrace, pRegistryPath);
+    // keep the present path events up to this trace level in memory,
+    // dumped to %SystemRoot%\Temp\qxldod.ring
+    QueryDwordSetting(L"TraceRing", g_TraceRing, pRegistryPath);
+    TraceRingInit();
+    // send the messages up to this trace level to the host through
+    // QXL_IO_LOG, by default the log_level of the device ROM
+    QueryDwordSetting(L"HostLogLevel", g_HostLogLevel, pRegistryPath);
+    // follow the monitor layout the client writes to the device ROM, 0
+    // leaves it to the guest agent
+    QueryDwordSetting(L"ClientMonitorsConfig", g_ClientMonitorsConfig, pRegistryPath);
+    // 0 and 1 send bitmaps in the format of the surface, 2 sends 16bpp
+    // ones from a 32bpp surface while a client is connected
+    QueryDwordSetting(L"EncodingPolicy", g_EncodingPolicy, pRegistryPath);
+    // without a client presents only update a copy of the screen, which
+    // is uploaded every that many ms and when a client connects; 0 sends
+    // every present
+    QueryDwordSetting(L"HeadlessPeriod", g_HeadlessPeriod, pRegistryPath);
+    // 0 blits VGA presents in the DDI call, as the sample driver does
+    QueryDwordSetting(L"VgaAsyncPresent", g_VgaAsyncPresent, pRegistryPath);
 
     // Initialize DDI function pointers and dxgkrnl
     KMDDOD_INITIALIZATION_DATA InitialData = {0};
@@ -137,6 +190,7 @@ DriverEntry(
     if (!NT_SUCCESS(Status))
     {
         DbgPrint(TRACE_LEVEL_ERROR, ("DxgkInitializeDisplayOnlyDriver failed with Status: 0x%X\n", Status));
+        TraceRingFree();
     }
 
     DbgPrint(TRACE_LEVEL_INFORMATION, ("<--- %s\n", __FUNCTION__));
@@ -157,6 +211,7 @@ DodUnload(VOID)
 {
     PAGED_CODE();
     DbgPrint(TRACE_LEVEL_INFORMATION, ("<--> %s\n", __FUNCTION__));
+    TraceRingFree();
 }
 
 NTSTATUS
@@ -780,8 +835,22 @@ void DebugPrint(int level, const char *fmt, ...)
     va_start(list, fmt);
     vDbgPrintEx(DPFLTR_IHVVIDEO_ID, xlate[level - 1], fmt, list);
     va_end(list);
+
+    if ((ULONG)level <= g_HostLogPrintLevel) {
+        va_start(list, fmt);
+        HostLogWrite(fmt, list);
+        va_end(list);
+    }
 }
 
 #endif
 
+void HostLogPrint(const char *fmt, ...)
+{
+    va_list list;
+    va_start(list, fmt);
+    HostLogWrite(fmt, list);
+    va_end(list);
+}
+
 #pragma code_seg(pop) // End Non-Paged Code
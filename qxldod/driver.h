@@ -232,17 +232,27 @@ DodGetScanLine(
     INOUT_PDXGKARG_GETSCANLINE  pGetScanLine
 );
 
+// messages up to g_HostLogPrintLevel also go to the host log, in free
+// builds as well
+extern ULONG g_HostLogPrintLevel;
+void HostLogWrite(const char *fmt, va_list list);
+void HostLogPrint(const char *fmt, ...);
+
+#define DbgExpandArguments(...) __VA_ARGS__
+
 #if DBG
 
 extern int nDebugLevel;
 void DebugPrint(int level, const char *fmt, ...);
 
-#define DbgExpandArguments(...) __VA_ARGS__
-
 #define DbgPrint(level, line) \
     DebugPrint(level, DbgExpandArguments line)
 #else
-#define DbgPrint(level, line) {}
+#define DbgPrint(level, line) \
+    do { \
+        if ((ULONG)(level) <= g_HostLogPrintLevel) \
+            HostLogPrint(DbgExpandArguments line); \
+    } while (0)
 #endif
 
 #ifndef TRACE_LEVEL_INFORMATION
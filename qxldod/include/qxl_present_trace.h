@@ -0,0 +1,55 @@
+#ifndef _H_QXL_PRESENT_TRACE
+#define _H_QXL_PRESENT_TRACE
+
+/*
+ * PresentDisplayOnly trace, written by the driver when the PresentTrace
+ * parameter is set and read back by Tools/qxlmock. The file is a
+ * QXLPresentTraceHeader followed by one record per present:
+ *
+ *   QXLPresentTraceFrame
+ *   QXLPresentTraceMove  [num_moves]
+ *   QXLPresentTraceRect  [num_rects]
+ *   pixels of every dirty rect in turn, row after row without padding,
+ *   (right - left) * bytes_per_pixel bytes per row
+ *
+ * Dirty rects are clipped to the source mode, moves are kept as given.
+ * All fields are little endian.
+ */
+
+#define QXL_PRESENT_TRACE_MAGIC     0x52545051 /* "QPTR" */
+#define QXL_PRESENT_TRACE_VERSION   1
+
+typedef struct QXLPresentTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       /* sizeof(QXLPresentTraceHeader) */
+    uint32_t frame_size;        /* sizeof(QXLPresentTraceFrame) */
+    uint64_t start_time;        /* system time of the first record, 100ns */
+} QXLPresentTraceHeader;
+
+typedef struct QXLPresentTraceRect {
+    int32_t left;
+    int32_t top;
+    int32_t right;
+    int32_t bottom;
+} QXLPresentTraceRect;
+
+typedef struct QXLPresentTraceMove {
+    int32_t src_x;
+    int32_t src_y;
+    QXLPresentTraceRect dest;
+} QXLPresentTraceMove;
+
+typedef struct QXLPresentTraceFrame {
+    uint32_t size;              /* of the whole record */
+    uint32_t source_id;
+    uint64_t time;              /* since start_time, 100ns */
+    uint32_t width;             /* source mode */
+    uint32_t height;
+    uint32_t bytes_per_pixel;
+    uint32_t rotation;          /* D3DKMDT_VIDPN_PRESENT_PATH_ROTATION of the blit */
+    uint32_t num_moves;
+    uint32_t num_rects;
+} QXLPresentTraceFrame;
+
+#endif /* _H_QXL_PRESENT_TRACE */
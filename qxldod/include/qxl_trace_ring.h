@@ -0,0 +1,74 @@
+#ifndef _H_QXL_TRACE_RING
+#define _H_QXL_TRACE_RING
+
+/*
+ * Binary trace ring of the present path. While the TraceRing parameter
+ * is set the driver keeps the last QXL_TRACE_RING_RECORDS events of
+ * every processor in memory and writes them out on request and when the
+ * device stops. A dump is a QXLTraceRingHeader followed, for every
+ * processor, by a uint64_t count of the events written on it and the
+ * records_per_cpu slots of its ring; event n is in slot n % records_per_cpu
+ * and slots with event QXL_TRACE_NONE were never written. All fields are
+ * little endian.
+ */
+
+#define QXL_TRACE_RING_MAGIC    0x52525451 /* "QTRR" */
+#define QXL_TRACE_RING_VERSION  1
+#define QXL_TRACE_ARGS          6
+
+/*
+ * The events with their trace level (TRACE_LEVEL_WARNING 3 to
+ * TRACE_LEVEL_VERBOSE 5) and the printf format of their arguments, which
+ * are stored as 64 bit integers. New events are only added at the end.
+ */
+#define QXL_TRACE_EVENTS(X) \
+    X(PRESENT,          4, "present on source %llu, %llu moves, %llu dirty rects") \
+    X(PRESENT_MOVE,     5, "move from (%lld, %lld) to (%lld, %lld)-(%lld, %lld)") \
+    X(PRESENT_DIRTY,    5, "dirty (%lld, %lld)-(%lld, %lld)") \
+    X(PRESENT_POSTED,   4, "posted to worker %llu after %llu waits") \
+    X(OPERATION_BEGIN,  4, "worker %llu runs a present") \
+    X(OPERATION_END,    4, "worker %llu done") \
+    X(DRAWABLE,         5, "drawable %llx type %llu on surface %llu") \
+    X(DRAWABLE_PUSH,    5, "drawable %llx pushed") \
+    X(BITMAP,           5, "bitmap %llux%llu, %llu bytes") \
+    X(CMD_RING_WAIT,    4, "command ring full") \
+    X(ALLOC,            5, "alloc %llu bytes in space %llu: %llx") \
+    X(ALLOC_FAILED,     3, "alloc of %llu bytes in space %llu failed, force %llu") \
+    X(FREE,             5, "free %llx") \
+    X(DELAYED_CHUNK,    4, "%llu bytes staged in system memory") \
+    X(RELEASE_FLUSH,    5, "%llu outputs released") \
+    X(RELEASE_WAIT,     3, "waiting for the release ring") \
+    X(RELEASE_WAIT_END, 3, "release ring wait done") \
+    X(OOM_NOTIFY,       3, "QXL_IO_NOTIFY_OOM") \
+    X(CMD_QUEUED,       5, "command ring full, %llu commands queued") \
+    X(CMD_REFILL,       4, "%llu queued commands to the ring, %llu left")
+
+enum {
+    QXL_TRACE_NONE,
+#define QXL_TRACE_ID(name, level, format) QXL_TRACE_##name,
+    QXL_TRACE_EVENTS(QXL_TRACE_ID)
+#undef QXL_TRACE_ID
+    QXL_TRACE_NUM_EVENTS
+};
+
+typedef struct QXLTraceRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       /* sizeof(QXLTraceRingHeader) */
+    uint32_t record_size;       /* sizeof(QXLTraceRecord) */
+    uint32_t num_cpus;
+    uint32_t records_per_cpu;
+    uint64_t frequency;         /* of the time stamps, per second */
+    uint64_t dump_time;         /* time stamp when the dump was taken */
+    uint64_t system_time;       /* system time then, 100ns since 1601 */
+} QXLTraceRingHeader;
+
+typedef struct QXLTraceRecord {
+    uint64_t time;              /* performance counter */
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t thread;            /* low bits of the thread id */
+    uint64_t args[QXL_TRACE_ARGS];
+} QXLTraceRecord;
+
+#endif /* _H_QXL_TRACE_RING */
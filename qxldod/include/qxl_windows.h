@@ -3,7 +3,9 @@
 
 enum {
     QXL_ESCAPE_SET_CUSTOM_DISPLAY = 0x10001,
-    QXL_ESCAPE_MONITOR_CONFIG
+    QXL_ESCAPE_MONITOR_CONFIG,
+    QXL_ESCAPE_GET_STATS,
+    QXL_ESCAPE_DUMP_TRACE_RING          /* see qxl_trace_ring.h */
 };
 
 typedef struct QXLEscapeSetCustomDisplay {
@@ -12,4 +14,69 @@ typedef struct QXLEscapeSetCustomDisplay {
     uint32_t bpp;
 } QXLEscapeSetCustomDisplay;
 
+#include "start-packed.h"
+
+#define QXL_ESCAPE_STATS_VERSION 1
+
+typedef struct SPICE_ATTR_PACKED QXLEscapeStatsMem {
+    uint64_t capacity;
+    uint64_t in_use;            /* allocated chunks, overhead included */
+    uint64_t free;
+    uint64_t free_chunks;
+    uint64_t top;               /* free space at the end of the space */
+} QXLEscapeStatsMem;
+
+/*
+ * Returned by QXL_ESCAPE_GET_STATS. The caller passes a buffer of any
+ * size that holds at least version and size; the driver fills as much
+ * of the structure as fits and sets size to the bytes it filled. Fields
+ * are only ever appended, version changes when their meaning does.
+ * Counters run since the driver was loaded, mem is a snapshot.
+ */
+typedef struct SPICE_ATTR_PACKED QXLEscapeStats {
+    uint32_t version;
+    uint32_t size;
+    uint64_t presents;          /* PresentDisplayOnly calls */
+    uint64_t drawables;         /* draw commands pushed */
+    uint64_t bytes_uploaded;    /* bitmap bytes copied for the device */
+    uint64_t cmd_ring_waits;    /* waits for room in the command ring */
+    uint64_t cursor_ring_waits;
+    uint64_t oom_notifies;      /* QXL_IO_NOTIFY_OOM sent */
+    uint64_t delayed_chunks;    /* chunks staged in system memory */
+    uint64_t release_entries;   /* release ring entries consumed */
+    uint64_t released_outputs;  /* commands freed through them */
+    uint64_t alloc_failures;    /* device memory allocations that failed */
+    QXLEscapeStatsMem mem[2];   /* device RAM, VRAM */
+    uint64_t presents_lossless; /* presents per encoding, see ChooseEncoding */
+    uint64_t presents_16bpp;
+    uint64_t presents_headless; /* kept in a shadow, see PresentHeadless */
+    uint64_t headless_uploads;  /* shadow damage uploaded */
+    uint64_t cmds_queued;       /* commands that found the command ring full */
+    uint64_t cmds_merged;       /* queued drawables dropped, covered by a later one */
+    uint64_t cmds_promoted;     /* small drawables queued ahead of larger ones */
+    uint64_t cmd_queue_depth;   /* commands queued now */
+    uint64_t cmd_queue_max;     /* most commands ever queued */
+    uint64_t source_pages_locked; /* present source pages locked, see MapSourceRects */
+    uint64_t source_pages_whole;  /* what mapping from row 0 would have locked */
+    uint64_t source_mdls;         /* MDLs they were locked with */
+    uint64_t cursor_ops_deferred; /* cursor commands left to the worker of head 0 */
+    uint64_t cursor_cache_hits;   /* shapes found in the cursor cache */
+    uint64_t cursor_cache_misses; /* shapes uploaded */
+    uint64_t cursor_moves_coalesced; /* moves written into a pending move */
+    uint64_t cursor_notifies_saved;  /* cursor ring notifies they saved */
+    uint64_t offscreen_hits;    /* dirty rects drawn from an offscreen surface */
+    uint64_t offscreen_parked;  /* offscreen surfaces created */
+    uint64_t offscreen_evicted; /* offscreen surfaces given up for another */
+    uint64_t custom_modes_reused; /* custom display sizes found in the table */
+    uint64_t custom_modes_added;
+    uint64_t client_monitors_applied;   /* client layouts read from the ROM */
+    uint64_t client_monitors_unchanged;
+    uint64_t client_monitors_bad_crc;
+    uint64_t vga_presents_staged;    /* VGA presents left to its worker */
+    uint64_t vga_presents_coalesced; /* staged behind another not blitted yet */
+    uint64_t vga_presents_sync;      /* blitted in the present call */
+} QXLEscapeStats;
+
+#include "end-packed.h"
+
 #endif /* _H_QXL_WINDOWS */
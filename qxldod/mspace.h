@@ -1,7 +1,7 @@
 #ifndef _H_MSPACE
 #define _H_MSPACE
 
-#define NO_MALLINFO 1
+#define NO_MALLINFO 0
 
 #ifdef __cplusplus
 extern "C" {
@@ -119,6 +119,23 @@ size_t mspace_max_footprint(mspace msp);
 
 
 #if !NO_MALLINFO
+/*
+  The fields of struct mallinfo are filled by mspace_mallinfo with
+  these numbers, the ones not meaningful here are always 0.
+*/
+struct mallinfo {
+  size_t arena;    /* non-mmapped space allocated from system */
+  size_t ordblks;  /* number of free chunks */
+  size_t smblks;   /* always 0 */
+  size_t hblks;    /* always 0 */
+  size_t hblkhd;   /* space in mmapped regions */
+  size_t usmblks;  /* maximum total allocated space */
+  size_t fsmblks;  /* always 0 */
+  size_t uordblks; /* total allocated space */
+  size_t fordblks; /* total free space */
+  size_t keepcost; /* releasable (via malloc_trim) space */
+};
+
 /*
   mspace_mallinfo behaves as mallinfo, but reports properties of
   the given space.